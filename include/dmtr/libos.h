@@ -171,6 +171,26 @@ DMTR_EXPORT int dmtr_push(dmtr_qtoken_t *qtok_out, int qd, const dmtr_sgarray_t
 DMTR_EXPORT int dmtr_pushto(
     dmtr_qtoken_t *qtok_out, int qd, const dmtr_sgarray_t *sga, const struct sockaddr *saddr, socklen_t size);
 
+/**
+ * @brief Pushes a batch of datagrams to UDP queue qd, each to its own destination.
+ *
+ * @details Hands the datagrams to the stack in one call and sends them out
+ * together, without a token per datagram. Stops at the first datagram that
+ * can't be sent, e.g. when the libOS is out of buffers. The data is copied, so
+ * the arrays can be reused as soon as the call returns. As with sendmmsg(),
+ * errors after a datagram has been handed to the stack aren't reported.
+ *
+ * @param num_pushed_out Number of datagrams pushed, from the start of sgas.
+ * @param qd Queue descriptor of a UDP socket.
+ * @param sgas Datagrams to push.
+ * @param saddrs Destination of each datagram.
+ * @param num Number of entries in sgas and saddrs.
+ *
+ * @return On successful completion zero is returned. If not even the first
+ * datagram could be pushed, an error code is returned instead.
+ */
+DMTR_EXPORT int dmtr_pushto_many(int *num_pushed_out, int qd, const dmtr_sgarray_t *sgas, const struct sockaddr_in *saddrs, int num);
+
 /**
  * @brief Asynchronously pops incoming data from socket/file.
  *
@@ -186,6 +206,47 @@ DMTR_EXPORT int dmtr_pushto(
  */
 DMTR_EXPORT int dmtr_pop(dmtr_qtoken_t *qt_out, int qd);
 
+/**
+ * @brief Pops the datagrams that have arrived on UDP queue qd, with their senders.
+ *
+ * @details Returns up to max datagrams without blocking and without a token
+ * per datagram. Pops are kept outstanding on the queue between calls, so
+ * dmtr_pop() shouldn't be used on the same queue. Free each array with
+ * dmtr_sgafree().
+ *
+ * @param num_out Number of datagrams popped.
+ * @param qd Queue descriptor of a UDP socket.
+ * @param sgas_out Datagrams popped.
+ * @param saddrs_out Sender of each datagram.
+ * @param max Number of entries in sgas_out and saddrs_out.
+ *
+ * @return On successful completion zero is returned. If no datagram has
+ * arrived, EAGAIN is returned; on failure, another error code is returned.
+ */
+DMTR_EXPORT int dmtr_popfrom(int *num_out, int qd, dmtr_sgarray_t *sgas_out, struct sockaddr_in *saddrs_out, int max);
+
+/**
+ * @brief Turns message framing on or off for TCP queue qd.
+ *
+ * @details On a framed queue, dmtr_push() sends the array behind a
+ * dmtr_header_t, and a pop only completes once a whole message has arrived,
+ * which it returns as an array of up to DMTR_SGARRAY_MAXSIZE segments that
+ * point into the buffers the message arrived in. Only a message spread over
+ * more buffers than that has the excess copied into its last segment. Free each
+ * message with dmtr_sgafree(). A framed push takes at most
+ * DMTR_SGARRAY_MAXSIZE - 1 segments, to leave room for the header, and can't
+ * be empty. Once the peer sends something that doesn't start with a valid
+ * header, every pop fails. Framing only stops while no data or framed pops are
+ * pending on the queue.
+ *
+ * @param qd Queue descriptor of a TCP socket.
+ * @param framed Nonzero to turn framing on, zero to turn it off.
+ *
+ * @return On successful completion zero is returned. If data or pops are
+ * pending, EBUSY is returned; on failure, another error code is returned.
+ */
+DMTR_EXPORT int dmtr_set_framed(int qd, int framed);
+
 /**
  * @brief Checks for completion of queue operation associated with queue token qtok.
  *
@@ -9,11 +9,11 @@
 #include <boost/coroutine2/coroutine.hpp>
 #include <dmtr/annot.h>
 #include <dmtr/types.h>
+#include <dmtr/libos/slab_table.hh>
 #include <dmtr/libos/user_thread.hh>
+#include <fcntl.h>
 #include <memory>
 #include <sys/socket.h>
-#include <boost/unordered_map.hpp>
-#include <boost/atomic.hpp>
 
 namespace dmtr {
 
@@ -33,18 +33,87 @@ class io_queue
         private: dmtr_sgarray_t my_sga_arg;
         private: io_queue *my_queue_arg;
 
-        public: task();
-        public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode);
-        public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode, const dmtr_sgarray_t &arg);
-        public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode, io_queue *arg);
-        public: static int initialize_result(dmtr_qresult_t &qr_out, int qd, dmtr_qtoken_t qt);
+        public: task() :
+            my_qr(),
+            my_error(EAGAIN),
+            my_sga_arg(),
+            my_queue_arg(NULL)
+        {}
 
-        public: int poll(dmtr_qresult_t &qr_out) const;
-        public: int complete(int error);
-        public: int complete(int error, const dmtr_sgarray_t &sga);
-        public: int complete(int error, int new_qd, const sockaddr_in &addr);
-        public: bool arg(const dmtr_sgarray_t *&arg_out) const;
-        public: bool arg(io_queue *&arg_out) const;
+        public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode) {
+            DMTR_OK(initialize_result(my_qr, q.qd(), qt));
+            my_qr.qr_opcode = opcode;
+            my_error = EAGAIN;
+            my_sga_arg = dmtr_sgarray_t();
+            my_queue_arg = NULL;
+            valid = true;
+            return 0;
+        }
+
+        public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode, const dmtr_sgarray_t &arg) {
+            DMTR_OK(initialize(q, qt, opcode));
+            my_sga_arg = arg;
+            return 0;
+        }
+
+        public: int initialize(io_queue &q, dmtr_qtoken_t qt, dmtr_opcode_t opcode, io_queue *arg) {
+            DMTR_NOTNULL(EINVAL, arg);
+            DMTR_OK(initialize(q, qt, opcode));
+            my_queue_arg = arg;
+            return 0;
+        }
+
+        public: static int initialize_result(dmtr_qresult_t &qr_out, int qd, dmtr_qtoken_t qt) {
+            qr_out = dmtr_qresult_t();
+            qr_out.qr_opcode = DMTR_OPC_INVALID;
+            qr_out.qr_qd = qd;
+            qr_out.qr_qt = qt;
+            return 0;
+        }
+
+        public: int poll(dmtr_qresult_t &qr_out) const {
+            DMTR_TRUE(EINVAL, valid);
+            qr_out = my_qr;
+            return my_error;
+        }
+
+        public: int complete(int error) {
+            DMTR_TRUE(EINVAL, valid);
+            DMTR_TRUE(EINVAL, EAGAIN != error);
+            my_error = error;
+            return 0;
+        }
+
+        public: int complete(int error, const dmtr_sgarray_t &sga) {
+            DMTR_TRUE(EINVAL, valid);
+            my_qr.qr_value.sga = sga;
+            return complete(error);
+        }
+
+        public: int complete(int error, int new_qd, const sockaddr_in &addr) {
+            DMTR_TRUE(EINVAL, valid);
+            my_qr.qr_value.ares.qd = new_qd;
+            my_qr.qr_value.ares.addr = addr;
+            return complete(error);
+        }
+
+        public: bool arg(const dmtr_sgarray_t *&arg_out) const {
+            if (DMTR_OPC_PUSH != my_qr.qr_opcode) {
+                return false;
+            }
+
+            arg_out = &my_sga_arg;
+            return true;
+        }
+
+        public: bool arg(io_queue *&arg_out) const {
+            if (NULL == my_queue_arg) {
+                return false;
+            }
+
+            arg_out = my_queue_arg;
+            return true;
+        }
 
         public: bool done() const {
             return my_error != EAGAIN;
@@ -59,19 +128,23 @@ class io_queue
             return my_qr.qr_opcode;
         }
     };
-#define MAX_TASKS 1024
-
-#ifdef MAX_TASKS
-    private: task my_tasks[MAX_TASKS];
-#else
-    private: boost::unordered_map<dmtr_qtoken_t,task> my_tasks;
-#endif
+    // A queue token is the queue descriptor in the upper 32 bits and a handle into `my_tasks` in
+    // the lower 32, so tasks only take up memory while they're outstanding, and a dropped token
+    // is rejected rather than mistaken for whichever operation reuses its slot. Most queues only
+    // ever have a push and a pop outstanding, so slots come a few at a time. The table isn't
+    // synchronized; queues used from more than one core hand out tokens of their own.
+    private: static const uint32_t TASK_SLAB_SIZE = 4;
+    private: typedef slab_table<task, 20, TASK_SLAB_SIZE> task_table;
+    private: task_table my_tasks;
     protected: const category_id my_cid;
     protected: const int my_qd;
-    private: boost::atomic<uint32_t> my_qt_counter;
- 
-    protected: io_queue(enum category_id cid, int qd);
-    public: virtual ~io_queue();
+
+    protected: io_queue(enum category_id cid, int qd) :
+        my_cid(cid),
+        my_qd(qd)
+    {}
+
+    public: virtual ~io_queue() {}
 
     public: int qd() const {
         return my_qd;
@@ -83,37 +156,122 @@ class io_queue
 
     // network control plane functions
     // todo: move into derived class.
-    public: virtual int socket(int domain, int type, int protocol);
-    public: virtual int getsockname(struct sockaddr * const saddr, socklen_t * const size);
-    public: virtual int listen(int backlog);
-    public: virtual int bind(const struct sockaddr * const saddr, socklen_t size);
-    public: virtual int accept(std::unique_ptr<io_queue> &q_out, dmtr_qtoken_t qtok, int new_qd);
-    public: virtual int connect(dmtr_qtoken_t qt, const struct sockaddr * const saddr, socklen_t size);
+    public: virtual int socket(int domain, int type, int protocol) {
+        return ENOTSUP;
+    }
+
+    public: virtual int getsockname(struct sockaddr * const saddr, socklen_t * const size) {
+        return ENOTSUP;
+    }
+
+    public: virtual int listen(int backlog) {
+        return ENOTSUP;
+    }
+
+    public: virtual int bind(const struct sockaddr * const saddr, socklen_t size) {
+        return ENOTSUP;
+    }
+
+    public: virtual int accept(std::unique_ptr<io_queue> &q_out, dmtr_qtoken_t qtok, int new_qd) {
+        return ENOTSUP;
+    }
+
+    public: virtual int connect(dmtr_qtoken_t qt, const struct sockaddr * const saddr, socklen_t size) {
+        return ENOTSUP;
+    }
 
     // file control plane functions
-    public: virtual int open(const char *pathname, int flags);
-    public: virtual int open2(const char *pathname, int flags, mode_t mode);
-    public: virtual int creat(const char *pathname, mode_t mode);
+    public: virtual int open(const char *pathname, int flags) {
+        return ENOTSUP;
+    }
+
+    public: virtual int open2(const char *pathname, int flags, mode_t mode) {
+        return ENOTSUP;
+    }
+
+    public: virtual int creat(const char *pathname, mode_t mode) {
+        return ENOTSUP;
+    }
 
     // general control plane functions.
-    public: virtual int close();
+    public: virtual int close() {
+        return 0;
+    }
 
     // data plane functions
     public: virtual int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga) = 0;
     public: virtual int pop(dmtr_qtoken_t qt) = 0;
     public: virtual int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) = 0;
-    public: virtual int drop(dmtr_qtoken_t qt);
-
-    public: static int set_non_blocking(int fd);
-    protected: int new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode);
-    protected: int new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode, const dmtr_sgarray_t &arg);
-    protected: int new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode, io_queue *arg);
-    protected: void insert_task(dmtr_qtoken_t qt);
-    protected: int get_task(task *&t_out, dmtr_qtoken_t qt);
-    public: int new_qtoken(dmtr_qtoken_t &qt_out);
-    public: bool has_task(dmtr_qtoken_t qt);
-    protected: task * get_task(dmtr_qtoken_t qt);
-    private: int drop_task(dmtr_qtoken_t qt);
+
+    public: virtual int drop(dmtr_qtoken_t qt) {
+        return drop_task(qt);
+    }
+
+    public: static int set_non_blocking(int fd) {
+        int flags = fcntl(fd, F_GETFL);
+        DMTR_TRUE(errno, -1 != flags);
+        DMTR_TRUE(errno, -1 != fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+        return 0;
+    }
+
+    protected: int new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode) {
+        task *t = NULL;
+        DMTR_OK(get_slot(t, qt));
+        return t->initialize(*this, qt, opcode);
+    }
+
+    protected: int new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode, const dmtr_sgarray_t &arg) {
+        task *t = NULL;
+        DMTR_OK(get_slot(t, qt));
+        return t->initialize(*this, qt, opcode, arg);
+    }
+
+    protected: int new_task(dmtr_qtoken_t qt, dmtr_opcode_t opcode, io_queue *arg) {
+        task *t = NULL;
+        DMTR_OK(get_slot(t, qt));
+        return t->initialize(*this, qt, opcode, arg);
+    }
+
+    protected: int get_task(task *&t_out, dmtr_qtoken_t qt) {
+        t_out = get_task(qt);
+        DMTR_NOTNULL(EINVAL, t_out);
+        return 0;
+    }
+
+    // Claims a slot in the task table. The token holds it until it's dropped, whether or not an
+    // operation was started with it.
+    public: virtual int new_qtoken(dmtr_qtoken_t &qt_out) {
+        task_table::handle_type h = 0;
+        task *t = NULL;
+        DMTR_OK(my_tasks.insert(h, t));
+        qt_out = (static_cast<dmtr_qtoken_t>(my_qd) << QD_OFFSET) | h;
+        return 0;
+    }
+
+    public: bool has_task(dmtr_qtoken_t qt) {
+        return NULL != get_task(qt);
+    }
+
+    // Returns null if `qt` has been dropped or no operation was started with it.
+    protected: task * get_task(dmtr_qtoken_t qt) {
+        task *t = NULL;
+        if (QT2QD(qt) != static_cast<dmtr_qtoken_t>(my_qd) || 0 != my_tasks.get(t, qt)) {
+            return NULL;
+        }
+
+        return t->is_valid() ? t : NULL;
+    }
+
+    private: int get_slot(task *&t_out, dmtr_qtoken_t qt) {
+        t_out = NULL;
+        DMTR_TRUE(EINVAL, QT2QD(qt) == static_cast<dmtr_qtoken_t>(my_qd));
+        return my_tasks.get(t_out, qt);
+    }
+
+    private: int drop_task(dmtr_qtoken_t qt) {
+        DMTR_TRUE(EINVAL, QT2QD(qt) == static_cast<dmtr_qtoken_t>(my_qd));
+        return my_tasks.remove(qt);
+    }
 };
 
 } // namespace dmtr
@@ -8,26 +8,54 @@
 
 #include "io_queue.hh"
 #include "io_queue_factory.hh"
-#include <boost/atomic.hpp>
+#include "slab_table.hh"
 #include <dmtr/annot.h>
 #include <memory>
-#include <unordered_map>
 
 namespace dmtr {
 
 class io_queue_api
 {
-    private: boost::atomic<uint32_t> my_qd_counter;
-    private: std::unique_ptr<io_queue> my_queues[256];
+    // A queue descriptor is a handle into `my_queues`, so a closed descriptor is rejected rather
+    // than mistaken for the queue that reuses its slot, and the table only grows with the number
+    // of open queues.
+    private: slab_table<std::unique_ptr<io_queue>> my_queues;
     private: io_queue_factory my_queue_factory;
 
     private: io_queue_api();
     public: ~io_queue_api();
-    private: int get_queue(io_queue *&q_out, int qd) const;
-    private: int new_qd();
     private: int new_queue(io_queue *&q_out, enum io_queue::category_id cid);
-    private: int insert_queue(std::unique_ptr<io_queue> &q);
-    private: int remove_queue(int qd);
+
+    private: int get_queue(io_queue *&q_out, int qd) const {
+        q_out = NULL;
+        const std::unique_ptr<io_queue> *q = NULL;
+        DMTR_OK(my_queues.get(q, qd));
+        DMTR_NOTNULL(EINVAL, q->get());
+        q_out = q->get();
+        return 0;
+    }
+
+    // Reserves a descriptor; the slot stays empty until `insert_queue()` fills it.
+    private: int new_qd(int &qd_out) {
+        slab_table<std::unique_ptr<io_queue>>::handle_type h = 0;
+        std::unique_ptr<io_queue> *q = NULL;
+        DMTR_OK(my_queues.insert(h, q));
+        qd_out = static_cast<int>(h);
+        return 0;
+    }
+
+    private: int insert_queue(std::unique_ptr<io_queue> &q) {
+        DMTR_NOTNULL(EINVAL, q.get());
+        std::unique_ptr<io_queue> *slot = NULL;
+        DMTR_OK(my_queues.get(slot, q->qd()));
+        DMTR_TRUE(EEXIST, NULL == slot->get());
+        *slot = std::move(q);
+        return 0;
+    }
+
+    private: int remove_queue(int qd) {
+        return my_queues.remove(qd);
+    }
 
     public: int qttoqd(dmtr_qtoken_t qtok) {
         return static_cast<int>(QT2QD(qtok));
@@ -0,0 +1,146 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_MEMORY_RING_HH_IS_INCLUDED
+#define DMTR_LIBOS_MEMORY_RING_HH_IS_INCLUDED
+
+#include "spsc_ring.hh"
+
+#include <boost/atomic.hpp>
+#include <dmtr/annot.h>
+#include <dmtr/fail.h>
+#include <dmtr/types.h>
+
+namespace dmtr {
+
+// The data path of `memory_ring_queue`: scatter-gather arrays handed from one core to another over
+// an `spsc_ring`, where one core only pushes and the other only pops. Each side keeps its
+// operations in a table of its own, so the cores share nothing but the ring and the token of each
+// slot, which a core only reads to find out that a token isn't one of its own.
+class memory_ring
+{
+    public: static const size_t RING_SIZE = 1024;
+    // Number of entries the consumer takes off the ring at a time.
+    public: static const size_t POP_BATCH_SIZE = 32;
+    // Outstanding operations per side. A token lives in slot `qt % MAX_TASKS_PER_SIDE` of its
+    // side's table.
+    public: static const size_t MAX_TASKS_PER_SIDE = 1024;
+
+    private: static const dmtr_qtoken_t NO_TOKEN = ~static_cast<dmtr_qtoken_t>(0);
+
+    private: struct task {
+        // `NO_TOKEN` while the slot is free. Everything else is only touched by the slot's side.
+        boost::atomic<dmtr_qtoken_t> qt;
+        bool done;
+        dmtr_sgarray_t sga;
+
+        task() :
+            qt(NO_TOKEN),
+            done(false),
+            sga()
+        {}
+    };
+
+    private: spsc_ring<dmtr_sgarray_t, RING_SIZE> my_ring;
+    private: alignas(DMTR_CACHE_LINE_SIZE) task my_push_tasks[MAX_TASKS_PER_SIDE];
+    private: alignas(DMTR_CACHE_LINE_SIZE) task my_pop_tasks[MAX_TASKS_PER_SIDE];
+    // Entries popped off the ring that haven't been handed to a pop token yet; consumer only.
+    private: dmtr_sgarray_t my_pop_batch[POP_BATCH_SIZE];
+    private: size_t my_pop_batch_head;
+    private: size_t my_pop_batch_len;
+
+    public: memory_ring() :
+        my_pop_batch_head(0),
+        my_pop_batch_len(0)
+    {}
+
+    private: memory_ring(const memory_ring &) = delete;
+    private: memory_ring &operator=(const memory_ring &) = delete;
+
+    // Producer side.
+    public: int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga) {
+        task *t = NULL;
+        DMTR_OK(claim(t, my_push_tasks, qt));
+        t->sga = sga;
+        t->qt.store(qt, boost::memory_order_release);
+        return 0;
+    }
+
+    // Consumer side.
+    public: int pop(dmtr_qtoken_t qt) {
+        task *t = NULL;
+        DMTR_OK(claim(t, my_pop_tasks, qt));
+        t->qt.store(qt, boost::memory_order_release);
+        return 0;
+    }
+
+    // Either side, for a token it issued. Returns `EAGAIN` until the operation has completed.
+    public: int poll(dmtr_qresult_t &qr_out, int qd, dmtr_qtoken_t qt) {
+        task * const push_task = find(my_push_tasks, qt);
+        task * const t = NULL == push_task ? find(my_pop_tasks, qt) : push_task;
+        DMTR_TRUE(EINVAL, t != NULL);
+
+        if (!t->done) {
+            if (t == push_task) {
+                if (!my_ring.try_push(t->sga)) {
+                    return EAGAIN;
+                }
+            } else if (!next_popped(t->sga)) {
+                return EAGAIN;
+            }
+            t->done = true;
+        }
+
+        qr_out.qr_opcode = t == push_task ? DMTR_OPC_PUSH : DMTR_OPC_POP;
+        qr_out.qr_qd = qd;
+        qr_out.qr_qt = qt;
+        qr_out.qr_value.sga = t->sga;
+        return 0;
+    }
+
+    // Either side, for a token it issued.
+    public: int drop(dmtr_qtoken_t qt) {
+        task *t = find(my_push_tasks, qt);
+        if (NULL == t) {
+            t = find(my_pop_tasks, qt);
+        }
+        DMTR_TRUE(EINVAL, t != NULL);
+        t->qt.store(NO_TOKEN, boost::memory_order_release);
+        return 0;
+    }
+
+    // The slot is only published (by storing its token) once the caller has filled it in.
+    private: static int claim(task *&t_out, task *tasks, dmtr_qtoken_t qt) {
+        DMTR_TRUE(EINVAL, NO_TOKEN != qt);
+        task &t = tasks[qt % MAX_TASKS_PER_SIDE];
+        DMTR_TRUE(ENOMEM, NO_TOKEN == t.qt.load(boost::memory_order_relaxed));
+        t.done = false;
+        t_out = &t;
+        return 0;
+    }
+
+    private: static task *find(task *tasks, dmtr_qtoken_t qt) {
+        task &t = tasks[qt % MAX_TASKS_PER_SIDE];
+        return t.qt.load(boost::memory_order_acquire) == qt ? &t : NULL;
+    }
+
+    // Takes the next entry off the ring, refilling the local batch when it runs out.
+    private: bool next_popped(dmtr_sgarray_t &sga_out) {
+        if (my_pop_batch_head == my_pop_batch_len) {
+            my_pop_batch_head = 0;
+            my_pop_batch_len = my_ring.pop_bulk(my_pop_batch, POP_BATCH_SIZE);
+            if (0 == my_pop_batch_len) {
+                return false;
+            }
+        }
+
+        sga_out = my_pop_batch[my_pop_batch_head++];
+        return true;
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_MEMORY_RING_HH_IS_INCLUDED */
@@ -0,0 +1,83 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_MEMORY_RING_QUEUE_HH_IS_INCLUDED
+#define DMTR_LIBOS_MEMORY_RING_QUEUE_HH_IS_INCLUDED
+
+#include "io_queue.hh"
+#include "memory_ring.hh"
+
+#include <boost/atomic.hpp>
+#include <dmtr/annot.h>
+#include <dmtr/types.h>
+#include <memory>
+
+namespace dmtr {
+
+// Drop-in replacement for `memory_queue` for handing scatter-gather arrays from one core to
+// another. Pushes and pops complete directly from `poll()` against a lock-free ring instead of
+// going through a locked `std::queue` and a pair of user threads, so one core must only push and
+// the other must only pop. Each side tracks its own operations in `memory_ring` rather than in the
+// `io_queue` task table, and hands out tokens from a counter of its own, so the cores never take a
+// lock. Select it with
+// `register_queue_ctor(io_queue::MEMORY_Q, memory_ring_queue::new_object)`.
+class memory_ring_queue : public io_queue
+{
+    private: memory_ring my_ring;
+    private: boost::atomic<uint32_t> my_qt_counter;
+    private: bool my_good_flag;
+
+    private: memory_ring_queue(int qd) :
+        io_queue(MEMORY_Q, qd),
+        my_qt_counter(0),
+        my_good_flag(true)
+    {}
+
+    public: static int new_object(std::unique_ptr<io_queue> &q_out, int qd) {
+        q_out = std::unique_ptr<io_queue>(new memory_ring_queue(qd));
+        return 0;
+    }
+
+    public: virtual int new_qtoken(dmtr_qtoken_t &qt_out) {
+        uint32_t n = 0;
+        do {
+            n = my_qt_counter.fetch_add(1, boost::memory_order_relaxed);
+        } while (0 == n);
+        qt_out = (static_cast<dmtr_qtoken_t>(my_qd) << QD_OFFSET) | n;
+        return 0;
+    }
+
+    public: virtual int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga) {
+        DMTR_TRUE(EPERM, good());
+        return my_ring.push(qt, sga);
+    }
+
+    public: virtual int pop(dmtr_qtoken_t qt) {
+        DMTR_TRUE(EPERM, good());
+        return my_ring.pop(qt);
+    }
+
+    public: virtual int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) {
+        DMTR_TRUE(EINVAL, good());
+        return my_ring.poll(qr_out, my_qd, qt);
+    }
+
+    public: virtual int drop(dmtr_qtoken_t qt) {
+        return my_ring.drop(qt);
+    }
+
+    public: virtual int close() {
+        my_good_flag = false;
+        return 0;
+    }
+
+    private: bool good() const {
+        return my_good_flag;
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_MEMORY_RING_QUEUE_HH_IS_INCLUDED */
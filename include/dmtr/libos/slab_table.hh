@@ -0,0 +1,167 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_SLAB_TABLE_HH_IS_INCLUDED
+#define DMTR_LIBOS_SLAB_TABLE_HH_IS_INCLUDED
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace dmtr {
+
+// Table of values addressed by 32-bit handles. Slots are allocated in fixed-size slabs as the
+// table grows, so memory follows the number of live entries (up to the high-water mark) and
+// pointers to values stay put. A handle packs a slot index with the slot's generation, which is
+// bumped on every `remove()`, so a stale handle is rejected instead of aliasing whatever reused
+// its slot. Handles are never 0 and always fit in a non-negative `int`. `SlabSize` is the number of
+// slots allocated at a time, and so the least a table takes up once anything is in it.
+template <typename Value, unsigned IndexBits = 20, uint32_t SlabSize = 64>
+class slab_table
+{
+    static_assert(IndexBits > 0 && IndexBits < 31, "slab_table needs room for a generation");
+    static_assert(SlabSize > 0 && ((1u << IndexBits) % SlabSize) == 0,
+        "slab_table's slabs must tile its index space");
+
+    public: typedef uint32_t handle_type;
+
+    public: static const uint32_t MAX_SIZE = 1u << IndexBits;
+    private: static const uint32_t INDEX_MASK = MAX_SIZE - 1;
+    private: static const uint32_t GENERATION_MASK = (1u << (31 - IndexBits)) - 1;
+    private: static const uint32_t SLAB_SIZE = SlabSize;
+    private: static const uint32_t NIL = UINT32_MAX;
+
+    private: struct slot {
+        Value value;
+        uint32_t generation = 1;
+        uint32_t next_free = NIL;
+        bool in_use = false;
+    };
+
+    private: std::vector<std::unique_ptr<slot[]>> my_slabs;
+    private: uint32_t my_free_head;
+    private: uint32_t my_capacity;
+    private: size_t my_size;
+
+    public: slab_table() :
+        my_free_head(NIL),
+        my_capacity(0),
+        my_size(0)
+    {}
+
+    private: slab_table(const slab_table &) = delete;
+    private: slab_table &operator=(const slab_table &) = delete;
+
+    public: size_t size() const {
+        return my_size;
+    }
+
+    // Claims a slot, returning its handle and the (default-constructed) value in it.
+    public: int insert(handle_type &h_out, Value *&value_out) {
+        if (NIL == my_free_head) {
+            if (MAX_SIZE == my_capacity) {
+                return ENOMEM;
+            }
+            grow();
+        }
+
+        const uint32_t index = my_free_head;
+        slot &s = at(index);
+        my_free_head = s.next_free;
+        s.next_free = NIL;
+        s.in_use = true;
+        ++my_size;
+
+        h_out = (s.generation << IndexBits) | index;
+        value_out = &s.value;
+        return 0;
+    }
+
+    public: int get(Value *&value_out, handle_type h) {
+        slot *s = NULL;
+        int ret = lookup(s, h);
+        if (0 != ret) {
+            return ret;
+        }
+
+        value_out = &s->value;
+        return 0;
+    }
+
+    public: int get(const Value *&value_out, handle_type h) const {
+        slot *s = NULL;
+        int ret = lookup(s, h);
+        if (0 != ret) {
+            return ret;
+        }
+
+        value_out = &s->value;
+        return 0;
+    }
+
+    public: bool contains(handle_type h) const {
+        slot *s = NULL;
+        return 0 == lookup(s, h);
+    }
+
+    // Releases the slot and resets its value, invalidating `h`.
+    public: int remove(handle_type h) {
+        slot *s = NULL;
+        int ret = lookup(s, h);
+        if (0 != ret) {
+            return ret;
+        }
+
+        s->value = Value();
+        s->in_use = false;
+        s->generation = next_generation(s->generation);
+        s->next_free = my_free_head;
+        my_free_head = h & INDEX_MASK;
+        --my_size;
+        return 0;
+    }
+
+    private: int lookup(slot *&s_out, handle_type h) const {
+        const uint32_t index = h & INDEX_MASK;
+        if (index >= my_capacity) {
+            return EINVAL;
+        }
+
+        slot &s = at(index);
+        if (!s.in_use || s.generation != (h >> IndexBits)) {
+            return EINVAL;
+        }
+
+        s_out = &s;
+        return 0;
+    }
+
+    private: slot &at(uint32_t index) const {
+        return my_slabs[index / SLAB_SIZE][index % SLAB_SIZE];
+    }
+
+    private: void grow() {
+        my_slabs.emplace_back(new slot[SLAB_SIZE]);
+        const uint32_t first = my_capacity;
+        my_capacity += SLAB_SIZE;
+        // Thread the new slots onto the free list in order, so low indices are handed out first.
+        for (uint32_t i = my_capacity; i-- > first;) {
+            at(i).next_free = my_free_head;
+            my_free_head = i;
+        }
+    }
+
+    // Generations skip 0 so that a handle is never 0.
+    private: static uint32_t next_generation(uint32_t generation) {
+        generation = (generation + 1) & GENERATION_MASK;
+        return 0 == generation ? 1 : generation;
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_SLAB_TABLE_HH_IS_INCLUDED */
@@ -0,0 +1,99 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_SPSC_RING_HH_IS_INCLUDED
+#define DMTR_LIBOS_SPSC_RING_HH_IS_INCLUDED
+
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <cstddef>
+
+#define DMTR_CACHE_LINE_SIZE 64
+
+namespace dmtr {
+
+// Bounded single-producer/single-consumer ring. Exactly one thread may push and exactly one
+// thread may pop; neither side takes a lock or allocates. `Capacity` must be a power of two.
+template <typename Value, size_t Capacity>
+class spsc_ring
+{
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+        "spsc_ring capacity must be a power of two");
+
+    private: static const size_t MASK = Capacity - 1;
+
+    // Each side owns a cache line holding its own index and a stale copy of the other side's, so
+    // it only touches the shared line when the copy says the ring is full (or empty).
+    private: alignas(DMTR_CACHE_LINE_SIZE) boost::atomic<size_t> my_tail;
+    private: size_t my_cached_head;
+    private: alignas(DMTR_CACHE_LINE_SIZE) boost::atomic<size_t> my_head;
+    private: size_t my_cached_tail;
+    private: alignas(DMTR_CACHE_LINE_SIZE) Value my_slots[Capacity];
+
+    public: spsc_ring() :
+        my_tail(0),
+        my_cached_head(0),
+        my_head(0),
+        my_cached_tail(0)
+    {}
+
+    private: spsc_ring(const spsc_ring &) = delete;
+    private: spsc_ring &operator=(const spsc_ring &) = delete;
+
+    public: static size_t capacity() {
+        return Capacity;
+    }
+
+    // Producer side. Pushes up to `count` values and returns how many fit.
+    public: size_t push_bulk(const Value *values, size_t count) {
+        const size_t tail = my_tail.load(boost::memory_order_relaxed);
+        size_t space = Capacity - (tail - my_cached_head);
+        if (space < count) {
+            my_cached_head = my_head.load(boost::memory_order_acquire);
+            space = Capacity - (tail - my_cached_head);
+        }
+
+        const size_t n = std::min(space, count);
+        for (size_t i = 0; i < n; ++i) {
+            my_slots[(tail + i) & MASK] = values[i];
+        }
+        my_tail.store(tail + n, boost::memory_order_release);
+        return n;
+    }
+
+    public: bool try_push(const Value &value) {
+        return push_bulk(&value, 1) == 1;
+    }
+
+    // Consumer side. Pops up to `count` values into `values_out` and returns how many there were.
+    public: size_t pop_bulk(Value *values_out, size_t count) {
+        const size_t head = my_head.load(boost::memory_order_relaxed);
+        size_t available = my_cached_tail - head;
+        if (available < count) {
+            my_cached_tail = my_tail.load(boost::memory_order_acquire);
+            available = my_cached_tail - head;
+        }
+
+        const size_t n = std::min(available, count);
+        for (size_t i = 0; i < n; ++i) {
+            values_out[i] = my_slots[(head + i) & MASK];
+        }
+        my_head.store(head + n, boost::memory_order_release);
+        return n;
+    }
+
+    public: bool try_pop(Value &value_out) {
+        return pop_bulk(&value_out, 1) == 1;
+    }
+
+    // Approximate when called from anything but the consumer.
+    public: bool empty() const {
+        return my_tail.load(boost::memory_order_acquire) == my_head.load(boost::memory_order_acquire);
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_SPSC_RING_HH_IS_INCLUDED */
@@ -0,0 +1,493 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_LIBOS_URING_FILE_QUEUE_HH_IS_INCLUDED
+#define DMTR_LIBOS_URING_FILE_QUEUE_HH_IS_INCLUDED
+
+#include "io_queue.hh"
+#include "slab_table.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dmtr/annot.h>
+#include <dmtr/types.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <memory>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+namespace dmtr {
+
+// File queue that turns pushes into writes and pops into reads at the file's cursor, issued
+// through an io_uring so that the core that polls the queue never blocks on the disk. Requests
+// queue up in the submission ring and go to the kernel together on the next `poll()`, which also
+// reaps whatever completions are ready in batches. Select it with
+// `register_queue_ctor(io_queue::FILE_Q, uring_file_queue::new_object)`, after setting options
+// with `uring_file_queue::set_options()` if the defaults don't fit.
+//
+// Pushes are appended at the cursor in the order they were made and complete with the pushed
+// array once all of it has been written. A pop reads up to `read_size` bytes at the cursor into a
+// buffer from `malloc()`, to be freed with `dmtr_sgafree()`; it completes with an empty array at
+// the end of the file. The queue keeps track of where the file ends, so it assumes that nothing
+// else changes the file's size while it's open.
+class uring_file_queue : public io_queue
+{
+    public: struct options {
+        unsigned int ring_entries = 256;
+        // Opens files with `O_DIRECT`, which needs every buffer, length and file offset to be a
+        // multiple of the block size. Pushes must then add up to whole blocks and either fit in a
+        // fixed buffer or have block-aligned segments, and `read_size` must be a multiple of the
+        // block size. A pop that runs into the end of the file leaves the cursor there, so it
+        // stays aligned only if the file ends on a block boundary.
+        bool direct = false;
+        // Registers this many buffers of `fixed_buffer_size` bytes with the ring. Pushes that fit
+        // in one are copied into it and written with `IORING_OP_WRITE_FIXED`, which saves the
+        // kernel from mapping the pages on every write; larger ones fall back to `writev`.
+        size_t fixed_buffer_count = 0;
+        size_t fixed_buffer_size = 64 * 1024;
+        // Follows each batch of writes with an `fdatasync` and holds the writes' completions until
+        // it finishes, so a completed push is durable at the cost of one sync per batch.
+        bool group_commit = false;
+        size_t read_size = 4096;
+    };
+
+    // Number of completions reaped from the ring at a time.
+    public: static const size_t COMPLETION_BATCH_SIZE = 32;
+    private: static const size_t BUFFER_ALIGNMENT = 4096;
+
+    private: enum request_kind {
+        WRITE,
+        READ,
+        SYNC,
+    };
+
+    // State of a request while the kernel owns it, looked up by the handle passed as its user
+    // data. Requests outlive dropped tasks, since the kernel may still be using their buffers.
+    private: struct request {
+        request_kind kind = WRITE;
+        dmtr_qtoken_t qt = 0;
+        struct iovec iov[DMTR_SGARRAY_MAXSIZE];
+        size_t len = 0;
+        int fixed_index = -1;
+        void *buf = NULL;
+        // Outcome of a write that's waiting on its batch's sync.
+        int error = 0;
+        // Writes that complete with a sync.
+        std::vector<uint32_t> batch;
+    };
+
+    private: struct io_uring my_ring;
+    private: bool my_ring_flag;
+    private: int my_fd;
+    private: off_t my_offset;
+    // Where the file ends once every write queued so far has gone through.
+    private: off_t my_size;
+    private: const options my_options;
+    private: slab_table<request> my_requests;
+    private: std::vector<void *> my_fixed_buffers;
+    private: std::vector<int> my_free_fixed_buffers;
+    // Writes queued since the last submission, which the next sync will cover.
+    private: std::vector<uint32_t> my_unsynced;
+    private: size_t my_unsubmitted;
+
+    private: uring_file_queue(int qd, const options &opts) :
+        io_queue(FILE_Q, qd),
+        my_ring_flag(false),
+        my_fd(-1),
+        my_offset(0),
+        my_size(0),
+        my_options(opts),
+        my_unsubmitted(0)
+    {}
+
+    public: virtual ~uring_file_queue() {
+        if (good()) {
+            close();
+        }
+    }
+
+    public: static int new_object(std::unique_ptr<io_queue> &q_out, int qd) {
+        q_out = std::unique_ptr<io_queue>(new uring_file_queue(qd, default_options()));
+        return 0;
+    }
+
+    // Options that queues created from here on are given.
+    public: static void set_options(const options &opts) {
+        default_options() = opts;
+    }
+
+    public: virtual int open(const char *pathname, int flags) {
+        return open2(pathname, flags, 0);
+    }
+
+    public: virtual int creat(const char *pathname, mode_t mode) {
+        return open2(pathname, O_CREAT | O_WRONLY | O_TRUNC, mode);
+    }
+
+    public: virtual int open2(const char *pathname, int flags, mode_t mode) {
+        DMTR_NOTNULL(EINVAL, pathname);
+        DMTR_TRUE(EPERM, !good());
+
+        if (my_options.direct) {
+            flags |= O_DIRECT;
+        }
+        int fd = ::open(pathname, flags, mode);
+        if (-1 == fd) {
+            return errno;
+        }
+
+        struct stat st;
+        if (-1 == ::fstat(fd, &st)) {
+            int error = errno;
+            ::close(fd);
+            return error;
+        }
+
+        int ret = setup_ring();
+        if (0 != ret) {
+            ::close(fd);
+            return ret;
+        }
+
+        my_fd = fd;
+        my_size = st.st_size;
+        my_offset = flags & O_APPEND ? st.st_size : 0;
+        return 0;
+    }
+
+    public: virtual int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga) {
+        DMTR_TRUE(EPERM, good());
+        DMTR_TRUE(EINVAL, sga.sga_numsegs <= DMTR_SGARRAY_MAXSIZE);
+
+        uint32_t h = 0;
+        request *r = NULL;
+        struct io_uring_sqe *sqe = NULL;
+        DMTR_OK(new_request(h, r, sqe, qt, DMTR_OPC_PUSH, &sga));
+        r->kind = WRITE;
+        for (size_t i = 0; i < sga.sga_numsegs; ++i) {
+            r->iov[i].iov_base = sga.sga_segs[i].sgaseg_buf;
+            r->iov[i].iov_len = sga.sga_segs[i].sgaseg_len;
+            r->len += sga.sga_segs[i].sgaseg_len;
+        }
+
+        if (r->len <= my_options.fixed_buffer_size && !my_free_fixed_buffers.empty()) {
+            r->fixed_index = my_free_fixed_buffers.back();
+            my_free_fixed_buffers.pop_back();
+            char *p = static_cast<char *>(my_fixed_buffers[r->fixed_index]);
+            for (size_t i = 0; i < sga.sga_numsegs; ++i) {
+                memcpy(p, r->iov[i].iov_base, r->iov[i].iov_len);
+                p += r->iov[i].iov_len;
+            }
+            io_uring_prep_write_fixed(sqe, my_fd, my_fixed_buffers[r->fixed_index], r->len,
+                my_offset, r->fixed_index);
+        } else {
+            io_uring_prep_writev(sqe, my_fd, r->iov, sga.sga_numsegs, my_offset);
+        }
+        io_uring_sqe_set_data(sqe, to_user_data(h));
+
+        my_offset += r->len;
+        my_size = std::max(my_size, my_offset);
+        ++my_unsubmitted;
+        if (my_options.group_commit) {
+            my_unsynced.push_back(h);
+        }
+        return 0;
+    }
+
+    public: virtual int pop(dmtr_qtoken_t qt) {
+        DMTR_TRUE(EPERM, good());
+
+        void *buf = NULL;
+        DMTR_OK(posix_memalign(&buf, BUFFER_ALIGNMENT, my_options.read_size));
+
+        uint32_t h = 0;
+        request *r = NULL;
+        struct io_uring_sqe *sqe = NULL;
+        int ret = new_request(h, r, sqe, qt, DMTR_OPC_POP, NULL);
+        if (0 != ret) {
+            free(buf);
+            return ret;
+        }
+        r->kind = READ;
+        r->buf = buf;
+        r->len = my_options.read_size;
+        r->iov[0].iov_base = buf;
+        r->iov[0].iov_len = r->len;
+        io_uring_prep_readv(sqe, my_fd, r->iov, 1, my_offset);
+        io_uring_sqe_set_data(sqe, to_user_data(h));
+
+        // Reads of regular files only come up short at the end, so the cursor moves to where this
+        // one will stop before it completes, and operations queued behind it start right there.
+        my_offset += std::min(static_cast<off_t>(r->len), std::max(my_size - my_offset, off_t(0)));
+        ++my_unsubmitted;
+        return 0;
+    }
+
+    public: virtual int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) {
+        DMTR_TRUE(EINVAL, good());
+
+        task *t;
+        DMTR_OK(get_task(t, qt));
+        if (!t->done()) {
+            DMTR_OK(submit());
+            DMTR_OK(reap());
+            if (!t->done()) {
+                return EAGAIN;
+            }
+        }
+
+        return t->poll(qr_out);
+    }
+
+    // Waits for whatever the kernel is still doing with the queue's buffers before letting go of
+    // them.
+    public: virtual int close() {
+        DMTR_TRUE(EPERM, good());
+
+        int ret = submit();
+        while (0 == ret && my_requests.size() > 0) {
+            struct io_uring_cqe *cqe = NULL;
+            ret = -io_uring_wait_cqe(&my_ring, &cqe);
+            if (0 == ret) {
+                ret = reap();
+            }
+        }
+
+        teardown_ring();
+        if (-1 == ::close(my_fd) && 0 == ret) {
+            ret = errno;
+        }
+        my_fd = -1;
+        return ret;
+    }
+
+    private: static options &default_options() {
+        static options opts;
+        return opts;
+    }
+
+    private: bool good() const {
+        return my_fd != -1;
+    }
+
+    private: static void *to_user_data(uint32_t h) {
+        return reinterpret_cast<void *>(static_cast<uintptr_t>(h));
+    }
+
+    private: int setup_ring() {
+        int ret = -io_uring_queue_init(my_options.ring_entries, &my_ring, 0);
+        if (0 != ret) {
+            return ret;
+        }
+        my_ring_flag = true;
+
+        if (0 == my_options.fixed_buffer_count) {
+            return 0;
+        }
+
+        std::vector<struct iovec> iovs(my_options.fixed_buffer_count);
+        for (size_t i = 0; i < iovs.size(); ++i) {
+            void *buf = NULL;
+            ret = posix_memalign(&buf, BUFFER_ALIGNMENT, my_options.fixed_buffer_size);
+            if (0 != ret) {
+                teardown_ring();
+                return ret;
+            }
+            my_fixed_buffers.push_back(buf);
+            iovs[i].iov_base = buf;
+            iovs[i].iov_len = my_options.fixed_buffer_size;
+        }
+
+        ret = -io_uring_register_buffers(&my_ring, iovs.data(), iovs.size());
+        if (0 != ret) {
+            teardown_ring();
+            return ret;
+        }
+        for (size_t i = iovs.size(); i-- > 0;) {
+            my_free_fixed_buffers.push_back(static_cast<int>(i));
+        }
+        return 0;
+    }
+
+    private: void teardown_ring() {
+        if (my_ring_flag) {
+            io_uring_queue_exit(&my_ring);
+            my_ring_flag = false;
+        }
+        for (size_t i = 0; i < my_fixed_buffers.size(); ++i) {
+            free(my_fixed_buffers[i]);
+        }
+        my_fixed_buffers.clear();
+        my_free_fixed_buffers.clear();
+    }
+
+    // Claims a task, a request and a submission entry for an operation, or none of them.
+    private: int new_request(uint32_t &h_out, request *&r_out, struct io_uring_sqe *&sqe_out,
+        dmtr_qtoken_t qt, dmtr_opcode_t opcode, const dmtr_sgarray_t *sga)
+    {
+        DMTR_OK(next_sqe(sqe_out));
+        int ret = my_requests.insert(h_out, r_out);
+        if (0 == ret) {
+            ret = NULL == sga ? new_task(qt, opcode) : new_task(qt, opcode, *sga);
+            if (0 != ret) {
+                my_requests.remove(h_out);
+            }
+        }
+        if (0 != ret) {
+            // The entry is already claimed, so it goes to the kernel as a no-op that's ignored.
+            io_uring_prep_nop(sqe_out);
+            io_uring_sqe_set_data(sqe_out, NULL);
+            ++my_unsubmitted;
+            return ret;
+        }
+
+        r_out->qt = qt;
+        return 0;
+    }
+
+    // Hands out the next free submission entry, submitting what's queued if the ring is full.
+    private: int next_sqe(struct io_uring_sqe *&sqe_out) {
+        sqe_out = io_uring_get_sqe(&my_ring);
+        if (NULL == sqe_out) {
+            DMTR_OK(submit());
+            sqe_out = io_uring_get_sqe(&my_ring);
+        }
+        DMTR_NOTNULL(EAGAIN, sqe_out);
+        return 0;
+    }
+
+    private: int submit() {
+        if (my_options.group_commit && !my_unsynced.empty()) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&my_ring);
+            if (NULL == sqe) {
+                // Make room for the sync; it'll be drained behind the writes all the same.
+                int ret = io_uring_submit(&my_ring);
+                DMTR_TRUE(-ret, ret >= 0);
+                my_unsubmitted = 0;
+                sqe = io_uring_get_sqe(&my_ring);
+                DMTR_NOTNULL(EAGAIN, sqe);
+            }
+
+            uint32_t h = 0;
+            request *r = NULL;
+            DMTR_OK(my_requests.insert(h, r));
+            r->kind = SYNC;
+            r->batch.swap(my_unsynced);
+            io_uring_prep_fsync(sqe, my_fd, IORING_FSYNC_DATASYNC);
+            // Drained, so the sync starts once every write ahead of it has finished.
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+            io_uring_sqe_set_data(sqe, to_user_data(h));
+            ++my_unsubmitted;
+        }
+
+        if (0 == my_unsubmitted) {
+            return 0;
+        }
+
+        int ret = io_uring_submit(&my_ring);
+        DMTR_TRUE(-ret, ret >= 0);
+        my_unsubmitted = 0;
+        return 0;
+    }
+
+    private: int reap() {
+        struct io_uring_cqe *cqes[COMPLETION_BATCH_SIZE];
+        for (;;) {
+            unsigned int n = io_uring_peek_batch_cqe(&my_ring, cqes, COMPLETION_BATCH_SIZE);
+            for (unsigned int i = 0; i < n; ++i) {
+                const uint32_t h = static_cast<uint32_t>(
+                    reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqes[i])));
+                // Handles are never 0, which marks the no-ops.
+                const int ret = 0 == h ? 0 : on_completion(h, cqes[i]->res);
+                if (0 != ret) {
+                    // Whatever the failed completion got to is done, so it isn't reaped again.
+                    io_uring_cq_advance(&my_ring, i + 1);
+                    return ret;
+                }
+            }
+            io_uring_cq_advance(&my_ring, n);
+            if (n < COMPLETION_BATCH_SIZE) {
+                return 0;
+            }
+        }
+    }
+
+    private: int on_completion(uint32_t h, int res) {
+        request *r = NULL;
+        DMTR_OK(my_requests.get(r, h));
+
+        switch (r->kind) {
+            default:
+                DMTR_UNREACHABLE();
+            case WRITE: {
+                if (r->fixed_index >= 0) {
+                    my_free_fixed_buffers.push_back(r->fixed_index);
+                    r->fixed_index = -1;
+                }
+                // A short write to a regular file means the disk is full.
+                r->error = res < 0 ? -res : (static_cast<size_t>(res) < r->len ? ENOSPC : 0);
+                if (my_options.group_commit) {
+                    return 0;
+                }
+                return finish_write(h, 0);
+            }
+            case READ: {
+                task *t = get_task(r->qt);
+                if (NULL != t) {
+                    if (res < 0) {
+                        DMTR_OK(t->complete(-res));
+                    } else {
+                        dmtr_sgarray_t sga = {};
+                        if (res > 0) {
+                            sga.sga_buf = r->buf;
+                            sga.sga_numsegs = 1;
+                            sga.sga_segs[0].sgaseg_buf = r->buf;
+                            sga.sga_segs[0].sgaseg_len = res;
+                            r->buf = NULL;
+                        }
+                        DMTR_OK(t->complete(0, sga));
+                    }
+                }
+                free(r->buf);
+                return my_requests.remove(h);
+            }
+            case SYNC: {
+                std::vector<uint32_t> batch;
+                batch.swap(r->batch);
+                DMTR_OK(my_requests.remove(h));
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    DMTR_OK(finish_write(batch[i], res < 0 ? -res : 0));
+                }
+                return 0;
+            }
+        }
+    }
+
+    private: int finish_write(uint32_t h, int sync_error) {
+        request *r = NULL;
+        DMTR_OK(my_requests.get(r, h));
+        task *t = get_task(r->qt);
+        if (NULL != t) {
+            const int error = 0 != r->error ? r->error : sync_error;
+            if (0 != error) {
+                DMTR_OK(t->complete(error));
+            } else {
+                const dmtr_sgarray_t *sga = NULL;
+                DMTR_TRUE(EINVAL, t->arg(sga));
+                DMTR_OK(t->complete(0, *sga));
+            }
+        }
+        return my_requests.remove(h);
+    }
+};
+
+} // namespace dmtr
+
+#endif /* DMTR_LIBOS_URING_FILE_QUEUE_HH_IS_INCLUDED */
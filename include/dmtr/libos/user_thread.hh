@@ -4,56 +4,242 @@
 #ifndef DMTR_LIBOS_USER_THREAD_HH_IS_INCLUDED
 #define DMTR_LIBOS_USER_THREAD_HH_IS_INCLUDED
 
+#include <boost/context/stack_context.hpp>
 #include <boost/coroutine2/coroutine.hpp>
-#include <functional>
-#include <queue>
+#include <dmtr/fail.h>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
 
 namespace dmtr {
 
+// Free list of `BlockSize` blocks, one per thread, so that recycling a block takes no locks. A
+// block freed on another thread joins that thread's list. The link lives in the free block
+// itself, at `link_offset`. When the thread exits, `Release` gives back whatever is on its list.
+template <size_t BlockSize, size_t MaxFree, void (*Release)(void *)>
+class thread_free_list {
+    private: struct node {
+        node *next;
+    };
+
+    private: node *my_head = nullptr;
+    private: size_t my_count = 0;
+    private: size_t my_link_offset = 0;
+
+    public: static thread_free_list &local() {
+        static thread_local thread_free_list list;
+        return list;
+    }
+
+    // Anything pushed after this (by a thread-local destroyed later) is handed straight back.
+    public: ~thread_free_list() {
+        for (void *block = pop(my_link_offset); nullptr != block; block = pop(my_link_offset)) {
+            Release(block);
+        }
+        my_count = MaxFree;
+    }
+
+    // Returns null once the block is on the list. If the list is full, returns the block, which
+    // the caller then frees itself.
+    public: void *push(void *block, size_t link_offset) {
+        if (my_count == MaxFree) {
+            return block;
+        }
+
+        node *n = reinterpret_cast<node *>(static_cast<char *>(block) + link_offset);
+        n->next = my_head;
+        my_head = n;
+        my_link_offset = link_offset;
+        ++my_count;
+        return nullptr;
+    }
+
+    public: void *pop(size_t link_offset) {
+        if (nullptr == my_head) {
+            return nullptr;
+        }
+
+        node *n = my_head;
+        my_head = n->next;
+        --my_count;
+        return reinterpret_cast<char *>(n) - link_offset;
+    }
+};
+
+// Stack allocator for `boost::coroutines2` that recycles fixed-size, guard-paged stacks from the
+// calling thread's free list instead of mapping and unmapping one per coroutine. It's a stateless
+// handle, since coroutines copy their allocator.
+class user_thread_stack_pool {
+    public: static const size_t STACK_SIZE = 64 * 1024;
+    private: static const size_t MAX_FREE_STACKS = 256;
+
+    private: static void release(void *base) {
+        munmap(base, STACK_SIZE + sysconf(_SC_PAGESIZE));
+    }
+
+    private: typedef thread_free_list<STACK_SIZE, MAX_FREE_STACKS, release> free_list_type;
+
+    public: boost::context::stack_context allocate() {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const size_t size = STACK_SIZE + page_size;
+
+        void *base = free_list_type::local().pop(page_size);
+        if (nullptr == base) {
+            base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (MAP_FAILED == base) {
+                throw std::bad_alloc();
+            }
+            // Stacks grow down, so the guard page goes at the bottom.
+            if (0 != mprotect(base, page_size, PROT_NONE)) {
+                munmap(base, size);
+                throw std::bad_alloc();
+            }
+        }
+
+        boost::context::stack_context sctx;
+        sctx.size = size;
+        sctx.sp = static_cast<char *>(base) + size;
+        return sctx;
+    }
+
+    public: void deallocate(boost::context::stack_context &sctx) noexcept {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        void *base = static_cast<char *>(sctx.sp) - sctx.size;
+        if (nullptr != free_list_type::local().push(base, page_size)) {
+            munmap(base, sctx.size);
+        }
+    }
+};
+
+// FIFO of values waiting for a user thread. The first `InlineCapacity` live in the thread
+// itself, and a longer backlog grows onto the heap once and keeps that capacity, so neither
+// enqueueing nor servicing allocates in the steady state. Mirrors the parts of `std::queue` that
+// thread functions use.
+template <typename Value, size_t InlineCapacity = 16>
+class user_thread_queue {
+    private: Value my_inline[InlineCapacity];
+    private: std::unique_ptr<Value[]> my_heap;
+    private: Value *my_items;
+    private: size_t my_capacity;
+    private: size_t my_head;
+    private: size_t my_size;
+
+    public: user_thread_queue() :
+        my_items(my_inline),
+        my_capacity(InlineCapacity),
+        my_head(0),
+        my_size(0)
+    {}
+
+    private: user_thread_queue(const user_thread_queue &) = delete;
+
+    public: bool empty() const {
+        return 0 == my_size;
+    }
+
+    public: size_t size() const {
+        return my_size;
+    }
+
+    public: Value &front() {
+        return my_items[my_head];
+    }
+
+    public: void push(const Value &value) {
+        if (my_size == my_capacity) {
+            grow();
+        }
+
+        my_items[(my_head + my_size) % my_capacity] = value;
+        ++my_size;
+    }
+
+    // Resets the slot, so the queue doesn't hold on to what the value owns.
+    public: void pop() {
+        my_items[my_head] = Value();
+        my_head = (my_head + 1) % my_capacity;
+        --my_size;
+    }
+
+    private: void grow() {
+        const size_t capacity = 2 * my_capacity;
+        std::unique_ptr<Value[]> heap(new Value[capacity]);
+        for (size_t i = 0; i < my_size; ++i) {
+            heap[i] = std::move(my_items[(my_head + i) % my_capacity]);
+        }
+
+        my_heap = std::move(heap);
+        my_items = my_heap.get();
+        my_capacity = capacity;
+        my_head = 0;
+    }
+};
+
+// A background task with its own stack. The stack comes from `user_thread_stack_pool` and the
+// thread object itself from a per-thread free list, so once a core has warmed up, creating and
+// destroying user threads maps no memory and allocates nothing.
 template <typename Value>
 class user_thread {
-    public: typedef std::queue<Value> queue_type;
+    public: typedef user_thread_queue<Value> queue_type;
     public: typedef boost::coroutines2::coroutine<void> coroutine_type;
     public: typedef coroutine_type::push_type yield_type;
-    public: typedef std::function<int (yield_type &, queue_type &)> function_type;
+    public: typedef int (function_type)(yield_type &, queue_type &);
+
+    private: static const size_t MAX_FREE_THREADS = 256;
 
     private: int my_error;
-    private: std::unique_ptr<queue_type> my_queue;
-    private: std::unique_ptr<coroutine_type::pull_type> my_coroutine;
+    private: queue_type my_queue;
+    private: coroutine_type::pull_type my_coroutine;
 
-    public: user_thread(function_type fun) :
+    // The coroutine runs `fun` as far as its first yield on construction, as before.
+    public: template <typename Function>
+    user_thread(Function fun) :
         my_error(EAGAIN),
-        my_queue(new queue_type)
-    {
-        my_coroutine.reset(new coroutine_type::pull_type([=](yield_type &yield) {
-            my_error = fun(yield, *my_queue);
+        my_coroutine(user_thread_stack_pool(), [this, fun](yield_type &yield) mutable {
+            my_error = fun(yield, my_queue);
             if (EAGAIN == my_error) {
                 DMTR_PANIC("User thread function may not return `EAGAIN`.");
             }
-        }));
-    }
+        })
+    {}
 
+    // The coroutine holds on to `this`, so user threads stay where they were created.
     private: user_thread(const user_thread &) = delete;
+    private: user_thread(user_thread &&) = delete;
 
-    public: user_thread(user_thread &&other) :
-        my_error(other.error),
-        my_coroutine(std::move(other.my_coroutine)),
-        my_queue(std::move(other.my_queue))
-    {
-        other.my_error = EAGAIN;
+    public: static void *operator new(size_t size) {
+        void *p = free_list().pop(0);
+        return nullptr == p ? ::operator new(size) : p;
+    }
+
+    public: static void operator delete(void *p) {
+        if (nullptr != free_list().push(p, 0)) {
+            ::operator delete(p);
+        }
+    }
+
+    private: static void release(void *p) {
+        ::operator delete(p);
+    }
+
+    private: static auto &free_list() {
+        return thread_free_list<sizeof(user_thread), MAX_FREE_THREADS, release>::local();
     }
 
     public: bool done() const {
-        return !(bool)*my_coroutine;
+        return !(bool)my_coroutine;
     }
 
     public: void enqueue(const Value &value) {
-        my_queue->push(value);
+        my_queue.push(value);
     }
 
     public: int service() {
         if (!done()) {
-            (*my_coroutine)();
+            my_coroutine();
         }
 
         if (!done()) {
@@ -63,10 +249,8 @@ class user_thread {
         DMTR_TRUE(ENOTSUP, my_error != EAGAIN);
         return my_error;
     }
-
 };
 
 } //namespace dmtr
 
 #endif /* DMTR_LIBOS_USER_THREAD_HH_IS_INCLUDED */
-
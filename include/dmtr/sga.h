@@ -15,6 +15,27 @@ DMTR_EXPORT int dmtr_sgalen(size_t *len_out, const dmtr_sgarray_t *sga);
 DMTR_EXPORT int dmtr_sgafree(dmtr_sgarray_t *sga);
 DMTR_EXPORT dmtr_sgarray_t dmtr_sgaalloc(size_t len);
 
+/**
+ * @brief Registers an application memory region for zero-copy pushes.
+ *
+ * @details Segments that lie within a registered region are sent straight
+ * from application memory instead of being copied. The application must not
+ * modify or release such a segment until `free_cb` is called for it, which
+ * happens once for every pushed segment, including segments the libOS ends up
+ * copying. The region must be page aligned, and catnip only accepts regions
+ * when the EAL runs in IOVA-as-VA mode.
+ *
+ * @param ptr Start of the region.
+ * @param len Length of the region, in bytes.
+ * @param free_cb Callback invoked with the segment's buffer and `free_arg`;
+ * may be NULL.
+ * @param free_arg Opaque argument passed to `free_cb`.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_register_mem(void *ptr, size_t len, dmtr_free_cb_t free_cb, void *free_arg);
+
 #ifdef __cplusplus
 }
 #endif
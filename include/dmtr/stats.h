@@ -0,0 +1,73 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#ifndef DMTR_STATS_H_IS_INCLUDED
+#define DMTR_STATS_H_IS_INCLUDED
+
+#include <dmtr/sys/gcc.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dmtr_histogram {
+    uint64_t count;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} dmtr_histogram_t;
+
+typedef struct dmtr_stats {
+    // Time from issuing an operation until its completion is observed, in
+    // nanoseconds.
+    dmtr_histogram_t push_latency_ns;
+    dmtr_histogram_t pop_latency_ns;
+    // Time spent blocked in `dmtr_wait*()`, in nanoseconds.
+    dmtr_histogram_t wait_latency_ns;
+
+    // Packets per non-empty RX burst and per TX burst.
+    dmtr_histogram_t rx_burst_size;
+    dmtr_histogram_t tx_burst_size;
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    uint64_t empty_polls;
+    // Outgoing TCP segments that resent sequence space already sent on their
+    // connection.
+    uint64_t tcp_retransmits;
+
+    // Only filled in by libOSes that have them; never reset. Catnap only has
+    // `tx_dropped`; catnip has all of them.
+    uint64_t rx_sleeps;
+    uint64_t tx_dropped;
+    uint64_t header_pool_in_use;
+    uint64_t header_pool_size;
+    uint64_t body_pool_in_use;
+    uint64_t body_pool_size;
+    uint64_t alloc_failures;
+    uint64_t rx_filtered;
+} dmtr_stats_t;
+
+/**
+ * @brief Reads the statistics of the calling thread's libOS.
+ *
+ * @details Statistics are kept per thread, so that recording them takes no
+ * locks or atomics. Histograms and counters cover everything since
+ * initialization or the last reset.
+ *
+ * @param stats_out Statistics of the calling thread.
+ * @param reset Whether to start over once they have been read.
+ *
+ * @return On successful completion zero is returned. On failure, an error code
+ * is returned instead.
+ */
+DMTR_EXPORT int dmtr_get_stats(dmtr_stats_t *stats_out, int reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DMTR_STATS_H_IS_INCLUDED */
@@ -12,7 +12,7 @@
 extern "C" {
 #endif
 
-#define DMTR_SGARRAY_MAXSIZE 1
+#define DMTR_SGARRAY_MAXSIZE 16
 #define DMTR_HEADER_MAGIC 0x10102010
 #define QD_OFFSET 32ul
     //#define QD_MASK 0xFFFFFFFFul << QD_OFFSET
@@ -26,7 +26,12 @@ typedef struct dmtr_sgaseg {
     uint32_t sgaseg_len;
 } dmtr_sgaseg_t;
 
+// Called once the libOS no longer references a segment pushed from a
+// registered memory region.
+typedef void (*dmtr_free_cb_t)(void *buf, void *arg);
+
 typedef struct dmtr_sgarray {
+    // Keeps popped data alive until `dmtr_sgafree()`; opaque to applications.
     void *sga_buf;
     uint32_t sga_numsegs;
     dmtr_sgaseg_t sga_segs[DMTR_SGARRAY_MAXSIZE];
@@ -6,6 +6,7 @@
 
 #include <dmtr/sys/gcc.h>
 #include <dmtr/types.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -44,6 +45,32 @@ DMTR_EXPORT int dmtr_wait(dmtr_qresult_t *qr_out, dmtr_qtoken_t qtok);
  */
 DMTR_EXPORT int dmtr_wait_any(dmtr_qresult_t *qr_out, int *ready_offset, dmtr_qtoken_t qtoks[], int num_qtoks);
 
+/**
+ * @brief Blocks until at least one queue operation in the set of queue tokens
+ * qtoks completes, or until timeout expires, and returns every completion found
+ * up to max_ready.
+ *
+ * @details Returns results of completed I/O operations in qrs_out and the
+ * offsets of their queue tokens in ready_offsets, both of which must have room
+ * for max_ready entries. Destroys completed queue tokens so application does
+ * not need to call dmtr_drop. A single call checks all of qtoks against one
+ * poll of the libOS, so it is much cheaper than calling dmtr_wait_any once per
+ * completion when many tokens are outstanding.
+ *
+ * @param qrs_out Results of completed queue operations.
+ * @param ready_offsets Offsets in list of queue tokens qtoks that are complete.
+ * @param num_ready_out Number of entries filled in qrs_out and ready_offsets.
+ * @param qtoks List of queue tokens to wait on.
+ * @param num_qtoks Number of queue tokens to wait on.
+ * @param max_ready Maximum number of results to return.
+ * @param timeout How long to wait, or NULL to wait until an operation completes.
+ *
+ * @return On successful completion zero is returned. If timeout expires before
+ * any operation completes, ETIMEDOUT is returned. On failure, an error code is
+ * returned instead.
+ */
+DMTR_EXPORT int dmtr_wait_many(dmtr_qresult_t *qrs_out, int *ready_offsets, int *num_ready_out, dmtr_qtoken_t qtoks[], int num_qtoks, int max_ready, const struct timespec *timeout);
+
 DMTR_EXPORT int dmtr_wait_all(dmtr_qresult_t *qr_out, dmtr_qtoken_t qtoks[], int num_qtoks);
 
 #ifdef __cplusplus
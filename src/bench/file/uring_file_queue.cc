@@ -0,0 +1,173 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Appends records to a file through `uring_file_queue` and through blocking `write()` calls, with
+// and without making every record durable, and prints one JSON object per run like `dmtr-bench`.
+// Blocking writes sync every record when durable; the queue syncs once per batch of
+// `--depth` records with group commit. It only needs the headers and liburing, so
+// `make bench-file` builds and runs it on its own.
+//
+//   dmtr-bench-file [--path PATH] [--size BYTES] [--count N] [--depth N] [--fixed] [--direct]
+
+#include <dmtr/libos/uring_file_queue.hh>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace dmtr;
+
+// The libOS provides these when queues run inside it.
+void dmtr_fail(int error_arg, const char *expr_arg, const char *, const char *filen_arg,
+    int lineno_arg) {
+    fprintf(stderr, "%s:%d: `%s` failed with %d\n", filen_arg, lineno_arg, expr_arg, error_arg);
+}
+
+void dmtr_panic(const char *why_arg, const char *filen_arg, int lineno_arg) {
+    fprintf(stderr, "%s:%d: %s\n", filen_arg, lineno_arg, why_arg);
+    abort();
+}
+
+struct config {
+    std::string path = "/tmp/dmtr-bench-file";
+    size_t size = 4096;
+    size_t count = 16384;
+    size_t depth = 32;
+    bool fixed = false;
+    bool direct = false;
+};
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+static void report(const char *mode, bool durable, const config &cfg, double ns) {
+    printf("{\"benchmark\": \"file\", \"mode\": \"%s\", \"durable\": %s, \"size\": %zu, "
+        "\"count\": %zu, \"depth\": %zu, \"ns_per_op\": %.1f, \"mbps\": %.1f}\n",
+        mode, durable ? "true" : "false", cfg.size, cfg.count, cfg.depth, ns / cfg.count,
+        cfg.size * cfg.count * 8 / ns * 1000);
+}
+
+static int run_blocking(const config &cfg, bool durable, void *record) {
+    int flags = O_CREAT | O_WRONLY | O_TRUNC | (cfg.direct ? O_DIRECT : 0);
+    int fd = ::open(cfg.path.c_str(), flags, 0644);
+    if (-1 == fd) {
+        return errno;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < cfg.count; ++i) {
+        if (::write(fd, record, cfg.size) != static_cast<ssize_t>(cfg.size)) {
+            ::close(fd);
+            return errno;
+        }
+        if (durable && -1 == ::fdatasync(fd)) {
+            ::close(fd);
+            return errno;
+        }
+    }
+    report("blocking", durable, cfg, elapsed_ns(start));
+    return ::close(fd);
+}
+
+static int run_uring(const config &cfg, bool durable, void *record) {
+    uring_file_queue::options opts;
+    opts.direct = cfg.direct;
+    opts.group_commit = durable;
+    if (cfg.fixed) {
+        opts.fixed_buffer_count = cfg.depth;
+        opts.fixed_buffer_size = cfg.size;
+    }
+    uring_file_queue::set_options(opts);
+
+    std::unique_ptr<io_queue> q;
+    DMTR_OK(uring_file_queue::new_object(q, 0));
+    DMTR_OK(q->creat(cfg.path.c_str(), 0644));
+
+    dmtr_sgarray_t sga = {};
+    sga.sga_numsegs = 1;
+    sga.sga_segs[0].sgaseg_buf = record;
+    sga.sga_segs[0].sgaseg_len = cfg.size;
+
+    // Keeps `depth` records in flight, pushing a fresh one as each completes.
+    std::vector<dmtr_qtoken_t> qts(cfg.depth);
+    size_t pushed = 0;
+    size_t completed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < cfg.depth && pushed < cfg.count; ++i, ++pushed) {
+        DMTR_OK(q->new_qtoken(qts[i]));
+        DMTR_OK(q->push(qts[i], sga));
+    }
+    while (completed < cfg.count) {
+        for (size_t i = 0; i < cfg.depth; ++i) {
+            if (0 == qts[i]) {
+                continue;
+            }
+            dmtr_qresult_t qr;
+            int ret = q->poll(qr, qts[i]);
+            if (EAGAIN == ret) {
+                continue;
+            }
+            DMTR_OK(ret);
+            DMTR_OK(q->drop(qts[i]));
+            qts[i] = 0;
+            ++completed;
+            if (pushed < cfg.count) {
+                DMTR_OK(q->new_qtoken(qts[i]));
+                DMTR_OK(q->push(qts[i], sga));
+                ++pushed;
+            }
+        }
+    }
+    report(cfg.fixed ? "uring_fixed" : "uring", durable, cfg, elapsed_ns(start));
+    return q->close();
+}
+
+int main(int argc, char *argv[]) {
+    config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ("--fixed" == arg) {
+            cfg.fixed = true;
+        } else if ("--direct" == arg) {
+            cfg.direct = true;
+        } else if (i + 1 < argc && "--path" == arg) {
+            cfg.path = argv[++i];
+        } else if (i + 1 < argc && "--size" == arg) {
+            cfg.size = strtoul(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && "--count" == arg) {
+            cfg.count = strtoul(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && "--depth" == arg) {
+            cfg.depth = strtoul(argv[++i], NULL, 0);
+        } else {
+            fprintf(stderr, "unknown argument `%s`\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (0 == cfg.size || 0 == cfg.count || 0 == cfg.depth) {
+        fprintf(stderr, "--size, --count and --depth must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    // Aligned so that the record can be written with `O_DIRECT`.
+    void *record = NULL;
+    DMTR_OK(posix_memalign(&record, 4096, cfg.size));
+    memset(record, 'x', cfg.size);
+
+    for (bool durable : {false, true}) {
+        DMTR_OK(run_blocking(cfg, durable, record));
+        DMTR_OK(run_uring(cfg, durable, record));
+    }
+
+    free(record);
+    ::unlink(cfg.path.c_str());
+    return 0;
+}
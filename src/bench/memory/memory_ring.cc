@@ -0,0 +1,171 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Bounces a scatter-gather array between two threads, through a pair of `memory_ring`s (the data
+// path of `memory_ring_queue`) and through a pair of mutex-guarded `std::queue`s as
+// `memory_queue` uses, and prints one JSON object per run like `dmtr-bench`. It only needs the
+// headers, so `make bench-ring` builds and runs it on its own.
+//
+//   dmtr-bench-ring [--count N]
+
+#include <dmtr/libos/memory_ring.hh>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+
+using namespace dmtr;
+
+// The libOS provides these when the ring is used from a queue.
+void dmtr_fail(int error_arg, const char *expr_arg, const char *, const char *filen_arg,
+    int lineno_arg) {
+    fprintf(stderr, "%s:%d: `%s` failed with %d\n", filen_arg, lineno_arg, expr_arg, error_arg);
+}
+
+void dmtr_panic(const char *why_arg, const char *filen_arg, int lineno_arg) {
+    fprintf(stderr, "%s:%d: %s\n", filen_arg, lineno_arg, why_arg);
+    abort();
+}
+
+// With a single CPU, a thread waiting for the other has to let it run.
+static bool one_cpu = std::thread::hardware_concurrency() < 2;
+
+static void spin() {
+    if (one_cpu) {
+        std::this_thread::yield();
+    }
+}
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+static void report(const char *mode, size_t count, double ns) {
+    printf("{\"benchmark\": \"memory_ring\", \"mode\": \"%s\", \"count\": %zu, "
+        "\"ns_per_round_trip\": %.1f}\n", mode, count, ns / count);
+}
+
+// A push or a pop on `ring`, from claiming the token to dropping it.
+static int ring_op(memory_ring &ring, dmtr_opcode_t opcode, dmtr_qtoken_t qt,
+    dmtr_sgarray_t &sga) {
+    DMTR_OK(DMTR_OPC_PUSH == opcode ? ring.push(qt, sga) : ring.pop(qt));
+    dmtr_qresult_t qr;
+    int ret;
+    while (EAGAIN == (ret = ring.poll(qr, 0, qt))) {
+        spin();
+    }
+    DMTR_OK(ret);
+    sga = qr.qr_value.sga;
+    return ring.drop(qt);
+}
+
+static int run_ring(size_t count) {
+    // Each ring holds both sides' task tables, which are too large for the stack.
+    std::unique_ptr<memory_ring> there(new memory_ring);
+    std::unique_ptr<memory_ring> back(new memory_ring);
+
+    // Pushes on a ring take even tokens and pops odd ones.
+    int echo_ret = 0;
+    std::thread echo([&]() {
+        dmtr_sgarray_t sga = {};
+        for (size_t i = 0; i < count && 0 == echo_ret; ++i) {
+            echo_ret = ring_op(*there, DMTR_OPC_POP, 2 * i + 1, sga);
+            if (0 == echo_ret) {
+                echo_ret = ring_op(*back, DMTR_OPC_PUSH, 2 * i, sga);
+            }
+        }
+    });
+
+    dmtr_sgarray_t sga = {};
+    sga.sga_numsegs = 1;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        DMTR_OK(ring_op(*there, DMTR_OPC_PUSH, 2 * i, sga));
+        DMTR_OK(ring_op(*back, DMTR_OPC_POP, 2 * i + 1, sga));
+    }
+    double ns = elapsed_ns(start);
+    echo.join();
+    DMTR_OK(echo_ret);
+    report("ring", count, ns);
+    return 0;
+}
+
+// How `memory_queue` hands arrays over.
+class locked_queue
+{
+    private: std::mutex my_lock;
+    private: std::queue<dmtr_sgarray_t> my_queue;
+
+    public: void push(const dmtr_sgarray_t &sga) {
+        std::lock_guard<std::mutex> guard(my_lock);
+        my_queue.push(sga);
+    }
+
+    public: void pop(dmtr_sgarray_t &sga_out) {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> guard(my_lock);
+                if (!my_queue.empty()) {
+                    sga_out = my_queue.front();
+                    my_queue.pop();
+                    return;
+                }
+            }
+            spin();
+        }
+    }
+};
+
+static int run_locked(size_t count) {
+    locked_queue there;
+    locked_queue back;
+
+    std::thread echo([&]() {
+        dmtr_sgarray_t sga = {};
+        for (size_t i = 0; i < count; ++i) {
+            there.pop(sga);
+            back.push(sga);
+        }
+    });
+
+    dmtr_sgarray_t sga = {};
+    sga.sga_numsegs = 1;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        there.push(sga);
+        back.pop(sga);
+    }
+    double ns = elapsed_ns(start);
+    echo.join();
+    report("locked", count, ns);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = 1000000;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 < argc && "--count" == arg) {
+            count = strtoul(argv[++i], NULL, 0);
+        } else {
+            fprintf(stderr, "unknown argument `%s`\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (0 == count) {
+        fprintf(stderr, "--count must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    DMTR_OK(run_ring(count));
+    DMTR_OK(run_locked(count));
+    return 0;
+}
@@ -0,0 +1,239 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Measures the queue-descriptor and token tables with many connections open at once: what opening
+// a connection costs, what one takes up in memory, and what completing, polling, dropping and
+// reissuing a pop on a random connection costs, which is where a table that doesn't fit in cache
+// shows. Each connection is an idle queue with one outstanding pop, kept in a descriptor table
+// like `io_queue_api`'s, and every token is resolved the way `io_queue_api::poll()` does it. Also
+// checks that tokens and descriptors are rejected once they've been dropped. Prints one JSON
+// object like `dmtr-bench`. It only needs the headers, so `make bench-connections` builds and runs
+// it on its own.
+//
+//   dmtr-bench-connections [--count N]
+
+#include <dmtr/annot.h>
+#include <dmtr/libos/io_queue.hh>
+#include <dmtr/libos/slab_table.hh>
+#include <dmtr/types.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace dmtr;
+
+// The libOS provides these when queues run inside it.
+void dmtr_fail(int error_arg, const char *expr_arg, const char *, const char *filen_arg,
+    int lineno_arg) {
+    fprintf(stderr, "%s:%d: `%s` failed with %d\n", filen_arg, lineno_arg, expr_arg, error_arg);
+}
+
+void dmtr_panic(const char *why_arg, const char *filen_arg, int lineno_arg) {
+    fprintf(stderr, "%s:%d: %s\n", filen_arg, lineno_arg, why_arg);
+    abort();
+}
+
+// Bytes the process has on the heap through `new`. The benchmark is single-threaded.
+static size_t live_bytes = 0;
+
+void *operator new(size_t size) {
+    void *p = malloc(0 == size ? 1 : size);
+    if (NULL == p) {
+        throw std::bad_alloc();
+    }
+    live_bytes += malloc_usable_size(p);
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    live_bytes -= malloc_usable_size(p);
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+// A connection nothing arrives on until the benchmark delivers something to its pending pop.
+class idle_queue : public io_queue
+{
+    private: dmtr_qtoken_t my_pending_qt;
+
+    public: idle_queue(int qd) :
+        io_queue(NETWORK_Q, qd),
+        my_pending_qt(0)
+    {}
+
+    // What every queue embedded when tasks lived in a fixed array of `MAX_TASKS` (1024).
+    public: static const size_t FIXED_TABLE_SIZE = 1024 * sizeof(task);
+
+    public: virtual int push(dmtr_qtoken_t qt, const dmtr_sgarray_t &sga) {
+        task *t = NULL;
+        DMTR_OK(new_task(qt, DMTR_OPC_PUSH, sga));
+        DMTR_OK(get_task(t, qt));
+        return t->complete(0, sga);
+    }
+
+    public: virtual int pop(dmtr_qtoken_t qt) {
+        DMTR_TRUE(EBUSY, 0 == my_pending_qt);
+        DMTR_OK(new_task(qt, DMTR_OPC_POP));
+        my_pending_qt = qt;
+        return 0;
+    }
+
+    public: virtual int poll(dmtr_qresult_t &qr_out, dmtr_qtoken_t qt) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, qt));
+        return t->poll(qr_out);
+    }
+
+    public: virtual int drop(dmtr_qtoken_t qt) {
+        if (qt == my_pending_qt) {
+            my_pending_qt = 0;
+        }
+        return io_queue::drop(qt);
+    }
+
+    public: int deliver(const dmtr_sgarray_t &sga) {
+        task *t = NULL;
+        DMTR_OK(get_task(t, my_pending_qt));
+        my_pending_qt = 0;
+        return t->complete(0, sga);
+    }
+};
+
+typedef slab_table<std::unique_ptr<io_queue>> queue_table;
+
+struct connection {
+    int qd;
+    dmtr_qtoken_t qt;
+};
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+static int open_connection(connection &c_out, queue_table &queues) {
+    queue_table::handle_type h = 0;
+    std::unique_ptr<io_queue> *q = NULL;
+    DMTR_OK(queues.insert(h, q));
+    q->reset(new idle_queue(h));
+    c_out.qd = h;
+    DMTR_OK((*q)->new_qtoken(c_out.qt));
+    return (*q)->pop(c_out.qt);
+}
+
+// Resolves a token to its queue the way `io_queue_api` does.
+static int get_queue(io_queue *&q_out, queue_table &queues, dmtr_qtoken_t qt) {
+    std::unique_ptr<io_queue> *q = NULL;
+    DMTR_OK(queues.get(q, static_cast<int>(QT2QD(qt))));
+    q_out = q->get();
+    return 0;
+}
+
+// Completes the connection's pop, collects it by token, drops the token and issues the next pop.
+static int cycle(connection &c, queue_table &queues, const dmtr_sgarray_t &sga) {
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, queues, c.qt));
+    DMTR_OK(static_cast<idle_queue *>(q)->deliver(sga));
+
+    dmtr_qresult_t qr = {};
+    DMTR_OK(q->poll(qr, c.qt));
+    DMTR_TRUE(EINVAL, qr.qr_qt == c.qt && qr.qr_value.sga.sga_buf == sga.sga_buf);
+    DMTR_OK(q->drop(c.qt));
+
+    DMTR_OK(q->new_qtoken(c.qt));
+    return q->pop(c.qt);
+}
+
+// A dropped token and a closed descriptor must not reach whatever took over their slots.
+static int check_stale(queue_table &queues, std::vector<connection> &connections) {
+    connection &c = connections[0];
+    const dmtr_qtoken_t old_qt = c.qt;
+    io_queue *q = NULL;
+    DMTR_OK(get_queue(q, queues, old_qt));
+    DMTR_OK(q->drop(old_qt));
+    DMTR_OK(q->new_qtoken(c.qt));
+    DMTR_OK(q->pop(c.qt));
+    DMTR_TRUE(EINVAL, (c.qt & 0xffffffff) != 0);
+    DMTR_TRUE(EINVAL, EINVAL == q->drop(old_qt));
+    DMTR_TRUE(EINVAL, q->has_task(c.qt) && !q->has_task(old_qt));
+
+    const int old_qd = c.qd;
+    DMTR_OK(queues.remove(old_qd));
+    DMTR_OK(open_connection(c, queues));
+    std::unique_ptr<io_queue> *slot = NULL;
+    DMTR_TRUE(EINVAL, EINVAL == queues.get(slot, old_qd));
+    DMTR_TRUE(EINVAL, c.qd != old_qd && c.qd > 0);
+    return 0;
+}
+
+static int run(size_t count) {
+    queue_table queues;
+    std::vector<connection> connections(count);
+
+    const size_t bytes_before = live_bytes;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        DMTR_OK(open_connection(connections[i], queues));
+    }
+    const double open_ns = elapsed_ns(start);
+    // The benchmark's own bookkeeping isn't part of a connection.
+    const size_t bytes = live_bytes - bytes_before - connections.capacity() * sizeof(connection);
+
+    char payload[64] = {};
+    dmtr_sgarray_t sga = {};
+    sga.sga_buf = payload;
+    sga.sga_numsegs = 1;
+    sga.sga_segs[0].sgaseg_buf = payload;
+    sga.sga_segs[0].sgaseg_len = sizeof(payload);
+
+    // Visit connections in random order so lookups don't ride the cache.
+    const size_t ops = 10 * count;
+    uint64_t x = 88172645463325252ull;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        DMTR_OK(cycle(connections[x % count], queues, sga));
+    }
+    const double op_ns = elapsed_ns(start);
+
+    DMTR_OK(check_stale(queues, connections));
+
+    printf("{\"benchmark\": \"connections\", \"count\": %zu, \"ops\": %zu, "
+        "\"ns_per_open\": %.1f, \"ns_per_op\": %.1f, \"bytes_per_connection\": %.1f, "
+        "\"fixed_table_bytes_per_connection\": %zu}\n",
+        count, ops, open_ns / count, op_ns / ops, static_cast<double>(bytes) / count,
+        idle_queue::FIXED_TABLE_SIZE);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = 100000;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 < argc && "--count" == arg) {
+            count = strtoul(argv[++i], NULL, 0);
+        } else {
+            fprintf(stderr, "unknown argument `%s`\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (0 == count || count > queue_table::MAX_SIZE) {
+        fprintf(stderr, "--count must be between 1 and %u\n", queue_table::MAX_SIZE);
+        return EXIT_FAILURE;
+    }
+
+    return run(count);
+}
@@ -0,0 +1,198 @@
+#!/bin/bash
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+# Runs dmtr-bench over a local stand-in for a network, so that it needs no NIC:
+#
+#   catnap: a veth pair, each end in its own network namespace.
+#   catnip: one DPDK net_tap port per process, with both taps on a Linux bridge.
+#
+# Neither end gets a kernel IP address, so the kernel stack never answers for the libOS. Must run
+# as root.
+#
+# usage: loopback.sh <catnap|catnip> <dmtr-bench> <output> [scenario...]
+#
+# SIZES and WINDOW may each be a list, and every combination is run. For instance,
+# WINDOW="1 16 256 4096" with udp-wait-many shows how events/s holds up as the number of
+# outstanding tokens grows.
+#
+# SERVER_THREADS runs the server on that many threads, each with its own libOS listening on the
+# same port.
+#
+# CAPTURE=1 has the server capture every frame it sends and receives, with dmtr-capture (from next
+# to dmtr-bench, or CAPTURE_TOOL) draining its rings throughout, to measure what capture costs. The
+# pcapng files are thrown away with the rest of the work directory. SNAPLEN and FILTER (the output
+# of `tcpdump -ddd`) go into the server's config.
+
+set -e
+
+LIBOS=$1
+BENCH=$2
+OUTPUT=$3
+shift 3
+SCENARIOS=${@:-udp-pingpong udp-echo udp-batch udp-wait-many tcp-pingpong tcp-echo tcp-stream tcp-churn}
+
+SIZES=${SIZES:-64 1024}
+ITERATIONS=${ITERATIONS:-100000}
+WINDOW=${WINDOW:-32}
+DURATION=${DURATION:-10}
+SERVER_THREADS=${SERVER_THREADS:-1}
+CAPTURE=${CAPTURE:-0}
+CAPTURE_TOOL=${CAPTURE_TOOL:-$(dirname $BENCH)/dmtr-capture}
+
+export MTU=${MTU:-1500}
+export MSS=${MSS:-1450}
+
+SERVER_IP=10.254.0.1
+CLIENT_IP=10.254.0.2
+SERVER_MAC=02:00:00:00:fe:01
+CLIENT_MAC=02:00:00:00:fe:02
+PORT=12345
+
+WORKDIR=$(mktemp -d)
+
+#===============================================================================
+
+# write_config <file> <my ip> <my mac> <interface> <eal args>
+write_config() {
+    cat > $1 <<EOF_CONFIG
+catnip:
+  my_ipv4_addr: $2
+  my_link_addr: "$3"
+  my_interface_name: $4
+  arp_table:
+    "$SERVER_MAC": $SERVER_IP
+    "$CLIENT_MAC": $CLIENT_IP
+server:
+  bind:
+    host: $SERVER_IP
+    port: $PORT
+  client:
+    host: $CLIENT_IP
+    port: $PORT
+client:
+  client:
+    host: $CLIENT_IP
+    port: $PORT
+  connect_to:
+    host: $SERVER_IP
+    port: $PORT
+dpdk:
+  eal_init: [$5]
+EOF_CONFIG
+}
+
+# add_capture <file>
+add_capture() {
+    cat >> $1 <<EOF_CONFIG
+capture:
+  path: $CAPTURE_PATH
+  snaplen: ${SNAPLEN:-65535}
+EOF_CONFIG
+    if [ -n "$FILTER" ]; then
+        echo "  filter: \"$(echo "$FILTER" | tr '\n' ',')\"" >> $1
+    fi
+}
+
+setup_catnap() {
+    ip netns add dmtr-server
+    ip netns add dmtr-client
+    ip link add dmtr-server type veth peer name dmtr-client
+    ip link set dmtr-server netns dmtr-server address $SERVER_MAC up
+    ip link set dmtr-client netns dmtr-client address $CLIENT_MAC up
+    write_config $WORKDIR/server.yaml $SERVER_IP $SERVER_MAC dmtr-server ""
+    write_config $WORKDIR/client.yaml $CLIENT_IP $CLIENT_MAC dmtr-client ""
+    SERVER_PREFIX="ip netns exec dmtr-server"
+    CLIENT_PREFIX="ip netns exec dmtr-client"
+}
+
+teardown_catnap() {
+    ip netns del dmtr-server 2> /dev/null || true
+    ip netns del dmtr-client 2> /dev/null || true
+}
+
+# A net_ring port is only visible to the process that created it, so each process gets a net_tap
+# port instead. --in-memory and distinct file prefixes let both share the host's hugepages.
+eal_args() {
+    echo "\"\", \"-c\", \"$1\", \"--no-pci\", \"--in-memory\", \"--file-prefix=$2\", \
+\"--vdev=net_tap0,iface=$2,mac=$3\""
+}
+
+# The taps are created up front and bridged before either process opens them, so that no packet is
+# lost while a process starts up. The tap PMD attaches to an existing multi-queue tap by name.
+setup_catnip() {
+    ip link add dmtr-br type bridge
+    ip link set dmtr-br up
+    for iface in dmtr-server dmtr-client; do
+        ip tuntap add dev $iface mode tap multi_queue
+        ip link set $iface master dmtr-br up
+    done
+    write_config $WORKDIR/server.yaml $SERVER_IP $SERVER_MAC dmtr-server \
+        "$(eal_args 0x1 dmtr-server $SERVER_MAC)"
+    write_config $WORKDIR/client.yaml $CLIENT_IP $CLIENT_MAC dmtr-client \
+        "$(eal_args 0x2 dmtr-client $CLIENT_MAC)"
+    SERVER_PREFIX=
+    CLIENT_PREFIX=
+}
+
+teardown_catnip() {
+    ip link del dmtr-server 2> /dev/null || true
+    ip link del dmtr-client 2> /dev/null || true
+    ip link del dmtr-br 2> /dev/null || true
+}
+
+cleanup() {
+    [ -n "$CAPTURE_PID" ] && kill $CAPTURE_PID 2> /dev/null && wait $CAPTURE_PID 2> /dev/null
+    [ -n "$SERVER_PID" ] && kill $SERVER_PID 2> /dev/null && wait $SERVER_PID 2> /dev/null
+    teardown_$LIBOS
+    rm -rf $WORKDIR
+    rm -f $CAPTURE_PATH-*
+}
+
+#===============================================================================
+
+case $LIBOS in
+    catnap|catnip) ;;
+    *) echo "usage: $0 <catnap|catnip> <dmtr-bench> <output> [scenario...]" >&2; exit 1 ;;
+esac
+
+# The rings are shared memory, so they go in /dev/shm rather than in $WORKDIR.
+CAPTURE_PATH=/dev/shm/dmtr-bench-capture-$$
+
+trap cleanup EXIT
+teardown_$LIBOS
+setup_$LIBOS
+if [ "$CAPTURE" = 1 ]; then
+    add_capture $WORKDIR/server.yaml
+fi
+
+for scenario in $SCENARIOS; do
+    for size in $SIZES; do
+    for window in $WINDOW; do
+        args="--libos=$LIBOS --scenario=$scenario --size=$size --iterations=$ITERATIONS \
+--window=$window --duration=$DURATION"
+
+        CONFIG_PATH=$WORKDIR/server.yaml $SERVER_PREFIX $BENCH $args --peer=server \
+            --threads=$SERVER_THREADS &
+        SERVER_PID=$!
+        sleep 1
+
+        if [ "$CAPTURE" = 1 ]; then
+            rings=$(for ((i = 0; i < SERVER_THREADS; i++)); do echo $CAPTURE_PATH-$i; done)
+            $CAPTURE_TOOL -o $WORKDIR/$scenario-$size-$window.pcapng $rings &
+            CAPTURE_PID=$!
+        fi
+
+        CONFIG_PATH=$WORKDIR/client.yaml $CLIENT_PREFIX $BENCH $args --peer=client | tee -a $OUTPUT
+
+        if [ -n "$CAPTURE_PID" ]; then
+            kill -INT $CAPTURE_PID 2> /dev/null || true
+            wait $CAPTURE_PID || true
+            CAPTURE_PID=
+        fi
+        kill $SERVER_PID
+        wait $SERVER_PID 2> /dev/null || true
+        SERVER_PID=
+    done
+    done
+done
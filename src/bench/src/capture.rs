@@ -0,0 +1,219 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Microbenchmark of what packet capture adds to each frame a runtime sends or receives: nothing
+//! but a branch when it's off, and otherwise a copy into the ring, with or without a snaplen and a
+//! filter. A thread drains the ring throughout, as `dmtr-capture` would. Prints one JSON object
+//! per mode and frame size, like `dmtr-bench`.
+
+#![feature(bench_black_box)]
+
+use demikernel::{
+    bpf::BpfProgram,
+    capture::{
+        CaptureConfig,
+        CaptureReader,
+        CaptureRing,
+        Direction,
+    },
+};
+use std::{
+    env,
+    hint,
+    path::Path,
+    process,
+    sync::{
+        atomic::{
+            AtomicBool,
+            Ordering,
+        },
+        Arc,
+    },
+    thread,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+const SIZES: &[usize] = &[64, 1500];
+
+/// How long to run each measurement for.
+const DURATION: Duration = Duration::from_millis(200);
+
+/// How long the draining thread sleeps when the ring is empty, as `dmtr-capture` does.
+const DRAIN_IDLE_SLEEP: Duration = Duration::from_millis(1);
+
+/// `tcpdump -ddd udp port 53`.
+const UDP_PORT_53: &str = "20
+40 0 0 12
+21 0 6 34525
+48 0 0 20
+21 0 15 17
+40 0 0 54
+21 12 0 53
+40 0 0 56
+21 10 11 53
+21 0 10 2048
+48 0 0 23
+21 0 8 17
+40 0 0 20
+69 6 0 8191
+177 0 0 14
+72 0 0 14
+21 2 0 53
+72 0 0 16
+21 0 1 53
+6 0 0 262144
+6 0 0 0
+";
+
+struct Mode {
+    name: &'static str,
+    // Whether capture is on at all, and if so, with which snaplen and filter.
+    enabled: bool,
+    snaplen: usize,
+    filter: bool,
+    // Destination port of the frames, which the filter only lets through if it's 53.
+    dst_port: u16,
+}
+
+const MODES: &[Mode] = &[
+    Mode {
+        name: "off",
+        enabled: false,
+        snaplen: 65535,
+        filter: false,
+        dst_port: 53,
+    },
+    Mode {
+        name: "all",
+        enabled: true,
+        snaplen: 65535,
+        filter: false,
+        dst_port: 53,
+    },
+    Mode {
+        name: "snaplen_96",
+        enabled: true,
+        snaplen: 96,
+        filter: false,
+        dst_port: 53,
+    },
+    Mode {
+        name: "filter_accept",
+        enabled: true,
+        snaplen: 65535,
+        filter: true,
+        dst_port: 53,
+    },
+    Mode {
+        name: "filter_reject",
+        enabled: true,
+        snaplen: 65535,
+        filter: true,
+        dst_port: 80,
+    },
+];
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Runs `f` in rounds until `DURATION` has passed and returns the mean nanoseconds per call, and
+/// the number of calls.
+fn measure<F: FnMut()>(mut f: F) -> (f64, u64) {
+    const ROUND: u32 = 1024;
+    let start = Instant::now();
+    let mut calls = 0u64;
+    while start.elapsed() < DURATION {
+        for _ in 0..ROUND {
+            f();
+        }
+        calls += ROUND as u64;
+    }
+    (start.elapsed().as_nanos() as f64 / calls as f64, calls)
+}
+
+/// An Ethernet frame of `size` bytes carrying an IPv4/UDP datagram to `dst_port`.
+fn udp_frame(size: usize, dst_port: u16) -> Vec<u8> {
+    let mut frame = vec![0u8; size];
+    frame[12..14].copy_from_slice(&0x0800u16.to_be_bytes());
+    frame[14] = 0x45;
+    frame[23] = 17;
+    frame[34..36].copy_from_slice(&1234u16.to_be_bytes());
+    frame[36..38].copy_from_slice(&dst_port.to_be_bytes());
+    frame
+}
+
+fn main() {
+    let dir = if Path::new("/dev/shm").is_dir() {
+        "/dev/shm".into()
+    } else {
+        env::temp_dir()
+    };
+    let path = dir.join(format!("dmtr-bench-capture-{}", process::id()));
+    let filter = BpfProgram::parse(UDP_PORT_53).unwrap();
+    let mut id = 0;
+    for &size in SIZES {
+        for mode in MODES {
+            let config = CaptureConfig {
+                path: path.to_str().unwrap().to_string(),
+                snaplen: mode.snaplen,
+                ring_size: 16 << 20,
+                filter: if mode.filter {
+                    Some(filter.clone())
+                } else {
+                    None
+                },
+            };
+            let mut capture: Option<CaptureRing> = None;
+            let mut drainer = None;
+            let stop = Arc::new(AtomicBool::new(false));
+            if mode.enabled {
+                capture = Some(config.create_ring(id).unwrap());
+                let mut reader = CaptureReader::open(&config.ring_path(id)).unwrap();
+                let stop = stop.clone();
+                drainer = Some(thread::spawn(move || {
+                    while !stop.load(Ordering::Relaxed) {
+                        let num_drained = reader.drain(|record| {
+                            hint::black_box(record.data);
+                        });
+                        if num_drained == 0 {
+                            thread::sleep(DRAIN_IDLE_SLEEP);
+                        }
+                    }
+                    reader.dropped()
+                }));
+            }
+
+            // Taps the way the runtimes do, so "off" costs what it does there.
+            let frame = udp_frame(size, mode.dst_port);
+            let (ns, calls) = measure(|| {
+                let frame = hint::black_box(&frame[..]);
+                if let Some(ref mut capture) = capture {
+                    capture.tap(Direction::Inbound, frame.len(), Some(frame).into_iter());
+                }
+            });
+
+            stop.store(true, Ordering::Relaxed);
+            let dropped = drainer.map_or(0, |drainer| drainer.join().unwrap());
+            if mode.enabled {
+                std::fs::remove_file(config.ring_path(id)).unwrap();
+                id += 1;
+            }
+            println!(
+                "{{\"benchmark\": \"capture\", \"mode\": \"{}\", \"size\": {}, \"ns_per_frame\": \
+                 {:.1}, \"drop_rate\": {:.4}}}",
+                mode.name,
+                size,
+                ns,
+                dropped as f64 / calls as f64,
+            );
+        }
+    }
+}
@@ -0,0 +1,77 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Microbenchmark of the software checksum kernels that the libOSes fall back on without checksum
+//! offload, over payloads from a minimum-sized frame up to a jumbo frame. Prints one JSON object
+//! per kernel, payload size and mode, like `dmtr-bench`.
+
+#![feature(bench_black_box)]
+
+use demikernel::checksum::{
+    Checksum,
+    Kernel,
+};
+use std::{
+    hint,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+const SIZES: &[usize] = &[64, 128, 256, 512, 1024, 1500, 4096, 9000];
+
+/// How long to run each measurement for.
+const DURATION: Duration = Duration::from_millis(200);
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Runs `f` in rounds until `DURATION` has passed and returns the mean nanoseconds per call.
+fn measure<F: FnMut()>(mut f: F) -> f64 {
+    const ROUND: u32 = 1024;
+    let start = Instant::now();
+    let mut calls = 0u64;
+    while start.elapsed() < DURATION {
+        for _ in 0..ROUND {
+            f();
+        }
+        calls += ROUND as u64;
+    }
+    start.elapsed().as_nanos() as f64 / calls as f64
+}
+
+fn main() {
+    println!("{{\"benchmark\": \"checksum\", \"best\": \"{}\"}}", Kernel::best().name());
+    for &size in SIZES {
+        let src = (0..size).map(|i| i as u8).collect::<Vec<_>>();
+        let mut dst = vec![0u8; size];
+        for kernel in Kernel::ALL.iter().filter(|k| k.is_supported()) {
+            for &copy in &[false, true] {
+                let ns = measure(|| {
+                    let mut checksum = Checksum::with_kernel(*kernel);
+                    if copy {
+                        checksum.copy_and_add(&mut dst, hint::black_box(&src));
+                    } else {
+                        checksum.add(hint::black_box(&src));
+                    }
+                    hint::black_box(checksum.finish());
+                });
+                println!(
+                    "{{\"kernel\": \"{}\", \"size\": {}, \"copy\": {}, \"ns_per_op\": {:.1}, \
+                     \"gbps\": {:.2}}}",
+                    kernel.name(),
+                    size,
+                    copy,
+                    ns,
+                    (size * 8) as f64 / ns,
+                );
+            }
+        }
+    }
+}
@@ -0,0 +1,247 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Microbenchmark of the cost of getting from a `dmtr_*` call into the libOS, with a libOS whose
+//! operations do nothing but borrow their thread-local state. Compares calls bound to the libOS at
+//! build time, as `export_network_libos!` binds them, with calls through the table of the
+//! `dynamic-dispatch` feature. Prints one JSON object per operation and mode, like `dmtr-bench`.
+
+#![feature(bench_black_box)]
+
+use catnip::interop::dmtr_qtoken_t;
+use demikernel::{
+    interop::{
+        dmtr_free_cb_t,
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+    },
+    network::{
+        self,
+        libos_network_init,
+        DynamicLibOS,
+        NetworkLibOS,
+        NetworkOps,
+    },
+    stats::dmtr_stats_t,
+};
+use libc::{
+    c_int,
+    c_void,
+    sockaddr,
+    sockaddr_in,
+    socklen_t,
+    timespec,
+};
+use std::{
+    cell::RefCell,
+    hint,
+    mem::MaybeUninit,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// How long to run each measurement for.
+const DURATION: Duration = Duration::from_millis(200);
+
+thread_local! {
+    // Stands in for the libOS that a real one borrows on every call.
+    static CALLS: RefCell<Option<u64>> = RefCell::new(Some(0));
+}
+
+/// A libOS that only implements the operations measured here.
+struct NullLibOS;
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl NetworkOps for NullLibOS {
+    fn socket(_qd_out: *mut c_int, _domain: c_int, _socket_type: c_int, _protocol: c_int) -> c_int {
+        unimplemented!()
+    }
+
+    fn bind(_qd: c_int, _saddr: *const sockaddr, _size: socklen_t) -> c_int {
+        unimplemented!()
+    }
+
+    fn listen(_fd: c_int, _backlog: c_int) -> c_int {
+        unimplemented!()
+    }
+
+    fn accept(_qtok_out: *mut dmtr_qtoken_t, _sockqd: c_int) -> c_int {
+        unimplemented!()
+    }
+
+    fn connect(
+        _qtok_out: *mut dmtr_qtoken_t,
+        _qd: c_int,
+        _saddr: *const sockaddr,
+        _size: socklen_t,
+    ) -> c_int {
+        unimplemented!()
+    }
+
+    fn pushto(
+        _qtok_out: *mut dmtr_qtoken_t,
+        _qd: c_int,
+        _sga: *const dmtr_sgarray_t,
+        _saddr: *const sockaddr,
+        _size: socklen_t,
+    ) -> c_int {
+        unimplemented!()
+    }
+
+    fn drop(_qt: dmtr_qtoken_t) -> c_int {
+        with_libos(|calls| *calls += 1);
+        0
+    }
+
+    fn close(_qd: c_int) -> c_int {
+        unimplemented!()
+    }
+
+    fn push(_qtok_out: *mut dmtr_qtoken_t, _qd: c_int, _sga: *const dmtr_sgarray_t) -> c_int {
+        unimplemented!()
+    }
+
+    fn wait(_qr_out: *mut dmtr_qresult_t, _qt: dmtr_qtoken_t) -> c_int {
+        unimplemented!()
+    }
+
+    fn wait_any(
+        _qr_out: *mut dmtr_qresult_t,
+        _ready_offset: *mut c_int,
+        _qts: *mut dmtr_qtoken_t,
+        _num_qts: c_int,
+    ) -> c_int {
+        unimplemented!()
+    }
+
+    fn poll(_qr_out: *mut dmtr_qresult_t, _qt: dmtr_qtoken_t) -> c_int {
+        with_libos(|calls| *calls += 1);
+        libc::EAGAIN
+    }
+
+    fn pop(_qtok_out: *mut dmtr_qtoken_t, _qd: c_int) -> c_int {
+        unimplemented!()
+    }
+
+    fn sgaalloc(_size: libc::size_t) -> dmtr_sgarray_t {
+        unimplemented!()
+    }
+
+    fn sgafree(_sga: *mut dmtr_sgarray_t) -> c_int {
+        unimplemented!()
+    }
+
+    fn getsockname(_qd: c_int, _saddr: *mut sockaddr, _size: *mut socklen_t) -> c_int {
+        unimplemented!()
+    }
+
+    fn register_mem(
+        _ptr: *mut c_void,
+        _len: libc::size_t,
+        _free_cb: dmtr_free_cb_t,
+        _free_arg: *mut c_void,
+    ) -> c_int {
+        unimplemented!()
+    }
+
+    fn wait_many(
+        _qrs_out: *mut dmtr_qresult_t,
+        _ready_offsets: *mut c_int,
+        _num_ready_out: *mut c_int,
+        _qts: *mut dmtr_qtoken_t,
+        _num_qts: c_int,
+        _max_ready: c_int,
+        _timeout: *const timespec,
+    ) -> c_int {
+        unimplemented!()
+    }
+
+    fn get_stats(_stats_out: *mut dmtr_stats_t) -> c_int {
+        unimplemented!()
+    }
+
+    fn pushto_many(
+        _num_pushed_out: *mut c_int,
+        _qd: c_int,
+        _sgas: *const dmtr_sgarray_t,
+        _saddrs: *const sockaddr_in,
+        _num: c_int,
+    ) -> c_int {
+        unimplemented!()
+    }
+
+    fn popfrom(
+        _num_out: *mut c_int,
+        _qd: c_int,
+        _sgas_out: *mut dmtr_sgarray_t,
+        _saddrs_out: *mut sockaddr_in,
+        _max: c_int,
+    ) -> c_int {
+        unimplemented!()
+    }
+
+    fn set_framed(_qd: c_int, _framed: c_int) -> c_int {
+        unimplemented!()
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+fn with_libos<T>(f: impl FnOnce(&mut u64) -> T) -> T {
+    CALLS.with(|c| f(c.borrow_mut().as_mut().expect("Uninitialized engine")))
+}
+
+/// Runs `f` in rounds until `DURATION` has passed and returns the mean nanoseconds per call.
+fn measure<F: FnMut()>(mut f: F) -> f64 {
+    const ROUND: u32 = 1024;
+    let start = Instant::now();
+    let mut calls = 0u64;
+    while start.elapsed() < DURATION {
+        for _ in 0..ROUND {
+            f();
+        }
+        calls += ROUND as u64;
+    }
+    start.elapsed().as_nanos() as f64 / calls as f64
+}
+
+fn report(op: &str, mode: &str, ns: f64) {
+    println!(
+        "{{\"benchmark\": \"dispatch\", \"op\": \"{}\", \"mode\": \"{}\", \"ns_per_op\": {:.2}}}",
+        op, mode, ns
+    );
+}
+
+/// Measures `dmtr_poll()` on a token that hasn't completed, as in a polling loop, and
+/// `dmtr_drop()`, both bound to `T`.
+fn run<T: NetworkOps>(mode: &str) {
+    let mut qr = MaybeUninit::<dmtr_qresult_t>::uninit();
+    let ns = measure(|| {
+        let qt = hint::black_box(1);
+        hint::black_box(network::dmtr_poll::<T>(qr.as_mut_ptr(), qt));
+    });
+    report("poll", mode, ns);
+
+    let ns = measure(|| {
+        let qt = hint::black_box(1);
+        hint::black_box(network::dmtr_drop::<T>(qt));
+    });
+    report("drop", mode, ns);
+}
+
+fn main() {
+    run::<NullLibOS>("static");
+    libos_network_init(NetworkLibOS::of::<NullLibOS>());
+    run::<DynamicLibOS>("dynamic");
+}
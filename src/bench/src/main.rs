@@ -0,0 +1,314 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Benchmarks for the catnip and catnap libOSes that run against local stand-ins for a network
+//! (see `scripts/loopback.sh`), so that results are reproducible on any machine. Every run prints
+//! one JSON object per line, so that results can be diffed across commits.
+
+mod scenario;
+
+use crate::scenario::{
+    Params,
+    Peer,
+    Scenario,
+};
+use anyhow::{
+    bail,
+    format_err,
+    Error,
+};
+use catnap_libos::runtime::LinuxRuntime;
+use catnip::{
+    collections::bytes::BytesMut,
+    libos::LibOS,
+    protocols::{
+        ip::Port,
+        ipv4::Endpoint,
+    },
+    runtime::Runtime,
+};
+use clap::{
+    App,
+    Arg,
+};
+use demikernel::{
+    capture::{
+        CaptureConfig,
+        CaptureRing,
+    },
+    config::Config,
+};
+use std::{
+    convert::TryFrom,
+    env,
+    net::Ipv4Addr,
+    process,
+    str::FromStr,
+    sync::Arc,
+    thread,
+    time::Duration,
+};
+
+//==============================================================================
+// Runtimes
+//==============================================================================
+
+/// Buffers to push, in whichever form the runtime sends best.
+pub trait BenchRuntime: Runtime {
+    fn make_buf(&self, size: usize) -> Self::Buf;
+
+    /// Hands staged frames to the device.
+    fn flush_tx(&self);
+}
+
+impl BenchRuntime for LinuxRuntime {
+    fn make_buf(&self, size: usize) -> Self::Buf {
+        BytesMut::from(&vec![b'a'; size][..]).freeze()
+    }
+
+    fn flush_tx(&self) {
+        LinuxRuntime::flush_tx(self)
+    }
+}
+
+#[cfg(feature = "catnip")]
+impl BenchRuntime for catnip_libos::runtime::DPDKRuntime {
+    fn make_buf(&self, size: usize) -> Self::Buf {
+        use catnip_libos::memory::DPDKBuf;
+
+        let mut mbuf = self.alloc_body_mbuf();
+        if size > mbuf.len() {
+            return DPDKBuf::External(BytesMut::from(&vec![b'a'; size][..]).freeze());
+        }
+        unsafe { mbuf.slice_mut()[..size].fill(b'a') };
+        mbuf.trim(mbuf.len() - size);
+        DPDKBuf::Managed(mbuf)
+    }
+
+    fn flush_tx(&self) {
+        catnip_libos::runtime::DPDKRuntime::flush_tx(self)
+    }
+}
+
+fn catnap_libos(config: &Config, id: u16) -> Result<LibOS<LinuxRuntime>, Error> {
+    let rt = catnap_libos::runtime::initialize_linux(
+        config.local_link_addr,
+        config.local_ipv4_addr,
+        &config.local_interface_name,
+        config.arp_table(),
+    )?;
+    rt.set_capture(capture_ring(&config.capture(), id)?);
+    Ok(LibOS::new(rt)?)
+}
+
+/// Brings up the port with a queue for each of `num_queues` server threads.
+#[cfg(feature = "catnip")]
+fn catnip_queues(
+    config: &Config,
+    num_queues: u16,
+) -> Result<Vec<catnip_libos::dpdk::DPDKQueue>, Error> {
+    catnip_libos::dpdk::initialize_dpdk_queues(catnip_libos::dpdk::PortConfig {
+        num_queues,
+        rss_key: None,
+        rss_reta: None,
+        flow_filter: false,
+        ..catnip_libos::dpdk::PortConfig::from_config(config)
+    })
+}
+
+#[cfg(feature = "catnip")]
+fn catnip_libos(
+    config: &Config,
+) -> Result<LibOS<catnip_libos::runtime::DPDKRuntime>, Error> {
+    let mut queues = catnip_queues(config, 1)?;
+    let rt = queues.remove(0).into_runtime();
+    rt.set_capture(capture_ring(&config.capture(), rt.queue_id())?);
+    Ok(LibOS::new(rt)?)
+}
+
+/// Ring `id` of the `capture` section of the config, if it has one.
+fn capture_ring(capture: &Option<CaptureConfig>, id: u16) -> Result<Option<CaptureRing>, Error> {
+    capture.as_ref().map(|capture| capture.create_ring(id)).transpose()
+}
+
+/// Runs the server on `threads` threads, each with its own libOS from `make_libos` and its own
+/// listener on the same port. The libOS spreads incoming flows across them: catnip with RSS
+/// across its queues, and catnap with a packet fanout group across its sockets.
+fn run_sharded<RT, F>(threads: usize, params: Params, make_libos: F) -> Result<(), Error>
+where
+    RT: BenchRuntime,
+    F: Fn(usize) -> Result<LibOS<RT>, Error> + Send + Sync + 'static,
+{
+    let params = Arc::new(params);
+    let make_libos = Arc::new(make_libos);
+    let workers: Vec<_> = (0..threads)
+        .map(|i| {
+            let (params, make_libos) = (params.clone(), make_libos.clone());
+            thread::spawn(move || scenario::run(&mut make_libos(i)?, &params))
+        })
+        .collect();
+    for worker in workers {
+        worker
+            .join()
+            .map_err(|_| format_err!("server thread panicked"))??;
+    }
+    Ok(())
+}
+
+//==============================================================================
+// Configuration
+//==============================================================================
+
+fn addr(config: &Config, k1: &str, k2: &str) -> Result<Endpoint, Error> {
+    let addr = &config.config_obj[k1][k2];
+    let host_s = addr["host"]
+        .as_str()
+        .ok_or_else(|| format_err!("Missing {}.{}.host", k1, k2))?;
+    let host = Ipv4Addr::from_str(host_s)?;
+    let port_i = addr["port"]
+        .as_i64()
+        .ok_or_else(|| format_err!("Missing {}.{}.port", k1, k2))?;
+    let port = Port::try_from(port_i as u16)?;
+    Ok(Endpoint::new(host, port))
+}
+
+/// Addresses of this peer and the other one, laid out as in the tests' `config.yaml`.
+fn endpoints(config: &Config, peer: Peer) -> Result<(Endpoint, Endpoint), Error> {
+    Ok(match peer {
+        Peer::Server => (
+            addr(config, "server", "bind")?,
+            addr(config, "server", "client")?,
+        ),
+        Peer::Client => (
+            addr(config, "client", "client")?,
+            addr(config, "client", "connect_to")?,
+        ),
+    })
+}
+
+//==============================================================================
+// main
+//==============================================================================
+
+fn run() -> Result<(), Error> {
+    let matches = App::new("dmtr-bench")
+        .about("Runs one side of a libOS benchmark; start the server first.")
+        .arg(
+            Arg::with_name("libos")
+                .long("libos")
+                .takes_value(true)
+                .possible_values(&["catnap", "catnip"])
+                .required(true),
+        )
+        .arg(
+            Arg::with_name("peer")
+                .long("peer")
+                .takes_value(true)
+                .possible_values(&["server", "client"])
+                .required(true),
+        )
+        .arg(
+            Arg::with_name("scenario")
+                .long("scenario")
+                .takes_value(true)
+                .possible_values(Scenario::NAMES)
+                .required(true),
+        )
+        .arg(
+            Arg::with_name("size")
+                .long("size")
+                .takes_value(true)
+                .default_value("64")
+                .help("Message size, in bytes"),
+        )
+        .arg(
+            Arg::with_name("iterations")
+                .long("iterations")
+                .takes_value(true)
+                .default_value("100000")
+                .help("Messages (or connections) per run"),
+        )
+        .arg(
+            Arg::with_name("window")
+                .long("window")
+                .takes_value(true)
+                .default_value("32")
+                .help("Messages in flight for echo scenarios (pops outstanding for udp-wait-many)"),
+        )
+        .arg(
+            Arg::with_name("threads")
+                .long("threads")
+                .takes_value(true)
+                .default_value("1")
+                .help("Server threads, each with its own libOS listening on the same port"),
+        )
+        .arg(
+            Arg::with_name("duration")
+                .long("duration")
+                .takes_value(true)
+                .default_value("10")
+                .help("Seconds to stream for"),
+        )
+        .get_matches();
+
+    let config_path = env::var("CONFIG_PATH").map_err(|_| format_err!("CONFIG_PATH not set"))?;
+    let config = Config::new(config_path.clone());
+    let peer = match matches.value_of("peer").unwrap() {
+        "server" => Peer::Server,
+        _ => Peer::Client,
+    };
+    let (local_addr, remote_addr) = endpoints(&config, peer)?;
+    let params = Params {
+        libos: matches.value_of("libos").unwrap().to_string(),
+        scenario: Scenario::from_name(matches.value_of("scenario").unwrap()).unwrap(),
+        peer,
+        local_addr,
+        remote_addr,
+        size: matches.value_of("size").unwrap().parse()?,
+        iterations: matches.value_of("iterations").unwrap().parse()?,
+        window: matches.value_of("window").unwrap().parse()?,
+        duration: Duration::from_secs(matches.value_of("duration").unwrap().parse()?),
+    };
+    if params.size == 0 || params.iterations == 0 || params.window == 0 {
+        bail!("size, iterations and window must be positive");
+    }
+    let threads: usize = matches.value_of("threads").unwrap().parse()?;
+    if threads == 0 {
+        bail!("threads must be positive");
+    }
+    // A client's connections could hash to any thread, so only servers are sharded.
+    if threads > 1 && peer == Peer::Client {
+        bail!("only servers can run on several threads");
+    }
+
+    match params.libos.as_str() {
+        "catnap" if threads > 1 => run_sharded(threads, params, move |i| {
+            catnap_libos(&Config::new(config_path.clone()), i as u16)
+        }),
+        "catnap" => scenario::run(&mut catnap_libos(&config, 0)?, &params),
+        #[cfg(feature = "catnip")]
+        "catnip" if threads > 1 => {
+            let queues = catnip_queues(&config, threads as u16)?;
+            let queues = std::sync::Mutex::new(queues.into_iter().map(Some).collect::<Vec<_>>());
+            let capture = config.capture();
+            run_sharded(threads, params, move |i| {
+                let queue = queues.lock().unwrap()[i].take().unwrap();
+                // None of the server threads is the one that ran `rte_eal_init`.
+                unsafe { dpdk_rs::rte_thread_register() };
+                let rt = queue.into_runtime();
+                rt.set_capture(capture_ring(&capture, rt.queue_id())?);
+                Ok(LibOS::new(rt)?)
+            })
+        },
+        #[cfg(feature = "catnip")]
+        "catnip" => scenario::run(&mut catnip_libos(&config)?, &params),
+        _ => bail!("dmtr-bench was built without {}", params.libos),
+    }
+}
+
+fn main() {
+    if let Err(e) = run() {
+        eprintln!("dmtr-bench: {:?}", e);
+        process::exit(1);
+    }
+}
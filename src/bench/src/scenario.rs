@@ -0,0 +1,597 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+use crate::BenchRuntime;
+use anyhow::{
+    bail,
+    Error,
+};
+use catnip::{
+    file_table::FileDescriptor,
+    interop::dmtr_opcode_t,
+    libos::LibOS,
+    operations::OperationResult,
+    protocols::ipv4::Endpoint,
+};
+use demikernel::{
+    datagram,
+    interop::{
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+    },
+    wait,
+};
+use histogram::Histogram;
+use libc::sockaddr_in;
+use std::{
+    mem,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub enum Peer {
+    Server,
+    Client,
+}
+
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub enum Scenario {
+    /// Datagrams echoed back, with a window of them in flight.
+    UdpEcho,
+    /// One datagram in flight at a time.
+    UdpPingPong,
+    /// Like `UdpEcho`, but datagrams go through `pushto_many()` and `popfrom()` a window at a
+    /// time instead of one token each.
+    UdpBatch,
+    /// Like `UdpEcho`, but the server keeps a window of pops outstanding and collects them with
+    /// `wait_many()`, to see how events/s holds up as the number of outstanding tokens grows.
+    UdpWaitMany,
+    /// Messages echoed back over a connection, with a window of them in flight.
+    TcpEcho,
+    /// One message in flight at a time over a connection.
+    TcpPingPong,
+    /// Client pushes as fast as it can; the server drains.
+    TcpStream,
+    /// A fresh connection for every message.
+    TcpChurn,
+}
+
+pub struct Params {
+    pub libos: String,
+    pub scenario: Scenario,
+    pub peer: Peer,
+    pub local_addr: Endpoint,
+    pub remote_addr: Endpoint,
+    pub size: usize,
+    pub iterations: usize,
+    pub window: usize,
+    pub duration: Duration,
+}
+
+/// What a client measured, printed as one line of JSON.
+struct Report {
+    ops: usize,
+    bytes: usize,
+    elapsed: Duration,
+    latency: Option<Histogram>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl Scenario {
+    pub const NAMES: &'static [&'static str] = &[
+        "udp-echo",
+        "udp-pingpong",
+        "udp-batch",
+        "udp-wait-many",
+        "tcp-echo",
+        "tcp-pingpong",
+        "tcp-stream",
+        "tcp-churn",
+    ];
+
+    pub fn from_name(name: &str) -> Option<Self> {
+        Some(match name {
+            "udp-echo" => Scenario::UdpEcho,
+            "udp-pingpong" => Scenario::UdpPingPong,
+            "udp-batch" => Scenario::UdpBatch,
+            "udp-wait-many" => Scenario::UdpWaitMany,
+            "tcp-echo" => Scenario::TcpEcho,
+            "tcp-pingpong" => Scenario::TcpPingPong,
+            "tcp-stream" => Scenario::TcpStream,
+            "tcp-churn" => Scenario::TcpChurn,
+            _ => return None,
+        })
+    }
+
+    fn name(&self) -> &'static str {
+        match self {
+            Scenario::UdpEcho => "udp-echo",
+            Scenario::UdpPingPong => "udp-pingpong",
+            Scenario::UdpBatch => "udp-batch",
+            Scenario::UdpWaitMany => "udp-wait-many",
+            Scenario::TcpEcho => "tcp-echo",
+            Scenario::TcpPingPong => "tcp-pingpong",
+            Scenario::TcpStream => "tcp-stream",
+            Scenario::TcpChurn => "tcp-churn",
+        }
+    }
+
+    fn is_udp(&self) -> bool {
+        matches!(
+            self,
+            Scenario::UdpEcho | Scenario::UdpPingPong | Scenario::UdpBatch | Scenario::UdpWaitMany
+        )
+    }
+}
+
+impl Report {
+    fn to_json(&self, params: &Params) -> String {
+        let secs = self.elapsed.as_secs_f64();
+        let mut json = format!(
+            "{{\"libos\": \"{}\", \"scenario\": \"{}\", \"size\": {}, \"window\": {}, \
+             \"ops\": {}, \"elapsed_s\": {:.3}, \"ops_per_s\": {:.0}, \"gbps\": {:.3}",
+            params.libos,
+            params.scenario.name(),
+            params.size,
+            params.window,
+            self.ops,
+            secs,
+            self.ops as f64 / secs,
+            (self.bytes * 8) as f64 / secs / 1e9,
+        );
+        if let Some(ref h) = self.latency {
+            let percentile = |p| h.percentile(p).unwrap_or(0);
+            json += &format!(
+                ", \"latency_ns\": {{\"p50\": {}, \"p90\": {}, \"p99\": {}, \"p999\": {}, \
+                 \"max\": {}}}",
+                percentile(50.0),
+                percentile(90.0),
+                percentile(99.0),
+                percentile(99.9),
+                h.maximum().unwrap_or(0),
+            );
+        }
+        json + "}"
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+pub fn run<RT: BenchRuntime>(libos: &mut LibOS<RT>, params: &Params) -> Result<(), Error> {
+    let socket_type = if params.scenario.is_udp() {
+        libc::SOCK_DGRAM
+    } else {
+        libc::SOCK_STREAM
+    };
+
+    if params.peer == Peer::Server {
+        // Servers run until they're killed.
+        if params.scenario == Scenario::UdpBatch {
+            return udp_batch_echo_server(libos, params);
+        }
+        if params.scenario == Scenario::UdpWaitMany {
+            return udp_wait_many_echo_server(libos, params);
+        }
+        if params.scenario.is_udp() {
+            return udp_echo_server(libos, params);
+        }
+        let listener = libos.socket(libc::AF_INET, socket_type, 0)?;
+        libos.bind(listener, params.local_addr)?;
+        libos.listen(listener, 128)?;
+        loop {
+            let fd = tcp_accept(libos, listener)?;
+            match params.scenario {
+                Scenario::TcpChurn => tcp_echo_once(libos, fd, params.size)?,
+                _ => tcp_echo_server(libos, fd, params.scenario != Scenario::TcpStream)?,
+            }
+            libos.close(fd)?;
+        }
+    }
+
+    let report = match params.scenario {
+        Scenario::UdpEcho | Scenario::UdpPingPong | Scenario::UdpWaitMany => {
+            let sockfd = libos.socket(libc::AF_INET, socket_type, 0)?;
+            libos.bind(sockfd, params.local_addr)?;
+            echo_client(libos, sockfd, params, true)?
+        },
+        Scenario::UdpBatch => {
+            let sockfd = libos.socket(libc::AF_INET, socket_type, 0)?;
+            libos.bind(sockfd, params.local_addr)?;
+            batch_client(libos, sockfd, params)?
+        },
+        Scenario::TcpEcho | Scenario::TcpPingPong => {
+            let sockfd = tcp_connect(libos, params, socket_type)?;
+            echo_client(libos, sockfd, params, false)?
+        },
+        Scenario::TcpStream => {
+            let sockfd = tcp_connect(libos, params, socket_type)?;
+            stream_client(libos, sockfd, params)?
+        },
+        Scenario::TcpChurn => churn_client(libos, params, socket_type)?,
+    };
+    println!("{}", report.to_json(params));
+    Ok(())
+}
+
+fn udp_echo_server<RT: BenchRuntime>(libos: &mut LibOS<RT>, params: &Params) -> Result<(), Error> {
+    let sockfd = libos.socket(libc::AF_INET, libc::SOCK_DGRAM, 0)?;
+    libos.bind(sockfd, params.local_addr)?;
+    loop {
+        let qt = libos.pop(sockfd)?;
+        let (remote, buf) = match libos.wait2(qt) {
+            (_, OperationResult::Pop(Some(remote), buf)) => (remote, buf),
+            (_, r) => bail!("pop failed: {:?}", r),
+        };
+        let qt = libos.pushto2(sockfd, buf, remote)?;
+        libos.wait2(qt);
+    }
+}
+
+/// Echoes back whatever has arrived, a batch at a time.
+fn udp_batch_echo_server<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    params: &Params,
+) -> Result<(), Error> {
+    let sockfd = libos.socket(libc::AF_INET, libc::SOCK_DGRAM, 0)?;
+    libos.bind(sockfd, params.local_addr)?;
+    let rt = libos.rt().clone();
+    let mut sgas = vec![dmtr_sgarray_t::empty(); params.window];
+    let mut saddrs = vec![unsafe { mem::zeroed::<sockaddr_in>() }; params.window];
+    loop {
+        let npopped = match datagram::popfrom(libos, sockfd, &mut sgas, &mut saddrs) {
+            Ok(npopped) => npopped,
+            Err(libc::EAGAIN) => continue,
+            Err(e) => bail!("popfrom failed: {}", e),
+        };
+        let mut npushed = 0;
+        while npushed < npopped {
+            match datagram::pushto_many(
+                libos,
+                sockfd,
+                &sgas[npushed..npopped],
+                &saddrs[npushed..npopped],
+                |sga| Some(rt.clone_sgarray(&(*sga).into())),
+            ) {
+                Ok(n) => npushed += n,
+                Err(libc::EAGAIN) => libos.rt().flush_tx(),
+                Err(e) => bail!("pushto_many failed: {}", e),
+            }
+        }
+        libos.rt().flush_tx();
+        for sga in &sgas[..npopped] {
+            rt.free_sgarray((*sga).into());
+        }
+    }
+}
+
+/// Echoes back whatever has arrived, with a window of pops outstanding. Each one that completes
+/// is replaced right away.
+fn udp_wait_many_echo_server<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    params: &Params,
+) -> Result<(), Error> {
+    let sockfd = libos.socket(libc::AF_INET, libc::SOCK_DGRAM, 0)?;
+    libos.bind(sockfd, params.local_addr)?;
+    let rt = libos.rt().clone();
+    let mut qts = Vec::with_capacity(params.window);
+    for _ in 0..params.window {
+        qts.push(libos.pop(sockfd)?);
+    }
+    let mut qrs = vec![unsafe { mem::zeroed::<dmtr_qresult_t>() }; params.window];
+    let mut offsets = vec![0; params.window];
+    let mut sgas = Vec::with_capacity(params.window);
+    let mut saddrs = Vec::with_capacity(params.window);
+    loop {
+        let nready = match wait::wait_many(libos, &qts, &mut qrs, &mut offsets, None) {
+            Ok(nready) => nready,
+            Err(e) => bail!("wait_many failed: {}", e),
+        };
+        sgas.clear();
+        saddrs.clear();
+        for (qr, &offset) in qrs[..nready].iter().zip(&offsets[..nready]) {
+            if qr.qr_opcode != dmtr_opcode_t::DMTR_OPC_POP {
+                bail!("pop failed with opcode {}", qr.qr_opcode as i32);
+            }
+            let sga = unsafe { qr.qr_value.sga };
+            sgas.push(sga);
+            saddrs.push(sga.sga_addr);
+            qts[offset as usize] = libos.pop(sockfd)?;
+        }
+        let mut npushed = 0;
+        while npushed < nready {
+            match datagram::pushto_many(
+                libos,
+                sockfd,
+                &sgas[npushed..],
+                &saddrs[npushed..],
+                |sga| Some(rt.clone_sgarray(&(*sga).into())),
+            ) {
+                Ok(n) => npushed += n,
+                Err(libc::EAGAIN) => libos.rt().flush_tx(),
+                Err(e) => bail!("pushto_many failed: {}", e),
+            }
+        }
+        libos.rt().flush_tx();
+        for sga in &sgas {
+            rt.free_sgarray((*sga).into());
+        }
+    }
+}
+
+fn tcp_accept<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    listener: FileDescriptor,
+) -> Result<FileDescriptor, Error> {
+    let qt = libos.accept(listener)?;
+    match libos.wait2(qt) {
+        (_, OperationResult::Accept(fd)) => Ok(fd),
+        (_, r) => bail!("accept failed: {:?}", r),
+    }
+}
+
+/// Serves one connection until the client closes it, echoing everything back if `echo` is set
+/// and draining it otherwise.
+fn tcp_echo_server<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    fd: FileDescriptor,
+    echo: bool,
+) -> Result<(), Error> {
+    loop {
+        let qt = libos.pop(fd)?;
+        let buf = match libos.wait2(qt) {
+            (_, OperationResult::Pop(_, buf)) => buf,
+            (_, r) => bail!("pop failed: {:?}", r),
+        };
+        if buf.is_empty() {
+            return Ok(());
+        }
+        if echo {
+            let qt = libos.push2(fd, buf)?;
+            libos.wait2(qt);
+        }
+    }
+}
+
+/// Echoes `size` bytes back on `fd`.
+fn tcp_echo_once<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    fd: FileDescriptor,
+    size: usize,
+) -> Result<(), Error> {
+    let mut received = 0;
+    while received < size {
+        let qt = libos.pop(fd)?;
+        let buf = match libos.wait2(qt) {
+            (_, OperationResult::Pop(_, buf)) if !buf.is_empty() => buf,
+            (_, r) => bail!("pop failed: {:?}", r),
+        };
+        received += buf.len();
+        let qt = libos.push2(fd, buf)?;
+        libos.wait2(qt);
+    }
+    Ok(())
+}
+
+fn tcp_connect<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    params: &Params,
+    socket_type: i32,
+) -> Result<FileDescriptor, Error> {
+    let sockfd = libos.socket(libc::AF_INET, socket_type, 0)?;
+    let qt = libos.connect(sockfd, params.remote_addr)?;
+    match libos.wait2(qt) {
+        (_, OperationResult::Connect) => Ok(sockfd),
+        (_, r) => bail!("connect failed: {:?}", r),
+    }
+}
+
+/// Pops until `size` bytes have come back, since a stream may split a message.
+fn pop_exactly<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    fd: FileDescriptor,
+    size: usize,
+) -> Result<(), Error> {
+    let mut received = 0;
+    while received < size {
+        let qt = libos.pop(fd)?;
+        match libos.wait2(qt) {
+            (_, OperationResult::Pop(_, buf)) if !buf.is_empty() => received += buf.len(),
+            (_, r) => bail!("pop failed: {:?}", r),
+        }
+    }
+    Ok(())
+}
+
+/// Sends `params.iterations` messages and times each round trip. Ping-pong keeps one message in
+/// flight, echo keeps a window of them.
+fn echo_client<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    sockfd: FileDescriptor,
+    params: &Params,
+    udp: bool,
+) -> Result<Report, Error> {
+    let window = match params.scenario {
+        Scenario::UdpPingPong | Scenario::TcpPingPong => 1,
+        _ => params.window,
+    };
+    let buf = libos.rt().make_buf(params.size);
+    let mut latency = Histogram::new();
+    let mut in_flight = std::collections::VecDeque::with_capacity(window);
+
+    let start = Instant::now();
+    for i in 0..(params.iterations + window) {
+        if in_flight.len() == window || i >= params.iterations {
+            if in_flight.is_empty() {
+                break;
+            }
+            if udp {
+                let qt = libos.pop(sockfd)?;
+                match libos.wait2(qt) {
+                    (_, OperationResult::Pop(..)) => (),
+                    (_, r) => bail!("pop failed: {:?}", r),
+                }
+            } else {
+                pop_exactly(libos, sockfd, params.size)?;
+            }
+            let sent: Instant = in_flight.pop_front().unwrap();
+            let _ = latency.increment(sent.elapsed().as_nanos() as u64);
+        }
+        if i < params.iterations {
+            in_flight.push_back(Instant::now());
+            let qt = if udp {
+                libos.pushto2(sockfd, buf.clone(), params.remote_addr)?
+            } else {
+                libos.push2(sockfd, buf.clone())?
+            };
+            libos.wait2(qt);
+        }
+    }
+
+    Ok(Report {
+        ops: params.iterations,
+        bytes: params.iterations * params.size,
+        elapsed: start.elapsed(),
+        latency: Some(latency),
+    })
+}
+
+/// Sends `params.iterations` datagrams a window at a time with `pushto_many()` and collects the
+/// echoes with `popfrom()`. Latency is per window.
+fn batch_client<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    sockfd: FileDescriptor,
+    params: &Params,
+) -> Result<Report, Error> {
+    let rt = libos.rt().clone();
+    let sga: dmtr_sgarray_t = rt.into_sgarray(rt.make_buf(params.size)).into();
+    let mut popped = vec![dmtr_sgarray_t::empty(); params.window];
+    let mut senders = vec![unsafe { mem::zeroed::<sockaddr_in>() }; params.window];
+    let mut latency = Histogram::new();
+
+    // Echo one datagram up front, which resolves the server's link address before the clock
+    // starts and hands back its address in the form `pushto_many()` takes.
+    let qt = libos.pushto2(sockfd, rt.make_buf(params.size), params.remote_addr)?;
+    libos.wait2(qt);
+    let remote = loop {
+        match datagram::popfrom(libos, sockfd, &mut popped[..1], &mut senders[..1]) {
+            Ok(..) => {
+                rt.free_sgarray(popped[0].into());
+                break senders[0];
+            },
+            Err(libc::EAGAIN) => (),
+            Err(e) => bail!("popfrom failed: {}", e),
+        }
+    };
+
+    let start = Instant::now();
+    let mut sent = 0;
+    while sent < params.iterations {
+        let n = params.window.min(params.iterations - sent);
+        let sgas = vec![sga; n];
+        let saddrs = vec![remote; n];
+        let begin = Instant::now();
+        let mut npushed = 0;
+        while npushed < n {
+            match datagram::pushto_many(
+                libos,
+                sockfd,
+                &sgas[npushed..],
+                &saddrs[npushed..],
+                |sga| Some(rt.clone_sgarray(&(*sga).into())),
+            ) {
+                Ok(k) => npushed += k,
+                Err(libc::EAGAIN) => (),
+                Err(e) => bail!("pushto_many failed: {}", e),
+            }
+            libos.rt().flush_tx();
+        }
+        let mut nreceived = 0;
+        while nreceived < n {
+            match datagram::popfrom(libos, sockfd, &mut popped, &mut senders) {
+                Ok(k) => {
+                    for sga in &popped[..k] {
+                        rt.free_sgarray((*sga).into());
+                    }
+                    nreceived += k;
+                },
+                Err(libc::EAGAIN) => (),
+                Err(e) => bail!("popfrom failed: {}", e),
+            }
+        }
+        let _ = latency.increment(begin.elapsed().as_nanos() as u64);
+        sent += n;
+    }
+    let elapsed = start.elapsed();
+    rt.free_sgarray(sga.into());
+
+    Ok(Report {
+        ops: params.iterations,
+        bytes: params.iterations * params.size,
+        elapsed,
+        latency: Some(latency),
+    })
+}
+
+fn stream_client<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    sockfd: FileDescriptor,
+    params: &Params,
+) -> Result<Report, Error> {
+    let buf = libos.rt().make_buf(params.size);
+    let mut ops = 0;
+    let start = Instant::now();
+    while start.elapsed() < params.duration {
+        let qts = (0..params.window)
+            .map(|_| libos.push2(sockfd, buf.clone()))
+            .collect::<Result<Vec<_>, _>>()?;
+        for qt in qts {
+            libos.wait2(qt);
+        }
+        ops += params.window;
+    }
+    Ok(Report {
+        ops,
+        bytes: ops * params.size,
+        elapsed: start.elapsed(),
+        latency: None,
+    })
+}
+
+/// Connects, exchanges one message and closes, `params.iterations` times. Latency covers the
+/// whole exchange, connection setup included.
+fn churn_client<RT: BenchRuntime>(
+    libos: &mut LibOS<RT>,
+    params: &Params,
+    socket_type: i32,
+) -> Result<Report, Error> {
+    let buf = libos.rt().make_buf(params.size);
+    let mut latency = Histogram::new();
+    let start = Instant::now();
+    for _ in 0..params.iterations {
+        let begin = Instant::now();
+        let sockfd = tcp_connect(libos, params, socket_type)?;
+        let qt = libos.push2(sockfd, buf.clone())?;
+        libos.wait2(qt);
+        pop_exactly(libos, sockfd, params.size)?;
+        libos.close(sockfd)?;
+        let _ = latency.increment(begin.elapsed().as_nanos() as u64);
+    }
+    Ok(Report {
+        ops: params.iterations,
+        bytes: params.iterations * params.size,
+        elapsed: start.elapsed(),
+        latency: Some(latency),
+    })
+}
@@ -0,0 +1,156 @@
+// -*- mode: c++; c-file-style: "k&r"; c-basic-offset: 4 -*-
+
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Measures the user threads behind `io_queue` tasks: what servicing one costs (a switch onto its
+// stack and back), and what a queue's pair of them (as `memory_queue` starts) costs to create and
+// destroy once the per-thread pools have warmed up, in heap allocations and in memory. Prints one
+// JSON object per run like `dmtr-bench`. It only needs the headers and Boost.Context, so
+// `make bench-user-thread` builds and runs it on its own.
+//
+//   dmtr-bench-user-thread [--count N]
+
+#include <dmtr/libos/user_thread.hh>
+#include <dmtr/types.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <unistd.h>
+
+using namespace dmtr;
+
+typedef user_thread<dmtr_qtoken_t> thread_type;
+
+// The libOS provides these when user threads run inside a queue.
+void dmtr_fail(int error_arg, const char *expr_arg, const char *, const char *filen_arg,
+    int lineno_arg) {
+    fprintf(stderr, "%s:%d: `%s` failed with %d\n", filen_arg, lineno_arg, expr_arg, error_arg);
+}
+
+void dmtr_panic(const char *why_arg, const char *filen_arg, int lineno_arg) {
+    fprintf(stderr, "%s:%d: %s\n", filen_arg, lineno_arg, why_arg);
+    abort();
+}
+
+// Every heap allocation the process makes goes through here. The benchmark is single-threaded.
+static size_t num_allocations = 0;
+
+void *operator new(size_t size) {
+    ++num_allocations;
+    void *p = malloc(0 == size ? 1 : size);
+    if (NULL == p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+// Takes `count` values, yielding whenever it runs out, the way queue threads wait for work.
+static int consume(thread_type::yield_type &yield, thread_type::queue_type &tq, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        while (tq.empty()) {
+            yield();
+        }
+        tq.pop();
+    }
+    return 0;
+}
+
+static int run_service(size_t count) {
+    std::unique_ptr<thread_type> t(new thread_type(
+        [count](thread_type::yield_type &yield, thread_type::queue_type &tq) {
+            return consume(yield, tq, count);
+        }));
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i + 1 < count; ++i) {
+        t->enqueue(i);
+        DMTR_TRUE(EINVAL, EAGAIN == t->service());
+    }
+    t->enqueue(count);
+    DMTR_OK(t->service());
+    double ns = elapsed_ns(start);
+
+    printf("{\"benchmark\": \"user_thread\", \"mode\": \"service\", \"count\": %zu, "
+        "\"ns_per_service\": %.1f}\n", count, ns / count);
+    return 0;
+}
+
+// Creates, works and destroys one queue's push and pop threads.
+static int queue_cycle() {
+    std::unique_ptr<thread_type> push_thread(new thread_type(
+        [](thread_type::yield_type &yield, thread_type::queue_type &tq) {
+            return consume(yield, tq, 1);
+        }));
+    std::unique_ptr<thread_type> pop_thread(new thread_type(
+        [](thread_type::yield_type &yield, thread_type::queue_type &tq) {
+            return consume(yield, tq, 1);
+        }));
+
+    push_thread->enqueue(0);
+    pop_thread->enqueue(0);
+    DMTR_OK(push_thread->service());
+    DMTR_OK(pop_thread->service());
+    return 0;
+}
+
+static int run_lifecycle(size_t count) {
+    // Fill the pools first.
+    DMTR_OK(queue_cycle());
+
+    const size_t allocations_before = num_allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        DMTR_OK(queue_cycle());
+    }
+    double ns = elapsed_ns(start);
+    const size_t allocations = num_allocations - allocations_before;
+
+    // Each thread holds a pooled stack with its guard page and a pooled thread object.
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t bytes_per_thread =
+        user_thread_stack_pool::STACK_SIZE + page_size + sizeof(thread_type);
+
+    printf("{\"benchmark\": \"user_thread\", \"mode\": \"lifecycle\", \"count\": %zu, "
+        "\"ns_per_queue\": %.1f, \"allocations_per_queue\": %.3f, \"bytes_per_queue\": %zu}\n",
+        count, ns / count, static_cast<double>(allocations) / count, 2 * bytes_per_thread);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = 1000000;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 < argc && "--count" == arg) {
+            count = strtoul(argv[++i], NULL, 0);
+        } else {
+            fprintf(stderr, "unknown argument `%s`\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (0 == count) {
+        fprintf(stderr, "--count must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    DMTR_OK(run_service(count));
+    DMTR_OK(run_lifecycle(count));
+    return 0;
+}
@@ -5,17 +5,14 @@
 #![deny(clippy::all)]
 #![feature(maybe_uninit_uninit_array, new_uninit)]
 #![feature(try_blocks)]
+#![feature(once_cell)]
 
 pub mod runtime;
 
 use anyhow::Error;
 use catnip::{
     file_table::FileDescriptor,
-    interop::{
-        dmtr_qresult_t,
-        dmtr_qtoken_t,
-        dmtr_sgarray_t,
-    },
+    interop::dmtr_qtoken_t,
     libos::LibOS,
     logging,
     protocols::{
@@ -26,16 +23,29 @@ use catnip::{
 };
 use demikernel::{
     config::Config,
+    datagram,
+    framing,
+    interop::{
+        dmtr_free_cb_t,
+        dmtr_header_t,
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+    },
     network::{
-        libos_network_init,
-        NetworkLibOS,
+        libos_network_bind,
+        NetworkOps,
     },
+    stats::dmtr_stats_t,
+    wait,
 };
 use libc::{
     c_char,
     c_int,
+    c_void,
     sockaddr,
+    sockaddr_in,
     socklen_t,
+    timespec,
 };
 use runtime::LinuxRuntime;
 use std::{
@@ -43,12 +53,20 @@ use std::{
     convert::TryFrom,
     mem,
     net::Ipv4Addr,
-    slice,
+    ptr,
+    sync::atomic::{
+        AtomicU16,
+        Ordering,
+    },
 };
 
 thread_local! {
     static LIBOS: RefCell<Option<LibOS<LinuxRuntime>>> = RefCell::new(None);
 }
+
+/// Id of the capture ring of the next libOS to be initialized.
+static NEXT_CAPTURE_ID: AtomicU16 = AtomicU16::new(0);
+
 fn with_libos<T>(f: impl FnOnce(&mut LibOS<LinuxRuntime>) -> T) -> T {
     LIBOS.with(|l| {
         let mut tls_libos = l.borrow_mut();
@@ -73,6 +91,12 @@ pub fn catnap_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
             config.arp_table(),
         )
         .unwrap();
+        if let Some(capture) = config.capture() {
+            // Each thread's libOS has a socket of its own, and so a ring of its own.
+            let id = NEXT_CAPTURE_ID.fetch_add(1, Ordering::Relaxed);
+            rt.set_capture(Some(capture.create_ring(id)?));
+        }
+        framing::set_max_message_size(config.max_message_size());
         LibOS::new(rt)?
     };
 
@@ -90,28 +114,159 @@ pub fn catnap_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
         *tls_libos = Some(libos);
     });
 
-    libos_network_init(NetworkLibOS::new(
-        catnap_socket,
-        catnap_bind,
-        catnap_listen,
-        catnap_accept,
-        catnap_connect,
-        catnap_pushto,
-        catnap_drop,
-        catnap_close,
-        catnap_push,
-        catnap_wait,
-        catnap_wait_any,
-        catnap_poll,
-        catnap_pop,
-        catnap_sgaalloc,
-        catnap_sgafree,
-        catnap_getsockname,
-    ));
+    libos_network_bind::<Catnap>();
 
     0
 }
 
+//==============================================================================
+// network
+//==============================================================================
+
+/// Binds the `dmtr_*` network calls to catnap.
+pub struct Catnap;
+
+demikernel::export_network_libos!(Catnap);
+
+impl NetworkOps for Catnap {
+    fn socket(qd_out: *mut c_int, domain: c_int, socket_type: c_int, protocol: c_int) -> c_int {
+        catnap_socket(qd_out, domain, socket_type, protocol)
+    }
+
+    fn bind(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int {
+        catnap_bind(qd, saddr, size)
+    }
+
+    fn listen(fd: c_int, backlog: c_int) -> c_int {
+        catnap_listen(fd, backlog)
+    }
+
+    fn accept(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
+        catnap_accept(qtok_out, sockqd)
+    }
+
+    fn connect(
+        qtok_out: *mut dmtr_qtoken_t,
+        qd: c_int,
+        saddr: *const sockaddr,
+        size: socklen_t,
+    ) -> c_int {
+        catnap_connect(qtok_out, qd, saddr, size)
+    }
+
+    fn pushto(
+        qtok_out: *mut dmtr_qtoken_t,
+        qd: c_int,
+        sga: *const dmtr_sgarray_t,
+        saddr: *const sockaddr,
+        size: socklen_t,
+    ) -> c_int {
+        catnap_pushto(qtok_out, qd, sga, saddr, size)
+    }
+
+    fn drop(qt: dmtr_qtoken_t) -> c_int {
+        catnap_drop(qt)
+    }
+
+    fn close(qd: c_int) -> c_int {
+        catnap_close(qd)
+    }
+
+    fn push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray_t) -> c_int {
+        catnap_push(qtok_out, qd, sga)
+    }
+
+    fn wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+        catnap_wait(qr_out, qt)
+    }
+
+    fn wait_any(
+        qr_out: *mut dmtr_qresult_t,
+        ready_offset: *mut c_int,
+        qts: *mut dmtr_qtoken_t,
+        num_qts: c_int,
+    ) -> c_int {
+        catnap_wait_any(qr_out, ready_offset, qts, num_qts)
+    }
+
+    fn poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+        catnap_poll(qr_out, qt)
+    }
+
+    fn pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+        catnap_pop(qtok_out, qd)
+    }
+
+    fn sgaalloc(size: libc::size_t) -> dmtr_sgarray_t {
+        catnap_sgaalloc(size)
+    }
+
+    fn sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
+        catnap_sgafree(sga)
+    }
+
+    fn getsockname(qd: c_int, saddr: *mut sockaddr, size: *mut socklen_t) -> c_int {
+        catnap_getsockname(qd, saddr, size)
+    }
+
+    fn register_mem(
+        ptr: *mut c_void,
+        len: libc::size_t,
+        free_cb: dmtr_free_cb_t,
+        free_arg: *mut c_void,
+    ) -> c_int {
+        catnap_register_mem(ptr, len, free_cb, free_arg)
+    }
+
+    fn wait_many(
+        qrs_out: *mut dmtr_qresult_t,
+        ready_offsets: *mut c_int,
+        num_ready_out: *mut c_int,
+        qts: *mut dmtr_qtoken_t,
+        num_qts: c_int,
+        max_ready: c_int,
+        timeout: *const timespec,
+    ) -> c_int {
+        catnap_wait_many(
+            qrs_out,
+            ready_offsets,
+            num_ready_out,
+            qts,
+            num_qts,
+            max_ready,
+            timeout,
+        )
+    }
+
+    fn get_stats(stats_out: *mut dmtr_stats_t) -> c_int {
+        catnap_get_stats(stats_out)
+    }
+
+    fn pushto_many(
+        num_pushed_out: *mut c_int,
+        qd: c_int,
+        sgas: *const dmtr_sgarray_t,
+        saddrs: *const sockaddr_in,
+        num: c_int,
+    ) -> c_int {
+        catnap_pushto_many(num_pushed_out, qd, sgas, saddrs, num)
+    }
+
+    fn popfrom(
+        num_out: *mut c_int,
+        qd: c_int,
+        sgas_out: *mut dmtr_sgarray_t,
+        saddrs_out: *mut sockaddr_in,
+        max: c_int,
+    ) -> c_int {
+        catnap_popfrom(num_out, qd, sgas_out, saddrs_out, max)
+    }
+
+    fn set_framed(qd: c_int, framed: c_int) -> c_int {
+        catnap_set_framed(qd, framed)
+    }
+}
+
 //==============================================================================
 // socket
 //==============================================================================
@@ -223,12 +378,17 @@ fn catnap_connect(
 //==============================================================================
 
 fn catnap_close(qd: c_int) -> c_int {
-    with_libos(|libos| match libos.close(qd as FileDescriptor) {
-        Ok(..) => 0,
-        Err(e) => {
-            eprintln!("dmtr_close failed: {:?}", e);
-            e.errno()
-        },
+    let fd = qd as FileDescriptor;
+    with_libos(|libos| {
+        datagram::forget(libos, fd);
+        framing::forget(libos, fd);
+        match libos.close(fd) {
+            Ok(..) => 0,
+            Err(e) => {
+                eprintln!("dmtr_close failed: {:?}", e);
+                e.errno()
+            },
+        }
     })
 }
 
@@ -241,8 +401,26 @@ fn catnap_push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray
         return libc::EINVAL;
     }
     let sga = unsafe { &*sga };
+    if !sga.is_valid() {
+        return libc::EINVAL;
+    }
+    let fd = qd as FileDescriptor;
+    // A framed queue sends the array behind its header, which lives here until the push has
+    // cloned it.
+    let mut header = dmtr_header_t::default();
+    let framed;
+    let sga = if framing::is_framed(fd) {
+        framed = match framing::frame(sga, &mut header) {
+            Ok(framed) => framed,
+            Err(e) => return e,
+        };
+        &framed
+    } else {
+        sga
+    };
     with_libos(|libos| {
-        unsafe { *qtok_out = libos.push(qd as FileDescriptor, sga).unwrap() };
+        let buf = libos.rt().sgaclone(sga);
+        unsafe { *qtok_out = libos.push2(fd, buf).unwrap() };
         0
     })
 }
@@ -262,6 +440,9 @@ fn catnap_pushto(
         return libc::EINVAL;
     }
     let sga = unsafe { &*sga };
+    if !sga.is_valid() {
+        return libc::EINVAL;
+    }
     if saddr.is_null() {
         return libc::EINVAL;
     }
@@ -273,31 +454,83 @@ fn catnap_pushto(
     let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
     let endpoint = ipv4::Endpoint::new(addr, port);
     with_libos(|libos| {
-        unsafe { *qtok_out = libos.pushto(qd as FileDescriptor, sga, endpoint).unwrap() };
+        let buf = libos.rt().sgaclone(sga);
+        unsafe { *qtok_out = libos.pushto2(qd as FileDescriptor, buf, endpoint).unwrap() };
         0
     })
 }
 
+//==============================================================================
+// pushto_many
+//==============================================================================
+
+fn catnap_pushto_many(
+    num_pushed_out: *mut c_int,
+    qd: c_int,
+    sgas: *const dmtr_sgarray_t,
+    saddrs: *const sockaddr_in,
+    num: c_int,
+) -> c_int {
+    with_libos(|libos| {
+        let rt = libos.rt().clone();
+        let ret = datagram::pushto_many_raw(libos, num_pushed_out, qd, sgas, saddrs, num, |sga| {
+            Some(rt.sgaclone(sga))
+        });
+        // Send the whole batch as one burst rather than waiting for the next poll.
+        libos.rt().flush_tx();
+        ret
+    })
+}
+
 //==============================================================================
 // pop
 //==============================================================================
 
 fn catnap_pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+    if let Some(qt) = framing::pop(qd as FileDescriptor) {
+        unsafe { *qtok_out = qt };
+        return 0;
+    }
     with_libos(|libos| {
         unsafe { *qtok_out = libos.pop(qd as FileDescriptor).unwrap() };
         0
     })
 }
 
+//==============================================================================
+// popfrom
+//==============================================================================
+
+fn catnap_popfrom(
+    num_out: *mut c_int,
+    qd: c_int,
+    sgas_out: *mut dmtr_sgarray_t,
+    saddrs_out: *mut sockaddr_in,
+    max: c_int,
+) -> c_int {
+    with_libos(|libos| datagram::popfrom_raw(libos, num_out, qd, sgas_out, saddrs_out, max))
+}
+
+//==============================================================================
+// set_framed
+//==============================================================================
+
+fn catnap_set_framed(qd: c_int, framed: c_int) -> c_int {
+    framing::set_framed_raw(qd, framed)
+}
+
 //==============================================================================
 // poll
 //==============================================================================
 
 fn catnap_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    if framing::is_framed_token(qt) {
+        return with_libos(|libos| framing::poll_raw(libos, qr_out, qt));
+    }
     with_libos(|libos| match libos.poll(qt) {
         None => libc::EAGAIN,
         Some(r) => {
-            unsafe { *qr_out = r };
+            unsafe { *qr_out = r.into() };
             0
         },
     })
@@ -308,6 +541,12 @@ fn catnap_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
 //==============================================================================
 
 fn catnap_drop(qt: dmtr_qtoken_t) -> c_int {
+    if framing::is_framed_token(qt) {
+        return match framing::drop_token(qt) {
+            Ok(()) => 0,
+            Err(e) => e,
+        };
+    }
     with_libos(|libos| {
         libos.drop_qtoken(qt);
         0
@@ -319,11 +558,14 @@ fn catnap_drop(qt: dmtr_qtoken_t) -> c_int {
 //==============================================================================
 
 fn catnap_wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    if framing::is_framed_token(qt) {
+        return with_libos(|libos| framing::wait_raw(libos, qr_out, qt));
+    }
     with_libos(|libos| {
         let (qd, r) = libos.wait2(qt);
         if !qr_out.is_null() {
-            let packed = dmtr_qresult_t::pack(libos.rt(), r, qd, qt);
-            unsafe { *qr_out = packed };
+            let packed = catnip::interop::dmtr_qresult_t::pack(libos.rt(), r, qd, qt);
+            unsafe { *qr_out = packed.into() };
         }
         0
     })
@@ -339,14 +581,42 @@ fn catnap_wait_any(
     qts: *mut dmtr_qtoken_t,
     num_qts: c_int,
 ) -> c_int {
-    let qts = unsafe { slice::from_raw_parts(qts, num_qts as usize) };
+    let mut num_ready: c_int = 0;
+    catnap_wait_many(
+        qr_out,
+        ready_offset,
+        &mut num_ready,
+        qts,
+        num_qts,
+        1,
+        ptr::null(),
+    )
+}
+
+//==============================================================================
+// wait_many
+//==============================================================================
+
+fn catnap_wait_many(
+    qrs_out: *mut dmtr_qresult_t,
+    ready_offsets: *mut c_int,
+    num_ready_out: *mut c_int,
+    qts: *mut dmtr_qtoken_t,
+    num_qts: c_int,
+    max_ready: c_int,
+    timeout: *const timespec,
+) -> c_int {
     with_libos(|libos| {
-        let (ix, qr) = libos.wait_any(qts);
-        unsafe {
-            *qr_out = qr;
-            *ready_offset = ix as c_int;
-        }
-        0
+        wait::wait_many_raw(
+            libos,
+            qrs_out,
+            ready_offsets,
+            num_ready_out,
+            qts,
+            num_qts,
+            max_ready,
+            timeout,
+        )
     })
 }
 
@@ -355,7 +625,7 @@ fn catnap_wait_any(
 //==============================================================================
 
 fn catnap_sgaalloc(size: libc::size_t) -> dmtr_sgarray_t {
-    with_libos(|libos| libos.rt().alloc_sgarray(size))
+    with_libos(|libos| libos.rt().sgaalloc(size))
 }
 
 //==============================================================================
@@ -366,11 +636,36 @@ fn catnap_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
     if sga.is_null() {
         return 0;
     }
+    let sga = unsafe { *sga };
     with_libos(|libos| {
-        libos.rt().free_sgarray(unsafe { *sga });
+        if !framing::free(libos, &sga) {
+            libos.rt().sgafree(sga);
+        }
         0
     })
 }
+
+//==============================================================================
+// register_mem
+//==============================================================================
+
+fn catnap_register_mem(
+    ptr: *mut c_void,
+    len: libc::size_t,
+    free_cb: dmtr_free_cb_t,
+    free_arg: *mut c_void,
+) -> c_int {
+    with_libos(
+        |libos| match libos.rt().register_mem(ptr, len, free_cb, free_arg) {
+            Ok(..) => 0,
+            Err(e) => {
+                eprintln!("dmtr_register_mem failed: {:?}", e);
+                libc::EINVAL
+            },
+        },
+    )
+}
+
 //==============================================================================
 // getsockname
 //==============================================================================
@@ -378,3 +673,16 @@ fn catnap_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
 fn catnap_getsockname(_qd: c_int, _saddr: *mut sockaddr, _size: *mut socklen_t) -> c_int {
     unimplemented!();
 }
+
+//==============================================================================
+// get_stats
+//==============================================================================
+
+// There are no pools or device counters here, only frames the socket refused for good.
+fn catnap_get_stats(stats_out: *mut dmtr_stats_t) -> c_int {
+    let stats_out = unsafe { &mut *stats_out };
+    with_libos(|libos| {
+        stats_out.tx_dropped = libos.rt().tx_dropped() as u64;
+        0
+    })
+}
@@ -6,16 +6,20 @@ use catnip::{
         BytesMut,
     },
     interop::{
-        dmtr_sgarray_t,
+        self as catnip_interop,
         dmtr_sgaseg_t,
     },
     protocols::{
         arp,
         ethernet2::{
-            Ethernet2Header,
+            frame::ETHERNET2_HEADER_SIZE,
             MacAddress,
         },
-        tcp,
+        ipv4::datagram::IPV4_HEADER_SIZE,
+        tcp::{
+            self,
+            segment::MAX_TCP_HEADER_SIZE,
+        },
         udp,
     },
     runtime::{
@@ -28,8 +32,24 @@ use catnip::{
         Scheduler,
         SchedulerHandle,
     },
+};
+use demikernel::{
+    arp::ArpMirror,
+    capture::{
+        CaptureRing,
+        Direction,
+    },
+    checksum::{
+        Checksum,
+        SoftwareChecksums,
+    },
+    clock,
+    interop::{
+        dmtr_free_cb_t,
+        dmtr_sgarray_t,
+    },
+    stats,
     timer::{
-        Timer,
         TimerRc,
         WaitFuture,
     },
@@ -58,14 +78,16 @@ use std::{
     collections::HashMap,
     convert::TryInto,
     fs,
-    mem::{
-        self,
-        MaybeUninit,
-    },
+    io,
+    lazy::SyncLazy,
+    mem,
     net::Ipv4Addr,
+    os::unix::io::AsRawFd,
+    process,
     ptr,
     rc::Rc,
     slice,
+    sync::Mutex,
     time::{
         Duration,
         Instant,
@@ -78,11 +100,49 @@ use std::{
 
 // ETH_P_ALL must be converted to big-endian short but (due to a bug in Rust libc bindings) comes as an int.
 const ETH_P_ALL: libc::c_ushort = (libc::ETH_P_ALL as libc::c_ushort).to_be();
+
+// Packet fanout socket option and modes, which the libc bindings don't have.
+const PACKET_FANOUT: libc::c_int = 18;
+const PACKET_FANOUT_HASH: u32 = 0;
+const PACKET_FANOUT_FLAG_UNIQUEID: u32 = 0x2000;
+const PACKET_FANOUT_FLAG_DEFRAG: u32 = 0x8000;
+
+// Fanout group of this process's sockets on each interface, by interface index.
+static FANOUT_GROUPS: SyncLazy<Mutex<HashMap<i32, u16>>> =
+    SyncLazy::new(|| Mutex::new(HashMap::new()));
+
+// 4096B frame size chosen arbitrarily, seems fine for now.
+const MAX_FRAME_SIZE: usize = 4096;
+
+/// Maximum number of frames staged for transmission before we issue a `sendmmsg`.
+pub const TRANSMIT_BATCH_SIZE: usize = 32;
+
+const MAX_HEADER_SIZE: usize = ETHERNET2_HEADER_SIZE + IPV4_HEADER_SIZE + MAX_TCP_HEADER_SIZE;
+
 enum SockAddrPurpose {
     Bind,
     Send,
 }
 
+/// A frame staged for transmission. The header is serialized in place and the body is sent
+/// straight out of the buffer handed to us by the network stack.
+pub struct TxFrame {
+    header: [u8; MAX_HEADER_SIZE],
+    header_size: usize,
+    body: Option<Bytes>,
+    dest_sockaddr: libc::sockaddr_ll,
+}
+
+/// Application memory registered with `dmtr_register_mem`. The kernel copies every frame, so
+/// registration only records the callback to run once a pushed segment has been copied.
+#[derive(Clone, Copy)]
+pub struct ExternalRegion {
+    addr: usize,
+    len: usize,
+    free_cb: dmtr_free_cb_t,
+    free_arg: *mut libc::c_void,
+}
+
 #[derive(Clone)]
 pub struct LinuxRuntime {
     inner: Rc<RefCell<Inner>>,
@@ -98,6 +158,14 @@ pub struct Inner {
     pub ipv4_addr: Ipv4Addr,
     pub tcp_options: tcp::Options<LinuxRuntime>,
     pub arp_options: arp::Options,
+    pub rx_frames: Box<[[u8; MAX_FRAME_SIZE]; RECEIVE_BATCH_SIZE]>,
+    pub tx_batch: ArrayVec<TxFrame, TRANSMIT_BATCH_SIZE>,
+    pub tx_dropped: usize,
+    pub external_regions: Vec<ExternalRegion>,
+    pub capture: Option<CaptureRing>,
+    // The fanout hash sends every ARP frame to one socket, so each socket shares the replies it
+    // gets with the rest of the interface.
+    pub arp_mirror: ArpMirror,
 }
 
 //==============================================================================
@@ -150,66 +218,84 @@ impl LinuxRuntime {
         socket
             .bind(&raw_sockaddr(SockAddrPurpose::Bind, ifindex, &[0; 6]))
             .unwrap();
+        if let Err(e) = join_fanout_group(&socket, ifindex) {
+            eprintln!("WARNING: Failed to join packet fanout group: {:?}", e);
+        }
 
+        // There's no checksum offload on an `AF_PACKET` socket, so the stack leaves checksums to
+        // us, and we compute them with the fastest kernel the CPU has.
+        let tcp_options = tcp::Options::new(
+            None,
+            None,
+            None,
+            None,
+            None,
+            None,
+            None,
+            None,
+            Some(true),
+            Some(true),
+        );
+
+        clock::resync(now);
         let inner = Inner {
-            timer: TimerRc(Rc::new(Timer::new(now))),
+            timer: TimerRc::new(now),
             rng: SmallRng::from_seed([0; 32]),
             socket,
             ifindex,
             link_addr,
             ipv4_addr,
-            tcp_options: tcp::Options::default(),
+            tcp_options,
             arp_options,
+            rx_frames: Box::new([[0; MAX_FRAME_SIZE]; RECEIVE_BATCH_SIZE]),
+            tx_batch: ArrayVec::new(),
+            tx_dropped: 0,
+            external_regions: vec![],
+            capture: None,
+            arp_mirror: ArpMirror::join(ifindex as u64),
         };
         Self {
             inner: Rc::new(RefCell::new(inner)),
             scheduler: Scheduler::new(),
         }
     }
-}
 
-//==============================================================================
-// Trait Implementations
-//==============================================================================
+    /// Hands any staged frames to the kernel.
+    pub fn flush_tx(&self) {
+        self.inner.borrow_mut().flush_tx();
+    }
 
-impl Runtime for LinuxRuntime {
-    type Buf = Bytes;
-    type WaitFuture = WaitFuture<TimerRc>;
+    /// Starts copying the frames we send and receive into `capture`, or stops.
+    pub fn set_capture(&self, capture: Option<CaptureRing>) {
+        self.inner.borrow_mut().capture = capture;
+    }
 
-    fn into_sgarray(&self, buf: Bytes) -> dmtr_sgarray_t {
-        let buf_copy: Box<[u8]> = (&buf[..]).into();
-        let ptr = Box::into_raw(buf_copy);
-        let sgaseg = dmtr_sgaseg_t {
-            sgaseg_buf: ptr as *mut _,
-            sgaseg_len: buf.len() as u32,
-        };
-        dmtr_sgarray_t {
-            sga_buf: ptr::null_mut(),
-            sga_numsegs: 1,
-            sga_segs: [sgaseg],
-            sga_addr: unsafe { mem::zeroed() },
-        }
+    /// Number of frames dropped because the socket refused them.
+    pub fn tx_dropped(&self) -> usize {
+        self.inner.borrow().tx_dropped
     }
 
-    fn alloc_sgarray(&self, size: usize) -> dmtr_sgarray_t {
+    /// Allocates a scatter-gather array of `size` bytes. A single heap segment suffices, since
+    /// there's no pool limiting the segment size.
+    pub fn sgaalloc(&self, size: usize) -> dmtr_sgarray_t {
         let allocation: Box<[u8]> = unsafe { Box::new_uninit_slice(size).assume_init() };
         let ptr = Box::into_raw(allocation);
         let sgaseg = dmtr_sgaseg_t {
             sgaseg_buf: ptr as *mut _,
             sgaseg_len: size as u32,
         };
-        dmtr_sgarray_t {
-            sga_buf: ptr::null_mut(),
-            sga_numsegs: 1,
-            sga_segs: [sgaseg],
-            sga_addr: unsafe { mem::zeroed() },
-        }
+        let mut sga = dmtr_sgarray_t::empty();
+        sga.push_segment(sgaseg).unwrap();
+        sga
     }
 
-    fn free_sgarray(&self, sga: dmtr_sgarray_t) {
-        assert_eq!(sga.sga_numsegs, 1);
-        for i in 0..sga.sga_numsegs as usize {
-            let seg = &sga.sga_segs[i];
+    pub fn sgafree(&self, sga: dmtr_sgarray_t) {
+        // Popped arrays are owned by the `Bytes` in `sga_buf`.
+        if !sga.sga_buf.is_null() {
+            drop(unsafe { Box::from_raw(sga.sga_buf as *mut Bytes) });
+            return;
+        }
+        for seg in sga.segments() {
             let allocation: Box<[u8]> = unsafe {
                 Box::from_raw(slice::from_raw_parts_mut(
                     seg.sgaseg_buf as *mut _,
@@ -220,66 +306,261 @@ impl Runtime for LinuxRuntime {
         }
     }
 
-    fn clone_sgarray(&self, sga: &dmtr_sgarray_t) -> Bytes {
-        let mut len = 0;
-        for i in 0..sga.sga_numsegs as usize {
-            len += sga.sga_segs[i].sgaseg_len;
-        }
-        let mut buf = BytesMut::zeroed(len as usize).unwrap();
+    /// Gathers all segments into a single buffer. The kernel copies the frame anyway, so this is
+    /// the only copy on the transmit path.
+    pub fn sgaclone(&self, sga: &dmtr_sgarray_t) -> Bytes {
+        let inner = self.inner.borrow();
+        let mut buf = BytesMut::zeroed(sga.len()).unwrap();
         let mut pos = 0;
-        for i in 0..sga.sga_numsegs as usize {
-            let seg = &sga.sga_segs[i];
+        for seg in sga.segments() {
             let seg_slice = unsafe {
                 slice::from_raw_parts(seg.sgaseg_buf as *mut u8, seg.sgaseg_len as usize)
             };
             buf[pos..(pos + seg_slice.len())].copy_from_slice(seg_slice);
             pos += seg_slice.len();
+
+            // We're done with segments from registered regions as soon as they're copied.
+            let (start, end) = (
+                seg.sgaseg_buf as usize,
+                seg.sgaseg_buf as usize + seg_slice.len(),
+            );
+            let region = inner
+                .external_regions
+                .iter()
+                .find(|r| r.addr <= start && end <= r.addr + r.len);
+            if let Some(ExternalRegion {
+                free_cb: Some(free_cb),
+                free_arg,
+                ..
+            }) = region
+            {
+                unsafe { free_cb(seg.sgaseg_buf, *free_arg) };
+            }
         }
         buf.freeze()
     }
 
-    fn transmit(&self, pkt: impl PacketBuf<Bytes>) {
-        let header_size = pkt.header_size();
-        let body_size = pkt.body_size();
+    /// Registers application memory for pushes. Pushes always copy on this libOS, so this only
+    /// arranges for `free_cb` to be called the way it would be on catnip.
+    pub fn register_mem(
+        &self,
+        ptr: *mut libc::c_void,
+        len: usize,
+        free_cb: dmtr_free_cb_t,
+        free_arg: *mut libc::c_void,
+    ) -> Result<(), Error> {
+        if ptr.is_null() || len == 0 {
+            anyhow::bail!("Empty memory region");
+        }
+        let (start, end) = (ptr as usize, ptr as usize + len);
+        let mut inner = self.inner.borrow_mut();
+        if inner
+            .external_regions
+            .iter()
+            .any(|r| start < r.addr + r.len && r.addr < end)
+        {
+            anyhow::bail!("Memory region {:?}+{} is already registered", ptr, len);
+        }
+        inner.external_regions.push(ExternalRegion {
+            addr: start,
+            len,
+            free_cb,
+            free_arg,
+        });
+        Ok(())
+    }
+}
+
+impl Inner {
+    /// Stages a frame for transmission, flushing the batch once it fills up.
+    fn enqueue_tx(&mut self, frame: TxFrame) {
+        if let Some(ref mut capture) = self.capture {
+            let header = &frame.header[..frame.header_size];
+            let wire_len = header.len() + frame.body.as_ref().map_or(0, |body| body.len());
+            let segments = Some(header).into_iter().chain(frame.body.as_deref());
+            capture.tap(Direction::Outbound, wire_len, segments);
+        }
+        self.tx_batch.push(frame);
+        if self.tx_batch.is_full() {
+            self.flush_tx();
+        }
+        // The kernel didn't take any of the batch, so make room for the next frame.
+        if self.tx_batch.is_full() {
+            self.tx_batch.remove(0);
+            self.tx_dropped += 1;
+        }
+    }
+
+    /// Sends staged frames with a single `sendmmsg`. Frames the socket couldn't take right now
+    /// stay staged and are retried on the next flush.
+    fn flush_tx(&mut self) {
+        if self.tx_batch.is_empty() {
+            return;
+        }
+        // Each frame is gathered from its header and its body.
+        let mut iovecs: [[libc::iovec; 2]; TRANSMIT_BATCH_SIZE] = unsafe { mem::zeroed() };
+        let mut msgs: [libc::mmsghdr; TRANSMIT_BATCH_SIZE] = unsafe { mem::zeroed() };
+        for (i, frame) in self.tx_batch.iter().enumerate() {
+            iovecs[i][0].iov_base = frame.header.as_ptr() as *mut libc::c_void;
+            iovecs[i][0].iov_len = frame.header_size;
+            let mut iovlen = 1;
+            if let Some(ref body) = frame.body {
+                iovecs[i][1].iov_base = body.as_ptr() as *mut libc::c_void;
+                iovecs[i][1].iov_len = body.len();
+                iovlen += 1;
+            }
+            msgs[i].msg_hdr.msg_name = &frame.dest_sockaddr as *const _ as *mut libc::c_void;
+            msgs[i].msg_hdr.msg_namelen = mem::size_of::<libc::sockaddr_ll>() as libc::socklen_t;
+            msgs[i].msg_hdr.msg_iov = iovecs[i].as_mut_ptr();
+            msgs[i].msg_hdr.msg_iovlen = iovlen;
+        }
+        let num_sent = unsafe {
+            libc::sendmmsg(
+                self.socket.as_raw_fd(),
+                msgs.as_mut_ptr(),
+                self.tx_batch.len() as libc::c_uint,
+                libc::MSG_DONTWAIT,
+            )
+        };
+        if num_sent >= 0 {
+            stats::record_tx_burst(num_sent as usize);
+            self.tx_batch.drain(..num_sent as usize);
+            return;
+        }
+        match io::Error::last_os_error().raw_os_error() {
+            Some(libc::EAGAIN) | Some(libc::EINTR) => (),
+            // The first frame was rejected for good, so drop it and keep the rest.
+            _ => {
+                self.tx_batch.remove(0);
+                self.tx_dropped += 1;
+            },
+        }
+    }
+
+    /// Receives up to `RECEIVE_BATCH_SIZE` frames with a single `recvmmsg`.
+    fn receive_batch(&mut self) -> ArrayVec<Bytes, RECEIVE_BATCH_SIZE> {
+        let mut out = ArrayVec::new();
+        let mut iovecs: [libc::iovec; RECEIVE_BATCH_SIZE] = unsafe { mem::zeroed() };
+        let mut msgs: [libc::mmsghdr; RECEIVE_BATCH_SIZE] = unsafe { mem::zeroed() };
+        for (i, frame) in self.rx_frames.iter_mut().enumerate() {
+            iovecs[i].iov_base = frame.as_mut_ptr() as *mut libc::c_void;
+            iovecs[i].iov_len = frame.len();
+            msgs[i].msg_hdr.msg_iov = &mut iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        let num_received = unsafe {
+            libc::recvmmsg(
+                self.socket.as_raw_fd(),
+                msgs.as_mut_ptr(),
+                RECEIVE_BATCH_SIZE as libc::c_uint,
+                libc::MSG_DONTWAIT,
+                ptr::null_mut(),
+            )
+        };
+        stats::record_rx_burst(num_received.max(0) as usize);
+        if num_received <= 0 {
+            return out;
+        }
+        // `Bytes` owns its storage, so each frame is copied once out of the receive arena, and
+        // its checksum checked as it's copied. Frames with bad checksums are dropped.
+        let checksums = SoftwareChecksums::all();
+        for i in 0..num_received as usize {
+            let len = msgs[i].msg_len as usize;
+            if let Some(ref mut capture) = self.capture {
+                let frame = &self.rx_frames[i][..len];
+                capture.tap(Direction::Inbound, len, Some(frame).into_iter());
+            }
+            let mut buf = BytesMut::zeroed(len).unwrap();
+            if checksums.copy_and_verify(&mut buf[..], &self.rx_frames[i][..len]) {
+                self.arp_mirror.tap(&buf[..]);
+                out.push(buf.freeze());
+            }
+        }
+        out
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
 
-        let mut buf = BytesMut::zeroed(header_size + body_size).unwrap();
+impl Runtime for LinuxRuntime {
+    type Buf = Bytes;
+    type WaitFuture = WaitFuture;
 
-        pkt.write_header(&mut buf[..header_size]);
-        if let Some(body) = pkt.take_body() {
-            buf[header_size..].copy_from_slice(&body[..]);
+    fn into_sgarray(&self, buf: Bytes) -> catnip_interop::dmtr_sgarray_t {
+        // Point the segment into the received buffer, and keep the buffer alive in `sga_buf`
+        // until the application frees the array.
+        let sgaseg = dmtr_sgaseg_t {
+            sgaseg_buf: buf.as_ptr() as *mut _,
+            sgaseg_len: buf.len() as u32,
+        };
+        catnip_interop::dmtr_sgarray_t {
+            sga_buf: Box::into_raw(Box::new(buf)) as *mut _,
+            sga_numsegs: 1,
+            sga_segs: [sgaseg],
+            sga_addr: unsafe { mem::zeroed() },
         }
+    }
 
-        let buf = buf.freeze();
-        let (header, _) = Ethernet2Header::parse(buf.clone()).unwrap();
-        let dest_addr_arr = header.dst_addr.to_array();
-        let dest_sockaddr = raw_sockaddr(
-            SockAddrPurpose::Send,
-            self.inner.borrow().ifindex,
-            &dest_addr_arr,
-        );
+    fn alloc_sgarray(&self, size: usize) -> catnip_interop::dmtr_sgarray_t {
+        self.sgaalloc(size).into()
+    }
 
-        self.inner
-            .borrow()
-            .socket
-            .send_to(&buf, &dest_sockaddr)
-            .unwrap();
+    fn free_sgarray(&self, sga: catnip_interop::dmtr_sgarray_t) {
+        self.sgafree(sga.into())
     }
 
-    fn receive(&self) -> ArrayVec<Bytes, RECEIVE_BATCH_SIZE> {
-        // 4096B buffer size chosen arbitrarily, seems fine for now.
-        // This use-case is an example for MaybeUninit in the docs
-        let mut out: [MaybeUninit<u8>; 4096] =
-            [unsafe { MaybeUninit::uninit().assume_init() }; 4096];
-        if let Ok((bytes_read, _origin_addr)) = self.inner.borrow().socket.recv_from(&mut out[..]) {
-            let mut ret = ArrayVec::new();
-            unsafe {
-                let out = mem::transmute::<[MaybeUninit<u8>; 4096], [u8; 4096]>(out);
-                ret.push(BytesMut::from(&out[..bytes_read]).freeze());
-            }
-            ret
-        } else {
-            ArrayVec::new()
+    fn clone_sgarray(&self, sga: &catnip_interop::dmtr_sgarray_t) -> Bytes {
+        self.sgaclone(&(*sga).into())
+    }
+
+    fn transmit(&self, pkt: impl PacketBuf<Bytes>) {
+        let header_size = pkt.header_size();
+        assert!(header_size <= MAX_HEADER_SIZE);
+
+        let mut header = [0; MAX_HEADER_SIZE];
+        pkt.write_header(&mut header[..header_size]);
+        stats::record_tx_headers(&header[..header_size]);
+        let body = pkt.take_body();
+        let checksums = SoftwareChecksums::all();
+        if checksums.applies_to(&header[..header_size]) {
+            let body_checksum = body.as_ref().map(|body| {
+                let mut checksum = Checksum::new();
+                checksum.add(&body[..]);
+                checksum
+            });
+            checksums.fill(&mut header[..header_size], body_checksum.as_ref());
         }
+
+        // The destination link address is the first field of the Ethernet header we just wrote.
+        let mut dest_addr_arr = [0; 6];
+        dest_addr_arr.copy_from_slice(&header[..6]);
+
+        let mut inner = self.inner.borrow_mut();
+        let dest_sockaddr = raw_sockaddr_ll(SockAddrPurpose::Send, inner.ifindex, &dest_addr_arr);
+        inner.enqueue_tx(TxFrame {
+            header,
+            header_size,
+            body,
+            dest_sockaddr,
+        });
+    }
+
+    fn receive(&self) -> ArrayVec<Bytes, RECEIVE_BATCH_SIZE> {
+        let mut inner = self.inner.borrow_mut();
+
+        // `LibOS` receives once per scheduler poll, so this is where we push out whatever was
+        // transmitted during the last iteration.
+        inner.flush_tx();
+
+        let mut out = inner.receive_batch();
+        inner.arp_mirror.drain(out.remaining_capacity(), |frame| {
+            let mut buf = BytesMut::zeroed(frame.len()).unwrap();
+            buf.copy_from_slice(&frame[..]);
+            out.push(buf.freeze());
+        });
+        out
     }
 
     fn scheduler(&self) -> &Scheduler<Operation<Self>> {
@@ -299,7 +580,7 @@ impl Runtime for LinuxRuntime {
     }
 
     fn udp_options(&self) -> udp::Options {
-        udp::Options::default()
+        udp::Options::new(true, true)
     }
 
     fn arp_options(&self) -> arp::Options {
@@ -307,25 +588,21 @@ impl Runtime for LinuxRuntime {
     }
 
     fn advance_clock(&self, now: Instant) {
-        self.inner.borrow_mut().timer.0.advance_clock(now);
+        clock::resync(now);
+        let timer = self.inner.borrow().timer.clone();
+        timer.advance_clock(now);
     }
 
     fn wait(&self, duration: Duration) -> Self::WaitFuture {
-        let inner = self.inner.borrow_mut();
-        let now = inner.timer.0.now();
-        inner
-            .timer
-            .0
-            .wait_until(inner.timer.clone(), now + duration)
+        self.inner.borrow().timer.wait(duration)
     }
 
     fn wait_until(&self, when: Instant) -> Self::WaitFuture {
-        let inner = self.inner.borrow_mut();
-        inner.timer.0.wait_until(inner.timer.clone(), when)
+        self.inner.borrow().timer.wait_until(when)
     }
 
     fn now(&self) -> Instant {
-        self.inner.borrow().timer.0.now()
+        self.inner.borrow().timer.now()
     }
 
     fn rng_gen<T>(&self) -> T
@@ -351,10 +628,14 @@ impl Runtime for LinuxRuntime {
 // Helper Functions
 //==============================================================================
 
-fn raw_sockaddr(purpose: SockAddrPurpose, ifindex: i32, mac_addr: &[u8; 6]) -> SockAddr {
+fn raw_sockaddr_ll(
+    purpose: SockAddrPurpose,
+    ifindex: i32,
+    mac_addr: &[u8; 6],
+) -> libc::sockaddr_ll {
     let mut padded_address = [0_u8; 8];
     padded_address[..6].copy_from_slice(mac_addr);
-    let sockaddr_ll = libc::sockaddr_ll {
+    libc::sockaddr_ll {
         sll_family: libc::AF_PACKET.try_into().unwrap(),
         sll_protocol: purpose.protocol(),
         sll_ifindex: ifindex,
@@ -362,7 +643,11 @@ fn raw_sockaddr(purpose: SockAddrPurpose, ifindex: i32, mac_addr: &[u8; 6]) -> S
         sll_pkttype: 0,
         sll_halen: purpose.halen(),
         sll_addr: padded_address,
-    };
+    }
+}
+
+fn raw_sockaddr(purpose: SockAddrPurpose, ifindex: i32, mac_addr: &[u8; 6]) -> SockAddr {
+    let sockaddr_ll = raw_sockaddr_ll(purpose, ifindex, mac_addr);
 
     unsafe {
         let sockaddr_ptr =
@@ -374,6 +659,65 @@ fn raw_sockaddr(purpose: SockAddrPurpose, ifindex: i32, mac_addr: &[u8; 6]) -> S
     }
 }
 
+/// Adds `socket` to the fanout group of this process's sockets on `ifindex`, so that the kernel
+/// hands each frame to just one of them, picked by a hash of its flow. With a libOS per thread,
+/// every thread then sees whole flows, and listeners on the same port on every thread split
+/// incoming connections between them, like `SO_REUSEPORT`. Connections opened by a thread may
+/// hash to another one, though, so only listeners can be sharded this way.
+fn join_fanout_group(socket: &Socket, ifindex: i32) -> Result<(), io::Error> {
+    let mode = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+    let mut groups = FANOUT_GROUPS.lock().unwrap();
+    if let Some(&id) = groups.get(&ifindex) {
+        return set_packet_fanout(socket, id as u32 | mode << 16);
+    }
+    // Have the kernel pick an id that no other process uses, or fall back to our pid on kernels
+    // that can't.
+    let id = match set_packet_fanout(socket, (mode | PACKET_FANOUT_FLAG_UNIQUEID) << 16) {
+        Ok(()) => get_packet_fanout(socket)? as u16,
+        Err(..) => {
+            let id = process::id() as u16;
+            set_packet_fanout(socket, id as u32 | mode << 16)?;
+            id
+        },
+    };
+    groups.insert(ifindex, id);
+    Ok(())
+}
+
+fn set_packet_fanout(socket: &Socket, arg: u32) -> Result<(), io::Error> {
+    let ret = unsafe {
+        libc::setsockopt(
+            socket.as_raw_fd(),
+            libc::SOL_PACKET,
+            PACKET_FANOUT,
+            &arg as *const u32 as *const libc::c_void,
+            mem::size_of::<u32>() as libc::socklen_t,
+        )
+    };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+fn get_packet_fanout(socket: &Socket) -> Result<u32, io::Error> {
+    let mut arg: u32 = 0;
+    let mut len = mem::size_of::<u32>() as libc::socklen_t;
+    let ret = unsafe {
+        libc::getsockopt(
+            socket.as_raw_fd(),
+            libc::SOL_PACKET,
+            PACKET_FANOUT,
+            &mut arg as *mut u32 as *mut libc::c_void,
+            &mut len,
+        )
+    };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(arg & 0xffff)
+}
+
 pub fn initialize_linux(
     local_link_addr: MacAddress,
     local_ipv4_addr: Ipv4Addr,
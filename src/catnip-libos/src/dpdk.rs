@@ -1,7 +1,12 @@
 use crate::{
+    flow::{
+        self,
+        FlowFilter,
+    },
     memory::{
         MemoryConfig,
         MemoryManager,
+        SOCKET_ID_ANY,
     },
     runtime::DPDKRuntime,
 };
@@ -11,6 +16,7 @@ use anyhow::{
     Error,
 };
 use catnip::protocols::ethernet2::MacAddress;
+use demikernel::config::Config;
 use dpdk_rs::{
     rte_delay_us_block,
     rte_eal_init,
@@ -20,13 +26,17 @@ use dpdk_rs::{
     rte_eth_dev_get_mtu,
     rte_eth_dev_info_get,
     rte_eth_dev_is_valid_port,
+    rte_eth_dev_rss_reta_update,
     rte_eth_dev_set_mtu,
+    rte_eth_dev_socket_id,
     rte_eth_dev_start,
+    rte_eth_dev_stop,
     rte_eth_find_next_owned_by,
     rte_eth_link,
     rte_eth_link_get_nowait,
     rte_eth_macaddr_get,
     rte_eth_promiscuous_enable,
+    rte_eth_rss_reta_entry64,
     rte_eth_rx_mq_mode_ETH_MQ_RX_RSS as ETH_MQ_RX_RSS,
     rte_eth_rx_queue_setup,
     rte_eth_rxconf,
@@ -34,11 +44,16 @@ use dpdk_rs::{
     rte_eth_tx_queue_setup,
     rte_eth_txconf,
     rte_ether_addr,
+    rte_lcore_count,
     DEV_RX_OFFLOAD_JUMBO_FRAME,
+    DEV_RX_OFFLOAD_SCATTER,
     DEV_RX_OFFLOAD_TCP_CKSUM,
+    DEV_RX_OFFLOAD_TCP_LRO,
     DEV_RX_OFFLOAD_UDP_CKSUM,
+    DEV_TX_OFFLOAD_IPV4_CKSUM,
     DEV_TX_OFFLOAD_MULTI_SEGS,
     DEV_TX_OFFLOAD_TCP_CKSUM,
+    DEV_TX_OFFLOAD_TCP_TSO,
     DEV_TX_OFFLOAD_UDP_CKSUM,
     ETH_LINK_FULL_DUPLEX,
     ETH_LINK_UP,
@@ -47,12 +62,14 @@ use dpdk_rs::{
     RTE_ETHER_MAX_LEN,
     RTE_ETH_DEV_NO_OWNER,
     RTE_PKTMBUF_HEADROOM,
+    RTE_RETA_GROUP_SIZE,
 };
 use std::{
     collections::HashMap,
     ffi::CString,
     mem::MaybeUninit,
     net::Ipv4Addr,
+    sync::Arc,
     time::Duration,
 };
 
@@ -67,6 +84,108 @@ macro_rules! expect_zero {
     }};
 }
 
+/// One RX/TX queue pair of an initialized port, along with the memory pools that back it. A queue
+/// is meant to be driven by a single `LibOS` on its own lcore, so it is created on the thread that
+/// brings up the port and then moved to the thread that will own it.
+pub struct DPDKQueue {
+    link_addr: MacAddress,
+    ipv4_addr: Ipv4Addr,
+    port_id: u16,
+    queue_id: u16,
+    memory_manager: MemoryManager,
+    arp_table: HashMap<Ipv4Addr, MacAddress>,
+    disable_arp: bool,
+    mss: usize,
+    tcp_checksum_offload: bool,
+    udp_checksum_offload: bool,
+    tcp_tso: bool,
+    rx_intr_idle_polls: Option<usize>,
+    flow_filter: Option<Arc<FlowFilter>>,
+}
+
+// The memory manager is freshly created for this queue and isn't shared with anything else until
+// `into_runtime` is called on the owning lcore.
+unsafe impl Send for DPDKQueue {}
+
+impl DPDKQueue {
+    pub fn queue_id(&self) -> u16 {
+        self.queue_id
+    }
+
+    pub fn into_runtime(self) -> DPDKRuntime {
+        DPDKRuntime::new(
+            self.link_addr,
+            self.ipv4_addr,
+            self.port_id,
+            self.queue_id,
+            self.memory_manager,
+            self.arp_table,
+            self.disable_arp,
+            self.mss,
+            self.tcp_checksum_offload,
+            self.udp_checksum_offload,
+            self.tcp_tso,
+            self.rx_intr_idle_polls,
+            self.flow_filter,
+        )
+    }
+}
+
+/// How to bring up a port and its queues.
+#[derive(Clone)]
+pub struct PortConfig {
+    /// How should each queue's pools be sized? Their NUMA node is always the port's.
+    pub memory_config: MemoryConfig,
+    pub local_ipv4_addr: Ipv4Addr,
+    pub eal_init_args: Vec<CString>,
+    pub arp_table: HashMap<Ipv4Addr, MacAddress>,
+    pub disable_arp: bool,
+    pub use_jumbo_frames: bool,
+    pub mtu: u16,
+    pub mss: usize,
+    pub tcp_checksum_offload: bool,
+    pub udp_checksum_offload: bool,
+    /// Should TCP segmentation and receive coalescing be offloaded, where the device supports it?
+    pub tcp_tso: bool,
+    pub tcp_lro: bool,
+    /// After how many empty polls should an idle queue sleep on its RX interrupt? `None` spins.
+    pub rx_intr_idle_polls: Option<usize>,
+    /// How many RX/TX queue pairs should incoming flows be spread across with RSS?
+    pub num_queues: u16,
+    /// RSS hash key and redirection table. The device's defaults are used where they're `None`.
+    pub rss_key: Option<Vec<u8>>,
+    pub rss_reta: Option<Vec<u16>>,
+    pub promiscuous: bool,
+    /// Should the NIC drop traffic that isn't for one of our sockets (see `flow`), if it can?
+    pub flow_filter: bool,
+}
+
+impl PortConfig {
+    /// Everything the config file says about the port.
+    pub fn from_config(config: &Config) -> Self {
+        Self {
+            memory_config: MemoryConfig::from_config(config),
+            local_ipv4_addr: config.local_ipv4_addr,
+            eal_init_args: config.eal_init_args(),
+            arp_table: config.arp_table(),
+            disable_arp: config.disable_arp,
+            use_jumbo_frames: config.use_jumbo_frames,
+            mtu: config.mtu,
+            mss: config.mss,
+            tcp_checksum_offload: config.tcp_checksum_offload,
+            udp_checksum_offload: config.udp_checksum_offload,
+            tcp_tso: config.tcp_tso,
+            tcp_lro: config.tcp_lro,
+            rx_intr_idle_polls: config.rx_intr_idle_polls,
+            num_queues: config.num_queues(),
+            rss_key: config.rss_key(),
+            rss_reta: config.rss_reta(),
+            promiscuous: config.promiscuous(),
+            flow_filter: config.flow_filter(),
+        }
+    }
+}
+
 pub fn initialize_dpdk(
     local_ipv4_addr: Ipv4Addr,
     eal_init_args: &[CString],
@@ -78,9 +197,67 @@ pub fn initialize_dpdk(
     tcp_checksum_offload: bool,
     udp_checksum_offload: bool,
 ) -> Result<DPDKRuntime, Error> {
+    let mut queues = initialize_dpdk_queues(PortConfig {
+        memory_config: MemoryConfig::default(),
+        local_ipv4_addr,
+        eal_init_args: eal_init_args.to_vec(),
+        arp_table,
+        disable_arp,
+        use_jumbo_frames,
+        mtu,
+        mss,
+        tcp_checksum_offload,
+        udp_checksum_offload,
+        tcp_tso: false,
+        tcp_lro: false,
+        rx_intr_idle_polls: None,
+        num_queues: 1,
+        rss_key: None,
+        rss_reta: None,
+        promiscuous: true,
+        flow_filter: false,
+    })?;
+    Ok(queues.remove(0).into_runtime())
+}
+
+/// Initializes DPDK and brings up the first available port with `num_queues` RX/TX queue pairs.
+/// Incoming flows are spread across RX queues with RSS, using `rss_key` and `rss_reta` if given
+/// and the device's defaults otherwise. Each queue gets its own pools, sized by `memory_config` and
+/// allocated on the port's NUMA node. With `rx_intr_idle_polls`, RX interrupts are enabled so that
+/// idle queues can sleep instead of spinning. With `flow_filter`, the NIC drops traffic that isn't
+/// for one of our sockets (see `flow`), if it can.
+pub fn initialize_dpdk_queues(config: PortConfig) -> Result<Vec<DPDKQueue>, Error> {
+    let PortConfig {
+        mut memory_config,
+        local_ipv4_addr,
+        eal_init_args,
+        arp_table,
+        disable_arp,
+        use_jumbo_frames,
+        mtu,
+        mss,
+        tcp_checksum_offload,
+        udp_checksum_offload,
+        tcp_tso,
+        tcp_lro,
+        rx_intr_idle_polls,
+        num_queues,
+        rss_key,
+        rss_reta,
+        promiscuous,
+        flow_filter,
+    } = config;
+    let rss_key = rss_key.as_deref();
+    let rss_reta = rss_reta.as_deref();
+    if num_queues == 0 {
+        bail!("At least one queue is required");
+    }
     std::env::set_var("MLX5_SHUT_UP_BF", "1");
-    std::env::set_var("MLX5_SINGLE_THREADED", "1");
-    std::env::set_var("MLX4_SINGLE_THREADED", "1");
+    // Queues are driven from different lcores, so the driver may only skip locking with one queue.
+    if num_queues == 1 {
+        std::env::set_var("MLX5_SINGLE_THREADED", "1");
+        std::env::set_var("MLX4_SINGLE_THREADED", "1");
+    }
     let eal_init_refs = eal_init_args
         .iter()
         .map(|s| s.as_ptr() as *mut u8)
@@ -97,29 +274,52 @@ pub fn initialize_dpdk(
         nb_ports
     );
 
-    let mut memory_config = MemoryConfig::default();
+    let nb_lcores = unsafe { rte_lcore_count() };
+    if num_queues as u32 > nb_lcores {
+        eprintln!(
+            "WARNING: {} queues requested but only {} lcores enabled.",
+            num_queues, nb_lcores
+        );
+    }
+
+    let owner = RTE_ETH_DEV_NO_OWNER as u64;
+    let port_id = unsafe { rte_eth_find_next_owned_by(0, owner) as u16 };
+
     if use_jumbo_frames {
         memory_config.max_body_size =
             (RTE_ETHER_MAX_JUMBO_FRAME_LEN + RTE_PKTMBUF_HEADROOM) as usize;
     }
-    let memory_manager = MemoryManager::new(memory_config)?;
+    // Keep packet buffers next to the NIC, rather than on whichever node we happen to run on.
+    memory_config.socket_id = unsafe { rte_eth_dev_socket_id(port_id) };
+    if memory_config.socket_id < 0 {
+        memory_config.socket_id = SOCKET_ID_ANY;
+    }
+    let memory_managers = (0..num_queues)
+        .map(|queue_id| MemoryManager::new_for_queue(memory_config, queue_id))
+        .collect::<Result<Vec<_>, Error>>()?;
 
-    let owner = RTE_ETH_DEV_NO_OWNER as u64;
-    let port_id = unsafe { rte_eth_find_next_owned_by(0, owner) as u16 };
-    initialize_dpdk_port(
+    // Isolation has to be set up before the port is configured, and rules added after it starts.
+    let isolated = flow_filter && flow::isolate(port_id, true);
+    if flow_filter && !isolated {
+        eprintln!("WARNING: Device doesn't support flow isolation, filtering in software.");
+    }
+
+    let tcp_tso = initialize_dpdk_port(
         port_id,
-        &memory_manager,
+        memory_config.socket_id,
+        &memory_managers,
         use_jumbo_frames,
         mtu,
         tcp_checksum_offload,
         udp_checksum_offload,
+        tcp_tso,
+        tcp_lro,
+        rx_intr_idle_polls.is_some(),
+        rss_key,
+        rss_reta,
+        promiscuous,
     )?;
 
-    // TODO: Where is this function?
-    // if unsafe { rte_lcore_count() } > 1 {
-    //     eprintln!("WARNING: Too many lcores enabled. Only 1 used.");
-    // }
-
     let local_link_addr = unsafe {
         let mut m: MaybeUninit<rte_ether_addr> = MaybeUninit::zeroed();
         // TODO: Why does bindgen say this function doesn't return an int?
@@ -130,29 +330,81 @@ pub fn initialize_dpdk(
         Err(format_err!("Invalid mac address"))?;
     }
 
-    Ok(DPDKRuntime::new(
-        local_link_addr,
-        local_ipv4_addr,
-        port_id,
-        memory_manager,
-        arp_table,
-        disable_arp,
-        mss,
-        tcp_checksum_offload,
-        udp_checksum_offload,
-    ))
+    let flow_filter = if isolated {
+        // Accepted traffic is spread the same way RSS would have spread it.
+        let rss_queues = match rss_reta {
+            Some(reta) => reta.to_vec(),
+            None => (0..num_queues).collect(),
+        };
+        match FlowFilter::new(port_id, local_ipv4_addr, rss_queues) {
+            Ok(filter) => Some(Arc::new(filter)),
+            // An isolated port without its rules would receive nothing.
+            Err(e) => {
+                eprintln!(
+                    "WARNING: Failed to install flow rules ({:?}), filtering in software.",
+                    e
+                );
+                leave_flow_isolation(port_id)?;
+                None
+            },
+        }
+    } else {
+        None
+    };
+
+    let queues = memory_managers
+        .into_iter()
+        .enumerate()
+        .map(|(queue_id, memory_manager)| DPDKQueue {
+            link_addr: local_link_addr.clone(),
+            ipv4_addr: local_ipv4_addr,
+            port_id,
+            queue_id: queue_id as u16,
+            memory_manager,
+            arp_table: arp_table.clone(),
+            disable_arp,
+            mss,
+            tcp_checksum_offload,
+            udp_checksum_offload,
+            tcp_tso,
+            rx_intr_idle_polls,
+            flow_filter: flow_filter.clone(),
+        })
+        .collect();
+    Ok(queues)
 }
 
+/// Restarts a port that was started in flow isolation mode without it, so that it delivers all of
+/// our traffic again.
+fn leave_flow_isolation(port_id: u16) -> Result<(), Error> {
+    unsafe { rte_eth_dev_stop(port_id) };
+    if !flow::isolate(port_id, false) {
+        bail!("Failed to take port {} out of flow isolation", port_id);
+    }
+    unsafe { expect_zero!(rte_eth_dev_start(port_id))? };
+    Ok(())
+}
+
+/// Configures and starts the port. TSO and LRO are only enabled if the device supports them;
+/// returns whether TSO ended up enabled. The port only receives frames for other hosts if it's
+/// `promiscuous`.
 fn initialize_dpdk_port(
     port_id: u16,
-    memory_manager: &MemoryManager,
+    socket_id: i32,
+    memory_managers: &[MemoryManager],
     use_jumbo_frames: bool,
     mtu: u16,
     tcp_checksum_offload: bool,
     udp_checksum_offload: bool,
-) -> Result<(), Error> {
-    let rx_rings = 1;
-    let tx_rings = 1;
+    tcp_tso: bool,
+    tcp_lro: bool,
+    rx_intr: bool,
+    rss_key: Option<&[u8]>,
+    rss_reta: Option<&[u16]>,
+    promiscuous: bool,
+) -> Result<bool, Error> {
+    let rx_rings = memory_managers.len() as u16;
+    let tx_rings = memory_managers.len() as u16;
     let rx_ring_size = 2048;
     let tx_ring_size = 2048;
     let nb_rxd = rx_ring_size;
@@ -197,8 +449,32 @@ fn initialize_dpdk_port(
     if use_jumbo_frames {
         port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_JUMBO_FRAME as u64;
     }
+    if tcp_lro {
+        if dev_info.rx_offload_capa & DEV_RX_OFFLOAD_TCP_LRO as u64 != 0 {
+            // Coalesced packets span several `mbuf`s.
+            port_conf.rxmode.offloads |= (DEV_RX_OFFLOAD_TCP_LRO | DEV_RX_OFFLOAD_SCATTER) as u64;
+            port_conf.rxmode.max_lro_pkt_size = dev_info.max_lro_pkt_size;
+        } else {
+            eprintln!("WARNING: Device doesn't support LRO, receiving segments as they are.");
+        }
+    }
+    if rx_intr {
+        port_conf.intr_conf.set_rxq(1);
+    }
     port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
     port_conf.rx_adv_conf.rss_conf.rss_hf = ETH_RSS_IP as u64 | dev_info.flow_type_rss_offloads;
+    if let Some(key) = rss_key {
+        if dev_info.hash_key_size != 0 && key.len() != dev_info.hash_key_size as usize {
+            bail!(
+                "RSS key must be {} bytes long, got {}",
+                dev_info.hash_key_size,
+                key.len()
+            );
+        }
+        // The key is only read during `rte_eth_dev_configure`, so we can borrow it here.
+        port_conf.rx_adv_conf.rss_conf.rss_key = key.as_ptr() as *mut u8;
+        port_conf.rx_adv_conf.rss_conf.rss_key_len = key.len() as u8;
+    }
 
     port_conf.txmode.mq_mode = ETH_MQ_TX_NONE;
     if tcp_checksum_offload {
@@ -208,6 +484,18 @@ fn initialize_dpdk_port(
         port_conf.txmode.offloads |= DEV_TX_OFFLOAD_UDP_CKSUM as u64;
     }
     port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MULTI_SEGS as u64;
+    let tcp_tso = tcp_tso && {
+        let tso_capa =
+            (DEV_TX_OFFLOAD_TCP_TSO | DEV_TX_OFFLOAD_IPV4_CKSUM | DEV_TX_OFFLOAD_TCP_CKSUM) as u64;
+        if dev_info.tx_offload_capa & tso_capa == tso_capa {
+            // The NIC fills in the checksums of the segments it cuts.
+            port_conf.txmode.offloads |= tso_capa;
+            true
+        } else {
+            eprintln!("WARNING: Device doesn't support TSO, segmenting in software.");
+            false
+        }
+    };
 
     let mut rx_conf: rte_eth_rxconf = unsafe { MaybeUninit::zeroed().assume_init() };
     rx_conf.rx_thresh.pthresh = rx_pthresh;
@@ -230,15 +518,13 @@ fn initialize_dpdk_port(
         ))?;
     }
 
-    let socket_id = 0;
-
     unsafe {
-        for i in 0..rx_rings {
+        for (i, memory_manager) in memory_managers.iter().enumerate() {
             expect_zero!(rte_eth_rx_queue_setup(
                 port_id,
-                i,
+                i as u16,
                 nb_rxd,
-                socket_id,
+                socket_id as u32,
                 &rx_conf as *const _,
                 memory_manager.body_pool(),
             ))?;
@@ -248,12 +534,18 @@ fn initialize_dpdk_port(
                 port_id,
                 i,
                 nb_txd,
-                socket_id,
+                socket_id as u32,
                 &tx_conf as *const _
             ))?;
         }
         expect_zero!(rte_eth_dev_start(port_id))?;
-        rte_eth_promiscuous_enable(port_id);
+        if promiscuous {
+            rte_eth_promiscuous_enable(port_id);
+        }
+    }
+
+    if let Some(reta) = rss_reta {
+        update_rss_reta(port_id, dev_info.reta_size, rx_rings, reta)?;
     }
 
     if unsafe { rte_eth_dev_is_valid_port(port_id) } == 0 {
@@ -288,5 +580,38 @@ fn initialize_dpdk_port(
         retry_count -= 1;
     }
 
+    Ok(tcp_tso)
+}
+
+/// Fills the device's RSS redirection table by repeating `reta`, so that flows hashing to a given
+/// table entry always land on the same queue (and thus the same lcore).
+fn update_rss_reta(
+    port_id: u16,
+    reta_size: u16,
+    num_queues: u16,
+    reta: &[u16],
+) -> Result<(), Error> {
+    if reta.is_empty() {
+        bail!("RSS redirection table must not be empty");
+    }
+    if let Some(queue_id) = reta.iter().find(|&&q| q >= num_queues) {
+        bail!("RSS redirection table entry {} out of range", queue_id);
+    }
+    let group_size = RTE_RETA_GROUP_SIZE as usize;
+    let num_groups = (reta_size as usize + group_size - 1) / group_size;
+    let mut reta_conf: Vec<rte_eth_rss_reta_entry64> =
+        vec![unsafe { MaybeUninit::zeroed().assume_init() }; num_groups];
+    for i in 0..reta_size as usize {
+        let entry = &mut reta_conf[i / group_size];
+        entry.mask |= 1 << (i % group_size);
+        entry.reta[i % group_size] = reta[i % reta.len()];
+    }
+    unsafe {
+        expect_zero!(rte_eth_dev_rss_reta_update(
+            port_id,
+            reta_conf.as_mut_ptr(),
+            reta_size
+        ))?;
+    }
     Ok(())
 }
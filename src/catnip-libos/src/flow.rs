@@ -0,0 +1,399 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Hardware RX filtering with `rte_flow`.
+//!
+//! The port runs in flow isolation mode, so the NIC only hands us frames that match one of our
+//! rules. Out of the box those are ARP, ICMP for our address, and TCP and UDP to our ephemeral
+//! ports (replies on connections we opened). Each bound port gets a rule of its own. Everything
+//! else is dropped by a lowest-priority rule that counts what it drops, so that the traffic we
+//! filter out is still accounted for.
+
+use anyhow::{
+    format_err,
+    Error,
+};
+use dpdk_rs::{
+    rte_eth_hash_function_RTE_ETH_HASH_FUNCTION_DEFAULT as HASH_FUNCTION_DEFAULT,
+    rte_flow,
+    rte_flow_action,
+    rte_flow_action_count,
+    rte_flow_action_rss,
+    rte_flow_action_type_RTE_FLOW_ACTION_TYPE_COUNT as ACTION_COUNT,
+    rte_flow_action_type_RTE_FLOW_ACTION_TYPE_DROP as ACTION_DROP,
+    rte_flow_action_type_RTE_FLOW_ACTION_TYPE_END as ACTION_END,
+    rte_flow_action_type_RTE_FLOW_ACTION_TYPE_RSS as ACTION_RSS,
+    rte_flow_attr,
+    rte_flow_create,
+    rte_flow_destroy,
+    rte_flow_error,
+    rte_flow_isolate,
+    rte_flow_item,
+    rte_flow_item_eth,
+    rte_flow_item_icmp,
+    rte_flow_item_ipv4,
+    rte_flow_item_tcp,
+    rte_flow_item_type_RTE_FLOW_ITEM_TYPE_END as ITEM_END,
+    rte_flow_item_type_RTE_FLOW_ITEM_TYPE_ETH as ITEM_ETH,
+    rte_flow_item_type_RTE_FLOW_ITEM_TYPE_ICMP as ITEM_ICMP,
+    rte_flow_item_type_RTE_FLOW_ITEM_TYPE_IPV4 as ITEM_IPV4,
+    rte_flow_item_type_RTE_FLOW_ITEM_TYPE_TCP as ITEM_TCP,
+    rte_flow_item_type_RTE_FLOW_ITEM_TYPE_UDP as ITEM_UDP,
+    rte_flow_item_udp,
+    rte_flow_query,
+    rte_flow_query_count,
+    ETH_RSS_IP,
+    ETH_RSS_TCP,
+    ETH_RSS_UDP,
+};
+use std::{
+    collections::HashMap,
+    ffi::CStr,
+    mem::{
+        self,
+        MaybeUninit,
+    },
+    net::Ipv4Addr,
+    os::raw::c_void,
+    ptr,
+    sync::Mutex,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Ports that catnip hands out to connections it opens, 49152 to 65535, as a spec and mask on the
+/// destination port. NICs like mlx4 and mlx5 don't take item ranges (`last`), but they do take
+/// masks.
+const EPHEMERAL_PORTS: (u16, u16) = (0xC000, 0xC000);
+
+const ETHER_TYPE_ARP: u16 = 0x0806;
+
+// Rules for our traffic take precedence over the catch-all drop rule.
+const PRIORITY_ACCEPT: u32 = 0;
+const PRIORITY_DROP: u32 = 1;
+
+#[derive(Copy, Clone, Debug, Eq, Hash, PartialEq)]
+pub enum Protocol {
+    Tcp,
+    Udp,
+}
+
+struct Flow(*mut rte_flow);
+
+// Flow handles are only ever used under `FlowFilter::inner`'s lock.
+unsafe impl Send for Flow {}
+
+#[derive(Default)]
+struct Inner {
+    /// Rules for bound ports, and how many sockets (across all queues) have them bound.
+    ports: HashMap<(Protocol, u16), (usize, Flow)>,
+    base: Vec<Flow>,
+    drop: Option<Flow>,
+}
+
+/// Flow rules of a port, shared by all of its queues.
+pub struct FlowFilter {
+    port_id: u16,
+    ipv4_addr: Ipv4Addr,
+    /// Queues that accepted traffic is spread across with RSS.
+    queues: Vec<u16>,
+    inner: Mutex<Inner>,
+}
+
+/// Spec and mask of every pattern item a rule may use. They only need to live until the rule is
+/// created.
+#[derive(Default)]
+struct Pattern {
+    eth: Option<(rte_flow_item_eth, rte_flow_item_eth)>,
+    ipv4: Option<(rte_flow_item_ipv4, rte_flow_item_ipv4)>,
+    icmp: bool,
+    /// Destination port spec and mask.
+    l4: Option<(Protocol, u16, u16)>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl FlowFilter {
+    /// Installs the base rules on a port that `isolate()` has been called on and that has since
+    /// been started.
+    pub fn new(port_id: u16, ipv4_addr: Ipv4Addr, queues: Vec<u16>) -> Result<Self, Error> {
+        let filter = Self {
+            port_id,
+            ipv4_addr,
+            queues,
+            inner: Mutex::new(Inner::default()),
+        };
+
+        let mut inner = filter.inner.lock().unwrap();
+        // ARP requests are broadcast, so they can't be matched on our MAC address. RSS can't hash
+        // ARP either, so it all lands on one queue, which shares the replies (`ArpMirror`).
+        let arp = Pattern {
+            eth: Some(eth_type(ETHER_TYPE_ARP)),
+            ..Default::default()
+        };
+        inner.base.push(filter.accept(arp)?);
+        let icmp = Pattern {
+            ipv4: Some(filter.ipv4_dst()),
+            icmp: true,
+            ..Default::default()
+        };
+        inner.base.push(filter.accept(icmp)?);
+        for protocol in [Protocol::Tcp, Protocol::Udp].iter() {
+            let ephemeral = Pattern {
+                ipv4: Some(filter.ipv4_dst()),
+                l4: Some((*protocol, EPHEMERAL_PORTS.0, EPHEMERAL_PORTS.1)),
+                ..Default::default()
+            };
+            inner.base.push(filter.accept(ephemeral)?);
+        }
+        match filter.drop_and_count() {
+            Ok(flow) => inner.drop = Some(flow),
+            // Isolation already keeps the traffic out; we just can't count it.
+            Err(e) => eprintln!("WARNING: Failed to install counting drop rule: {:?}", e),
+        }
+        drop(inner);
+        Ok(filter)
+    }
+
+    /// Lets traffic to `port` through. Ports that are bound more than once (say, by every queue)
+    /// share a rule.
+    pub fn allow_port(&self, protocol: Protocol, port: u16) -> Result<(), Error> {
+        let mut inner = self.inner.lock().unwrap();
+        if let Some((count, _)) = inner.ports.get_mut(&(protocol, port)) {
+            *count += 1;
+            return Ok(());
+        }
+        let pattern = Pattern {
+            ipv4: Some(self.ipv4_dst()),
+            l4: Some((protocol, port, u16::MAX)),
+            ..Default::default()
+        };
+        let flow = self.accept(pattern)?;
+        inner.ports.insert((protocol, port), (1, flow));
+        Ok(())
+    }
+
+    pub fn release_port(&self, protocol: Protocol, port: u16) {
+        let mut inner = self.inner.lock().unwrap();
+        let remove = match inner.ports.get_mut(&(protocol, port)) {
+            Some((count, _)) => {
+                *count -= 1;
+                *count == 0
+            },
+            None => false,
+        };
+        if remove {
+            let (_, flow) = inner.ports.remove(&(protocol, port)).unwrap();
+            self.destroy(flow);
+        }
+    }
+
+    /// Frames dropped by the filter so far.
+    pub fn dropped(&self) -> u64 {
+        let inner = self.inner.lock().unwrap();
+        let flow = match inner.drop {
+            Some(ref flow) => flow,
+            None => return 0,
+        };
+        let mut count: rte_flow_query_count = unsafe { MaybeUninit::zeroed().assume_init() };
+        let action = rte_flow_action {
+            type_: ACTION_COUNT,
+            conf: ptr::null(),
+        };
+        let mut error = MaybeUninit::<rte_flow_error>::zeroed();
+        let ret = unsafe {
+            rte_flow_query(
+                self.port_id,
+                flow.0,
+                &action,
+                &mut count as *mut _ as *mut c_void,
+                error.as_mut_ptr(),
+            )
+        };
+        if ret != 0 || count.hits_set() == 0 {
+            return 0;
+        }
+        count.hits
+    }
+
+    fn ipv4_dst(&self) -> (rte_flow_item_ipv4, rte_flow_item_ipv4) {
+        let mut spec: rte_flow_item_ipv4 = unsafe { MaybeUninit::zeroed().assume_init() };
+        let mut mask: rte_flow_item_ipv4 = unsafe { MaybeUninit::zeroed().assume_init() };
+        spec.hdr.dst_addr = u32::from_ne_bytes(self.ipv4_addr.octets());
+        mask.hdr.dst_addr = u32::MAX;
+        (spec, mask)
+    }
+
+    /// Creates a rule that spreads frames matching `pattern` across our queues.
+    fn accept(&self, pattern: Pattern) -> Result<Flow, Error> {
+        let rss = rte_flow_action_rss {
+            func: HASH_FUNCTION_DEFAULT,
+            level: 0,
+            types: (ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP) as u64,
+            key_len: 0,
+            queue_num: self.queues.len() as u32,
+            key: ptr::null(),
+            queue: self.queues.as_ptr(),
+        };
+        let actions = [
+            rte_flow_action {
+                type_: ACTION_RSS,
+                conf: &rss as *const _ as *const c_void,
+            },
+            rte_flow_action {
+                type_: ACTION_END,
+                conf: ptr::null(),
+            },
+        ];
+        self.create(PRIORITY_ACCEPT, &pattern, &actions)
+    }
+
+    /// Creates a rule that drops every frame that no other rule took, counting them.
+    fn drop_and_count(&self) -> Result<Flow, Error> {
+        let count: rte_flow_action_count = unsafe { MaybeUninit::zeroed().assume_init() };
+        let actions = [
+            rte_flow_action {
+                type_: ACTION_COUNT,
+                conf: &count as *const _ as *const c_void,
+            },
+            rte_flow_action {
+                type_: ACTION_DROP,
+                conf: ptr::null(),
+            },
+            rte_flow_action {
+                type_: ACTION_END,
+                conf: ptr::null(),
+            },
+        ];
+        self.create(PRIORITY_DROP, &Pattern::default(), &actions)
+    }
+
+    fn create(
+        &self,
+        priority: u32,
+        pattern: &Pattern,
+        actions: &[rte_flow_action],
+    ) -> Result<Flow, Error> {
+        let mut attr: rte_flow_attr = unsafe { MaybeUninit::zeroed().assume_init() };
+        attr.priority = priority;
+        attr.set_ingress(1);
+
+        // L4 specs and masks are built here, since they depend on the protocol.
+        let mut tcp: [rte_flow_item_tcp; 2] = unsafe { MaybeUninit::zeroed().assume_init() };
+        let mut udp: [rte_flow_item_udp; 2] = unsafe { MaybeUninit::zeroed().assume_init() };
+        let icmp: rte_flow_item_icmp = unsafe { MaybeUninit::zeroed().assume_init() };
+
+        let mut items = Vec::with_capacity(4);
+        // A pattern without an Ethernet spec matches any frame.
+        match pattern.eth {
+            Some((ref spec, ref mask)) => items.push(item(ITEM_ETH, Some(spec), Some(mask))),
+            None => items.push(item::<rte_flow_item_eth>(ITEM_ETH, None, None)),
+        }
+        if let Some((ref spec, ref mask)) = pattern.ipv4 {
+            items.push(item(ITEM_IPV4, Some(spec), Some(mask)));
+        }
+        if pattern.icmp {
+            items.push(item(ITEM_ICMP, None, Some(&icmp)));
+        }
+        match pattern.l4 {
+            Some((Protocol::Tcp, port, mask)) => {
+                tcp[0].hdr.dst_port = port.to_be();
+                tcp[1].hdr.dst_port = mask.to_be();
+                items.push(item(ITEM_TCP, Some(&tcp[0]), Some(&tcp[1])));
+            },
+            Some((Protocol::Udp, port, mask)) => {
+                udp[0].hdr.dst_port = port.to_be();
+                udp[1].hdr.dst_port = mask.to_be();
+                items.push(item(ITEM_UDP, Some(&udp[0]), Some(&udp[1])));
+            },
+            None => (),
+        }
+        items.push(item::<rte_flow_item_eth>(ITEM_END, None, None));
+
+        let mut error = MaybeUninit::<rte_flow_error>::zeroed();
+        let flow = unsafe {
+            rte_flow_create(
+                self.port_id,
+                &attr,
+                items.as_ptr(),
+                actions.as_ptr(),
+                error.as_mut_ptr(),
+            )
+        };
+        if flow.is_null() {
+            return Err(flow_error("rte_flow_create", unsafe { &error.assume_init() }));
+        }
+        Ok(Flow(flow))
+    }
+
+    fn destroy(&self, flow: Flow) {
+        let mut error = MaybeUninit::<rte_flow_error>::zeroed();
+        if unsafe { rte_flow_destroy(self.port_id, flow.0, error.as_mut_ptr()) } != 0 {
+            let e = flow_error("rte_flow_destroy", unsafe { &error.assume_init() });
+            eprintln!("WARNING: {:?}", e);
+        }
+    }
+}
+
+impl Drop for FlowFilter {
+    fn drop(&mut self) {
+        let inner = mem::take(self.inner.get_mut().unwrap());
+        for (_, (_, flow)) in inner.ports {
+            self.destroy(flow);
+        }
+        for flow in inner.base.into_iter().chain(inner.drop) {
+            self.destroy(flow);
+        }
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Puts the port in flow isolation mode, so that it only delivers traffic that rules ask for, or
+/// takes it out again. Must be called while the port is stopped, and before it is first
+/// configured. Returns whether the driver supports it.
+pub fn isolate(port_id: u16, on: bool) -> bool {
+    let mut error = MaybeUninit::<rte_flow_error>::zeroed();
+    if unsafe { rte_flow_isolate(port_id, on as i32, error.as_mut_ptr()) } != 0 {
+        let e = flow_error("rte_flow_isolate", unsafe { &error.assume_init() });
+        eprintln!("WARNING: {:?}", e);
+        return false;
+    }
+    true
+}
+
+fn eth_type(ether_type: u16) -> (rte_flow_item_eth, rte_flow_item_eth) {
+    let mut spec: rte_flow_item_eth = unsafe { MaybeUninit::zeroed().assume_init() };
+    let mut mask: rte_flow_item_eth = unsafe { MaybeUninit::zeroed().assume_init() };
+    spec.type_ = ether_type.to_be();
+    mask.type_ = u16::MAX;
+    (spec, mask)
+}
+
+/// Pattern items never use ranges (`last`), which not every NIC takes.
+fn item<T>(type_: u32, spec: Option<&T>, mask: Option<&T>) -> rte_flow_item {
+    let as_ptr = |p: Option<&T>| p.map_or(ptr::null(), |p| p as *const T as *const c_void);
+    rte_flow_item {
+        type_,
+        spec: as_ptr(spec),
+        last: ptr::null(),
+        mask: as_ptr(mask),
+    }
+}
+
+fn flow_error(function: &str, error: &rte_flow_error) -> Error {
+    let message = if error.message.is_null() {
+        "unknown error".to_string()
+    } else {
+        unsafe { CStr::from_ptr(error.message) }
+            .to_string_lossy()
+            .into_owned()
+    };
+    format_err!("{} failed: {}", function, message)
+}
@@ -5,19 +5,33 @@
 #![deny(clippy::all)]
 #![feature(maybe_uninit_uninit_array, new_uninit)]
 #![feature(try_blocks)]
+#![feature(once_cell)]
 
 pub mod dpdk;
+pub mod flow;
 pub mod memory;
 pub mod runtime;
 
-use crate::runtime::DPDKRuntime;
-use anyhow::Error;
+use crate::{
+    dpdk::{
+        DPDKQueue,
+        PortConfig,
+    },
+    flow::Protocol,
+    memory::MemoryManager,
+    runtime::DPDKRuntime,
+};
+use anyhow::{
+    format_err,
+    Error,
+};
 use catnip::{
+    fail::Fail,
     file_table::FileDescriptor,
     interop::{
-        dmtr_qresult_t,
+        dmtr_opcode_t,
         dmtr_qtoken_t,
-        dmtr_sgarray_t,
+        dmtr_sgaseg_t,
     },
     libos::LibOS,
     logging,
@@ -29,28 +43,68 @@ use catnip::{
 };
 use demikernel::{
     config::Config,
+    datagram,
+    framing,
+    interop::{
+        dmtr_free_cb_t,
+        dmtr_header_t,
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+    },
     network::{
-        libos_network_init,
-        NetworkLibOS,
+        libos_network_bind,
+        NetworkOps,
     },
+    stats::dmtr_stats_t,
+    wait,
 };
 use libc::{
     c_char,
     c_int,
+    c_void,
     sockaddr,
+    sockaddr_in,
     socklen_t,
+    timespec,
 };
+use dpdk_rs::rte_thread_register;
 use std::{
     cell::RefCell,
+    collections::{
+        HashMap,
+        HashSet,
+    },
     convert::TryFrom,
+    lazy::SyncLazy,
     mem,
     net::Ipv4Addr,
+    ptr,
     slice,
+    sync::Mutex,
 };
 
+/// Segments of a stream push up to this size are copied together with their neighbours even if
+/// they could go out without a copy, so that they don't go out in packets of their own.
+const COALESCE_MAX_SIZE: usize = 1024;
+
 thread_local! {
     static LIBOS: RefCell<Option<LibOS<DPDKRuntime>>> = RefCell::new(None);
+
+    // Datagram sockets, which must send a scatter-gather array as a single packet.
+    static DATAGRAM_QDS: RefCell<HashSet<FileDescriptor>> = RefCell::new(HashSet::new());
+
+    // Ports that bound sockets, and the connections they accepted, have let through the port's
+    // hardware filter, to release on close. Each holds a reference of its own, so the port stays
+    // open until the last of them is closed.
+    static FILTERED_PORTS: RefCell<HashMap<FileDescriptor, (Protocol, u16)>> =
+        RefCell::new(HashMap::new());
 }
+
+// Queues of the port that haven't been claimed by a thread yet. The first call to `dmtr_init`
+// brings up the port, and every call claims the next queue for the calling thread.
+static UNCLAIMED_QUEUES: SyncLazy<Mutex<Option<Vec<DPDKQueue>>>> =
+    SyncLazy::new(|| Mutex::new(None));
+
 fn with_libos<T>(f: impl FnOnce(&mut LibOS<DPDKRuntime>) -> T) -> T {
     LIBOS.with(|l| {
         let mut tls_libos = l.borrow_mut();
@@ -73,17 +127,12 @@ pub fn catnip_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
         // Load config file.
         let config = Config::initialize(argc, argv)?;
 
-        let rt = self::dpdk::initialize_dpdk(
-            config.local_ipv4_addr,
-            &config.eal_init_args(),
-            config.arp_table(),
-            config.disable_arp,
-            config.use_jumbo_frames,
-            config.mtu,
-            config.mss,
-            config.tcp_checksum_offload,
-            config.udp_checksum_offload,
-        )?;
+        let queue = claim_queue(&config)?;
+        let rt = queue.into_runtime();
+        if let Some(capture) = config.capture() {
+            rt.set_capture(Some(capture.create_ring(rt.queue_id())?));
+        }
+        framing::set_max_message_size(config.max_message_size());
         LibOS::new(rt)?
     };
 
@@ -101,28 +150,176 @@ pub fn catnip_init(argc: c_int, argv: *mut *mut c_char) -> c_int {
         *tls_libos = Some(libos);
     });
 
-    libos_network_init(NetworkLibOS::new(
-        catnip_socket,
-        catnip_bind,
-        catnip_listen,
-        catnip_accept,
-        catnip_connect,
-        catnip_pushto,
-        catnip_drop,
-        catnip_close,
-        catnip_push,
-        catnip_wait,
-        catnip_wait_any,
-        catnip_poll,
-        catnip_pop,
-        catnip_sgaalloc,
-        catnip_sgafree,
-        catnip_getsockname,
-    ));
+    libos_network_bind::<Catnip>();
 
     0
 }
 
+fn claim_queue(config: &Config) -> Result<DPDKQueue, Error> {
+    let mut unclaimed = UNCLAIMED_QUEUES.lock().unwrap();
+    match unclaimed.as_mut() {
+        None => {
+            let mut queues = self::dpdk::initialize_dpdk_queues(PortConfig::from_config(config))?;
+            // Hand out queues in order, starting with queue 0 for the main lcore.
+            queues.reverse();
+            let queue = queues.pop().unwrap();
+            *unclaimed = Some(queues);
+            Ok(queue)
+        },
+        Some(queues) => {
+            let queue = queues.pop().ok_or_else(|| {
+                format_err!("All {} queues already claimed", config.num_queues())
+            })?;
+            // Threads other than the one that ran `rte_eal_init` need an lcore id of their own to
+            // get a mempool cache.
+            if unsafe { rte_thread_register() } != 0 {
+                eprintln!("WARNING: Failed to register lcore for queue {}", queue.queue_id());
+            }
+            Ok(queue)
+        },
+    }
+}
+
+//==============================================================================
+// network
+//==============================================================================
+
+/// Binds the `dmtr_*` network calls to catnip.
+pub struct Catnip;
+
+demikernel::export_network_libos!(Catnip);
+
+impl NetworkOps for Catnip {
+    fn socket(qd_out: *mut c_int, domain: c_int, socket_type: c_int, protocol: c_int) -> c_int {
+        catnip_socket(qd_out, domain, socket_type, protocol)
+    }
+
+    fn bind(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int {
+        catnip_bind(qd, saddr, size)
+    }
+
+    fn listen(fd: c_int, backlog: c_int) -> c_int {
+        catnip_listen(fd, backlog)
+    }
+
+    fn accept(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
+        catnip_accept(qtok_out, sockqd)
+    }
+
+    fn connect(
+        qtok_out: *mut dmtr_qtoken_t,
+        qd: c_int,
+        saddr: *const sockaddr,
+        size: socklen_t,
+    ) -> c_int {
+        catnip_connect(qtok_out, qd, saddr, size)
+    }
+
+    fn pushto(
+        qtok_out: *mut dmtr_qtoken_t,
+        qd: c_int,
+        sga: *const dmtr_sgarray_t,
+        saddr: *const sockaddr,
+        size: socklen_t,
+    ) -> c_int {
+        catnip_pushto(qtok_out, qd, sga, saddr, size)
+    }
+
+    fn drop(qt: dmtr_qtoken_t) -> c_int {
+        catnip_drop(qt)
+    }
+
+    fn close(qd: c_int) -> c_int {
+        catnip_close(qd)
+    }
+
+    fn push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray_t) -> c_int {
+        catnip_push(qtok_out, qd, sga)
+    }
+
+    fn wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+        catnip_wait(qr_out, qt)
+    }
+
+    fn wait_any(
+        qr_out: *mut dmtr_qresult_t,
+        ready_offset: *mut c_int,
+        qts: *mut dmtr_qtoken_t,
+        num_qts: c_int,
+    ) -> c_int {
+        catnip_wait_any(qr_out, ready_offset, qts, num_qts)
+    }
+
+    fn poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+        catnip_poll(qr_out, qt)
+    }
+
+    fn pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+        catnip_pop(qtok_out, qd)
+    }
+
+    fn sgaalloc(size: libc::size_t) -> dmtr_sgarray_t {
+        catnip_sgaalloc(size)
+    }
+
+    fn sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
+        catnip_sgafree(sga)
+    }
+
+    fn getsockname(qd: c_int, saddr: *mut sockaddr, size: *mut socklen_t) -> c_int {
+        catnip_getsockname(qd, saddr, size)
+    }
+
+    fn register_mem(
+        ptr: *mut c_void,
+        len: libc::size_t,
+        free_cb: dmtr_free_cb_t,
+        free_arg: *mut c_void,
+    ) -> c_int {
+        catnip_register_mem(ptr, len, free_cb, free_arg)
+    }
+
+    fn wait_many(
+        qrs_out: *mut dmtr_qresult_t,
+        ready_offsets: *mut c_int,
+        num_ready_out: *mut c_int,
+        qts: *mut dmtr_qtoken_t,
+        num_qts: c_int,
+        max_ready: c_int,
+        timeout: *const timespec,
+    ) -> c_int {
+        catnip_wait_many(qrs_out, ready_offsets, num_ready_out, qts, num_qts, max_ready, timeout)
+    }
+
+    fn get_stats(stats_out: *mut dmtr_stats_t) -> c_int {
+        catnip_get_stats(stats_out)
+    }
+
+    fn pushto_many(
+        num_pushed_out: *mut c_int,
+        qd: c_int,
+        sgas: *const dmtr_sgarray_t,
+        saddrs: *const sockaddr_in,
+        num: c_int,
+    ) -> c_int {
+        catnip_pushto_many(num_pushed_out, qd, sgas, saddrs, num)
+    }
+
+    fn popfrom(
+        num_out: *mut c_int,
+        qd: c_int,
+        sgas_out: *mut dmtr_sgarray_t,
+        saddrs_out: *mut sockaddr_in,
+        max: c_int,
+    ) -> c_int {
+        catnip_popfrom(num_out, qd, sgas_out, saddrs_out, max)
+    }
+
+    fn set_framed(qd: c_int, framed: c_int) -> c_int {
+        catnip_set_framed(qd, framed)
+    }
+}
+
 //==============================================================================
 // socket
 //==============================================================================
@@ -135,6 +332,9 @@ pub fn catnip_socket(
 ) -> c_int {
     with_libos(|libos| match libos.socket(domain, socket_type, protocol) {
         Ok(fd) => {
+            if socket_type == libc::SOCK_DGRAM {
+                DATAGRAM_QDS.with(|d| d.borrow_mut().insert(fd));
+            }
             unsafe { *qd_out = fd as c_int };
             0
         },
@@ -158,16 +358,32 @@ fn catnip_bind(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int {
     }
     let saddr_in = unsafe { *mem::transmute::<*const sockaddr, *const libc::sockaddr_in>(saddr) };
     let mut addr = Ipv4Addr::from(u32::from_be_bytes(saddr_in.sin_addr.s_addr.to_le_bytes()));
-    let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
+    let port_u16 = u16::from_be(saddr_in.sin_port);
+    let port = ip::Port::try_from(port_u16).unwrap();
+    let fd = qd as FileDescriptor;
+    let protocol = if DATAGRAM_QDS.with(|d| d.borrow().contains(&fd)) {
+        Protocol::Udp
+    } else {
+        Protocol::Tcp
+    };
 
     with_libos(|libos| {
         if addr.is_unspecified() {
             addr = libos.rt().local_ipv4_addr();
         }
+        // Let the port's traffic through the hardware filter before anything can arrive on it.
+        if let Err(e) = libos.rt().allow_port(protocol, port_u16) {
+            eprintln!("dmtr_bind failed: {:?}", e);
+            return libc::EIO;
+        }
         let endpoint = ipv4::Endpoint::new(addr, port);
-        match libos.bind(qd as FileDescriptor, endpoint) {
-            Ok(..) => 0,
+        match libos.bind(fd, endpoint) {
+            Ok(..) => {
+                FILTERED_PORTS.with(|f| f.borrow_mut().insert(fd, (protocol, port_u16)));
+                0
+            },
             Err(e) => {
+                libos.rt().release_port(protocol, port_u16);
                 eprintln!("dmtr_bind failed: {:?}", e);
                 e.errno()
             },
@@ -202,6 +418,24 @@ fn catnip_accept(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
     })
 }
 
+/// If `qr` is a connection accepted on a filtered port, takes a reference to the port for it, so
+/// that closing the listening socket doesn't cut it off.
+fn hold_accepted_port(libos: &LibOS<DPDKRuntime>, qr: &dmtr_qresult_t) {
+    if qr.qr_opcode != dmtr_opcode_t::DMTR_OPC_ACCEPT {
+        return;
+    }
+    let accepted = unsafe { qr.qr_value.ares.qd } as FileDescriptor;
+    FILTERED_PORTS.with(|f| {
+        let mut f = f.borrow_mut();
+        if let Some(&(protocol, port)) = f.get(&(qr.qr_qd as FileDescriptor)) {
+            // The listening socket's reference keeps the rule in place, so this can't fail.
+            if libos.rt().allow_port(protocol, port).is_ok() {
+                f.insert(accepted, (protocol, port));
+            }
+        }
+    })
+}
+
 //==============================================================================
 // connect
 //==============================================================================
@@ -234,12 +468,22 @@ fn catnip_connect(
 //==============================================================================
 
 fn catnip_close(qd: c_int) -> c_int {
-    with_libos(|libos| match libos.close(qd as FileDescriptor) {
-        Ok(..) => 0,
-        Err(e) => {
-            eprintln!("dmtr_close failed: {:?}", e);
-            e.errno()
-        },
+    let fd = qd as FileDescriptor;
+    DATAGRAM_QDS.with(|d| d.borrow_mut().remove(&fd));
+    let filtered = FILTERED_PORTS.with(|f| f.borrow_mut().remove(&fd));
+    with_libos(|libos| {
+        if let Some((protocol, port)) = filtered {
+            libos.rt().release_port(protocol, port);
+        }
+        datagram::forget(libos, fd);
+        framing::forget(libos, fd);
+        match libos.close(fd) {
+            Ok(..) => 0,
+            Err(e) => {
+                eprintln!("dmtr_close failed: {:?}", e);
+                e.errno()
+            },
+        }
     })
 }
 
@@ -252,12 +496,106 @@ fn catnip_push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray
         return libc::EINVAL;
     }
     let sga = unsafe { &*sga };
+    if !sga.is_valid() {
+        return libc::EINVAL;
+    }
+    let fd = qd as FileDescriptor;
+    let is_datagram = DATAGRAM_QDS.with(|d| d.borrow().contains(&fd));
+    // A framed queue sends the array behind its header, which lives here until the push has
+    // cloned it.
+    let mut header = dmtr_header_t::default();
+    let framed;
+    let sga = if framing::is_framed(fd) {
+        framed = match framing::frame(sga, &mut header) {
+            Ok(framed) => framed,
+            Err(e) => return e,
+        };
+        &framed
+    } else {
+        sga
+    };
     with_libos(|libos| {
-        unsafe { *qtok_out = libos.push(qd as FileDescriptor, sga).unwrap() };
-        0
+        let mm = libos.rt().memory_manager();
+        let has_headroom = if is_datagram {
+            mm.has_headroom(sga.segments().len())
+        } else {
+            mm.has_stream_headroom(sga.segments(), libos.rt().mss())
+        };
+        if !has_headroom {
+            return libc::EAGAIN;
+        }
+        // A datagram goes out as one packet, so its segments are coalesced. A stream pushes large
+        // segments from the body pool or a registered region on their own, so that they go out as
+        // chained `mbuf`s without a copy, and copies each run of segments between them (like a
+        // framed push's header, or a trailer) into one buffer rather than sending them in packets
+        // of their own. Pushes on a stream are queued in order, so the last token stands for the
+        // whole array.
+        //
+        // Every segment is cloned before the first push, so that the array goes out whole or not
+        // at all: the pushes that follow an accepted one go to the same connection in the same
+        // state, and have nothing left to allocate.
+        let bufs: Option<Vec<_>> = if is_datagram {
+            mm.clone_sgarray(sga).map(|buf| vec![buf])
+        } else {
+            let runs = stream_runs(&mm, sga.segments());
+            // Only the segments that go out without a copy can fail to clone, and copying a
+            // registered segment releases it, so they're cloned first.
+            let cloned: Option<Vec<_>> = runs
+                .iter()
+                .map(|run| match run {
+                    [seg] if mm.is_zero_copy(seg) => mm.clone_sgaseg(seg).map(Some),
+                    _ => Some(None),
+                })
+                .collect();
+            cloned.map(|cloned| {
+                runs.iter()
+                    .zip(cloned)
+                    .map(|(run, buf)| buf.unwrap_or_else(|| mm.copy_segments(run)))
+                    .collect()
+            })
+        };
+        let mut bufs = match bufs {
+            Some(bufs) => bufs,
+            None => return libc::EAGAIN,
+        };
+        let last = bufs.pop().unwrap();
+        let r: Result<_, Fail> = try {
+            for buf in bufs {
+                let qt = libos.push2(fd, buf)?;
+                libos.drop_qtoken(qt);
+            }
+            libos.push2(fd, last)?
+        };
+        match r {
+            Ok(qt) => {
+                unsafe { *qtok_out = qt };
+                0
+            },
+            Err(e) => {
+                eprintln!("dmtr_push failed: {:?}", e);
+                e.errno()
+            },
+        }
     })
 }
 
+/// Splits a stream push into the buffers it goes out in: each segment that can go out without a
+/// copy and is larger than `COALESCE_MAX_SIZE` on its own, and each run of segments between them
+/// together.
+fn stream_runs<'a>(mm: &MemoryManager, segments: &'a [dmtr_sgaseg_t]) -> Vec<&'a [dmtr_sgaseg_t]> {
+    let copied =
+        |seg: &dmtr_sgaseg_t| !mm.is_zero_copy(seg) || seg.sgaseg_len as usize <= COALESCE_MAX_SIZE;
+    let mut runs = vec![];
+    let mut start = 0;
+    for i in 1..=segments.len() {
+        if i == segments.len() || !copied(&segments[i - 1]) || !copied(&segments[i]) {
+            runs.push(&segments[start..i]);
+            start = i;
+        }
+    }
+    runs
+}
+
 //==============================================================================
 // pushto
 //==============================================================================
@@ -273,6 +611,9 @@ fn catnip_pushto(
         return libc::EINVAL;
     }
     let sga = unsafe { &*sga };
+    if !sga.is_valid() {
+        return libc::EINVAL;
+    }
     if saddr.is_null() {
         return libc::EINVAL;
     }
@@ -284,31 +625,101 @@ fn catnip_pushto(
     let port = ip::Port::try_from(u16::from_be(saddr_in.sin_port)).unwrap();
     let endpoint = ipv4::Endpoint::new(addr, port);
     with_libos(|libos| {
-        unsafe { *qtok_out = libos.pushto(qd as FileDescriptor, sga, endpoint).unwrap() };
+        let mm = libos.rt().memory_manager();
+        if !mm.has_headroom(sga.segments().len()) {
+            return libc::EAGAIN;
+        }
+        // Datagrams go out as a single packet, so multiple segments are coalesced here.
+        let buf = match mm.clone_sgarray(sga) {
+            Some(buf) => buf,
+            None => return libc::EAGAIN,
+        };
+        unsafe { *qtok_out = libos.pushto2(qd as FileDescriptor, buf, endpoint).unwrap() };
         0
     })
 }
 
+//==============================================================================
+// pushto_many
+//==============================================================================
+
+fn catnip_pushto_many(
+    num_pushed_out: *mut c_int,
+    qd: c_int,
+    sgas: *const dmtr_sgarray_t,
+    saddrs: *const sockaddr_in,
+    num: c_int,
+) -> c_int {
+    with_libos(|libos| {
+        let mm = libos.rt().memory_manager();
+        let ret = datagram::pushto_many_raw(libos, num_pushed_out, qd, sgas, saddrs, num, |sga| {
+            if mm.has_headroom(sga.segments().len()) {
+                mm.clone_sgarray(sga)
+            } else {
+                None
+            }
+        });
+        // Send the whole batch as one burst rather than waiting for the next poll.
+        libos.rt().flush_tx();
+        ret
+    })
+}
+
 //==============================================================================
 // pop
 //==============================================================================
 
 fn catnip_pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+    if let Some(qt) = framing::pop(qd as FileDescriptor) {
+        unsafe { *qtok_out = qt };
+        return 0;
+    }
     with_libos(|libos| {
         unsafe { *qtok_out = libos.pop(qd as FileDescriptor).unwrap() };
         0
     })
 }
 
+//==============================================================================
+// popfrom
+//==============================================================================
+
+fn catnip_popfrom(
+    num_out: *mut c_int,
+    qd: c_int,
+    sgas_out: *mut dmtr_sgarray_t,
+    saddrs_out: *mut sockaddr_in,
+    max: c_int,
+) -> c_int {
+    with_libos(|libos| datagram::popfrom_raw(libos, num_out, qd, sgas_out, saddrs_out, max))
+}
+
+//==============================================================================
+// set_framed
+//==============================================================================
+
+fn catnip_set_framed(qd: c_int, framed: c_int) -> c_int {
+    // Only a stream needs framing; a datagram is a message already.
+    if DATAGRAM_QDS.with(|d| d.borrow().contains(&(qd as FileDescriptor))) {
+        return libc::EINVAL;
+    }
+    framing::set_framed_raw(qd, framed)
+}
+
 //==============================================================================
 // poll
 //==============================================================================
 
 fn catnip_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    if framing::is_framed_token(qt) {
+        return with_libos(|libos| framing::poll_raw(libos, qr_out, qt));
+    }
     with_libos(|libos| match libos.poll(qt) {
         None => libc::EAGAIN,
         Some(r) => {
-            unsafe { *qr_out = r };
+            let qr: dmtr_qresult_t = r.into();
+            hold_accepted_port(libos, &qr);
+            unsafe { *qr_out = qr };
             0
         },
     })
@@ -319,6 +730,12 @@ fn catnip_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
 //==============================================================================
 
 fn catnip_drop(qt: dmtr_qtoken_t) -> c_int {
+    if framing::is_framed_token(qt) {
+        return match framing::drop_token(qt) {
+            Ok(()) => 0,
+            Err(e) => e,
+        };
+    }
     with_libos(|libos| {
         libos.drop_qtoken(qt);
         0
@@ -330,11 +747,16 @@ fn catnip_drop(qt: dmtr_qtoken_t) -> c_int {
 //==============================================================================
 
 fn catnip_wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    if framing::is_framed_token(qt) {
+        return with_libos(|libos| framing::wait_raw(libos, qr_out, qt));
+    }
     with_libos(|libos| {
         let (qd, r) = libos.wait2(qt);
+        let qr: dmtr_qresult_t =
+            catnip::interop::dmtr_qresult_t::pack(libos.rt(), r, qd, qt).into();
+        hold_accepted_port(libos, &qr);
         if !qr_out.is_null() {
-            let packed = dmtr_qresult_t::pack(libos.rt(), r, qd, qt);
-            unsafe { *qr_out = packed };
+            unsafe { *qr_out = qr };
         }
         0
     })
@@ -350,14 +772,49 @@ fn catnip_wait_any(
     qts: *mut dmtr_qtoken_t,
     num_qts: c_int,
 ) -> c_int {
-    let qts = unsafe { slice::from_raw_parts(qts, num_qts as usize) };
+    let mut num_ready: c_int = 0;
+    catnip_wait_many(
+        qr_out,
+        ready_offset,
+        &mut num_ready,
+        qts,
+        num_qts,
+        1,
+        ptr::null(),
+    )
+}
+
+//==============================================================================
+// wait_many
+//==============================================================================
+
+fn catnip_wait_many(
+    qrs_out: *mut dmtr_qresult_t,
+    ready_offsets: *mut c_int,
+    num_ready_out: *mut c_int,
+    qts: *mut dmtr_qtoken_t,
+    num_qts: c_int,
+    max_ready: c_int,
+    timeout: *const timespec,
+) -> c_int {
     with_libos(|libos| {
-        let (ix, qr) = libos.wait_any(qts);
-        unsafe {
-            *qr_out = qr;
-            *ready_offset = ix as c_int;
+        let ret = wait::wait_many_raw(
+            libos,
+            qrs_out,
+            ready_offsets,
+            num_ready_out,
+            qts,
+            num_qts,
+            max_ready,
+            timeout,
+        );
+        if ret == 0 {
+            let num_ready = unsafe { *num_ready_out } as usize;
+            for qr in unsafe { slice::from_raw_parts(qrs_out, num_ready) } {
+                hold_accepted_port(libos, qr);
+            }
         }
-        0
+        ret
     })
 }
 
@@ -366,7 +823,7 @@ fn catnip_wait_any(
 //==============================================================================
 
 fn catnip_sgaalloc(size: libc::size_t) -> dmtr_sgarray_t {
-    with_libos(|libos| libos.rt().alloc_sgarray(size))
+    with_libos(|libos| libos.rt().memory_manager().alloc_sgarray(size))
 }
 
 //==============================================================================
@@ -377,12 +834,34 @@ fn catnip_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
     if sga.is_null() {
         return 0;
     }
+    let sga = unsafe { *sga };
     with_libos(|libos| {
-        libos.rt().free_sgarray(unsafe { *sga });
+        if !framing::free(libos, &sga) {
+            libos.rt().memory_manager().free_sgarray(sga);
+        }
         0
     })
 }
 
+//==============================================================================
+// register_mem
+//==============================================================================
+
+fn catnip_register_mem(
+    ptr: *mut c_void,
+    len: libc::size_t,
+    free_cb: dmtr_free_cb_t,
+    free_arg: *mut c_void,
+) -> c_int {
+    with_libos(|libos| match libos.rt().register_mem(ptr, len, free_cb, free_arg) {
+        Ok(..) => 0,
+        Err(e) => {
+            eprintln!("dmtr_register_mem failed: {:?}", e);
+            libc::EINVAL
+        },
+    })
+}
+
 //==============================================================================
 // getsockname
 //==============================================================================
@@ -390,3 +869,24 @@ fn catnip_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
 fn catnip_getsockname(_qd: c_int, _saddr: *mut sockaddr, _size: *mut socklen_t) -> c_int {
     unimplemented!();
 }
+
+//==============================================================================
+// get_stats
+//==============================================================================
+
+fn catnip_get_stats(stats_out: *mut dmtr_stats_t) -> c_int {
+    let stats_out = unsafe { &mut *stats_out };
+    with_libos(|libos| {
+        let rt = libos.rt();
+        let memory_stats = rt.memory_stats();
+        stats_out.rx_sleeps = rt.rx_sleeps() as u64;
+        stats_out.tx_dropped = rt.tx_dropped() as u64;
+        stats_out.rx_filtered = rt.rx_filtered();
+        stats_out.header_pool_in_use = memory_stats.header_pool_in_use as u64;
+        stats_out.header_pool_size = memory_stats.header_pool_size as u64;
+        stats_out.body_pool_in_use = memory_stats.body_pool_in_use as u64;
+        stats_out.body_pool_size = memory_stats.body_pool_size as u64;
+        stats_out.alloc_failures = memory_stats.alloc_failures as u64;
+        0
+    })
+}
@@ -4,10 +4,7 @@ use catnip::{
         Bytes,
         BytesMut,
     },
-    interop::{
-        dmtr_sgarray_t,
-        dmtr_sgaseg_t,
-    },
+    interop::dmtr_sgaseg_t,
     protocols::{
         ethernet2::frame::ETHERNET2_HEADER_SIZE,
         ipv4::datagram::IPV4_HEADER_SIZE,
@@ -15,21 +12,35 @@ use catnip::{
     },
     runtime::RuntimeBuf,
 };
+use demikernel::{
+    config::Config,
+    interop::{
+        dmtr_free_cb_t,
+        dmtr_sgarray_t,
+        DMTR_SGARRAY_MAXSIZE,
+    },
+};
 use dpdk_rs::{
+    rte_eal_iova_mode,
     rte_errno,
+    rte_extmem_register,
+    rte_iova_mode_RTE_IOVA_VA,
     rte_mbuf,
+    rte_mbuf_ext_shared_info,
     rte_mempool,
+    rte_mempool_avail_count,
     rte_mempool_calc_obj_size,
     rte_mempool_mem_iter,
     rte_mempool_memhdr,
+    rte_mempool_in_use_count,
     rte_mempool_objsz,
     rte_pktmbuf_adj,
     rte_pktmbuf_alloc,
+    rte_pktmbuf_chain,
     rte_pktmbuf_clone,
     rte_pktmbuf_free,
     rte_pktmbuf_pool_create,
     rte_pktmbuf_trim,
-    rte_socket_id,
     rte_strerror,
 };
 use libc::{
@@ -37,6 +48,10 @@ use libc::{
     c_void,
 };
 use std::{
+    cell::{
+        Cell,
+        RefCell,
+    },
     ffi::CString,
     mem,
     ops::Deref,
@@ -47,6 +62,23 @@ use std::{
 
 const _RTE_PKTMBUF_HEADROOM: usize = 128;
 
+// Let DPDK pick the NUMA node, for when the port's node is unknown.
+pub const SOCKET_ID_ANY: i32 = -1;
+
+// `dmtr_push` reports `EAGAIN` unless at least this many buffers would be left in each pool after
+// the push, leaving room for retransmissions, control segments and receives.
+const POOL_LOW_WATERMARK: usize = 64;
+
+// The stack clones and splits `mbuf`s through traits that can't fail, out of the indirect `mbuf`s
+// `has_headroom` holds back from pushes, and copies them into body `mbuf`s once those run out.
+const POOLS_EXHAUSTED: &str = "Indirect and body pools exhausted";
+
+// `rte_mbuf` flag for an `mbuf` attached to an external buffer.
+const EXT_ATTACHED_MBUF: u64 = 1 << 61;
+
+// Lengths within an `mbuf` are 16 bits, so larger segments of a registered region are copied.
+const MAX_EXTERNAL_SEGMENT_SIZE: usize = u16::MAX as usize;
+
 #[derive(Clone, Copy, Debug)]
 pub struct MemoryConfig {
     /// What is the cutoff point for copying application buffers into reserved body space within a
@@ -68,6 +100,9 @@ pub struct MemoryConfig {
 
     /// How many buffers should remain within `rte_mempool`'s per-thread cache?
     pub cache_size: usize,
+
+    /// Which NUMA node should the pools be allocated on? This should be the NIC's.
+    pub socket_id: i32,
 }
 
 impl Default for MemoryConfig {
@@ -79,10 +114,46 @@ impl Default for MemoryConfig {
             max_body_size: 8320,
             body_pool_size: 8191,
             cache_size: 250,
+            socket_id: SOCKET_ID_ANY,
+        }
+    }
+}
+
+impl MemoryConfig {
+    /// Default configuration, with any pool parameters given in the `dpdk.mempool` section of the
+    /// config file applied on top.
+    pub fn from_config(config: &Config) -> Self {
+        let mut memory_config = Self::default();
+        let params = [
+            ("inline_body_size", &mut memory_config.inline_body_size),
+            ("header_pool_size", &mut memory_config.header_pool_size),
+            ("indirect_pool_size", &mut memory_config.indirect_pool_size),
+            ("body_pool_size", &mut memory_config.body_pool_size),
+            ("cache_size", &mut memory_config.cache_size),
+        ];
+        for (name, value) in params {
+            if let Some(v) = config.mempool_param(name) {
+                *value = v;
+            }
         }
+        memory_config
     }
 }
 
+/// Occupancy of a queue's pools, for monitoring.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct MemoryStats {
+    pub header_pool_in_use: usize,
+    pub header_pool_size: usize,
+    pub indirect_pool_in_use: usize,
+    pub indirect_pool_size: usize,
+    pub body_pool_in_use: usize,
+    pub body_pool_size: usize,
+
+    /// How many allocations failed because a pool was empty?
+    pub alloc_failures: usize,
+}
+
 #[derive(Clone, Debug)]
 pub struct MemoryManager {
     inner: Rc<Inner>,
@@ -90,23 +161,33 @@ pub struct MemoryManager {
 
 impl MemoryManager {
     pub fn new(config: MemoryConfig) -> Result<Self, Error> {
+        Self::new_for_queue(config, 0)
+    }
+
+    /// Create the pools backing a single RX/TX queue pair. Pool names are suffixed with the queue
+    /// id, since `rte_mempool`s live in a process-wide namespace.
+    pub fn new_for_queue(config: MemoryConfig, queue_id: u16) -> Result<Self, Error> {
         Ok(Self {
-            inner: Rc::new(Inner::new(config)?),
+            inner: Rc::new(Inner::new(config, queue_id)?),
         })
     }
 
-    fn clone_mbuf(&self, mbuf: &Mbuf) -> Mbuf {
-        Mbuf {
-            ptr: self.inner.clone_mbuf(mbuf.ptr),
+    fn clone_mbuf(&self, mbuf: &Mbuf) -> Option<Mbuf> {
+        Some(Mbuf {
+            ptr: self.inner.clone_mbuf(mbuf.ptr)?,
             mm: self.clone(),
-        }
+        })
     }
 
     /// Given a pointer and length into a body `mbuf`, return a fresh indirect `mbuf` that points to
-    /// the same memory region, incrementing the refcount of the body `mbuf`.
-    pub fn clone_body(&self, ptr: *mut c_void, len: usize) -> Result<Mbuf, Error> {
+    /// the same memory region, incrementing the refcount of the body `mbuf`. Returns `None` if the
+    /// indirect pool is empty.
+    pub fn clone_body(&self, ptr: *mut c_void, len: usize) -> Result<Option<Mbuf>, Error> {
         let mbuf_ptr = self.recover_body_mbuf(ptr)?;
-        let body_clone = self.inner.clone_mbuf(mbuf_ptr);
+        let body_clone = match self.inner.clone_mbuf(mbuf_ptr) {
+            Some(body_clone) => body_clone,
+            None => return Ok(None),
+        };
 
         // Wrap the mbuf first so we free it on early exit.
         let mut mbuf = Mbuf {
@@ -139,7 +220,7 @@ impl MemoryManager {
         mbuf.adjust(adjust);
         mbuf.trim(trim);
 
-        Ok(mbuf)
+        Ok(Some(mbuf))
     }
 
     fn recover_body_mbuf(&self, ptr: *mut c_void) -> Result<*mut rte_mbuf, Error> {
@@ -170,17 +251,18 @@ impl MemoryManager {
     }
 
     pub fn into_sgarray(&self, buf: DPDKBuf) -> dmtr_sgarray_t {
-        let sgaseg = match buf {
+        let mut sga = dmtr_sgarray_t::empty();
+        match buf {
             DPDKBuf::External(bytes) => {
-                // We have to do a copy here since `Bytes` uses an `Arc<[u8]>` internally and has
-                // some additional bookkeeping for an offset and length, but we want to be able to
-                // hand off a raw pointer up the application that they can free later.
-                let buf_copy: Box<[u8]> = (&bytes[..]).into();
-                let ptr = Box::into_raw(buf_copy);
-                dmtr_sgaseg_t {
-                    sgaseg_buf: ptr as *mut _,
+                // `Bytes` uses an `Arc<[u8]>` internally, so we can't hand its storage to the
+                // application directly. Instead, we point the segment into it and keep the
+                // `Bytes` alive in `sga_buf` until the application frees the array.
+                let sgaseg = dmtr_sgaseg_t {
+                    sgaseg_buf: bytes.as_ptr() as *mut _,
                     sgaseg_len: bytes.len() as u32,
-                }
+                };
+                sga.sga_buf = Box::into_raw(Box::new(bytes)) as *mut _;
+                sga.push_segment(sgaseg).unwrap();
             },
             DPDKBuf::Managed(mbuf) => {
                 let sgaseg = dmtr_sgaseg_t {
@@ -188,111 +270,345 @@ impl MemoryManager {
                     sgaseg_len: mbuf.len() as u32,
                 };
                 mem::forget(mbuf);
-                sgaseg
+                sga.push_segment(sgaseg).unwrap();
             },
-        };
-        dmtr_sgarray_t {
-            sga_buf: ptr::null_mut(),
-            sga_numsegs: 1,
-            sga_segs: [sgaseg],
-            sga_addr: unsafe { mem::zeroed() },
         }
+        sga
     }
 
     pub fn alloc_header_mbuf(&self) -> Mbuf {
-        let mbuf_ptr = unsafe { rte_pktmbuf_alloc(self.inner.header_pool) };
-        assert!(!mbuf_ptr.is_null());
+        self.try_alloc_header_mbuf().expect("Header pool exhausted")
+    }
+
+    /// Allocate a header `mbuf`, or `None` if the header pool is empty.
+    pub fn try_alloc_header_mbuf(&self) -> Option<Mbuf> {
+        let mbuf_ptr = self.inner.alloc(self.inner.header_pool)?;
         unsafe {
             let num_bytes = (*mbuf_ptr).buf_len - (*mbuf_ptr).data_off;
             (*mbuf_ptr).data_len = num_bytes as u16;
             (*mbuf_ptr).pkt_len = num_bytes as u32;
         }
-        Mbuf {
+        Some(Mbuf {
             ptr: mbuf_ptr,
             mm: self.clone(),
-        }
+        })
     }
 
     pub fn alloc_body_mbuf(&self) -> Mbuf {
-        let mbuf_ptr = unsafe { rte_pktmbuf_alloc(self.inner.body_pool) };
-        assert!(!mbuf_ptr.is_null());
+        self.try_alloc_body_mbuf().expect("Body pool exhausted")
+    }
+
+    /// Allocate a body `mbuf`, or `None` if the body pool is empty.
+    pub fn try_alloc_body_mbuf(&self) -> Option<Mbuf> {
+        let mbuf_ptr = self.inner.alloc(self.inner.body_pool)?;
         unsafe {
             let num_bytes = (*mbuf_ptr).buf_len - (*mbuf_ptr).data_off;
             (*mbuf_ptr).data_len = num_bytes as u16;
             (*mbuf_ptr).pkt_len = num_bytes as u32;
         }
-        Mbuf {
+        Some(Mbuf {
             ptr: mbuf_ptr,
             mm: self.clone(),
+        })
+    }
+
+    /// Copy `buf` into body `mbuf`s, chaining as many as it takes. Returns `None` if the body pool
+    /// runs dry.
+    pub fn try_copy_to_body_mbufs(&self, buf: &[u8]) -> Option<Mbuf> {
+        let mut head: Option<Mbuf> = None;
+        for chunk in buf.chunks(self.inner.config.max_body_size - _RTE_PKTMBUF_HEADROOM) {
+            let mut mbuf = self.try_alloc_body_mbuf()?;
+            unsafe { mbuf.slice_mut()[..chunk.len()].copy_from_slice(chunk) };
+            mbuf.trim(mbuf.len() - chunk.len());
+            match head {
+                None => head = Some(mbuf),
+                Some(ref mut head) => unsafe {
+                    assert_eq!(rte_pktmbuf_chain(head.ptr(), mbuf.into_raw()), 0);
+                },
+            }
         }
+        head
     }
 
+    /// Copy `buf` into a fresh body `mbuf` chain, for when the indirect pool can't provide a clone.
+    /// The stack never writes to a buffer it has cloned, so a copy does as well.
+    fn copy_mbuf(&self, buf: &[u8]) -> Option<Mbuf> {
+        if buf.is_empty() {
+            let mut mbuf = self.try_alloc_body_mbuf()?;
+            mbuf.trim(mbuf.len());
+            return Some(mbuf);
+        }
+        self.try_copy_to_body_mbufs(buf)
+    }
+
+    /// Allocate a scatter-gather array of `size` bytes. Sizes that don't fit in a single body
+    /// `mbuf` are split across several, one per segment. Returns an empty array if `size` is too
+    /// large or the body pool runs dry.
     pub fn alloc_sgarray(&self, size: usize) -> dmtr_sgarray_t {
-        assert!(size <= self.inner.config.max_body_size);
+        let max_seg_size = self.inner.config.max_body_size - _RTE_PKTMBUF_HEADROOM;
+        let mut sga = dmtr_sgarray_t::empty();
+        if size > max_seg_size * DMTR_SGARRAY_MAXSIZE {
+            return sga;
+        }
 
-        let sgaseg = if self.inner.config.inline_body_size < size
-            && size <= self.inner.config.max_body_size
-        {
-            let mbuf_ptr = unsafe { rte_pktmbuf_alloc(self.inner.body_pool) };
-            assert!(!mbuf_ptr.is_null());
-            unsafe {
+        if size <= self.inner.config.inline_body_size {
+            let allocation: Box<[u8]> = unsafe { Box::new_uninit_slice(size).assume_init() };
+            let ptr = Box::into_raw(allocation);
+            let sgaseg = dmtr_sgaseg_t {
+                sgaseg_buf: ptr as *mut _,
+                sgaseg_len: size as u32,
+            };
+            sga.push_segment(sgaseg).unwrap();
+            return sga;
+        }
+
+        let mut remaining = size;
+        while remaining > 0 {
+            let seg_size = remaining.min(max_seg_size);
+            let mbuf_ptr = match self.inner.alloc(self.inner.body_pool) {
+                Some(mbuf_ptr) => mbuf_ptr,
+                None => {
+                    self.free_sgarray(sga);
+                    return dmtr_sgarray_t::empty();
+                },
+            };
+            let sgaseg = unsafe {
                 let num_bytes = (*mbuf_ptr).buf_len - (*mbuf_ptr).data_off;
                 // We don't strictly have to set these fields, since we don't directly hand off body
                 // `mbuf`s to `rte_eth_tx_burst`, but it's nice to have the original allocation size around.
-                assert!(size as u16 <= num_bytes);
-                (*mbuf_ptr).data_len = size as u16;
-                (*mbuf_ptr).pkt_len = size as u32;
+                assert!(seg_size as u16 <= num_bytes);
+                (*mbuf_ptr).data_len = seg_size as u16;
+                (*mbuf_ptr).pkt_len = seg_size as u32;
                 let buf_ptr = (*mbuf_ptr).buf_addr as *mut u8;
                 let data_ptr = buf_ptr.offset((*mbuf_ptr).data_off as isize);
                 dmtr_sgaseg_t {
                     sgaseg_buf: data_ptr as *mut _,
-                    sgaseg_len: size as u32,
+                    sgaseg_len: seg_size as u32,
                 }
-            }
-        } else {
-            let allocation: Box<[u8]> = unsafe { Box::new_uninit_slice(size).assume_init() };
-            let ptr = Box::into_raw(allocation);
-            dmtr_sgaseg_t {
-                sgaseg_buf: ptr as *mut _,
-                sgaseg_len: size as u32,
-            }
-        };
-        dmtr_sgarray_t {
-            sga_buf: ptr::null_mut(),
-            sga_numsegs: 1,
-            sga_segs: [sgaseg],
-            sga_addr: unsafe { mem::zeroed() },
+            };
+            sga.push_segment(sgaseg).unwrap();
+            remaining -= seg_size;
         }
+        sga
     }
 
     pub fn free_sgarray(&self, sga: dmtr_sgarray_t) {
-        assert_eq!(sga.sga_numsegs, 1);
-        let sgaseg = sga.sga_segs[0];
+        // Popped data that isn't in an `mbuf` is owned by the `Bytes` in `sga_buf`.
+        if !sga.sga_buf.is_null() {
+            drop(unsafe { Box::from_raw(sga.sga_buf as *mut Bytes) });
+            return;
+        }
+        for sgaseg in sga.segments() {
+            let (ptr, len) = (sgaseg.sgaseg_buf, sgaseg.sgaseg_len as usize);
+
+            if self.is_body_ptr(ptr) {
+                let mbuf_ptr = self.recover_body_mbuf(ptr).expect("Invalid sga pointer");
+                unsafe { rte_pktmbuf_free(mbuf_ptr) };
+            } else {
+                let allocation: Box<[u8]> =
+                    unsafe { Box::from_raw(slice::from_raw_parts_mut(ptr as *mut _, len)) };
+                drop(allocation);
+            }
+        }
+    }
+
+    /// Clone a single segment into a buffer for the networking stack. Segments in the body pool
+    /// are cloned into an indirect `mbuf`, and segments in a registered region are attached to one
+    /// as an external buffer, both without copying. Returns `None` if the indirect pool is empty.
+    pub fn clone_sgaseg(&self, sgaseg: &dmtr_sgaseg_t) -> Option<DPDKBuf> {
         let (ptr, len) = (sgaseg.sgaseg_buf, sgaseg.sgaseg_len as usize);
 
         if self.is_body_ptr(ptr) {
-            let mbuf_ptr = self.recover_body_mbuf(ptr).expect("Invalid sga pointer");
-            unsafe { rte_pktmbuf_free(mbuf_ptr) };
-        } else {
-            let allocation: Box<[u8]> =
-                unsafe { Box::from_raw(slice::from_raw_parts_mut(ptr as *mut _, len)) };
-            drop(allocation);
+            let mbuf = self.clone_body(ptr, len).expect("Invalid sga pointer")?;
+            return Some(DPDKBuf::Managed(mbuf));
         }
+        if let Some(ref region) = self.find_external(ptr, len) {
+            if len <= MAX_EXTERNAL_SEGMENT_SIZE {
+                return Some(DPDKBuf::Managed(self.attach_external(region, ptr, len)?));
+            }
+        }
+        Some(self.copy_segments(slice::from_ref(sgaseg)))
     }
 
-    pub fn clone_sgarray(&self, sga: &dmtr_sgarray_t) -> DPDKBuf {
-        assert_eq!(sga.sga_numsegs, 1);
-        let sgaseg = sga.sga_segs[0];
+    /// Does `clone_sgaseg` hand this segment to the stack without copying it?
+    pub fn is_zero_copy(&self, sgaseg: &dmtr_sgaseg_t) -> bool {
         let (ptr, len) = (sgaseg.sgaseg_buf, sgaseg.sgaseg_len as usize);
+        self.is_body_ptr(ptr)
+            || (len <= MAX_EXTERNAL_SEGMENT_SIZE && self.find_external(ptr, len).is_some())
+    }
 
-        if self.is_body_ptr(ptr) {
-            let mbuf = self.clone_body(ptr, len).expect("Invalid sga pointer");
-            DPDKBuf::Managed(mbuf)
-        } else {
-            let mut buf = BytesMut::zeroed(len).unwrap();
-            let seg_slice = unsafe { slice::from_raw_parts(ptr as *const u8, len) };
-            buf.copy_from_slice(seg_slice);
-            DPDKBuf::External(buf.freeze())
+    /// Clone a scatter-gather array into a single contiguous buffer. This only avoids the copy for
+    /// single-segment arrays; callers that can send segments separately (e.g. on a stream socket)
+    /// should use `clone_sgaseg` on each segment instead.
+    pub fn clone_sgarray(&self, sga: &dmtr_sgarray_t) -> Option<DPDKBuf> {
+        if let [sgaseg] = sga.segments() {
+            return self.clone_sgaseg(sgaseg);
+        }
+        Some(self.copy_sgarray(sga))
+    }
+
+    /// Copy a scatter-gather array into a single contiguous buffer, which takes nothing from the
+    /// pools.
+    pub fn copy_sgarray(&self, sga: &dmtr_sgarray_t) -> DPDKBuf {
+        self.copy_segments(sga.segments())
+    }
+
+    /// Copy consecutive segments into a single contiguous buffer. A registered segment is done
+    /// with as soon as it's copied.
+    pub fn copy_segments(&self, segments: &[dmtr_sgaseg_t]) -> DPDKBuf {
+        let len = segments.iter().map(|s| s.sgaseg_len as usize).sum();
+        let mut buf = BytesMut::zeroed(len).unwrap();
+        let mut offset = 0;
+        for sgaseg in segments {
+            let len = sgaseg.sgaseg_len as usize;
+            let seg_slice = unsafe { slice::from_raw_parts(sgaseg.sgaseg_buf as *const u8, len) };
+            buf[offset..(offset + len)].copy_from_slice(seg_slice);
+            offset += len;
+            if let Some(region) = self.find_external(sgaseg.sgaseg_buf, len) {
+                region.release(sgaseg.sgaseg_buf);
+            }
+        }
+        DPDKBuf::External(buf.freeze())
+    }
+
+    /// Register a region of application memory with DPDK, so that segments within it can be
+    /// attached to `mbuf`s as external buffers instead of being copied. The region must be page
+    /// aligned. `free_cb` is called once the last `mbuf` pointing at a pushed segment is freed.
+    pub fn register_external(
+        &self,
+        ptr: *mut c_void,
+        len: usize,
+        free_cb: dmtr_free_cb_t,
+        free_arg: *mut c_void,
+    ) -> Result<(), Error> {
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+        if ptr.is_null() || len == 0 {
+            anyhow::bail!("Empty memory region");
+        }
+        // We hand segments to the NIC at their virtual address, which is only their IO address
+        // when the EAL maps IOVA-as-VA.
+        if unsafe { rte_eal_iova_mode() } != rte_iova_mode_RTE_IOVA_VA {
+            anyhow::bail!("Registering memory requires IOVA-as-VA mode (`--iova-mode=va`)");
+        }
+        if ptr as usize % page_size != 0 || len % page_size != 0 {
+            anyhow::bail!("Memory region {:?}+{} isn't page aligned", ptr, len);
+        }
+        let (start, end) = (ptr as usize, ptr as usize + len);
+        let mut regions = self.inner.external_regions.borrow_mut();
+        if regions.iter().any(|r| start < r.addr + r.len && r.addr < end) {
+            anyhow::bail!("Memory region {:?}+{} is already registered", ptr, len);
+        }
+
+        // The EAL's table of external memory is process-wide, so another queue may have registered
+        // this region already.
+        let ret = unsafe { rte_extmem_register(ptr, len as _, ptr::null_mut(), 0, page_size as _) };
+        if ret != 0 && unsafe { rte_errno() } != libc::EEXIST {
+            let reason = unsafe { std::ffi::CStr::from_ptr(rte_strerror(rte_errno())) };
+            anyhow::bail!("Failed to register memory: {}", reason.to_str().unwrap())
+        }
+
+        regions.push(ExternalRegion {
+            addr: start,
+            len,
+            free_cb,
+            free_arg,
+        });
+        Ok(())
+    }
+
+    /// The registered region `ptr`+`len` lies in, if any.
+    fn find_external(&self, ptr: *mut c_void, len: usize) -> Option<ExternalRegion> {
+        let (start, end) = (ptr as usize, ptr as usize + len);
+        self.inner
+            .external_regions
+            .borrow()
+            .iter()
+            .find(|r| r.addr <= start && end <= r.addr + r.len)
+            .copied()
+    }
+
+    /// Attach a segment of a registered region to a fresh `mbuf`, as `rte_pktmbuf_attach_extbuf`
+    /// would (it's inline, so bindgen doesn't generate it). Each segment gets its own shared info
+    /// so that the application hears back about every segment it pushed.
+    fn attach_external(
+        &self,
+        region: &ExternalRegion,
+        ptr: *mut c_void,
+        len: usize,
+    ) -> Option<Mbuf> {
+        let mbuf_ptr = self.inner.alloc_indirect_empty()?;
+        let segment = Box::into_raw(Box::new(ExternalSegment {
+            shinfo: unsafe { mem::zeroed() },
+            free_cb: region.free_cb,
+            free_arg: region.free_arg,
+        }));
+        unsafe {
+            (*segment).shinfo.free_cb = Some(free_external_segment);
+            (*segment).shinfo.fcb_opaque = segment as *mut c_void;
+            (*segment).shinfo.refcnt = 1;
+
+            // `register_external` only accepts regions when the EAL maps IOVA-as-VA.
+            (*mbuf_ptr).buf_addr = ptr;
+            (*mbuf_ptr).__bindgen_anon_1.buf_iova = ptr as u64;
+            (*mbuf_ptr).buf_len = len as u16;
+            (*mbuf_ptr).data_off = 0;
+            (*mbuf_ptr).data_len = len as u16;
+            (*mbuf_ptr).pkt_len = len as u32;
+            (*mbuf_ptr).ol_flags |= EXT_ATTACHED_MBUF;
+            (*mbuf_ptr).shinfo = &mut (*segment).shinfo;
+        }
+        Some(Mbuf {
+            ptr: mbuf_ptr,
+            mm: self.clone(),
+        })
+    }
+
+    /// Are there enough buffers left to push `num_segments` more segments as datagrams? This is
+    /// checked before a push, so that applications back off while the pools drain instead of us
+    /// running dry in the middle of transmitting. Each segment may take a header and an indirect
+    /// `mbuf`, and the body pool has to keep feeding the RX queue for acknowledgements to get in.
+    pub fn has_headroom(&self, num_segments: usize) -> bool {
+        self.has_headroom_for(num_segments, num_segments)
+    }
+
+    /// Are there enough buffers left to push `segments` on a stream that's segmented at `mss`?
+    /// Each packet a segment goes out in takes a header, and a segment that isn't copied is split
+    /// into an indirect `mbuf` per packet, each of which is cloned again to keep until it's
+    /// acknowledged. A push that needs more than the whole indirect pool waits for it to be idle.
+    pub fn has_stream_headroom(&self, segments: &[dmtr_sgaseg_t], mss: usize) -> bool {
+        let (mut num_headers, mut num_indirect) = (0, 0);
+        for sgaseg in segments {
+            let num_packets = std::cmp::max((sgaseg.sgaseg_len as usize + mss - 1) / mss, 1);
+            num_headers += num_packets;
+            if self.is_zero_copy(sgaseg) {
+                num_indirect += 2 * num_packets;
+            }
+        }
+        let indirect_capacity = self
+            .inner
+            .config
+            .indirect_pool_size
+            .saturating_sub(POOL_LOW_WATERMARK);
+        self.has_headroom_for(num_headers, std::cmp::min(num_indirect, indirect_capacity))
+    }
+
+    fn has_headroom_for(&self, num_headers: usize, num_indirect: usize) -> bool {
+        let avail = |pool| unsafe { rte_mempool_avail_count(pool) } as usize;
+        avail(self.inner.header_pool) >= num_headers + POOL_LOW_WATERMARK
+            && avail(self.inner.indirect_pool) >= num_indirect + POOL_LOW_WATERMARK
+            && avail(self.inner.body_pool) >= POOL_LOW_WATERMARK
+    }
+
+    pub fn stats(&self) -> MemoryStats {
+        let in_use = |pool| unsafe { rte_mempool_in_use_count(pool) } as usize;
+        MemoryStats {
+            header_pool_in_use: in_use(self.inner.header_pool),
+            header_pool_size: self.inner.config.header_pool_size,
+            indirect_pool_in_use: in_use(self.inner.indirect_pool),
+            indirect_pool_size: self.inner.config.indirect_pool_size,
+            body_pool_in_use: in_use(self.inner.body_pool),
+            body_pool_size: self.inner.config.body_pool_size,
+            alloc_failures: self.inner.alloc_failures.get(),
         }
     }
 
@@ -330,10 +646,48 @@ struct Inner {
     //
     body_region_addr: usize,
     body_region_len: usize,
+
+    // Application memory registered for zero-copy pushes.
+    external_regions: RefCell<Vec<ExternalRegion>>,
+
+    alloc_failures: Cell<usize>,
+}
+
+#[derive(Clone, Copy, Debug)]
+struct ExternalRegion {
+    addr: usize,
+    len: usize,
+    free_cb: dmtr_free_cb_t,
+    free_arg: *mut c_void,
+}
+
+// Shared info for a single pushed segment of a registered region. `shinfo` must come first, since
+// DPDK hands the callback a pointer to it.
+#[repr(C)]
+struct ExternalSegment {
+    shinfo: rte_mbuf_ext_shared_info,
+    free_cb: dmtr_free_cb_t,
+    free_arg: *mut c_void,
+}
+
+impl ExternalRegion {
+    /// Tell the application we're done with the segment at `ptr`.
+    fn release(&self, ptr: *mut c_void) {
+        if let Some(free_cb) = self.free_cb {
+            unsafe { free_cb(ptr, self.free_arg) };
+        }
+    }
+}
+
+extern "C" fn free_external_segment(addr: *mut c_void, opaque: *mut c_void) {
+    let segment = unsafe { Box::from_raw(opaque as *mut ExternalSegment) };
+    if let Some(free_cb) = segment.free_cb {
+        unsafe { free_cb(addr, segment.free_arg) };
+    }
 }
 
 impl Inner {
-    fn new(config: MemoryConfig) -> Result<Self, Error> {
+    fn new(config: MemoryConfig, queue_id: u16) -> Result<Self, Error> {
         let header_size = ETHERNET2_HEADER_SIZE + IPV4_HEADER_SIZE + MAX_TCP_HEADER_SIZE;
         let header_mbuf_size = header_size + config.inline_body_size;
         let priv_size = 0;
@@ -342,14 +696,14 @@ impl Inner {
             "Private data isn't supported (it adds another region between `rte_mbuf` and data)"
         );
         let header_pool = unsafe {
-            let name = CString::new("header_pool")?;
+            let name = CString::new(format!("header_pool_{}", queue_id))?;
             rte_pktmbuf_pool_create(
                 name.as_ptr(),
                 config.header_pool_size as u32,
                 config.cache_size as u32,
                 priv_size,
                 header_mbuf_size as u16,
-                rte_socket_id() as i32,
+                config.socket_id,
             )
         };
         if header_pool.is_null() {
@@ -358,7 +712,7 @@ impl Inner {
         }
 
         let indirect_pool = unsafe {
-            let name = CString::new("indirect_pool")?;
+            let name = CString::new(format!("indirect_pool_{}", queue_id))?;
             rte_pktmbuf_pool_create(
                 name.as_ptr(),
                 config.indirect_pool_size as u32,
@@ -367,7 +721,7 @@ impl Inner {
                 // These mbufs have no body -- they're just for indirect mbufs to point to
                 // allocations from the body pool.
                 0,
-                rte_socket_id() as i32,
+                config.socket_id,
             )
         };
         if indirect_pool.is_null() {
@@ -375,14 +729,14 @@ impl Inner {
         }
 
         let body_pool = unsafe {
-            let name = CString::new("body_pool")?;
+            let name = CString::new(format!("body_pool_{}", queue_id))?;
             rte_pktmbuf_pool_create(
                 name.as_ptr(),
                 config.body_pool_size as u32,
                 config.cache_size as u32,
                 priv_size,
                 config.max_body_size as u16,
-                rte_socket_id() as i32,
+                config.socket_id,
             )
         };
         if body_pool.is_null() {
@@ -445,6 +799,10 @@ impl Inner {
 
             body_region_addr: base_addr,
             body_region_len: total_len,
+
+            external_regions: RefCell::new(vec![]),
+
+            alloc_failures: Cell::new(0),
         })
     }
 
@@ -452,16 +810,26 @@ impl Inner {
         64 + 128 + self.config.max_body_size
     }
 
-    fn alloc_indirect_empty(&self) -> *mut rte_mbuf {
-        let ptr = unsafe { rte_pktmbuf_alloc(self.indirect_pool) };
-        assert!(!ptr.is_null());
-        ptr
+    fn alloc(&self, pool: *mut rte_mempool) -> Option<*mut rte_mbuf> {
+        let ptr = unsafe { rte_pktmbuf_alloc(pool) };
+        if ptr.is_null() {
+            self.alloc_failures.set(self.alloc_failures.get() + 1);
+            return None;
+        }
+        Some(ptr)
     }
 
-    fn clone_mbuf(&self, ptr: *mut rte_mbuf) -> *mut rte_mbuf {
+    fn alloc_indirect_empty(&self) -> Option<*mut rte_mbuf> {
+        self.alloc(self.indirect_pool)
+    }
+
+    fn clone_mbuf(&self, ptr: *mut rte_mbuf) -> Option<*mut rte_mbuf> {
         let ptr = unsafe { rte_pktmbuf_clone(ptr, self.indirect_pool) };
-        assert!(!ptr.is_null());
-        ptr
+        if ptr.is_null() {
+            self.alloc_failures.set(self.alloc_failures.get() + 1);
+            return None;
+        }
+        Some(ptr)
     }
 }
 
@@ -491,9 +859,12 @@ impl Mbuf {
     pub fn split(self, ix: usize) -> (Self, Self) {
         let n = self.len();
         if ix == n {
-            let empty = Self {
-                ptr: self.mm.inner.alloc_indirect_empty(),
-                mm: self.mm.clone(),
+            let empty = match self.mm.inner.alloc_indirect_empty() {
+                Some(ptr) => Self {
+                    ptr,
+                    mm: self.mm.clone(),
+                },
+                None => self.mm.copy_mbuf(&[]).expect(POOLS_EXHAUSTED),
             };
             return (self, empty);
         }
@@ -517,10 +888,50 @@ impl Mbuf {
         unsafe { (*self.ptr).data_len as usize }
     }
 
+    /// Length of the whole chain of `mbuf`s.
+    pub fn pkt_len(&self) -> usize {
+        unsafe { (*self.ptr).pkt_len as usize }
+    }
+
+    /// Data of each `mbuf` in the chain, in order.
+    pub fn segments(&self) -> impl Iterator<Item = &[u8]> + '_ {
+        let mut seg = self.ptr;
+        std::iter::from_fn(move || {
+            if seg.is_null() {
+                return None;
+            }
+            unsafe {
+                let data_ptr = ((*seg).buf_addr as *mut u8).offset((*seg).data_off as isize);
+                let data = slice::from_raw_parts(data_ptr, (*seg).data_len as usize);
+                seg = (*seg).next;
+                Some(data)
+            }
+        })
+    }
+
     pub unsafe fn slice_mut(&mut self) -> &mut [u8] {
         slice::from_raw_parts_mut(self.data_ptr(), self.len())
     }
 
+    /// Copy a chain of `mbuf`s into a single contiguous buffer.
+    pub fn linearize(self) -> Bytes {
+        let pkt_len = unsafe { (*self.ptr).pkt_len as usize };
+        let mut buf = BytesMut::zeroed(pkt_len).unwrap();
+        let mut pos = 0;
+        let mut seg = self.ptr;
+        while !seg.is_null() {
+            unsafe {
+                let data_ptr = ((*seg).buf_addr as *mut u8).offset((*seg).data_off as isize);
+                let data_len = (*seg).data_len as usize;
+                let data = slice::from_raw_parts(data_ptr, data_len);
+                buf[pos..(pos + data_len)].copy_from_slice(data);
+                pos += data_len;
+                seg = (*seg).next;
+            }
+        }
+        buf.freeze()
+    }
+
     pub fn into_raw(mut self) -> *mut rte_mbuf {
         mem::replace(&mut self.ptr, ptr::null_mut())
     }
@@ -532,7 +943,10 @@ impl Mbuf {
 
 impl Clone for Mbuf {
     fn clone(&self) -> Self {
-        self.mm.clone_mbuf(self)
+        self.mm
+            .clone_mbuf(self)
+            .or_else(|| self.mm.copy_mbuf(&self[..]))
+            .expect(POOLS_EXHAUSTED)
     }
 }
 
@@ -672,7 +1086,7 @@ mod tests {
         let data_ptr = unsafe { prefix.data_ptr().offset(10) as *mut libc::c_void };
         let data_len = 17;
 
-        let cloned_mbuf = mm.clone_body(data_ptr, data_len).unwrap();
+        let cloned_mbuf = mm.clone_body(data_ptr, data_len).unwrap().unwrap();
         assert_eq!(cloned_mbuf[0], 32);
         assert_eq!(cloned_mbuf.len(), 17);
         assert_eq!(unsafe { (*cloned_mbuf.ptr).ol_flags }, 1 << 62);
@@ -1,19 +1,35 @@
-use crate::memory::{
-    DPDKBuf,
-    Mbuf,
-    MemoryManager,
+use crate::{
+    flow::{
+        FlowFilter,
+        Protocol,
+    },
+    memory::{
+        DPDKBuf,
+        Mbuf,
+        MemoryManager,
+        MemoryStats,
+    },
 };
+use anyhow::Error;
 use arrayvec::ArrayVec;
 use catnip::{
     self,
+    collections::bytes::BytesMut,
     interop::dmtr_sgarray_t,
     protocols::{
         arp,
         ethernet2::{
-            frame::MIN_PAYLOAD_SIZE,
+            frame::{
+                ETHERNET2_HEADER_SIZE,
+                MIN_PAYLOAD_SIZE,
+            },
             MacAddress,
         },
-        tcp,
+        ipv4::datagram::IPV4_HEADER_SIZE,
+        tcp::{
+            self,
+            segment::MAX_TCP_HEADER_SIZE,
+        },
         udp,
     },
     runtime::{
@@ -26,19 +42,47 @@ use catnip::{
         Scheduler,
         SchedulerHandle,
     },
+};
+use demikernel::{
+    arp::ArpMirror,
+    capture::{
+        CaptureRing,
+        Direction,
+    },
+    checksum::{
+        Checksum,
+        SoftwareChecksums,
+    },
+    clock,
+    interop::dmtr_free_cb_t,
+    stats,
     timer::{
-        Timer,
-        TimerPtr,
+        TimerRc,
         WaitFuture,
     },
 };
 use dpdk_rs::{
+    rte_dev_dma_map,
+    rte_epoll_event,
+    rte_epoll_wait,
+    rte_errno,
+    rte_eth_dev_info,
+    rte_eth_dev_info_get,
+    rte_eth_dev_rx_intr_ctl_q,
+    rte_eth_dev_rx_intr_disable,
+    rte_eth_dev_rx_intr_enable,
     rte_eth_rx_burst,
     rte_eth_tx_burst,
     rte_mbuf,
     rte_pktmbuf_chain,
+    rte_pktmbuf_free,
+    rte_pktmbuf_trim,
 };
 use futures::FutureExt;
+use libc::{
+    c_int,
+    c_void,
+};
 use rand::{
     distributions::{
         Distribution,
@@ -53,24 +97,19 @@ use std::{
     cell::RefCell,
     collections::HashMap,
     future::Future,
+    iter,
     mem,
     net::Ipv4Addr,
+    ptr,
     rc::Rc,
+    slice,
+    sync::Arc,
     time::{
         Duration,
         Instant,
     },
 };
 
-#[derive(Clone)]
-pub struct TimerRc(Rc<Timer<TimerRc>>);
-
-impl TimerPtr for TimerRc {
-    fn timer(&self) -> &Timer<Self> {
-        &*self.0
-    }
-}
-
 #[derive(Clone)]
 pub struct DPDKRuntime {
     inner: Rc<RefCell<Inner>>,
@@ -82,16 +121,21 @@ impl DPDKRuntime {
         link_addr: MacAddress,
         ipv4_addr: Ipv4Addr,
         dpdk_port_id: u16,
+        dpdk_queue_id: u16,
         memory_manager: MemoryManager,
         arp_table: HashMap<Ipv4Addr, MacAddress>,
         disable_arp: bool,
         mss: usize,
         tcp_checksum_offload: bool,
         udp_checksum_offload: bool,
+        tcp_tso: bool,
+        rx_intr_idle_polls: Option<usize>,
+        flow_filter: Option<Arc<FlowFilter>>,
     ) -> Self {
         let mut rng = rand::thread_rng();
         let rng = SmallRng::from_rng(&mut rng).expect("Failed to initialize RNG");
         let now = Instant::now();
+        clock::resync(now);
 
         let arp_options = arp::Options::new(
             Duration::from_secs(15),
@@ -101,6 +145,16 @@ impl DPDKRuntime {
             disable_arp,
         );
 
+        // The stack leaves checksums to us. Those the NIC doesn't compute, we compute as we
+        // transmit (and check as we receive) with the fastest kernel the CPU has.
+        let checksums = SoftwareChecksums {
+            tcp: !tcp_checksum_offload,
+            udp: !udp_checksum_offload,
+        };
+
+        // We advertise what fits in our MTU, and the stack segments at the MSS it negotiates. TSO
+        // only applies on our side: consecutive segments are chained into one large packet as
+        // they're staged, and the NIC cuts it back up (see `Inner::coalesce_tx`).
         let tcp_options = tcp::Options::new(
             Some(mss),
             None,
@@ -110,14 +164,14 @@ impl DPDKRuntime {
             Some(0xffff),
             Some(0),
             None,
-            Some(tcp_checksum_offload),
-            Some(tcp_checksum_offload),
+            Some(true),
+            Some(true),
         );
 
-        let udp_options = udp::Options::new(udp_checksum_offload, udp_checksum_offload);
+        let udp_options = udp::Options::new(true, true);
 
         let inner = Inner {
-            timer: TimerRc(Rc::new(Timer::new(now))),
+            timer: TimerRc::new(now),
             link_addr,
             ipv4_addr,
             rng,
@@ -126,7 +180,22 @@ impl DPDKRuntime {
             udp_options,
 
             dpdk_port_id,
+            dpdk_queue_id,
             memory_manager,
+
+            mss,
+            tcp_tso,
+            checksums,
+
+            tx_batch: ArrayVec::new(),
+            tx_batch_size: TRANSMIT_BATCH_SIZE,
+            tx_dropped: 0,
+
+            rx_intr: rx_intr_idle_polls.map(RxInterrupt::new),
+            flow_filter,
+            arp_mirror: ArpMirror::join(dpdk_port_id as u64),
+
+            capture: None,
         };
         Self {
             inner: Rc::new(RefCell::new(inner)),
@@ -142,11 +211,141 @@ impl DPDKRuntime {
         self.inner.borrow().dpdk_port_id
     }
 
+    pub fn queue_id(&self) -> u16 {
+        self.inner.borrow().dpdk_queue_id
+    }
+
+    /// Segment size on the wire, which the stack segments streams at.
+    pub fn mss(&self) -> usize {
+        self.inner.borrow().mss
+    }
+
     pub fn memory_manager(&self) -> MemoryManager {
         self.inner.borrow().memory_manager.clone()
     }
+
+    /// Sets how many packets are staged before they are handed to the NIC. A batch size of 1
+    /// transmits every packet immediately.
+    pub fn set_tx_batch_size(&self, tx_batch_size: usize) {
+        assert!(tx_batch_size >= 1 && tx_batch_size <= TRANSMIT_BATCH_SIZE);
+        let mut inner = self.inner.borrow_mut();
+        inner.tx_batch_size = tx_batch_size;
+        inner.flush_tx();
+    }
+
+    /// Hands any staged packets to the NIC.
+    pub fn flush_tx(&self) {
+        self.inner.borrow_mut().flush_tx();
+    }
+
+    /// Occupancy of this queue's pools.
+    pub fn memory_stats(&self) -> MemoryStats {
+        self.inner.borrow().memory_manager.stats()
+    }
+
+    /// Number of packets dropped because the TX ring was full or a pool was empty.
+    pub fn tx_dropped(&self) -> usize {
+        self.inner.borrow().tx_dropped
+    }
+
+    /// Sets how many empty polls in a row it takes before we sleep until the NIC raises an RX
+    /// interrupt, or turns sleeping off. The port must have been brought up with RX interrupts.
+    pub fn set_rx_intr_idle_polls(&self, idle_polls: Option<usize>) {
+        self.inner.borrow_mut().rx_intr = idle_polls.map(RxInterrupt::new);
+    }
+
+    /// Starts copying the frames this queue sends and receives into `capture`, or stops.
+    pub fn set_capture(&self, capture: Option<CaptureRing>) {
+        self.inner.borrow_mut().capture = capture;
+    }
+
+    /// Number of times this queue went to sleep waiting for an RX interrupt.
+    pub fn rx_sleeps(&self) -> usize {
+        self.inner.borrow().rx_intr.as_ref().map_or(0, |intr| intr.num_sleeps)
+    }
+
+    /// Lets traffic to a local port through the port's hardware filter, if it has one.
+    pub fn allow_port(&self, protocol: Protocol, port: u16) -> Result<(), Error> {
+        match self.inner.borrow().flow_filter {
+            Some(ref filter) => filter.allow_port(protocol, port),
+            None => Ok(()),
+        }
+    }
+
+    pub fn release_port(&self, protocol: Protocol, port: u16) {
+        if let Some(ref filter) = self.inner.borrow().flow_filter {
+            filter.release_port(protocol, port);
+        }
+    }
+
+    /// Number of frames the port's hardware filter has dropped.
+    pub fn rx_filtered(&self) -> u64 {
+        self.inner
+            .borrow()
+            .flow_filter
+            .as_ref()
+            .map_or(0, |filter| filter.dropped())
+    }
+
+    /// Registers application memory for zero-copy pushes and maps it for DMA by our port.
+    pub fn register_mem(
+        &self,
+        ptr: *mut c_void,
+        len: usize,
+        free_cb: dmtr_free_cb_t,
+        free_arg: *mut c_void,
+    ) -> Result<(), Error> {
+        let inner = self.inner.borrow();
+        inner
+            .memory_manager
+            .register_external(ptr, len, free_cb, free_arg)?;
+
+        let mut dev_info: rte_eth_dev_info = unsafe { mem::zeroed() };
+        unsafe { rte_eth_dev_info_get(inner.dpdk_port_id, &mut dev_info) };
+        let ret = unsafe { rte_dev_dma_map(dev_info.device, ptr, ptr as u64, len as _) };
+        // Every queue maps the region, so only the first one succeeds. Some PMDs (e.g. mlx5)
+        // don't need an explicit mapping and pick up registered memory on their own.
+        if ret != 0 && unsafe { rte_errno() } != libc::EEXIST {
+            eprintln!(
+                "WARNING: Failed to map {:?}+{} for DMA, errno {}",
+                ptr,
+                len,
+                unsafe { rte_errno() }
+            );
+        }
+        Ok(())
+    }
 }
 
+/// Maximum number of packets staged for transmission before we ring the doorbell.
+pub const TRANSMIT_BATCH_SIZE: usize = 32;
+
+/// Largest TCP segment handed to the NIC with TSO. The IPv4 total length field is 16 bits.
+const TSO_MAX_SEGMENT_SIZE: usize = u16::MAX as usize - IPV4_HEADER_SIZE - MAX_TCP_HEADER_SIZE;
+
+/// Most `mbuf`s chained into one TSO packet, which stays within the descriptors per packet that
+/// NICs accept.
+const TSO_MAX_MBUFS: u16 = 32;
+
+// TCP flags that end a run of segments the NIC can cut out of one packet.
+const TCP_FIN: u8 = 0x01;
+const TCP_SYN: u8 = 0x02;
+const TCP_RST: u8 = 0x04;
+const TCP_URG: u8 = 0x20;
+
+/// Longest we sleep waiting for an RX interrupt when no timer is due sooner. This only bounds the
+/// wait for what neither the NIC nor a timer wakes us up for, like ARP replies other queues share.
+const RX_INTR_MAX_SLEEP_MS: c_int = 10;
+
+// `rte_epoll_wait` on the calling thread's epoll instance, and `rte_eth_dev_rx_intr_ctl_q` ops.
+const RTE_EPOLL_PER_THREAD: c_int = -1;
+const RTE_INTR_EVENT_ADD: c_int = 1;
+
+// `rte_mbuf` TX offload flags.
+const PKT_TX_TCP_SEG: u64 = 1 << 50;
+const PKT_TX_IP_CKSUM: u64 = 1 << 54;
+const PKT_TX_IPV4: u64 = 1 << 55;
+
 struct Inner {
     timer: TimerRc,
     memory_manager: MemoryManager,
@@ -158,26 +357,333 @@ struct Inner {
     udp_options: udp::Options,
 
     dpdk_port_id: u16,
+    dpdk_queue_id: u16,
+
+    // Segment size on the wire, and whether the NIC segments larger TCP packets down to it.
+    mss: usize,
+    tcp_tso: bool,
+
+    // Checksums we compute and check ourselves, since the NIC doesn't.
+    checksums: SoftwareChecksums,
+
+    // Packets waiting to be handed to the NIC, in transmission order.
+    tx_batch: ArrayVec<*mut rte_mbuf, TRANSMIT_BATCH_SIZE>,
+    tx_batch_size: usize,
+    tx_dropped: usize,
+
+    // Adaptive polling; if set, we sleep on an RX interrupt once the queue has been idle a while.
+    rx_intr: Option<RxInterrupt>,
+
+    // Hardware RX filter of the port, shared with its other queues.
+    flow_filter: Option<Arc<FlowFilter>>,
+
+    // RSS sends every ARP frame to one queue, so each queue shares the replies it gets with the
+    // rest of the port.
+    arp_mirror: ArpMirror,
+
+    // Where we copy frames for `dmtr-capture`, if anywhere. Segments are captured as the stack
+    // hands them to us, before TSO chains them together.
+    capture: Option<CaptureRing>,
+}
+
+struct RxInterrupt {
+    idle_polls: usize,
+    num_empty_polls: usize,
+    // The RX interrupt is bound to the per-thread epoll instance of whichever thread sleeps first.
+    registered: bool,
+    num_sleeps: usize,
+}
+
+impl RxInterrupt {
+    fn new(idle_polls: usize) -> Self {
+        Self {
+            idle_polls,
+            num_empty_polls: 0,
+            registered: false,
+            num_sleeps: 0,
+        }
+    }
+}
+
+/// Where the headers of a TCP/IPv4 frame end, and what follows them.
+struct TcpSegment {
+    l3_len: usize,
+    l4_len: usize,
+    seq: u32,
+    payload_len: usize,
+}
+
+impl TcpSegment {
+    fn parse(frame: &[u8]) -> Option<Self> {
+        let l2_len = ETHERNET2_HEADER_SIZE;
+        if frame.len() < l2_len + IPV4_HEADER_SIZE || frame[12..14] != [0x08, 0x00] {
+            return None;
+        }
+        let ip = &frame[l2_len..];
+        if ip[9] != libc::IPPROTO_TCP as u8 {
+            return None;
+        }
+        let l3_len = (ip[0] & 0xf) as usize * 4;
+        if ip.len() < l3_len + 20 {
+            return None;
+        }
+        let tcp = &ip[l3_len..];
+        let l4_len = (tcp[12] >> 4) as usize * 4;
+        let total_len = u16::from_be_bytes([ip[2], ip[3]]) as usize;
+        if ip.len() < l3_len + l4_len || total_len < l3_len + l4_len {
+            return None;
+        }
+        Some(Self {
+            l3_len,
+            l4_len,
+            seq: u32::from_be_bytes([tcp[4], tcp[5], tcp[6], tcp[7]]),
+            payload_len: total_len - l3_len - l4_len,
+        })
+    }
+
+    /// Does this segment, in `frame`, pick up where `tail`, in `tail_frame`, leaves off, on the
+    /// same connection and with the same headers otherwise?
+    fn continues(&self, frame: &[u8], tail: &TcpSegment, tail_frame: &[u8]) -> bool {
+        if self.l3_len != tail.l3_len || self.l4_len != tail.l4_len {
+            return false;
+        }
+        let ip = ETHERNET2_HEADER_SIZE;
+        let tcp = ip + self.l3_len;
+        let end = tcp + self.l4_len;
+        let same = |range: std::ops::Range<usize>| frame[range.clone()] == tail_frame[range];
+        // Only the IPv4 length, ID and checksum, and the sequence number and TCP checksum, may
+        // differ.
+        same(0..(ip + 2))
+            && same((ip + 6)..(ip + 10))
+            && same((ip + 12)..tcp)
+            && same(tcp..(tcp + 4))
+            && same((tcp + 8)..(tcp + 16))
+            && same((tcp + 18)..end)
+            && frame[tcp + 13] & (TCP_FIN | TCP_SYN | TCP_RST | TCP_URG) == 0
+            && self.seq == tail.seq.wrapping_add(tail.payload_len as u32)
+    }
+}
+
+impl Inner {
+    /// Stages a packet for transmission, flushing the batch once it fills up. If the TX ring is
+    /// still full after flushing, the packet is dropped; TCP will retransmit it.
+    fn enqueue_tx(&mut self, mbuf: Mbuf) {
+        if let Some(ref mut capture) = self.capture {
+            capture.tap(Direction::Outbound, mbuf.pkt_len(), mbuf.segments());
+        }
+        if self.tx_batch.len() >= self.tx_batch_size {
+            self.flush_tx();
+        }
+        if self.tx_batch.is_full() {
+            self.tx_dropped += 1;
+            drop(mbuf);
+            return;
+        }
+        self.tx_batch.push(mbuf.into_raw());
+        if self.tx_batch.len() >= self.tx_batch_size {
+            self.flush_tx();
+        }
+    }
+
+    /// With TSO, chains a TCP segment onto the packet staged last if it's the next segment of the
+    /// same connection, so that the NIC cuts both out of one packet of up to 64 KB. The stack
+    /// segments at the negotiated MSS, which is also what the NIC cuts at. Returns `body` if the
+    /// segment has to go out on its own.
+    fn coalesce_tx(&mut self, header: &[u8], body: DPDKBuf) -> Result<(), DPDKBuf> {
+        if !self.tcp_tso || body.is_empty() {
+            return Err(body);
+        }
+        let tail_ptr = match self.tx_batch.last() {
+            Some(&tail_ptr) => tail_ptr,
+            None => return Err(body),
+        };
+        let tail_frame = unsafe { mbuf_data(tail_ptr) };
+        let (tail, segment) = match (TcpSegment::parse(tail_frame), TcpSegment::parse(header)) {
+            (Some(tail), Some(segment)) => (tail, segment),
+            _ => return Err(body),
+        };
+        if tail.payload_len == 0 || !segment.continues(header, &tail, tail_frame) {
+            return Err(body);
+        }
+
+        // Every segment the NIC cuts out but the last is `segsz` long.
+        let segsz = if unsafe { (*tail_ptr).ol_flags } & PKT_TX_TCP_SEG != 0 {
+            (unsafe { (*tail_ptr).__bindgen_anon_5.tx_offload } >> 24) as usize & 0xffff
+        } else {
+            tail.payload_len
+        };
+        if tail.payload_len % segsz != 0
+            || body.len() > segsz
+            || tail.payload_len + body.len() > TSO_MAX_SEGMENT_SIZE
+        {
+            return Err(body);
+        }
+        // A tail with a small inline body was padded out to the minimum frame size, and the
+        // padding mustn't end up between its payload and ours, so it's trimmed off.
+        let tail_frame_len = ETHERNET2_HEADER_SIZE + tail.l3_len + tail.l4_len + tail.payload_len;
+        let (tail_len, tail_nb_segs) =
+            unsafe { ((*tail_ptr).pkt_len as usize, (*tail_ptr).nb_segs) };
+        let tail_padding = match tail_len.checked_sub(tail_frame_len) {
+            Some(0) => 0,
+            Some(padding) if tail_nb_segs == 1 => padding,
+            _ => return Err(body),
+        };
+
+        let body_mbuf = match body {
+            DPDKBuf::Managed(mbuf) => mbuf,
+            DPDKBuf::External(bytes) => match self.memory_manager.try_copy_to_body_mbufs(&bytes) {
+                Some(mbuf) => mbuf,
+                None => return Err(DPDKBuf::External(bytes)),
+            },
+        };
+        if unsafe { (*tail_ptr).nb_segs + (*body_mbuf.ptr).nb_segs } > TSO_MAX_MBUFS {
+            return Err(DPDKBuf::Managed(body_mbuf));
+        }
+
+        if let Some(ref mut capture) = self.capture {
+            let wire_len = header.len() + body_mbuf.pkt_len();
+            capture.tap(
+                Direction::Outbound,
+                wire_len,
+                iter::once(header).chain(body_mbuf.segments()),
+            );
+        }
+        let body_len = body_mbuf.pkt_len();
+        unsafe {
+            assert_eq!(rte_pktmbuf_trim(tail_ptr, tail_padding as u16), 0);
+            assert_eq!(rte_pktmbuf_chain(tail_ptr, body_mbuf.into_raw()), 0);
+        }
+
+        let total_len = tail.l3_len + tail.l4_len + tail.payload_len + body_len;
+        let total_len_offset = ETHERNET2_HEADER_SIZE + 2;
+        tail_frame[total_len_offset..(total_len_offset + 2)]
+            .copy_from_slice(&(total_len as u16).to_be_bytes());
+        offload_segmentation(tail_ptr, segsz);
+        Ok(())
+    }
+
+    /// Hands staged packets to the NIC. Packets that don't fit in the TX ring stay staged and are
+    /// retried on the next flush.
+    fn flush_tx(&mut self) {
+        if self.tx_batch.is_empty() {
+            return;
+        }
+        let num_sent = unsafe {
+            rte_eth_tx_burst(
+                self.dpdk_port_id,
+                self.dpdk_queue_id,
+                self.tx_batch.as_mut_ptr(),
+                self.tx_batch.len() as u16,
+            )
+        };
+        self.tx_batch.drain(..num_sent as usize);
+        stats::record_tx_burst(num_sent as usize);
+    }
+
+    /// Counts an RX burst that put `nb_rx` packets in `packets`, and once the queue has been idle
+    /// for long enough, sleeps until the NIC raises an RX interrupt or the next timer is due.
+    /// Returns the number of packets in `packets`, which the burst after arming the interrupt may
+    /// have filled.
+    fn after_rx_burst(&mut self, packets: &mut [*mut rte_mbuf], nb_rx: usize) -> usize {
+        let (port_id, queue_id) = (self.dpdk_port_id, self.dpdk_queue_id);
+        let intr = match self.rx_intr.as_mut() {
+            Some(intr) => intr,
+            None => return nb_rx,
+        };
+        if nb_rx > 0 {
+            intr.num_empty_polls = 0;
+            return nb_rx;
+        }
+        intr.num_empty_polls += 1;
+        if intr.num_empty_polls < intr.idle_polls {
+            return 0;
+        }
+        intr.num_empty_polls = 0;
+
+        // Sleep no further than the next timer, which only fires once we poll again.
+        let timeout_ms = match self.timer.next_deadline() {
+            Some(deadline) => {
+                let ns = deadline.saturating_duration_since(clock::now()).as_nanos();
+                let ms = (ns + 999_999) / 1_000_000;
+                std::cmp::min(ms, RX_INTR_MAX_SLEEP_MS as u128) as c_int
+            },
+            None => RX_INTR_MAX_SLEEP_MS,
+        };
+        if timeout_ms == 0 {
+            return 0;
+        }
+
+        if !intr.registered {
+            let ret = unsafe {
+                rte_eth_dev_rx_intr_ctl_q(
+                    port_id,
+                    queue_id,
+                    RTE_EPOLL_PER_THREAD,
+                    RTE_INTR_EVENT_ADD,
+                    ptr::null_mut(),
+                )
+            };
+            if ret != 0 {
+                eprintln!(
+                    "WARNING: Failed to set up RX interrupts on queue {} ({}), polling instead.",
+                    queue_id, ret
+                );
+                self.rx_intr = None;
+                return 0;
+            }
+            intr.registered = true;
+        }
+
+        // A packet that arrived between the last burst and arming the interrupt doesn't raise
+        // one, so look again before going to sleep.
+        unsafe { rte_eth_dev_rx_intr_enable(port_id, queue_id) };
+        let nb_rx = unsafe {
+            rte_eth_rx_burst(port_id, queue_id, packets.as_mut_ptr(), packets.len() as u16)
+        };
+        if nb_rx == 0 {
+            let mut event: rte_epoll_event = unsafe { mem::zeroed() };
+            unsafe { rte_epoll_wait(RTE_EPOLL_PER_THREAD, &mut event, 1, timeout_ms) };
+            intr.num_sleeps += 1;
+        } else {
+            stats::record_rx_burst(nb_rx as usize);
+        }
+        unsafe { rte_eth_dev_rx_intr_disable(port_id, queue_id) };
+        nb_rx as usize
+    }
+}
+
+impl Drop for Inner {
+    fn drop(&mut self) {
+        for mbuf_ptr in self.tx_batch.drain(..) {
+            unsafe { rte_pktmbuf_free(mbuf_ptr) };
+        }
+    }
 }
 
 impl Runtime for DPDKRuntime {
     type Buf = DPDKBuf;
-    type WaitFuture = WaitFuture<TimerRc>;
+    type WaitFuture = WaitFuture;
 
+    // The memory manager works on the C ABI's scatter-gather arrays, which may hold more segments
+    // than catnip's. Only single-segment arrays pass through catnip itself.
     fn into_sgarray(&self, buf: Self::Buf) -> dmtr_sgarray_t {
-        self.inner.borrow().memory_manager.into_sgarray(buf)
+        self.inner.borrow().memory_manager.into_sgarray(buf).into()
     }
 
     fn alloc_sgarray(&self, size: usize) -> dmtr_sgarray_t {
-        self.inner.borrow().memory_manager.alloc_sgarray(size)
+        self.inner.borrow().memory_manager.alloc_sgarray(size).into()
     }
 
     fn free_sgarray(&self, sga: dmtr_sgarray_t) {
-        self.inner.borrow().memory_manager.free_sgarray(sga)
+        self.inner.borrow().memory_manager.free_sgarray(sga.into())
     }
 
+    // The stack can't take a failure here, so once the pools run dry the array is copied instead.
     fn clone_sgarray(&self, sga: &dmtr_sgarray_t) -> Self::Buf {
-        self.inner.borrow().memory_manager.clone_sgarray(sga)
+        let inner = self.inner.borrow();
+        let mm = &inner.memory_manager;
+        let sga = (*sga).into();
+        mm.clone_sgarray(&sga).unwrap_or_else(|| mm.copy_sgarray(&sga))
     }
 
     fn transmit(&self, buf: impl PacketBuf<DPDKBuf>) {
@@ -193,13 +699,32 @@ impl Runtime for DPDKRuntime {
         // Chain body buffer.
 
         // First, allocate a header mbuf and write the header into it.
-        let inner = self.inner.borrow_mut();
-        let mut header_mbuf = inner.memory_manager.alloc_header_mbuf();
+        // If a pool has run dry, drop the packet as a full TX ring would: TCP retransmits it, and
+        // `dmtr_push` holds off new data with `EAGAIN` until the pools refill.
+        let mut inner = self.inner.borrow_mut();
+        // Sending keeps the queue busy, even if nothing is coming in.
+        if let Some(intr) = inner.rx_intr.as_mut() {
+            intr.num_empty_polls = 0;
+        }
+        let mut header_mbuf = match inner.memory_manager.try_alloc_header_mbuf() {
+            Some(mbuf) => mbuf,
+            None => {
+                inner.tx_dropped += 1;
+                return;
+            },
+        };
         let header_size = buf.header_size();
         assert!(header_size <= header_mbuf.len());
         buf.write_header(unsafe { &mut header_mbuf.slice_mut()[..header_size] });
+        stats::record_tx_headers(&header_mbuf[..header_size]);
 
         if let Some(body) = buf.take_body() {
+            // A segment that continues the packet staged last goes out with it.
+            let body = match inner.coalesce_tx(&header_mbuf[..header_size], body) {
+                Ok(()) => return,
+                Err(body) => body,
+            };
+
             // Next, see how much space we have remaining and inline the body if we have room.
             let inline_space = header_mbuf.len() - header_size;
 
@@ -210,14 +735,28 @@ impl Runtime for DPDKRuntime {
                 // We're only using the header_mbuf for, well, the header.
                 header_mbuf.trim(header_mbuf.len() - header_size);
 
+                if inner.tcp_tso && body.len() > inner.mss {
+                    offload_segmentation(header_mbuf.ptr(), inner.mss);
+                } else {
+                    let header = unsafe { header_mbuf.slice_mut() };
+                    if inner.checksums.applies_to(header) {
+                        let mut body_checksum = Checksum::new();
+                        body_checksum.add(&body[..]);
+                        inner.checksums.fill(header, Some(&body_checksum));
+                    }
+                }
+
                 let body_mbuf = match body {
                     DPDKBuf::Managed(mbuf) => mbuf,
+                    // Segments larger than a body `mbuf` (with TSO) are copied into a chain.
                     DPDKBuf::External(bytes) => {
-                        let mut mbuf = inner.memory_manager.alloc_body_mbuf();
-                        assert!(mbuf.len() >= bytes.len());
-                        unsafe { mbuf.slice_mut()[..bytes.len()].copy_from_slice(&bytes[..]) };
-                        mbuf.trim(mbuf.len() - bytes.len());
-                        mbuf
+                        match inner.memory_manager.try_copy_to_body_mbufs(&bytes[..]) {
+                            Some(mbuf) => mbuf,
+                            None => {
+                                inner.tx_dropped += 1;
+                                return;
+                            },
+                        }
                     },
                 };
                 unsafe {
@@ -226,17 +765,20 @@ impl Runtime for DPDKRuntime {
                         0
                     );
                 }
-                let mut header_mbuf_ptr = header_mbuf.into_raw();
-                let num_sent =
-                    unsafe { rte_eth_tx_burst(inner.dpdk_port_id, 0, &mut header_mbuf_ptr, 1) };
-                assert_eq!(num_sent, 1);
+                inner.enqueue_tx(header_mbuf);
             }
-            // Otherwise, write in the inline space.
+            // Otherwise, write in the inline space, summing the body as we copy it if we have
+            // to checksum it.
             else {
-                let body_buf = unsafe {
-                    &mut header_mbuf.slice_mut()[header_size..(header_size + body.len())]
-                };
-                body_buf.copy_from_slice(&body[..]);
+                let frame = unsafe { &mut header_mbuf.slice_mut()[..(header_size + body.len())] };
+                let (header, body_buf) = frame.split_at_mut(header_size);
+                if inner.checksums.applies_to(header) {
+                    let mut body_checksum = Checksum::new();
+                    body_checksum.copy_and_add(body_buf, &body[..]);
+                    inner.checksums.fill(header, Some(&body_checksum));
+                } else {
+                    body_buf.copy_from_slice(&body[..]);
+                }
 
                 if header_size + body.len() < MIN_PAYLOAD_SIZE {
                     let padding_bytes = MIN_PAYLOAD_SIZE - (header_size + body.len());
@@ -251,14 +793,14 @@ impl Runtime for DPDKRuntime {
                 let frame_size = std::cmp::max(header_size + body.len(), MIN_PAYLOAD_SIZE);
                 header_mbuf.trim(header_mbuf.len() - frame_size);
 
-                let mut header_mbuf_ptr = header_mbuf.into_raw();
-                let num_sent =
-                    unsafe { rte_eth_tx_burst(inner.dpdk_port_id, 0, &mut header_mbuf_ptr, 1) };
-                assert_eq!(num_sent, 1);
+                inner.enqueue_tx(header_mbuf);
             }
         }
         // No body on our packet, just send the headers.
         else {
+            inner
+                .checksums
+                .fill(unsafe { &mut header_mbuf.slice_mut()[..header_size] }, None);
             if header_size < MIN_PAYLOAD_SIZE {
                 let padding_bytes = MIN_PAYLOAD_SIZE - header_size;
                 let padding_buf =
@@ -269,35 +811,56 @@ impl Runtime for DPDKRuntime {
             }
             let frame_size = std::cmp::max(header_size, MIN_PAYLOAD_SIZE);
             header_mbuf.trim(header_mbuf.len() - frame_size);
-            let mut header_mbuf_ptr = header_mbuf.into_raw();
-            let num_sent =
-                unsafe { rte_eth_tx_burst(inner.dpdk_port_id, 0, &mut header_mbuf_ptr, 1) };
-            assert_eq!(num_sent, 1);
+            inner.enqueue_tx(header_mbuf);
         }
     }
 
     fn receive(&self) -> ArrayVec<DPDKBuf, RECEIVE_BATCH_SIZE> {
-        let inner = self.inner.borrow_mut();
+        let mut inner = self.inner.borrow_mut();
         let mut out = ArrayVec::new();
 
+        // `LibOS` receives once per scheduler poll, so this is where we push out whatever was
+        // transmitted during the last iteration.
+        inner.flush_tx();
+
         let mut packets: [*mut rte_mbuf; RECEIVE_BATCH_SIZE] = unsafe { mem::zeroed() };
         let nb_rx = unsafe {
             rte_eth_rx_burst(
                 inner.dpdk_port_id,
-                0,
+                inner.dpdk_queue_id,
                 packets.as_mut_ptr(),
                 RECEIVE_BATCH_SIZE as u16,
             )
         };
         assert!(nb_rx as usize <= RECEIVE_BATCH_SIZE);
+        stats::record_rx_burst(nb_rx as usize);
+        let nb_rx = inner.after_rx_burst(&mut packets, nb_rx as usize);
 
-        for &packet in &packets[..nb_rx as usize] {
+        for &packet in &packets[..nb_rx] {
             let mbuf = Mbuf {
                 ptr: packet,
                 mm: inner.memory_manager.clone(),
             };
-            out.push(DPDKBuf::Managed(mbuf));
+            if let Some(ref mut capture) = inner.capture {
+                capture.tap(Direction::Inbound, mbuf.pkt_len(), mbuf.segments());
+            }
+            // LRO hands us coalesced packets as `mbuf` chains, but the stack expects contiguous
+            // buffers. Packets with bad checksums are dropped here, as the NIC would have.
+            if unsafe { (*packet).nb_segs } > 1 {
+                let buf = mbuf.linearize();
+                if inner.checksums.verify(&buf[..]) {
+                    out.push(DPDKBuf::External(buf));
+                }
+            } else if inner.checksums.verify(&mbuf[..]) {
+                inner.arp_mirror.tap(&mbuf[..]);
+                out.push(DPDKBuf::Managed(mbuf));
+            }
         }
+        inner.arp_mirror.drain(out.remaining_capacity(), |frame| {
+            let mut buf = BytesMut::zeroed(frame.len()).unwrap();
+            buf.copy_from_slice(&frame[..]);
+            out.push(DPDKBuf::External(buf.freeze()));
+        });
         out
     }
 
@@ -322,25 +885,21 @@ impl Runtime for DPDKRuntime {
     }
 
     fn advance_clock(&self, now: Instant) {
-        self.inner.borrow_mut().timer.0.advance_clock(now);
+        clock::resync(now);
+        let timer = self.inner.borrow().timer.clone();
+        timer.advance_clock(now);
     }
 
     fn wait(&self, duration: Duration) -> Self::WaitFuture {
-        let self_ = self.inner.borrow_mut();
-        let now = self_.timer.0.now();
-        self_
-            .timer
-            .0
-            .wait_until(self_.timer.clone(), now + duration)
+        self.inner.borrow().timer.wait(duration)
     }
 
     fn wait_until(&self, when: Instant) -> Self::WaitFuture {
-        let self_ = self.inner.borrow_mut();
-        self_.timer.0.wait_until(self_.timer.clone(), when)
+        self.inner.borrow().timer.wait_until(when)
     }
 
     fn now(&self) -> Instant {
-        self.inner.borrow().timer.0.now()
+        self.inner.borrow().timer.now()
     }
 
     fn rng_gen<T>(&self) -> T
@@ -365,3 +924,49 @@ impl Runtime for DPDKRuntime {
         &self.scheduler
     }
 }
+
+//==============================================================================
+// Helper Functions
+//==============================================================================
+
+/// The data in the first segment of an `mbuf`.
+unsafe fn mbuf_data<'a>(mbuf_ptr: *mut rte_mbuf) -> &'a mut [u8] {
+    let data = ((*mbuf_ptr).buf_addr as *mut u8).offset((*mbuf_ptr).data_off as isize);
+    slice::from_raw_parts_mut(data, (*mbuf_ptr).data_len as usize)
+}
+
+/// Marks a TCP/IPv4 packet for segmentation by the NIC into `mss`-sized segments. The first
+/// segment of `mbuf_ptr` must hold the packet's headers.
+fn offload_segmentation(mbuf_ptr: *mut rte_mbuf, mss: usize) {
+    let header = unsafe { mbuf_data(mbuf_ptr) };
+    let l2_len = ETHERNET2_HEADER_SIZE;
+    if header.len() < l2_len + IPV4_HEADER_SIZE || header[12..14] != [0x08, 0x00] {
+        return;
+    }
+    if header[l2_len + 9] != libc::IPPROTO_TCP as u8 {
+        return;
+    }
+    let l3_len = (header[l2_len] & 0xf) as usize * 4;
+    let l4_len = (header[l2_len + l3_len + 12] >> 4) as usize * 4;
+
+    // The NIC computes the IPv4 checksum of every segment, and expects the TCP checksum to be
+    // seeded with the pseudo-header checksum, leaving out the length.
+    header[(l2_len + 10)..(l2_len + 12)].copy_from_slice(&[0, 0]);
+    let mut sum = libc::IPPROTO_TCP as u32;
+    for word in header[(l2_len + 12)..(l2_len + 20)].chunks(2) {
+        sum += u16::from_be_bytes([word[0], word[1]]) as u32;
+    }
+    while sum >> 16 != 0 {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    let checksum_offset = l2_len + l3_len + 16;
+    header[checksum_offset..(checksum_offset + 2)].copy_from_slice(&(sum as u16).to_be_bytes());
+
+    // `tx_offload` packs l2_len:7, l3_len:9, l4_len:8 and tso_segsz:16.
+    let tx_offload =
+        l2_len as u64 | (l3_len as u64) << 7 | (l4_len as u64) << 16 | (mss as u64) << 24;
+    unsafe {
+        (*mbuf_ptr).ol_flags |= PKT_TX_TCP_SEG | PKT_TX_IPV4 | PKT_TX_IP_CKSUM;
+        (*mbuf_ptr).__bindgen_anon_5.tx_offload = tx_offload;
+    }
+}
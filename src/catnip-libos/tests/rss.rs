@@ -0,0 +1,319 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+use anyhow::{
+    format_err,
+    Error,
+};
+use catnip::{
+    libos::LibOS,
+    operations::OperationResult,
+    protocols::{
+        ip::Port,
+        ipv4::Endpoint,
+    },
+};
+use catnip_libos::{
+    dpdk::{
+        DPDKQueue,
+        PortConfig,
+    },
+    memory::DPDKBuf,
+    runtime::DPDKRuntime,
+};
+use demikernel::config::Config;
+use dpdk_rs::{
+    load_mlx_driver,
+    rte_thread_register,
+};
+use std::{
+    convert::TryFrom,
+    env,
+    net::Ipv4Addr,
+    str::FromStr,
+    thread,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Test
+//==============================================================================
+
+pub struct Test {
+    config: Config,
+    queues: Vec<DPDKQueue>,
+}
+
+impl Test {
+    pub fn new() -> Self {
+        load_mlx_driver();
+        let config = Config::new(std::env::var("CONFIG_PATH").unwrap());
+        let queues = catnip_libos::dpdk::initialize_dpdk_queues(PortConfig {
+            flow_filter: false,
+            ..PortConfig::from_config(&config)
+        })
+        .unwrap();
+
+        Self { config, queues }
+    }
+
+    fn addr(&self, k1: &str, k2: &str, port_offset: u16) -> Result<Endpoint, Error> {
+        let addr = &self.config.config_obj[k1][k2];
+        let host_s = addr["host"]
+            .as_str()
+            .ok_or(format_err!("Missing host"))
+            .unwrap();
+        let host = Ipv4Addr::from_str(host_s).unwrap();
+        let port_i = addr["port"]
+            .as_i64()
+            .ok_or(format_err!("Missing port"))
+            .unwrap();
+        let port = Port::try_from(port_i as u16 + port_offset).unwrap();
+        Ok(Endpoint::new(host, port))
+    }
+
+    pub fn is_server(&self) -> bool {
+        if env::var("PEER").unwrap().eq("server") {
+            true
+        } else if env::var("PEER").unwrap().eq("client") {
+            false
+        } else {
+            panic!("either PEER=server or PEER=client must be exported")
+        }
+    }
+
+    /// Number of concurrent flows opened by the client. Each flow uses its own source port, so
+    /// RSS spreads them across the server's queues.
+    pub fn nflows(&self) -> usize {
+        env::var("NFLOWS")
+            .map(|s| s.parse().unwrap())
+            .unwrap_or(64)
+    }
+}
+
+//==============================================================================
+// RSS Scaling
+//==============================================================================
+
+/// Runs one UDP echo server per queue on the server side, all bound to the same endpoint, and
+/// reports requests per second for each queue. Run the server with `num_queues` set from 1 to N
+/// to get the scaling curve. The client must run with a single queue, since replies to its flows
+/// could otherwise hash to a queue it isn't polling.
+#[test]
+fn udp_rss_scaling() {
+    let mut test = Test::new();
+    let report_interval = Duration::from_secs(1);
+
+    if test.is_server() {
+        let local_addr = test.addr("server", "bind", 0).unwrap();
+        let nqueues = test.queues.len();
+        let workers: Vec<_> = test
+            .queues
+            .drain(..)
+            .map(|queue| {
+                thread::spawn(move || {
+                    // None of the workers is the thread that ran `rte_eal_init`.
+                    unsafe { rte_thread_register() };
+                    let queue_id = queue.queue_id();
+                    let mut libos = LibOS::new(queue.into_runtime()).unwrap();
+                    let sockfd = libos.socket(libc::AF_INET, libc::SOCK_DGRAM, 0).unwrap();
+                    libos.bind(sockfd, local_addr).unwrap();
+
+                    let mut nrequests: usize = 0;
+                    let mut last_report = Instant::now();
+                    loop {
+                        let qtoken = libos.pop(sockfd).expect("server failed to pop()");
+                        let (remote, buf) = match libos.wait2(qtoken) {
+                            (_, OperationResult::Pop(Some(remote), buf)) => (remote, buf),
+                            _ => panic!("server failed to wait()"),
+                        };
+                        let qtoken = libos
+                            .pushto2(sockfd, buf, remote)
+                            .expect("server failed to pushto2()");
+                        libos.wait(qtoken);
+                        nrequests += 1;
+
+                        let elapsed = last_report.elapsed();
+                        if elapsed >= report_interval {
+                            println!(
+                                "queue {}/{}: {:.0} rps",
+                                queue_id,
+                                nqueues,
+                                nrequests as f64 / elapsed.as_secs_f64()
+                            );
+                            nrequests = 0;
+                            last_report = Instant::now();
+                        }
+                    }
+                })
+            })
+            .collect();
+        for worker in workers {
+            worker.join().unwrap();
+        }
+    } else {
+        assert_eq!(test.queues.len(), 1, "client must run with a single queue");
+        let remote_addr = test.addr("client", "connect_to", 0).unwrap();
+        let nflows = test.nflows();
+        let buffer_size = test.config.buffer_size;
+        let nreports = 10;
+
+        let mut libos = LibOS::new(test.queues.remove(0).into_runtime()).unwrap();
+        let mkbuf = |libos: &LibOS<DPDKRuntime>| {
+            let mut pktbuf = libos.rt().alloc_body_mbuf();
+            pktbuf.trim(pktbuf.len() - buffer_size);
+            DPDKBuf::Managed(pktbuf)
+        };
+
+        // Open one socket per flow, and prime each of them with a request.
+        let mut qtokens = Vec::with_capacity(nflows);
+        for i in 0..nflows {
+            let local_addr = test.addr("client", "client", i as u16).unwrap();
+            let sockfd = libos.socket(libc::AF_INET, libc::SOCK_DGRAM, 0).unwrap();
+            libos.bind(sockfd, local_addr).unwrap();
+            let buf = mkbuf(&libos);
+            let qtoken = libos.pushto2(sockfd, buf, remote_addr).unwrap();
+            libos.wait(qtoken);
+            qtokens.push(libos.pop(sockfd).unwrap());
+        }
+
+        let mut nrequests: usize = 0;
+        let mut last_report = Instant::now();
+        for _ in 0..nreports {
+            while last_report.elapsed() < report_interval {
+                let (i, sockfd, result) = libos.wait_any2(&qtokens);
+                match result {
+                    OperationResult::Pop(..) => (),
+                    _ => panic!("client failed to wait()"),
+                }
+                let buf = mkbuf(&libos);
+                let qtoken = libos.pushto2(sockfd, buf, remote_addr).unwrap();
+                libos.wait(qtoken);
+                qtokens[i] = libos.pop(sockfd).unwrap();
+                nrequests += 1;
+            }
+            println!(
+                "{} flows: {:.0} rps",
+                nflows,
+                nrequests as f64 / last_report.elapsed().as_secs_f64()
+            );
+            nrequests = 0;
+            last_report = Instant::now();
+        }
+    }
+}
+
+//==============================================================================
+// Sharded Accept
+//==============================================================================
+
+/// Runs one TCP listener per queue on the server side, all on the same endpoint, so that RSS
+/// hashes each connection's SYN (and the rest of it) to one of them, and reports connections per
+/// second for each queue. The client opens connections one after the other, each of which echoes
+/// a single message, and must run with a single queue.
+#[test]
+fn tcp_rss_accept() {
+    let mut test = Test::new();
+    let report_interval = Duration::from_secs(1);
+
+    if test.is_server() {
+        let local_addr = test.addr("server", "bind", 0).unwrap();
+        let nqueues = test.queues.len();
+        let workers: Vec<_> = test
+            .queues
+            .drain(..)
+            .map(|queue| {
+                thread::spawn(move || {
+                    // None of the workers is the thread that ran `rte_eal_init`.
+                    unsafe { rte_thread_register() };
+                    let queue_id = queue.queue_id();
+                    let mut libos = LibOS::new(queue.into_runtime()).unwrap();
+                    let listener = libos.socket(libc::AF_INET, libc::SOCK_STREAM, 0).unwrap();
+                    libos.bind(listener, local_addr).unwrap();
+                    libos.listen(listener, 128).unwrap();
+
+                    let mut naccepts: usize = 0;
+                    let mut last_report = Instant::now();
+                    loop {
+                        let qtoken = libos.accept(listener).expect("server failed to accept()");
+                        let sockfd = match libos.wait2(qtoken) {
+                            (_, OperationResult::Accept(sockfd)) => sockfd,
+                            _ => panic!("server failed to wait()"),
+                        };
+                        // Echo until the client closes.
+                        loop {
+                            let qtoken = libos.pop(sockfd).expect("server failed to pop()");
+                            let buf = match libos.wait2(qtoken) {
+                                (_, OperationResult::Pop(_, buf)) => buf,
+                                _ => panic!("server failed to wait()"),
+                            };
+                            if buf.len() == 0 {
+                                break;
+                            }
+                            let qtoken = libos.push2(sockfd, buf).expect("server failed to push()");
+                            libos.wait(qtoken);
+                        }
+                        libos.close(sockfd).unwrap();
+                        naccepts += 1;
+
+                        let elapsed = last_report.elapsed();
+                        if elapsed >= report_interval {
+                            println!(
+                                "queue {}/{}: {:.0} connections/s",
+                                queue_id,
+                                nqueues,
+                                naccepts as f64 / elapsed.as_secs_f64()
+                            );
+                            naccepts = 0;
+                            last_report = Instant::now();
+                        }
+                    }
+                })
+            })
+            .collect();
+        for worker in workers {
+            worker.join().unwrap();
+        }
+    } else {
+        assert_eq!(test.queues.len(), 1, "client must run with a single queue");
+        let remote_addr = test.addr("client", "connect_to", 0).unwrap();
+        let buffer_size = test.config.buffer_size;
+        let nreports = 10;
+
+        let mut libos = LibOS::new(test.queues.remove(0).into_runtime()).unwrap();
+        let mut nconnections: usize = 0;
+        let mut last_report = Instant::now();
+        for _ in 0..nreports {
+            while last_report.elapsed() < report_interval {
+                // Each connection gets a fresh ephemeral port, and with it a fresh RSS hash.
+                let sockfd = libos.socket(libc::AF_INET, libc::SOCK_STREAM, 0).unwrap();
+                let qtoken = libos.connect(sockfd, remote_addr).unwrap();
+                match libos.wait2(qtoken) {
+                    (_, OperationResult::Connect) => (),
+                    _ => panic!("client failed to connect()"),
+                }
+
+                let mut pktbuf = libos.rt().alloc_body_mbuf();
+                pktbuf.trim(pktbuf.len() - buffer_size);
+                let qtoken = libos.push2(sockfd, DPDKBuf::Managed(pktbuf)).unwrap();
+                libos.wait(qtoken);
+                let qtoken = libos.pop(sockfd).unwrap();
+                match libos.wait2(qtoken) {
+                    (_, OperationResult::Pop(..)) => (),
+                    _ => panic!("client failed to pop()"),
+                }
+                libos.close(sockfd).unwrap();
+                nconnections += 1;
+            }
+            println!(
+                "{:.0} connections/s",
+                nconnections as f64 / last_report.elapsed().as_secs_f64()
+            );
+            nconnections = 0;
+            last_report = Instant::now();
+        }
+    }
+}
@@ -0,0 +1,426 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+use anyhow::{
+    format_err,
+    Error,
+};
+use catnip::{
+    file_table::FileDescriptor,
+    interop::dmtr_sgaseg_t,
+    libos::LibOS,
+    operations::OperationResult,
+    protocols::{
+        ip::Port,
+        ipv4::Endpoint,
+    },
+};
+use catnip_libos::{
+    dpdk::PortConfig,
+    memory::DPDKBuf,
+    runtime::DPDKRuntime,
+};
+use demikernel::config::Config;
+use dpdk_rs::load_mlx_driver;
+use libc::c_void;
+use std::{
+    convert::TryFrom,
+    env,
+    net::Ipv4Addr,
+    ptr,
+    str::FromStr,
+    sync::atomic::{
+        AtomicUsize,
+        Ordering,
+    },
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Test
+//==============================================================================
+
+pub struct Test {
+    config: Config,
+    pub libos: LibOS<DPDKRuntime>,
+}
+
+impl Test {
+    pub fn new() -> Self {
+        load_mlx_driver();
+        let config = Config::new(std::env::var("CONFIG_PATH").unwrap());
+        // Bring up the port with the offloads from the environment (e.g. `TCP_TSO`).
+        let mut queues = catnip_libos::dpdk::initialize_dpdk_queues(PortConfig {
+            num_queues: 1,
+            rss_key: None,
+            rss_reta: None,
+            flow_filter: false,
+            ..PortConfig::from_config(&config)
+        })
+        .unwrap();
+        let libos = LibOS::new(queues.remove(0).into_runtime()).unwrap();
+
+        Self { config, libos }
+    }
+
+    fn addr(&self, k1: &str, k2: &str) -> Result<Endpoint, Error> {
+        let addr = &self.config.config_obj[k1][k2];
+        let host_s = addr["host"]
+            .as_str()
+            .ok_or(format_err!("Missing host"))
+            .unwrap();
+        let host = Ipv4Addr::from_str(host_s).unwrap();
+        let port_i = addr["port"]
+            .as_i64()
+            .ok_or(format_err!("Missing port"))
+            .unwrap();
+        let port = Port::try_from(port_i as u16).unwrap();
+        Ok(Endpoint::new(host, port))
+    }
+
+    pub fn is_server(&self) -> bool {
+        if env::var("PEER").unwrap().eq("server") {
+            true
+        } else if env::var("PEER").unwrap().eq("client") {
+            false
+        } else {
+            panic!("either PEER=server or PEER=client must be exported")
+        }
+    }
+
+    /// Accepts a single connection and drains it, reporting throughput every second.
+    pub fn drain(&mut self) -> ! {
+        let local_addr = self.addr("server", "bind").unwrap();
+        let sockfd = self
+            .libos
+            .socket(libc::AF_INET, libc::SOCK_STREAM, 0)
+            .unwrap();
+        self.libos.bind(sockfd, local_addr).unwrap();
+        self.libos.listen(sockfd, 8).unwrap();
+        let qtoken = self.libos.accept(sockfd).unwrap();
+        let fd = match self.libos.wait2(qtoken) {
+            (_, OperationResult::Accept(fd)) => fd,
+            _ => panic!("server failed to accept()"),
+        };
+
+        let mut nbytes: usize = 0;
+        let mut last_report = Instant::now();
+        loop {
+            let qtoken = self.libos.pop(fd).expect("server failed to pop()");
+            match self.libos.wait2(qtoken) {
+                (_, OperationResult::Pop(_, buf)) => nbytes += buf.len(),
+                _ => panic!("server failed to wait()"),
+            }
+            let elapsed = last_report.elapsed();
+            if elapsed >= Duration::from_secs(1) {
+                println!(
+                    "{:.2} Gbps",
+                    (nbytes * 8) as f64 / elapsed.as_secs_f64() / 1e9
+                );
+                nbytes = 0;
+                last_report = Instant::now();
+            }
+        }
+    }
+
+    /// Connects to the server, returning the connected socket.
+    pub fn connect(&mut self) -> FileDescriptor {
+        let remote_addr = self.addr("client", "connect_to").unwrap();
+        let sockfd = self
+            .libos
+            .socket(libc::AF_INET, libc::SOCK_STREAM, 0)
+            .unwrap();
+        let qtoken = self.libos.connect(sockfd, remote_addr).unwrap();
+        match self.libos.wait2(qtoken) {
+            (_, OperationResult::Connect) => (),
+            _ => panic!("client failed to connect()"),
+        }
+        sockfd
+    }
+}
+
+//==============================================================================
+// Push from Registered Memory
+//==============================================================================
+
+/// Size of the region of application memory that values are pushed from.
+const REGION_SIZE: usize = 2 * 1024 * 1024;
+
+/// Largest segment pushed at once. Larger values are pushed as several segments.
+const MAX_SEGMENT_SIZE: usize = 32 * 1024;
+
+static SEGMENTS_FREED: AtomicUsize = AtomicUsize::new(0);
+
+unsafe extern "C" fn segment_freed(_buf: *mut c_void, _arg: *mut c_void) {
+    SEGMENTS_FREED.fetch_add(1, Ordering::Relaxed);
+}
+
+/// Pushes `value` over `sockfd` in segments of at most `MAX_SEGMENT_SIZE`, returning how many
+/// segments were pushed.
+fn push_value(libos: &mut LibOS<DPDKRuntime>, sockfd: FileDescriptor, value: &[u8]) -> usize {
+    let mm = libos.rt().memory_manager();
+    let mut nsegments = 0;
+    for chunk in value.chunks(MAX_SEGMENT_SIZE) {
+        let sgaseg = dmtr_sgaseg_t {
+            sgaseg_buf: chunk.as_ptr() as *mut _,
+            sgaseg_len: chunk.len() as u32,
+        };
+        let qtoken = libos
+            .push2(sockfd, mm.clone_sgaseg(&sgaseg).unwrap())
+            .expect("client failed to push2()");
+        match libos.wait2(qtoken) {
+            (_, OperationResult::Push) => (),
+            _ => panic!("client failed to wait()"),
+        }
+        nsegments += 1;
+    }
+    nsegments
+}
+
+/// Compares pushing values of 64B to 64KB from memory registered with `register_mem`, which goes
+/// out without copying, against pushing the same values from ordinary heap memory, which is
+/// copied twice. The server just drains the connection.
+#[test]
+fn tcp_push_registered_mem() {
+    let mut test = Test::new();
+    let value_sizes = [64, 256, 1024, 4096, 16 * 1024, 64 * 1024];
+    let duration = Duration::from_secs(2);
+
+    if test.is_server() {
+        test.drain();
+    } else {
+        let sockfd = test.connect();
+
+        let region = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                REGION_SIZE,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_POPULATE,
+                -1,
+                0,
+            )
+        };
+        assert_ne!(region, libc::MAP_FAILED);
+        test.libos
+            .rt()
+            .register_mem(region, REGION_SIZE, Some(segment_freed), ptr::null_mut())
+            .unwrap();
+        let registered = unsafe { std::slice::from_raw_parts_mut(region as *mut u8, REGION_SIZE) };
+        let heap = vec![0u8; REGION_SIZE];
+
+        for &value_size in &value_sizes {
+            for &(label, memory) in &[("registered", &registered[..]), ("heap", &heap[..])] {
+                let nvalues = REGION_SIZE / value_size;
+                let mut npushed: usize = 0;
+                let mut nsegments: usize = 0;
+                let start = Instant::now();
+                while start.elapsed() < duration {
+                    let offset = (npushed % nvalues) * value_size;
+                    let value = &memory[offset..(offset + value_size)];
+                    nsegments += push_value(&mut test.libos, sockfd, value);
+                    npushed += 1;
+                }
+                let elapsed = start.elapsed().as_secs_f64();
+                println!(
+                    "{:>6} B {:>10}: {:.0} values/s, {:.2} Gbps, {} segments",
+                    value_size,
+                    label,
+                    npushed as f64 / elapsed,
+                    (npushed * value_size * 8) as f64 / elapsed / 1e9,
+                    nsegments
+                );
+            }
+        }
+        println!(
+            "{} registered segments released",
+            SEGMENTS_FREED.load(Ordering::Relaxed)
+        );
+    }
+}
+
+//==============================================================================
+// Bulk Push
+//==============================================================================
+
+/// Pushes 1MB messages back to back and reports throughput. Run with `TCP_TSO` (and `TCP_LRO` on
+/// the server) exported to have the NIC segment and coalesce, or without to compare against
+/// software segmentation.
+#[test]
+fn tcp_push_1mb() {
+    let mut test = Test::new();
+    let message_size = 1024 * 1024;
+    let nmessages = 1000;
+
+    if test.is_server() {
+        test.drain();
+    } else {
+        let sockfd = test.connect();
+        let start = Instant::now();
+        for _ in 0..nmessages {
+            // Body `mbuf`s are pushed without a copy, so a message goes out as a run of them.
+            let mut remaining = message_size;
+            while remaining > 0 {
+                let mut pktbuf = test.libos.rt().alloc_body_mbuf();
+                let len = remaining.min(pktbuf.len());
+                pktbuf.trim(pktbuf.len() - len);
+                let qtoken = test
+                    .libos
+                    .push2(sockfd, DPDKBuf::Managed(pktbuf))
+                    .expect("client failed to push2()");
+                match test.libos.wait2(qtoken) {
+                    (_, OperationResult::Push) => (),
+                    _ => panic!("client failed to wait()"),
+                }
+                remaining -= len;
+            }
+        }
+        let elapsed = start.elapsed().as_secs_f64();
+        println!(
+            "{} x {} B: {:.2} Gbps, {} packets dropped",
+            nmessages,
+            message_size,
+            (nmessages * message_size * 8) as f64 / elapsed / 1e9,
+            test.libos.rt().tx_dropped()
+        );
+    }
+}
+
+//==============================================================================
+// Push Against a Nearly Empty Pool
+//==============================================================================
+
+/// Pushes a 64 KB segment of registered memory, which the stack splits into an indirect `mbuf` per
+/// packet, while nearly all of the indirect pool is taken. The push must wait with `EAGAIN` rather
+/// than run the pool dry, and once it's let through with the pool drained anyway, the stack copies
+/// what it can't clone instead of panicking.
+#[test]
+fn tcp_push_nearly_empty_pool() {
+    let mut test = Test::new();
+
+    if test.is_server() {
+        test.drain();
+    } else {
+        let sockfd = test.connect();
+        let mm = test.libos.rt().memory_manager();
+        let mss = test.libos.rt().mss();
+
+        let region = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                REGION_SIZE,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_POPULATE,
+                -1,
+                0,
+            )
+        };
+        assert_ne!(region, libc::MAP_FAILED);
+        test.libos
+            .rt()
+            .register_mem(region, REGION_SIZE, None, ptr::null_mut())
+            .unwrap();
+        let sgaseg = dmtr_sgaseg_t {
+            sgaseg_buf: region,
+            sgaseg_len: 64 * 1024,
+        };
+        let segments = [sgaseg];
+
+        // Hold on to indirect `mbuf`s until a segment's worth more would leave too few behind.
+        let num_packets = (sgaseg.sgaseg_len as usize + mss - 1) / mss;
+        let mut held = vec![];
+        loop {
+            let stats = mm.stats();
+            let avail = stats.indirect_pool_size - stats.indirect_pool_in_use;
+            if avail <= num_packets + 64 {
+                break;
+            }
+            held.push(mm.clone_sgaseg(&sgaseg).unwrap());
+        }
+        assert!(mm.has_headroom(segments.len()));
+        assert!(!mm.has_stream_headroom(&segments, mss));
+
+        // Past the check, the push splits and clones more `mbuf`s than are left.
+        let qtoken = test
+            .libos
+            .push2(sockfd, mm.clone_sgaseg(&sgaseg).unwrap())
+            .expect("client failed to push2()");
+        match test.libos.wait2(qtoken) {
+            (_, OperationResult::Push) => (),
+            _ => panic!("client failed to wait()"),
+        }
+
+        drop(held);
+        assert!(mm.has_stream_headroom(&segments, mss));
+        println!("{:?}", mm.stats());
+    }
+}
+
+//==============================================================================
+// Coalesce Padded Segments
+//==============================================================================
+
+/// Pushes two 1-byte values back to back, which go out in frames padded to the minimum Ethernet
+/// payload. With TSO, the second is chained onto the first, which must not carry the first's
+/// padding into the stream. Run with `TCP_TSO` exported on the client.
+#[test]
+fn tcp_push_tso_padded() {
+    let mut test = Test::new();
+    let values = [b'a', b'b'];
+
+    if test.is_server() {
+        let local_addr = test.addr("server", "bind").unwrap();
+        let sockfd = test
+            .libos
+            .socket(libc::AF_INET, libc::SOCK_STREAM, 0)
+            .unwrap();
+        test.libos.bind(sockfd, local_addr).unwrap();
+        test.libos.listen(sockfd, 8).unwrap();
+        let qtoken = test.libos.accept(sockfd).unwrap();
+        let fd = match test.libos.wait2(qtoken) {
+            (_, OperationResult::Accept(fd)) => fd,
+            _ => panic!("server failed to accept()"),
+        };
+
+        let mut received = vec![];
+        while received.len() < values.len() {
+            let qtoken = test.libos.pop(fd).expect("server failed to pop()");
+            match test.libos.wait2(qtoken) {
+                (_, OperationResult::Pop(_, buf)) => received.extend_from_slice(&buf[..]),
+                _ => panic!("server failed to wait()"),
+            }
+        }
+        assert_eq!(&received[..], &values[..]);
+    } else {
+        assert!(
+            test.config.tcp_tso,
+            "TCP_TSO must be exported on the client"
+        );
+        let sockfd = test.connect();
+        let mm = test.libos.rt().memory_manager();
+
+        // Both pushes are staged before the next flush, so the second can continue the first.
+        let qtokens: Vec<_> = values
+            .iter()
+            .map(|value| {
+                let sgaseg = dmtr_sgaseg_t {
+                    sgaseg_buf: value as *const u8 as *mut _,
+                    sgaseg_len: 1,
+                };
+                let buf = mm.clone_sgaseg(&sgaseg).unwrap();
+                test.libos
+                    .push2(sockfd, buf)
+                    .expect("client failed to push2()")
+            })
+            .collect();
+        for qtoken in qtokens {
+            match test.libos.wait2(qtoken) {
+                (_, OperationResult::Push) => (),
+                _ => panic!("client failed to wait()"),
+            }
+        }
+    }
+}
@@ -15,23 +15,42 @@ use catnip::{
         ip::Port,
         ipv4::Endpoint,
     },
+    runtime::Runtime,
 };
 use catnip_libos::{
+    dpdk::PortConfig,
+    flow::Protocol,
     memory::DPDKBuf,
-    runtime::DPDKRuntime,
+    runtime::{
+        DPDKRuntime,
+        TRANSMIT_BATCH_SIZE,
+    },
+};
+use demikernel::{
+    config::Config,
+    datagram,
+    interop::{
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+    },
+    wait,
 };
-use demikernel::config::Config;
 use dpdk_rs::load_mlx_driver;
 use std::{
     convert::TryFrom,
     env,
+    mem,
     net::Ipv4Addr,
     panic,
     process,
+    slice,
     str::FromStr,
     sync::mpsc,
     thread,
-    time::Duration,
+    time::{
+        Duration,
+        Instant,
+    },
 };
 
 //==============================================================================
@@ -45,26 +64,36 @@ pub struct Test {
 
 impl Test {
     pub fn new() -> Self {
+        Self::with_flow_filter(false)
+    }
+
+    /// With `flow_filter` set, the port only hands this queue what rte_flow rules let through, so
+    /// tests have to allow their ports before binding them.
+    pub fn with_flow_filter(flow_filter: bool) -> Self {
         load_mlx_driver();
         let config = Config::new(std::env::var("CONFIG_PATH").unwrap());
-        let rt = catnip_libos::dpdk::initialize_dpdk(
-            config.local_ipv4_addr,
-            &config.eal_init_args(),
-            config.arp_table(),
-            config.disable_arp,
-            config.use_jumbo_frames,
-            config.mtu,
-            config.mss,
-            config.tcp_checksum_offload,
-            config.udp_checksum_offload,
-        )
+        // Bring up the port with RX interrupts if `RX_INTR_IDLE_POLLS` is exported.
+        let mut queues = catnip_libos::dpdk::initialize_dpdk_queues(PortConfig {
+            tcp_tso: false,
+            tcp_lro: false,
+            num_queues: 1,
+            rss_key: None,
+            rss_reta: None,
+            flow_filter,
+            ..PortConfig::from_config(&config)
+        })
         .unwrap();
-        let libos = LibOS::new(rt).unwrap();
+        let libos = LibOS::new(queues.remove(0).into_runtime()).unwrap();
 
         Self { config, libos }
     }
 
     fn addr(&self, k1: &str, k2: &str) -> Result<Endpoint, Error> {
+        self.addr_offset(k1, k2, 0)
+    }
+
+    /// Address `k1.k2` with `offset` added to its port.
+    fn addr_offset(&self, k1: &str, k2: &str, offset: u16) -> Result<Endpoint, Error> {
         let addr = &self.config.config_obj[k1][k2];
         let host_s = addr["host"]
             .as_str()
@@ -75,10 +104,19 @@ impl Test {
             .as_i64()
             .ok_or(format_err!("Missing port"))
             .unwrap();
-        let port = Port::try_from(port_i as u16).unwrap();
+        let port = Port::try_from(port_i as u16 + offset).unwrap();
         Ok(Endpoint::new(host, port))
     }
 
+    pub fn local_port(&self) -> u16 {
+        let (k1, k2) = if self.is_server() {
+            ("server", "bind")
+        } else {
+            ("client", "client")
+        };
+        self.config.config_obj[k1][k2]["port"].as_i64().unwrap() as u16
+    }
+
     pub fn is_server(&self) -> bool {
         if env::var("PEER").unwrap().eq("server") {
             true
@@ -106,14 +144,18 @@ impl Test {
     }
 
     pub fn mkbuf(&self, fill_char: u8) -> DPDKBuf {
-        assert!(self.config.buffer_size <= self.config.mss);
+        self.mkbuf_of_size(fill_char, self.config.buffer_size)
+    }
+
+    pub fn mkbuf_of_size(&self, fill_char: u8, size: usize) -> DPDKBuf {
+        assert!(size <= self.config.mss);
         let mut pktbuf = self.libos.rt().alloc_body_mbuf();
         let pktbuf_slice = unsafe { pktbuf.slice_mut() };
-        for j in 0..self.config.buffer_size {
+        for j in 0..size {
             pktbuf_slice[j] = fill_char;
         }
         drop(pktbuf_slice);
-        pktbuf.trim(pktbuf.len() - self.config.buffer_size);
+        pktbuf.trim(pktbuf.len() - size);
         DPDKBuf::Managed(pktbuf)
     }
 
@@ -286,3 +328,393 @@ fn udp_ping_pong() {
         }
     }
 }
+
+//==============================================================================
+// Transmit Rate
+//==============================================================================
+
+#[test]
+fn udp_tx_rate() {
+    let mut test = Test::new();
+    let payload: u8 = 'a' as u8;
+    let nsends: usize = 1_000_000;
+    let window: usize = 1024;
+    let packet_size: usize = 64;
+    let local_addr: Endpoint = test.local_addr();
+    let remote_addr: Endpoint = test.remote_addr();
+
+    // Only the client sends; the server just has to be there to keep the link up.
+    if test.is_server() {
+        return;
+    }
+
+    // Setup peer.
+    let sockfd = test
+        .libos
+        .socket(libc::AF_INET, libc::SOCK_DGRAM, 0)
+        .unwrap();
+    test.libos.bind(sockfd, local_addr).unwrap();
+    let sendbuf = test.mkbuf_of_size(payload, packet_size);
+
+    // A batch size of 1 rings the doorbell for every packet.
+    for &batch_size in &[1, TRANSMIT_BATCH_SIZE] {
+        test.libos.rt().set_tx_batch_size(batch_size);
+        let tx_dropped = test.libos.rt().tx_dropped();
+        let start = Instant::now();
+
+        // Issue a whole window of sends before waiting on any of them, so that waiting (which
+        // polls, and so flushes) doesn't cut the batches short.
+        for _ in 0..(nsends / window) {
+            let qtokens: Vec<_> = (0..window)
+                .map(|_| {
+                    test.libos
+                        .pushto2(sockfd, sendbuf.clone(), remote_addr)
+                        .expect("client failed to pushto2()")
+                })
+                .collect();
+            for qtoken in qtokens {
+                test.libos.wait(qtoken);
+            }
+        }
+        test.libos.rt().flush_tx();
+
+        let elapsed = start.elapsed();
+        println!(
+            "tx batch size {}: {:.0} pps ({} dropped)",
+            batch_size,
+            nsends as f64 / elapsed.as_secs_f64(),
+            test.libos.rt().tx_dropped() - tx_dropped
+        );
+    }
+}
+
+//==============================================================================
+// Wait Many
+//==============================================================================
+
+/// Reports how many completions per second `wait_many` hands back as the number of outstanding
+/// pops grows. The client just keeps the server's socket busy.
+#[test]
+fn udp_wait_many() {
+    let mut test = Test::new();
+    let payload: u8 = 'a' as u8;
+    let noutstanding = [1, 64, 1024, 8192];
+    let max_ready: usize = 64;
+    let duration = Duration::from_secs(2);
+    let local_addr: Endpoint = test.local_addr();
+    let remote_addr: Endpoint = test.remote_addr();
+
+    // Setup peer.
+    let sockfd = test
+        .libos
+        .socket(libc::AF_INET, libc::SOCK_DGRAM, 0)
+        .unwrap();
+    test.libos.bind(sockfd, local_addr).unwrap();
+
+    // Run peers.
+    if test.is_server() {
+        let mut qrs = vec![unsafe { mem::zeroed::<dmtr_qresult_t>() }; max_ready];
+        let mut offsets = vec![0; max_ready];
+        for &n in &noutstanding {
+            let mut qtokens: Vec<_> = (0..n)
+                .map(|_| test.libos.pop(sockfd).expect("server failed to pop()"))
+                .collect();
+
+            let mut nevents: usize = 0;
+            let start = Instant::now();
+            while start.elapsed() < duration {
+                let nready = match wait::wait_many(
+                    &mut test.libos,
+                    &qtokens,
+                    &mut qrs,
+                    &mut offsets,
+                    Some(duration),
+                ) {
+                    Ok(nready) => nready,
+                    Err(libc::ETIMEDOUT) => break,
+                    Err(e) => panic!("server failed to wait_many(): {}", e),
+                };
+                for i in 0..nready {
+                    let sga = unsafe { qrs[i].qr_value.sga };
+                    test.libos.rt().free_sgarray(sga.into());
+                    qtokens[offsets[i] as usize] =
+                        test.libos.pop(sockfd).expect("server failed to pop()");
+                }
+                nevents += nready;
+            }
+            println!(
+                "{:>5} outstanding: {:.0} events/s",
+                n,
+                nevents as f64 / start.elapsed().as_secs_f64()
+            );
+        }
+    } else {
+        let sendbuf = test.mkbuf(payload);
+        let start = Instant::now();
+        while start.elapsed() < duration * (noutstanding.len() as u32 + 1) {
+            let qtoken = test
+                .libos
+                .pushto2(sockfd, sendbuf.clone(), remote_addr)
+                .expect("client failed to pushto2()");
+            test.libos.wait(qtoken);
+        }
+    }
+}
+
+//==============================================================================
+// Adaptive Polling
+//==============================================================================
+
+/// CPU time consumed by the calling thread so far.
+fn thread_cpu_time() -> Duration {
+    let mut usage: libc::rusage = unsafe { mem::zeroed() };
+    assert_eq!(unsafe { libc::getrusage(libc::RUSAGE_THREAD, &mut usage) }, 0);
+    let to_duration =
+        |tv: libc::timeval| Duration::new(tv.tv_sec as u64, tv.tv_usec as u32 * 1000);
+    to_duration(usage.ru_utime) + to_duration(usage.ru_stime)
+}
+
+/// Trades latency for CPU: the client sends a ping every millisecond, and the server echoes them
+/// while sleeping on RX interrupts after different numbers of empty polls. The server reports its
+/// CPU usage and the client reports round-trip times for each setting. Export
+/// `RX_INTR_IDLE_POLLS` on the server so that the port comes up with RX interrupts.
+#[test]
+fn udp_ping_pong_adaptive() {
+    let mut test = Test::new();
+    let payload: u8 = 'a' as u8;
+    let idle_polls = [None, Some(100_000), Some(10_000), Some(1_000), Some(100), Some(10)];
+    let npings: usize = 2000;
+    let interval = Duration::from_millis(1);
+    let local_addr: Endpoint = test.local_addr();
+    let remote_addr: Endpoint = test.remote_addr();
+
+    // Setup peer.
+    let sockfd = test
+        .libos
+        .socket(libc::AF_INET, libc::SOCK_DGRAM, 0)
+        .unwrap();
+    test.libos.bind(sockfd, local_addr).unwrap();
+
+    // Run peers.
+    for &n in &idle_polls {
+        if test.is_server() {
+            test.libos.rt().set_rx_intr_idle_polls(n);
+            let rx_sleeps = test.libos.rt().rx_sleeps();
+            let start = Instant::now();
+            let cpu_start = thread_cpu_time();
+            for _ in 0..npings {
+                let qtoken = test.libos.pop(sockfd).expect("server failed to pop()");
+                let recvbuf = match test.libos.wait2(qtoken) {
+                    (_, OperationResult::Pop(_, buf)) => buf,
+                    _ => panic!("server failed to wait()"),
+                };
+                let qtoken = test
+                    .libos
+                    .pushto2(sockfd, recvbuf, remote_addr)
+                    .expect("server failed to pushto2()");
+                test.libos.wait(qtoken);
+            }
+            let cpu = thread_cpu_time() - cpu_start;
+            println!(
+                "idle polls {:>8?}: {:.1}% CPU, {} sleeps",
+                n,
+                100.0 * cpu.as_secs_f64() / start.elapsed().as_secs_f64(),
+                test.libos.rt().rx_sleeps() - rx_sleeps
+            );
+        } else {
+            let sendbuf = test.mkbuf(payload);
+            let mut rtts: Vec<Duration> = Vec::with_capacity(npings);
+            for _ in 0..npings {
+                thread::sleep(interval);
+                let start = Instant::now();
+                let qtoken = test
+                    .libos
+                    .pushto2(sockfd, sendbuf.clone(), remote_addr)
+                    .expect("client failed to pushto2()");
+                test.libos.wait(qtoken);
+                let qtoken = test.libos.pop(sockfd).expect("client failed to pop()");
+                match test.libos.wait2(qtoken) {
+                    (_, OperationResult::Pop(..)) => (),
+                    _ => panic!("client failed to wait()"),
+                }
+                rtts.push(start.elapsed());
+            }
+            rtts.sort();
+            println!(
+                "idle polls {:>8?}: p50 {:?}, p99 {:?}",
+                n,
+                rtts[npings / 2],
+                rtts[npings * 99 / 100]
+            );
+        }
+    }
+}
+
+//==============================================================================
+// Flow Filter
+//==============================================================================
+
+/// Ping-pongs with RX filtered in hardware. The client first sprays a port the server never
+/// allows, which the NIC should drop and count rather than hand to the server.
+#[test]
+fn udp_flow_filter() {
+    let mut test = Test::with_flow_filter(true);
+    let npongs: usize = 100;
+    let payload: u8 = 'a' as u8;
+    let local_addr: Endpoint = test.local_addr();
+    let remote_addr: Endpoint = test.remote_addr();
+
+    // Setup peer.
+    let sockfd = test
+        .libos
+        .socket(libc::AF_INET, libc::SOCK_DGRAM, 0)
+        .unwrap();
+    test.libos
+        .rt()
+        .allow_port(Protocol::Udp, test.local_port())
+        .expect("failed to allow port");
+    test.libos.bind(sockfd, local_addr).unwrap();
+
+    let sendbuf = test.mkbuf(payload);
+    let pong = |test: &mut Test| {
+        let qtoken = test.libos.pop(sockfd).expect("failed to pop()");
+        let recvbuf = match test.libos.wait2(qtoken) {
+            (_, OperationResult::Pop(_, buf)) => buf,
+            _ => panic!("failed to wait()"),
+        };
+        assert!(
+            Test::bufcmp(sendbuf.clone(), recvbuf),
+            "sendbuf != recvbuf"
+        );
+    };
+
+    // Run peers.
+    if test.is_server() {
+        for _ in 0..npongs {
+            pong(&mut test);
+            let qtoken = test
+                .libos
+                .pushto2(sockfd, sendbuf.clone(), remote_addr)
+                .expect("server failed to pushto2()");
+            test.libos.wait(qtoken);
+        }
+        println!("{} packets filtered", test.libos.rt().rx_filtered());
+    } else {
+        let blocked = test.addr_offset("client", "connect_to", 1).unwrap();
+        for _ in 0..npongs {
+            let qtoken = test
+                .libos
+                .pushto2(sockfd, sendbuf.clone(), blocked)
+                .expect("client failed to pushto2()");
+            test.libos.wait(qtoken);
+        }
+        for _ in 0..npongs {
+            let qtoken = test
+                .libos
+                .pushto2(sockfd, sendbuf.clone(), remote_addr)
+                .expect("client failed to pushto2()");
+            test.libos.wait(qtoken);
+            pong(&mut test);
+        }
+    }
+}
+
+//==============================================================================
+// Batch
+//==============================================================================
+
+#[test]
+fn udp_batch() {
+    let mut test = Test::new();
+    let payload: u8 = 'a' as u8;
+    let nrounds: usize = 100;
+    let batch_size: usize = 16;
+    let local_addr: Endpoint = test.local_addr();
+    let remote_addr: Endpoint = test.remote_addr();
+
+    // Setup peer.
+    let sockfd = test
+        .libos
+        .socket(libc::AF_INET, libc::SOCK_DGRAM, 0)
+        .unwrap();
+    test.libos.bind(sockfd, local_addr).unwrap();
+
+    let mut sgas = vec![dmtr_sgarray_t::empty(); batch_size];
+    let mut saddrs = vec![unsafe { mem::zeroed::<libc::sockaddr_in>() }; batch_size];
+    // Pops until `n` datagrams have arrived, checking their payloads.
+    let popfrom = |test: &mut Test,
+                   sgas: &mut [dmtr_sgarray_t],
+                   saddrs: &mut [libc::sockaddr_in],
+                   n: usize| {
+        let mut npopped = 0;
+        while npopped < n {
+            let k = match datagram::popfrom(
+                &mut test.libos,
+                sockfd,
+                &mut sgas[npopped..n],
+                &mut saddrs[npopped..n],
+            ) {
+                Ok(k) => k,
+                Err(libc::EAGAIN) => continue,
+                Err(e) => panic!("failed to popfrom(): {}", e),
+            };
+            for sga in &sgas[npopped..npopped + k] {
+                assert_eq!(sga.sga_numsegs, 1);
+                let seg = sga.sga_segs[0];
+                let len = seg.sgaseg_len as usize;
+                let data = unsafe { slice::from_raw_parts(seg.sgaseg_buf as *const u8, len) };
+                assert_eq!(data.len(), test.config.buffer_size);
+                assert!(data.iter().all(|&b| b == payload), "sendbuf != recvbuf");
+            }
+            npopped += k;
+        }
+    };
+
+    // Run peers.
+    if test.is_server() {
+        for _ in 0..nrounds {
+            popfrom(&mut test, &mut sgas, &mut saddrs, batch_size);
+            let sender = (saddrs[0].sin_addr.s_addr, saddrs[0].sin_port);
+            assert!(saddrs
+                .iter()
+                .all(|s| (s.sin_addr.s_addr, s.sin_port) == sender));
+
+            // Echo the batch back to whoever sent it.
+            let mm = test.libos.rt().memory_manager();
+            let mut npushed = 0;
+            while npushed < batch_size {
+                match datagram::pushto_many(
+                    &mut test.libos,
+                    sockfd,
+                    &sgas[npushed..],
+                    &saddrs[npushed..],
+                    |sga| mm.clone_sgarray(sga),
+                ) {
+                    Ok(k) => npushed += k,
+                    Err(e) => panic!("server failed to pushto_many(): {}", e),
+                }
+            }
+            test.libos.rt().flush_tx();
+            for sga in &sgas {
+                test.libos.rt().free_sgarray((*sga).into());
+            }
+        }
+    } else {
+        let sendbuf = test.mkbuf(payload);
+        for _ in 0..nrounds {
+            for _ in 0..batch_size {
+                let qtoken = test
+                    .libos
+                    .pushto2(sockfd, sendbuf.clone(), remote_addr)
+                    .expect("client failed to pushto2()");
+                test.libos.wait(qtoken);
+            }
+            popfrom(&mut test, &mut sgas, &mut saddrs, batch_size);
+            for sga in &sgas {
+                test.libos.rt().free_sgarray((*sga).into());
+            }
+        }
+    }
+    datagram::forget(&mut test.libos, sockfd);
+    test.libos.close(sockfd).unwrap();
+}
@@ -0,0 +1,186 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! ARP replies shared between the libOSes of a process on the same port.
+//!
+//! RSS and `PACKET_FANOUT_HASH` spread frames over queues by their IP header, so every ARP frame
+//! lands on one queue, and without a static ARP table only that queue's libOS would ever resolve
+//! an address. Each libOS joins the group of its port, copies the ARP replies it receives to the
+//! rest of the group, and hands its stack the replies the others copied to it.
+//!
+//! Only replies are copied: a request for our address is answered by the queue that got it, and
+//! the others learn the requester's address once they ask for it themselves.
+
+use std::{
+    collections::HashMap,
+    lazy::SyncLazy,
+    sync::{
+        atomic::{
+            AtomicBool,
+            Ordering,
+        },
+        Arc,
+        Mutex,
+        Weak,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+const ETHERTYPE_OFFSET: usize = 12;
+const ETHERTYPE_ARP: [u8; 2] = [0x08, 0x06];
+
+/// Offset of the ARP operation in the frame, past the Ethernet header and the address formats.
+const ARP_OPER_OFFSET: usize = 20;
+const ARP_OPER_REPLY: [u8; 2] = [0x00, 0x02];
+
+/// Replies waiting for a libOS that hasn't received in a while are dropped past this; ARP
+/// requests are retried anyway.
+const MAX_PENDING: usize = 64;
+
+/// Members of each group, by group key (the DPDK port or the interface index).
+static GROUPS: SyncLazy<Mutex<HashMap<u64, Vec<Weak<Inbox>>>>> =
+    SyncLazy::new(|| Mutex::new(HashMap::new()));
+
+#[derive(Default)]
+struct Inbox {
+    // Set whenever `frames` is non-empty, so that receiving doesn't take the lock.
+    pending: AtomicBool,
+    frames: Mutex<Vec<Vec<u8>>>,
+}
+
+/// Membership of a libOS in the group of its port.
+pub struct ArpMirror {
+    group: u64,
+    inbox: Arc<Inbox>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl ArpMirror {
+    pub fn join(group: u64) -> Self {
+        let inbox = Arc::new(Inbox::default());
+        let mut groups = GROUPS.lock().unwrap();
+        let members = groups.entry(group).or_default();
+        members.retain(|m| m.strong_count() > 0);
+        members.push(Arc::downgrade(&inbox));
+        Self { group, inbox }
+    }
+
+    /// Copies `frame` to the other members of the group, if it's an ARP reply.
+    #[inline]
+    pub fn tap(&self, frame: &[u8]) {
+        if is_arp_reply(frame) {
+            self.publish(frame);
+        }
+    }
+
+    /// Calls `f` on up to `max` replies the other members copied here.
+    #[inline]
+    pub fn drain(&self, max: usize, f: impl FnMut(Vec<u8>)) {
+        if max == 0 || !self.inbox.pending.load(Ordering::Acquire) {
+            return;
+        }
+        let mut frames = self.inbox.frames.lock().unwrap();
+        let n = std::cmp::min(max, frames.len());
+        frames.drain(..n).for_each(f);
+        self.inbox
+            .pending
+            .store(!frames.is_empty(), Ordering::Release);
+    }
+
+    fn publish(&self, frame: &[u8]) {
+        let groups = GROUPS.lock().unwrap();
+        let members = match groups.get(&self.group) {
+            Some(members) => members,
+            None => return,
+        };
+        for member in members.iter().filter_map(Weak::upgrade) {
+            if Arc::ptr_eq(&member, &self.inbox) {
+                continue;
+            }
+            let mut frames = member.frames.lock().unwrap();
+            if frames.len() < MAX_PENDING {
+                frames.push(frame.to_vec());
+                member.pending.store(true, Ordering::Release);
+            }
+        }
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Drop for ArpMirror {
+    fn drop(&mut self) {
+        let mut groups = GROUPS.lock().unwrap();
+        if let Some(members) = groups.get_mut(&self.group) {
+            members.retain(|m| m.strong_count() > 0 && !m.ptr_eq(&Arc::downgrade(&self.inbox)));
+        }
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+pub fn is_arp_reply(frame: &[u8]) -> bool {
+    frame.len() >= ARP_OPER_OFFSET + 2
+        && frame[ETHERTYPE_OFFSET..ETHERTYPE_OFFSET + 2] == ETHERTYPE_ARP
+        && frame[ARP_OPER_OFFSET..ARP_OPER_OFFSET + 2] == ARP_OPER_REPLY
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn arp(oper: u8) -> Vec<u8> {
+        let mut frame = vec![0u8; 42];
+        frame[12..14].copy_from_slice(&ETHERTYPE_ARP);
+        frame[21] = oper;
+        frame
+    }
+
+    #[test]
+    fn replies_reach_the_rest_of_the_group() {
+        let a = ArpMirror::join(7);
+        let b = ArpMirror::join(7);
+        let other_port = ArpMirror::join(8);
+
+        a.tap(&arp(1));
+        a.tap(&arp(2));
+
+        let mut got = vec![];
+        b.drain(usize::MAX, |f| got.push(f));
+        assert_eq!(got, vec![arp(2)]);
+
+        let mut none = vec![];
+        a.drain(usize::MAX, |f| none.push(f));
+        other_port.drain(usize::MAX, |f| none.push(f));
+        assert!(none.is_empty());
+    }
+
+    #[test]
+    fn drain_stops_at_max() {
+        let a = ArpMirror::join(9);
+        let b = ArpMirror::join(9);
+        a.tap(&arp(2));
+        a.tap(&arp(2));
+
+        let mut n = 0;
+        b.drain(1, |_| n += 1);
+        assert_eq!(n, 1);
+        b.drain(usize::MAX, |_| n += 1);
+        assert_eq!(n, 2);
+        assert!(!b.inbox.pending.load(Ordering::Acquire));
+    }
+}
@@ -0,0 +1,279 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Drains the capture rings of a running libOS (see the `capture` section of the config) into a
+//! pcapng file, with one interface per ring. Frames are written in the order each ring holds
+//! them, so frames of different rings may be out of order with respect to each other.
+
+use anyhow::Error;
+use clap::{
+    App,
+    Arg,
+};
+use demikernel::capture::{
+    CaptureReader,
+    CaptureRecord,
+    Direction,
+};
+use std::{
+    fs::File,
+    io::{
+        BufWriter,
+        Write,
+    },
+    process,
+    sync::atomic::{
+        AtomicBool,
+        Ordering,
+    },
+    thread,
+    time::{
+        Duration,
+        Instant,
+        SystemTime,
+        UNIX_EPOCH,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+const SECTION_HEADER_BLOCK: u32 = 0x0a0d_0d0a;
+const INTERFACE_DESCRIPTION_BLOCK: u32 = 1;
+const INTERFACE_STATISTICS_BLOCK: u32 = 5;
+const ENHANCED_PACKET_BLOCK: u32 = 6;
+
+const OPT_ENDOFOPT: u16 = 0;
+const SHB_USERAPPL: u16 = 4;
+const IF_NAME: u16 = 2;
+const IF_TSRESOL: u16 = 9;
+const EPB_FLAGS: u16 = 2;
+const ISB_IFDROP: u16 = 5;
+
+/// How long to sleep when none of the rings had anything for us.
+const IDLE_SLEEP: Duration = Duration::from_millis(1);
+
+static STOP: AtomicBool = AtomicBool::new(false);
+
+/// Writes pcapng blocks, which all end in their length, hence the staging buffer.
+struct PcapngWriter {
+    out: BufWriter<File>,
+    block: Vec<u8>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl PcapngWriter {
+    fn new(path: &str) -> Result<Self, Error> {
+        let mut writer = Self {
+            out: BufWriter::new(File::create(path)?),
+            block: Vec::with_capacity(128 << 10),
+        };
+        writer.begin(SECTION_HEADER_BLOCK);
+        writer.put_u32(0x1a2b_3c4d);
+        writer.put_u16(1);
+        writer.put_u16(0);
+        // Section length unknown.
+        writer.put_u64(u64::MAX);
+        writer.put_option(SHB_USERAPPL, b"dmtr-capture");
+        writer.end_options();
+        writer.end()?;
+        Ok(writer)
+    }
+
+    fn interface(&mut self, name: &str, linktype: u32, snaplen: usize) -> Result<(), Error> {
+        self.begin(INTERFACE_DESCRIPTION_BLOCK);
+        self.put_u16(linktype as u16);
+        self.put_u16(0);
+        self.put_u32(snaplen as u32);
+        self.put_option(IF_NAME, name.as_bytes());
+        // Timestamps are in nanoseconds.
+        self.put_option(IF_TSRESOL, &[9]);
+        self.end_options();
+        self.end()
+    }
+
+    fn packet(&mut self, interface_id: u32, record: &CaptureRecord) -> Result<(), Error> {
+        self.begin(ENHANCED_PACKET_BLOCK);
+        self.put_u32(interface_id);
+        self.put_timestamp(record.timestamp_ns);
+        self.put_u32(record.data.len() as u32);
+        self.put_u32(record.wire_len as u32);
+        self.put_padded(record.data);
+        let flags: u32 = match record.direction {
+            Direction::Inbound => 1,
+            Direction::Outbound => 2,
+        };
+        self.put_option(EPB_FLAGS, &flags.to_le_bytes());
+        self.end_options();
+        self.end()
+    }
+
+    fn statistics(&mut self, interface_id: u32, dropped: u64) -> Result<(), Error> {
+        let now_ns = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .map_or(0, |d| d.as_nanos() as u64);
+        self.begin(INTERFACE_STATISTICS_BLOCK);
+        self.put_u32(interface_id);
+        self.put_timestamp(now_ns);
+        self.put_option(ISB_IFDROP, &dropped.to_le_bytes());
+        self.end_options();
+        self.end()
+    }
+
+    fn flush(&mut self) -> Result<(), Error> {
+        Ok(self.out.flush()?)
+    }
+
+    fn begin(&mut self, block_type: u32) {
+        self.block.clear();
+        self.put_u32(block_type);
+        // Filled in by `end()`.
+        self.put_u32(0);
+    }
+
+    fn end(&mut self) -> Result<(), Error> {
+        let len = (self.block.len() + 4) as u32;
+        self.block[4..8].copy_from_slice(&len.to_le_bytes());
+        self.put_u32(len);
+        self.out.write_all(&self.block)?;
+        Ok(())
+    }
+
+    fn put_u16(&mut self, n: u16) {
+        self.block.extend_from_slice(&n.to_le_bytes());
+    }
+
+    fn put_u32(&mut self, n: u32) {
+        self.block.extend_from_slice(&n.to_le_bytes());
+    }
+
+    fn put_u64(&mut self, n: u64) {
+        self.block.extend_from_slice(&n.to_le_bytes());
+    }
+
+    fn put_timestamp(&mut self, ns: u64) {
+        self.put_u32((ns >> 32) as u32);
+        self.put_u32(ns as u32);
+    }
+
+    fn put_padded(&mut self, data: &[u8]) {
+        self.block.extend_from_slice(data);
+        let padding = (4 - data.len() % 4) % 4;
+        self.block.extend_from_slice(&[0; 3][..padding]);
+    }
+
+    fn put_option(&mut self, code: u16, value: &[u8]) {
+        self.put_u16(code);
+        self.put_u16(value.len() as u16);
+        self.put_padded(value);
+    }
+
+    fn end_options(&mut self) {
+        self.put_u16(OPT_ENDOFOPT);
+        self.put_u16(0);
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+extern "C" fn stop(_: libc::c_int) {
+    STOP.store(true, Ordering::Relaxed);
+}
+
+fn run() -> Result<(), Error> {
+    let matches = App::new("dmtr-capture")
+        .about("Writes the frames a libOS captures to a pcapng file, until interrupted.")
+        .arg(
+            Arg::with_name("output")
+                .short("o")
+                .long("output")
+                .takes_value(true)
+                .required(true)
+                .help("pcapng file to write"),
+        )
+        .arg(
+            Arg::with_name("count")
+                .long("count")
+                .takes_value(true)
+                .help("Stop after this many frames"),
+        )
+        .arg(
+            Arg::with_name("seconds")
+                .long("seconds")
+                .takes_value(true)
+                .help("Stop after this many seconds"),
+        )
+        .arg(
+            Arg::with_name("rings")
+                .multiple(true)
+                .required(true)
+                .help("Capture rings to drain, e.g. /dev/shm/dmtr-capture-0"),
+        )
+        .get_matches();
+    let count = match matches.value_of("count") {
+        Some(count) => Some(count.parse::<usize>()?),
+        None => None,
+    };
+    let deadline = match matches.value_of("seconds") {
+        Some(seconds) => Some(Instant::now() + Duration::from_secs_f64(seconds.parse()?)),
+        None => None,
+    };
+
+    let ring_paths: Vec<&str> = matches.values_of("rings").unwrap().collect();
+    let mut readers = ring_paths
+        .iter()
+        .map(|path| CaptureReader::open(path))
+        .collect::<Result<Vec<_>, Error>>()?;
+    let mut writer = PcapngWriter::new(matches.value_of("output").unwrap())?;
+    for (path, reader) in ring_paths.iter().zip(&readers) {
+        writer.interface(path, reader.linktype(), reader.snaplen())?;
+    }
+
+    unsafe {
+        libc::signal(libc::SIGINT, stop as libc::sighandler_t);
+        libc::signal(libc::SIGTERM, stop as libc::sighandler_t);
+    }
+    let mut num_frames = 0;
+    while !STOP.load(Ordering::Relaxed) {
+        if count.map_or(false, |count| num_frames >= count)
+            || deadline.map_or(false, |deadline| Instant::now() >= deadline)
+        {
+            break;
+        }
+        let mut num_drained = 0;
+        for (interface_id, reader) in readers.iter_mut().enumerate() {
+            let mut result = Ok(());
+            num_drained += reader.drain(|record| {
+                if result.is_ok() && count.map_or(true, |count| num_frames < count) {
+                    result = writer.packet(interface_id as u32, record);
+                    num_frames += 1;
+                }
+            });
+            result?;
+        }
+        if num_drained == 0 {
+            writer.flush()?;
+            thread::sleep(IDLE_SLEEP);
+        }
+    }
+
+    for (interface_id, reader) in readers.iter().enumerate() {
+        writer.statistics(interface_id as u32, reader.dropped())?;
+    }
+    writer.flush()?;
+    eprintln!("dmtr-capture: {} frames", num_frames);
+    Ok(())
+}
+
+fn main() {
+    if let Err(e) = run() {
+        eprintln!("dmtr-capture: {:?}", e);
+        process::exit(1);
+    }
+}
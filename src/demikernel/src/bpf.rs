@@ -0,0 +1,460 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Interpreter for classic BPF programs, which filter captured frames the way `tcpdump` does.
+//! There's no compiler here: programs come from `tcpdump -ddd <expression>`, whose output is the
+//! number of instructions followed by one `code jt jf k` line per instruction.
+
+use anyhow::{
+    bail,
+    format_err,
+    Error,
+};
+use std::convert::TryFrom;
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+// Instruction classes.
+const BPF_LD: u16 = 0x00;
+const BPF_LDX: u16 = 0x01;
+const BPF_ST: u16 = 0x02;
+const BPF_STX: u16 = 0x03;
+const BPF_ALU: u16 = 0x04;
+const BPF_JMP: u16 = 0x05;
+const BPF_RET: u16 = 0x06;
+const BPF_MISC: u16 = 0x07;
+
+// Load sizes.
+const BPF_W: u16 = 0x00;
+const BPF_H: u16 = 0x08;
+const BPF_B: u16 = 0x10;
+
+// Load modes.
+const BPF_IMM: u16 = 0x00;
+const BPF_ABS: u16 = 0x20;
+const BPF_IND: u16 = 0x40;
+const BPF_MEM: u16 = 0x60;
+const BPF_LEN: u16 = 0x80;
+const BPF_MSH: u16 = 0xa0;
+
+// ALU operations and jumps.
+const BPF_ADD: u16 = 0x00;
+const BPF_SUB: u16 = 0x10;
+const BPF_MUL: u16 = 0x20;
+const BPF_DIV: u16 = 0x30;
+const BPF_OR: u16 = 0x40;
+const BPF_AND: u16 = 0x50;
+const BPF_LSH: u16 = 0x60;
+const BPF_RSH: u16 = 0x70;
+const BPF_NEG: u16 = 0x80;
+const BPF_MOD: u16 = 0x90;
+const BPF_XOR: u16 = 0xa0;
+const BPF_JA: u16 = 0x00;
+const BPF_JEQ: u16 = 0x10;
+const BPF_JGT: u16 = 0x20;
+const BPF_JGE: u16 = 0x30;
+const BPF_JSET: u16 = 0x40;
+
+// Operand sources, and what `BPF_RET` returns.
+const BPF_K: u16 = 0x00;
+const BPF_X: u16 = 0x08;
+const BPF_A: u16 = 0x10;
+
+// `BPF_MISC` operations.
+const BPF_TAX: u16 = 0x00;
+const BPF_TXA: u16 = 0x80;
+
+/// Number of words of scratch memory.
+const BPF_MEMWORDS: usize = 16;
+
+/// Longest program the kernel accepts.
+const BPF_MAXINSNS: usize = 4096;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Instruction {
+    pub code: u16,
+    pub jt: u8,
+    pub jf: u8,
+    pub k: u32,
+}
+
+/// Second operand of an ALU operation or a conditional jump.
+#[derive(Clone, Copy, Debug)]
+enum Src {
+    K(u32),
+    X,
+}
+
+#[derive(Clone, Copy, Debug)]
+enum AluOp {
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Mod,
+    Or,
+    And,
+    Xor,
+    Lsh,
+    Rsh,
+}
+
+#[derive(Clone, Copy, Debug)]
+enum JmpOp {
+    Jeq,
+    Jgt,
+    Jge,
+    Jset,
+}
+
+/// An instruction decoded up front, so that running a program takes a single match per
+/// instruction. Jump offsets and scratch memory indices have been checked.
+#[derive(Clone, Copy, Debug)]
+enum Op {
+    LdAbs { size: usize, k: u32 },
+    LdInd { size: usize, k: u32 },
+    LdImm(u32),
+    LdMem(usize),
+    LdLen,
+    LdxImm(u32),
+    LdxMem(usize),
+    LdxLen,
+    LdxMsh(u32),
+    St(usize),
+    Stx(usize),
+    Alu(AluOp, Src),
+    Neg,
+    Ja(usize),
+    Jmp(JmpOp, Src, usize, usize),
+    RetK(u32),
+    RetA,
+    RetX,
+    Tax,
+    Txa,
+}
+
+/// A classic BPF program that has been checked to always terminate without going out of bounds.
+#[derive(Clone, Debug)]
+pub struct BpfProgram {
+    ops: Vec<Op>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl BpfProgram {
+    /// Checks `instructions` the way the kernel's `bpf_check_classic()` does: jumps only go
+    /// forward and land inside the program, scratch memory accesses are in bounds, there's no
+    /// division by a zero constant, and the program ends in a return.
+    pub fn new(instructions: Vec<Instruction>) -> Result<Self, Error> {
+        if instructions.is_empty() || instructions.len() > BPF_MAXINSNS {
+            bail!("BPF program has {} instructions", instructions.len());
+        }
+        let len = instructions.len();
+        let mut ops = Vec::with_capacity(len);
+        for (pc, insn) in instructions.iter().enumerate() {
+            match decode(insn, len - pc - 1) {
+                Some(op) => ops.push(op),
+                None => bail!("Invalid BPF instruction {} at {}", insn.code, pc),
+            }
+        }
+        if !matches!(ops[len - 1], Op::RetK(..) | Op::RetA | Op::RetX) {
+            bail!("BPF program doesn't end in a return");
+        }
+        Ok(Self { ops })
+    }
+
+    /// Parses the output of `tcpdump -ddd`. Instructions may also be separated by commas, as in
+    /// the bytecode that `iptables -m bpf` takes.
+    pub fn parse(s: &str) -> Result<Self, Error> {
+        let mut lines = s
+            .split(|c| c == '\n' || c == ',')
+            .map(str::trim)
+            .filter(|l| !l.is_empty());
+        let count: usize = lines
+            .next()
+            .ok_or_else(|| format_err!("Empty BPF program"))?
+            .parse()?;
+        let mut instructions = Vec::with_capacity(count);
+        for line in lines {
+            let fields = line
+                .split_whitespace()
+                .map(|f| f.parse::<u32>())
+                .collect::<Result<Vec<_>, _>>()?;
+            match fields[..] {
+                [code, jt, jf, k] => instructions.push(Instruction {
+                    code: u16::try_from(code)?,
+                    jt: u8::try_from(jt)?,
+                    jf: u8::try_from(jf)?,
+                    k,
+                }),
+                _ => bail!("Malformed BPF instruction `{}`", line),
+            }
+        }
+        if instructions.len() != count {
+            bail!(
+                "Expected {} BPF instructions, got {}",
+                count,
+                instructions.len()
+            );
+        }
+        Self::new(instructions)
+    }
+
+    /// Runs the program over `pkt`, which holds the first bytes of a frame of `wire_len` bytes.
+    /// Returns how many bytes of the frame to keep, or 0 to reject it. Loads past the end of
+    /// `pkt` reject the frame, as they do in the kernel.
+    pub fn run(&self, pkt: &[u8], wire_len: usize) -> u32 {
+        let mut a: u32 = 0;
+        let mut x: u32 = 0;
+        let mut mem = [0u32; BPF_MEMWORDS];
+        let mut pc = 0;
+        loop {
+            let op = self.ops[pc];
+            pc += 1;
+            match op {
+                Op::LdAbs { size, k } => match load(pkt, k as usize, size) {
+                    Some(v) => a = v,
+                    None => return 0,
+                },
+                Op::LdInd { size, k } => match load(pkt, x.wrapping_add(k) as usize, size) {
+                    Some(v) => a = v,
+                    None => return 0,
+                },
+                Op::LdImm(k) => a = k,
+                Op::LdMem(i) => a = mem[i],
+                Op::LdLen => a = wire_len as u32,
+                Op::LdxImm(k) => x = k,
+                Op::LdxMem(i) => x = mem[i],
+                Op::LdxLen => x = wire_len as u32,
+                Op::LdxMsh(k) => match pkt.get(k as usize) {
+                    Some(&b) => x = ((b & 0xf) as u32) << 2,
+                    None => return 0,
+                },
+                Op::St(i) => mem[i] = a,
+                Op::Stx(i) => mem[i] = x,
+                Op::Alu(alu, src) => {
+                    let operand = match src {
+                        Src::K(k) => k,
+                        Src::X => x,
+                    };
+                    a = match alu {
+                        AluOp::Add => a.wrapping_add(operand),
+                        AluOp::Sub => a.wrapping_sub(operand),
+                        AluOp::Mul => a.wrapping_mul(operand),
+                        AluOp::Div | AluOp::Mod if operand == 0 => return 0,
+                        AluOp::Div => a / operand,
+                        AluOp::Mod => a % operand,
+                        AluOp::Or => a | operand,
+                        AluOp::And => a & operand,
+                        AluOp::Xor => a ^ operand,
+                        AluOp::Lsh => a.checked_shl(operand).unwrap_or(0),
+                        AluOp::Rsh => a.checked_shr(operand).unwrap_or(0),
+                    };
+                },
+                Op::Neg => a = a.wrapping_neg(),
+                Op::Ja(offset) => pc += offset,
+                Op::Jmp(jmp, src, jt, jf) => {
+                    let operand = match src {
+                        Src::K(k) => k,
+                        Src::X => x,
+                    };
+                    let taken = match jmp {
+                        JmpOp::Jeq => a == operand,
+                        JmpOp::Jgt => a > operand,
+                        JmpOp::Jge => a >= operand,
+                        JmpOp::Jset => a & operand != 0,
+                    };
+                    pc += if taken { jt } else { jf };
+                },
+                Op::RetK(k) => return k,
+                Op::RetA => return a,
+                Op::RetX => return x,
+                Op::Tax => x = a,
+                Op::Txa => a = x,
+            }
+        }
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Decodes an instruction followed by `remaining` others, or returns `None` if it isn't valid
+/// there.
+fn decode(insn: &Instruction, remaining: usize) -> Option<Op> {
+    let code = insn.code;
+    let k = insn.k;
+    let src = if code & BPF_X != 0 { Src::X } else { Src::K(k) };
+    let mem_index = if (k as usize) < BPF_MEMWORDS {
+        Some(k as usize)
+    } else {
+        None
+    };
+    let size = match code & 0x18 {
+        BPF_W => Some(4),
+        BPF_H => Some(2),
+        BPF_B => Some(1),
+        _ => None,
+    };
+    let op = match code & 0x07 {
+        BPF_LD => match code & 0xe0 {
+            BPF_ABS => Op::LdAbs { size: size?, k },
+            BPF_IND => Op::LdInd { size: size?, k },
+            BPF_IMM => Op::LdImm(k),
+            BPF_MEM => Op::LdMem(mem_index?),
+            BPF_LEN => Op::LdLen,
+            _ => return None,
+        },
+        BPF_LDX => match code & 0xe0 {
+            BPF_IMM => Op::LdxImm(k),
+            BPF_MEM => Op::LdxMem(mem_index?),
+            BPF_LEN => Op::LdxLen,
+            BPF_MSH if code == BPF_LDX | BPF_B | BPF_MSH => Op::LdxMsh(k),
+            _ => return None,
+        },
+        BPF_ST => Op::St(mem_index?),
+        BPF_STX => Op::Stx(mem_index?),
+        BPF_ALU => {
+            let alu = match code & 0xf0 {
+                BPF_NEG => return Some(Op::Neg),
+                BPF_ADD => AluOp::Add,
+                BPF_SUB => AluOp::Sub,
+                BPF_MUL => AluOp::Mul,
+                BPF_DIV if code & BPF_X != 0 || k != 0 => AluOp::Div,
+                BPF_MOD if code & BPF_X != 0 || k != 0 => AluOp::Mod,
+                BPF_OR => AluOp::Or,
+                BPF_AND => AluOp::And,
+                BPF_XOR => AluOp::Xor,
+                BPF_LSH if code & BPF_X != 0 || k < 32 => AluOp::Lsh,
+                BPF_RSH if code & BPF_X != 0 || k < 32 => AluOp::Rsh,
+                _ => return None,
+            };
+            Op::Alu(alu, src)
+        },
+        BPF_JMP => {
+            let jmp = match code & 0xf0 {
+                BPF_JA if (k as usize) < remaining => return Some(Op::Ja(k as usize)),
+                BPF_JEQ => JmpOp::Jeq,
+                BPF_JGT => JmpOp::Jgt,
+                BPF_JGE => JmpOp::Jge,
+                BPF_JSET => JmpOp::Jset,
+                _ => return None,
+            };
+            let (jt, jf) = (insn.jt as usize, insn.jf as usize);
+            if jt >= remaining || jf >= remaining {
+                return None;
+            }
+            Op::Jmp(jmp, src, jt, jf)
+        },
+        BPF_RET => match code & 0x18 {
+            BPF_K => Op::RetK(k),
+            BPF_A => Op::RetA,
+            BPF_X => Op::RetX,
+            _ => return None,
+        },
+        BPF_MISC => match code & 0xf8 {
+            BPF_TAX => Op::Tax,
+            BPF_TXA => Op::Txa,
+            _ => return None,
+        },
+        _ => return None,
+    };
+    Some(op)
+}
+
+/// Loads a big-endian value of `size` bytes at `offset`, if it's inside `pkt`.
+#[inline(always)]
+fn load(pkt: &[u8], offset: usize, size: usize) -> Option<u32> {
+    let bytes = pkt.get(offset..offset.checked_add(size)?)?;
+    Some(match *bytes {
+        [b0, b1, b2, b3] => u32::from_be_bytes([b0, b1, b2, b3]),
+        [b0, b1] => u16::from_be_bytes([b0, b1]) as u32,
+        [b0] => b0 as u32,
+        _ => unreachable!(),
+    })
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::BpfProgram;
+
+    // `tcpdump -ddd udp port 53` on an Ethernet link.
+    const UDP_PORT_53: &str = "20
+40 0 0 12
+21 0 6 34525
+48 0 0 20
+21 0 15 17
+40 0 0 54
+21 12 0 53
+40 0 0 56
+21 10 11 53
+21 0 10 2048
+48 0 0 23
+21 0 8 17
+40 0 0 20
+69 6 0 8191
+177 0 0 14
+72 0 0 14
+21 2 0 53
+72 0 0 16
+21 0 1 53
+6 0 0 262144
+6 0 0 0
+";
+
+    /// An Ethernet frame carrying an IPv4/UDP datagram between the given ports.
+    fn udp_frame(src_port: u16, dst_port: u16) -> Vec<u8> {
+        let mut frame = vec![0u8; 14 + 20 + 8 + 4];
+        frame[12..14].copy_from_slice(&0x0800u16.to_be_bytes());
+        frame[14] = 0x45;
+        frame[23] = 17;
+        frame[34..36].copy_from_slice(&src_port.to_be_bytes());
+        frame[36..38].copy_from_slice(&dst_port.to_be_bytes());
+        frame
+    }
+
+    #[test]
+    fn filters_by_port() {
+        let program = BpfProgram::parse(UDP_PORT_53).unwrap();
+        let frame = udp_frame(1234, 53);
+        assert_eq!(program.run(&frame, frame.len()), 262144);
+        let frame = udp_frame(1234, 80);
+        assert_eq!(program.run(&frame, frame.len()), 0);
+        let mut frame = udp_frame(1234, 53);
+        frame[23] = 6;
+        assert_eq!(program.run(&frame, frame.len()), 0);
+    }
+
+    #[test]
+    fn truncated_frames_are_rejected() {
+        let program = BpfProgram::parse(UDP_PORT_53).unwrap();
+        let frame = udp_frame(1234, 53);
+        assert_eq!(program.run(&frame[..30], frame.len()), 0);
+    }
+
+    #[test]
+    fn parses_comma_separated_bytecode() {
+        let program = BpfProgram::parse("2,128 0 0 0,22 0 0 0").unwrap();
+        assert_eq!(program.run(&[0; 60], 60), 60);
+    }
+
+    #[test]
+    fn rejects_invalid_programs() {
+        // Wrong count, a jump out of the program, no return at the end, division by zero, and
+        // scratch memory out of bounds.
+        assert!(BpfProgram::parse("2\n6 0 0 0\n").is_err());
+        assert!(BpfProgram::parse("2\n21 1 0 0\n6 0 0 0\n").is_err());
+        assert!(BpfProgram::parse("1\n40 0 0 12\n").is_err());
+        assert!(BpfProgram::parse("2\n52 0 0 0\n6 0 0 0\n").is_err());
+        assert!(BpfProgram::parse("2\n96 0 0 16\n6 0 0 0\n").is_err());
+    }
+}
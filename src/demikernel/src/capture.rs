@@ -0,0 +1,583 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Packet capture for a libOS that owns its device, where `tcpdump` can't see the traffic.
+//!
+//! Each queue copies the frames it sends and receives into a ring in a shared memory file, which
+//! a separate process (`dmtr-capture`) drains into a pcapng file. The ring has a single producer
+//! and a single consumer, which only share the head and tail counters, so neither side ever
+//! waits for the other: when the ring is full, frames are dropped and counted instead.
+//!
+//! A runtime keeps an `Option<CaptureRing>`, so with capture off the tap costs one branch.
+
+use crate::{
+    bpf::BpfProgram,
+    clock,
+};
+use anyhow::{
+    bail,
+    Error,
+};
+use std::{
+    cmp,
+    fs::OpenOptions,
+    mem,
+    os::unix::{
+        fs::OpenOptionsExt,
+        io::AsRawFd,
+    },
+    ptr,
+    slice,
+    sync::atomic::{
+        AtomicU64,
+        Ordering,
+    },
+    time::{
+        Instant,
+        SystemTime,
+        UNIX_EPOCH,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+const MAGIC: u64 = u64::from_le_bytes(*b"DMTRCAP1");
+const VERSION: u32 = 1;
+
+/// pcap link type of the captured frames.
+pub const LINKTYPE_ETHERNET: u32 = 1;
+
+/// Records start after a page holding the `RingHeader`.
+const DATA_OFFSET: usize = 4096;
+
+const RECORD_HEADER_SIZE: usize = mem::size_of::<RecordHeader>();
+
+/// Marks a record that only fills the space up to the end of the ring.
+const RECORD_PADDING: u32 = 1 << 31;
+
+const MIN_RING_SIZE: usize = 1 << 16;
+const MAX_SNAPLEN: usize = 65535;
+
+/// Layout of the start of the shared memory file. The producer and the consumer each write their
+/// own cache line.
+#[repr(C)]
+struct RingHeader {
+    magic: u64,
+    version: u32,
+    linktype: u32,
+    snaplen: u32,
+    _reserved: u32,
+    capacity: u64,
+    _pad0: [u64; 4],
+
+    // Bytes written by the producer, and frames it dropped because the ring was full.
+    head: AtomicU64,
+    dropped: AtomicU64,
+    _pad1: [u64; 6],
+
+    // Bytes consumed by the consumer.
+    tail: AtomicU64,
+    _pad2: [u64; 7],
+}
+
+/// Precedes each frame in the ring. Records are 8-byte aligned and never wrap around: one that
+/// doesn't fit before the end of the ring starts over at the beginning, after a padding record,
+/// or if there's no room for even that, after nothing at all.
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct RecordHeader {
+    // Length of the whole record, header included.
+    len: u32,
+    caplen: u32,
+    wire_len: u32,
+    flags: u32,
+    timestamp_ns: u64,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Direction {
+    Inbound = 1,
+    Outbound = 2,
+}
+
+/// The `capture` section of the configuration.
+#[derive(Clone, Debug)]
+pub struct CaptureConfig {
+    /// Prefix of the shared memory files, one per queue, e.g. `/dev/shm/dmtr-capture`.
+    pub path: String,
+    /// Most bytes kept of each frame.
+    pub snaplen: usize,
+    /// Bytes of frames a ring holds before the libOS starts dropping them.
+    pub ring_size: usize,
+    /// Frames to keep, or all of them.
+    pub filter: Option<BpfProgram>,
+}
+
+/// A shared memory file mapped into this process.
+struct Mapping {
+    ptr: *mut u8,
+    len: usize,
+}
+
+/// The producer side of a ring, which a queue's runtime taps frames into.
+pub struct CaptureRing {
+    mapping: Mapping,
+    snaplen: usize,
+    filter: Option<BpfProgram>,
+    // Our copy of the head, and the last tail we've seen of the consumer.
+    head: u64,
+    tail: u64,
+    // Wall clock time at `start`, since timestamps come from the monotonic clock.
+    start: Instant,
+    start_ns: u64,
+}
+
+/// The consumer side of a ring.
+pub struct CaptureReader {
+    mapping: Mapping,
+    tail: u64,
+}
+
+/// A frame read out of a ring.
+pub struct CaptureRecord<'a> {
+    pub direction: Direction,
+    pub timestamp_ns: u64,
+    pub wire_len: usize,
+    pub data: &'a [u8],
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl CaptureConfig {
+    /// Path of the ring of queue `id`.
+    pub fn ring_path(&self, id: u16) -> String {
+        format!("{}-{}", self.path, id)
+    }
+
+    /// Creates the ring of queue `id`, replacing any left over from an earlier run.
+    pub fn create_ring(&self, id: u16) -> Result<CaptureRing, Error> {
+        CaptureRing::create(&self.ring_path(id), self)
+    }
+}
+
+impl Mapping {
+    fn new(path: &str, create_len: Option<usize>) -> Result<Self, Error> {
+        let mut options = OpenOptions::new();
+        options.read(true).write(true);
+        if create_len.is_some() {
+            options.create(true).truncate(true).mode(0o600);
+        }
+        let file = options.open(path)?;
+        if let Some(len) = create_len {
+            file.set_len(len as u64)?;
+        }
+        let len = file.metadata()?.len() as usize;
+        if len < DATA_OFFSET + MIN_RING_SIZE {
+            bail!("{} is too small to be a capture ring", path);
+        }
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_POPULATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            bail!(
+                "Failed to map {}: {}",
+                path,
+                std::io::Error::last_os_error()
+            );
+        }
+        Ok(Self {
+            ptr: ptr as *mut u8,
+            len,
+        })
+    }
+
+    fn header(&self) -> &RingHeader {
+        unsafe { &*(self.ptr as *const RingHeader) }
+    }
+
+    fn data(&self) -> *mut u8 {
+        unsafe { self.ptr.add(DATA_OFFSET) }
+    }
+}
+
+impl CaptureRing {
+    fn create(path: &str, config: &CaptureConfig) -> Result<Self, Error> {
+        let snaplen = cmp::min(config.snaplen, MAX_SNAPLEN);
+        if snaplen == 0 {
+            bail!("Capture snaplen must be positive");
+        }
+        // Room for at least a couple of frames of the full snaplen.
+        let min_size = cmp::max(MIN_RING_SIZE, 2 * align8(RECORD_HEADER_SIZE + snaplen));
+        let capacity = cmp::max(config.ring_size, min_size).next_power_of_two();
+        let mapping = Mapping::new(path, Some(DATA_OFFSET + capacity))?;
+        unsafe {
+            ptr::write(
+                mapping.ptr as *mut RingHeader,
+                RingHeader {
+                    magic: 0,
+                    version: VERSION,
+                    linktype: LINKTYPE_ETHERNET,
+                    snaplen: snaplen as u32,
+                    _reserved: 0,
+                    capacity: capacity as u64,
+                    _pad0: [0; 4],
+                    head: AtomicU64::new(0),
+                    dropped: AtomicU64::new(0),
+                    _pad1: [0; 6],
+                    tail: AtomicU64::new(0),
+                    _pad2: [0; 7],
+                },
+            );
+            // A reader only trusts the header once it sees the magic.
+            let magic =
+                &*(&(*(mapping.ptr as *const RingHeader)).magic as *const u64 as *const AtomicU64);
+            magic.store(MAGIC, Ordering::Release);
+        }
+        let start_ns = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .map_or(0, |d| d.as_nanos() as u64);
+        Ok(Self {
+            mapping,
+            snaplen,
+            filter: config.filter.clone(),
+            head: 0,
+            tail: 0,
+            start: clock::now(),
+            start_ns,
+        })
+    }
+
+    /// Copies a frame of `wire_len` bytes, held in `segments`, into the ring if it passes the
+    /// filter. Frames in a single segment are filtered before anything is copied; others are
+    /// filtered on what's been copied of them.
+    #[inline(never)]
+    pub fn tap<'a>(
+        &mut self,
+        direction: Direction,
+        wire_len: usize,
+        mut segments: impl Iterator<Item = &'a [u8]>,
+    ) {
+        let first = match segments.next() {
+            Some(first) => first,
+            None => return,
+        };
+        let contiguous = first.len() >= wire_len;
+        let mut caplen = cmp::min(wire_len, self.snaplen);
+        if let (true, Some(filter)) = (contiguous, self.filter.as_ref()) {
+            caplen = cmp::min(caplen, filter.run(&first[..wire_len], wire_len) as usize);
+            if caplen == 0 {
+                return;
+            }
+        }
+
+        let (pos, record) = match self.reserve(RECORD_HEADER_SIZE + caplen) {
+            Some(reserved) => reserved,
+            None => {
+                let dropped = &self.mapping.header().dropped;
+                dropped.store(dropped.load(Ordering::Relaxed) + 1, Ordering::Relaxed);
+                return;
+            },
+        };
+        let data = unsafe { slice::from_raw_parts_mut(record.add(RECORD_HEADER_SIZE), caplen) };
+        let mut copied = 0;
+        for segment in Some(first).into_iter().chain(segments) {
+            let n = cmp::min(segment.len(), caplen - copied);
+            data[copied..(copied + n)].copy_from_slice(&segment[..n]);
+            copied += n;
+            if copied == caplen {
+                break;
+            }
+        }
+        let mut caplen = copied;
+        if let (false, Some(filter)) = (contiguous, self.filter.as_ref()) {
+            caplen = cmp::min(caplen, filter.run(&data[..caplen], wire_len) as usize);
+            if caplen == 0 {
+                return;
+            }
+        }
+
+        let len = align8(RECORD_HEADER_SIZE + caplen);
+        let timestamp_ns = self.start_ns + (clock::now() - self.start).as_nanos() as u64;
+        unsafe {
+            ptr::write(
+                record as *mut RecordHeader,
+                RecordHeader {
+                    len: len as u32,
+                    caplen: caplen as u32,
+                    wire_len: wire_len as u32,
+                    flags: direction as u32,
+                    timestamp_ns,
+                },
+            );
+        }
+        self.head = pos + len as u64;
+        self.mapping
+            .header()
+            .head
+            .store(self.head, Ordering::Release);
+    }
+
+    /// Finds room for a record of `size` bytes, skipping to the start of the ring if it doesn't
+    /// fit before the end. Returns the record's position and where to write it.
+    fn reserve(&mut self, size: usize) -> Option<(u64, *mut u8)> {
+        let capacity = self.mapping.header().capacity;
+        let size = align8(size) as u64;
+        let offset = self.head & (capacity - 1);
+        let to_end = capacity - offset;
+        let needed = if size > to_end { to_end + size } else { size };
+        if needed > capacity - (self.head - self.tail) {
+            self.tail = self.mapping.header().tail.load(Ordering::Acquire);
+            if needed > capacity - (self.head - self.tail) {
+                return None;
+            }
+        }
+
+        let data = self.mapping.data();
+        let mut pos = self.head;
+        if size > to_end {
+            if to_end >= RECORD_HEADER_SIZE as u64 {
+                let padding = RecordHeader {
+                    len: to_end as u32,
+                    caplen: 0,
+                    wire_len: 0,
+                    flags: RECORD_PADDING,
+                    timestamp_ns: 0,
+                };
+                unsafe { ptr::write(data.add(offset as usize) as *mut RecordHeader, padding) };
+            }
+            pos += to_end;
+        }
+        Some((pos, unsafe { data.add((pos & (capacity - 1)) as usize) }))
+    }
+}
+
+impl CaptureReader {
+    pub fn open(path: &str) -> Result<Self, Error> {
+        let mapping = Mapping::new(path, None)?;
+        let header = mapping.header();
+        let magic = unsafe { &*(&header.magic as *const u64 as *const AtomicU64) };
+        if magic.load(Ordering::Acquire) != MAGIC || header.version != VERSION {
+            bail!("{} isn't a capture ring", path);
+        }
+        if !header.capacity.is_power_of_two()
+            || DATA_OFFSET as u64 + header.capacity > mapping.len as u64
+        {
+            bail!("{} has a corrupt header", path);
+        }
+        // Start from whatever is in the ring now.
+        let tail = header.tail.load(Ordering::Acquire);
+        Ok(Self { mapping, tail })
+    }
+
+    pub fn linktype(&self) -> u32 {
+        self.mapping.header().linktype
+    }
+
+    pub fn snaplen(&self) -> usize {
+        self.mapping.header().snaplen as usize
+    }
+
+    /// Number of frames the libOS dropped because the ring was full.
+    pub fn dropped(&self) -> u64 {
+        self.mapping.header().dropped.load(Ordering::Relaxed)
+    }
+
+    /// Hands every frame in the ring to `f`, then releases their space to the libOS all at once.
+    /// Returns how many there were.
+    pub fn drain(&mut self, mut f: impl FnMut(&CaptureRecord)) -> usize {
+        let header = self.mapping.header();
+        let capacity = header.capacity;
+        let head = header.head.load(Ordering::Acquire);
+        let data = self.mapping.data();
+        let mut num_records = 0;
+        while self.tail < head {
+            let offset = self.tail & (capacity - 1);
+            let to_end = capacity - offset;
+            if to_end < RECORD_HEADER_SIZE as u64 {
+                self.tail += to_end;
+                continue;
+            }
+            let record = unsafe { ptr::read(data.add(offset as usize) as *const RecordHeader) };
+            let len = record.len as u64;
+            if len < RECORD_HEADER_SIZE as u64 || len > to_end {
+                // Only a misbehaving producer could get us here, so start over at its head.
+                self.tail = head;
+                break;
+            }
+            if record.flags & RECORD_PADDING == 0 {
+                let caplen = cmp::min(record.caplen as usize, len as usize - RECORD_HEADER_SIZE);
+                let frame = unsafe {
+                    slice::from_raw_parts(data.add(offset as usize + RECORD_HEADER_SIZE), caplen)
+                };
+                f(&CaptureRecord {
+                    direction: if record.flags == Direction::Inbound as u32 {
+                        Direction::Inbound
+                    } else {
+                        Direction::Outbound
+                    },
+                    timestamp_ns: record.timestamp_ns,
+                    wire_len: record.wire_len as usize,
+                    data: frame,
+                });
+                num_records += 1;
+            }
+            self.tail += len;
+        }
+        header.tail.store(self.tail, Ordering::Release);
+        num_records
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+// The mapping is only ever accessed through the ring's producer or consumer, each of which has a
+// single owner.
+unsafe impl Send for Mapping {}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr as *mut libc::c_void, self.len) };
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+fn align8(n: usize) -> usize {
+    (n + 7) & !7
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        CaptureConfig,
+        CaptureReader,
+        Direction,
+        MIN_RING_SIZE,
+        RECORD_HEADER_SIZE,
+    };
+    use crate::bpf::BpfProgram;
+    use std::{
+        fs,
+        process,
+    };
+
+    fn config(name: &str, snaplen: usize, filter: Option<BpfProgram>) -> CaptureConfig {
+        CaptureConfig {
+            path: format!("/tmp/dmtr-capture-test-{}-{}", name, process::id()),
+            snaplen,
+            ring_size: MIN_RING_SIZE,
+            filter,
+        }
+    }
+
+    fn drain_all(reader: &mut CaptureReader) -> Vec<(Direction, usize, Vec<u8>)> {
+        let mut frames = vec![];
+        reader.drain(|r| frames.push((r.direction, r.wire_len, r.data.to_vec())));
+        frames
+    }
+
+    #[test]
+    fn frames_round_trip() {
+        let config = config("round-trip", 64, None);
+        let mut ring = config.create_ring(0).unwrap();
+        let mut reader = CaptureReader::open(&config.ring_path(0)).unwrap();
+
+        let frame: Vec<u8> = (0..100).map(|i| i as u8).collect();
+        ring.tap(Direction::Inbound, 100, vec![&frame[..]].into_iter());
+        // A chained frame is gathered, and truncated to the snaplen.
+        ring.tap(
+            Direction::Outbound,
+            100,
+            vec![&frame[..10], &frame[10..]].into_iter(),
+        );
+        let frames = drain_all(&mut reader);
+        assert_eq!(frames.len(), 2);
+        assert_eq!(frames[0], (Direction::Inbound, 100, frame[..64].to_vec()));
+        assert_eq!(frames[1], (Direction::Outbound, 100, frame[..64].to_vec()));
+        assert!(drain_all(&mut reader).is_empty());
+
+        fs::remove_file(config.ring_path(0)).unwrap();
+    }
+
+    #[test]
+    fn full_ring_drops_and_wraps() {
+        let config = config("wrap", 1500, None);
+        let mut ring = config.create_ring(0).unwrap();
+        let mut reader = CaptureReader::open(&config.ring_path(0)).unwrap();
+
+        // Fill the ring without draining it, then keep going with a reader that keeps up, so
+        // records land across the end of the ring.
+        let frame = vec![0xab; 1000];
+        let fits = MIN_RING_SIZE / (RECORD_HEADER_SIZE + frame.len());
+        for _ in 0..(fits + 5) {
+            ring.tap(
+                Direction::Inbound,
+                frame.len(),
+                vec![&frame[..]].into_iter(),
+            );
+        }
+        assert_eq!(reader.dropped(), 5);
+        assert_eq!(drain_all(&mut reader).len(), fits);
+        for i in 0..(3 * fits) {
+            let frame = vec![i as u8; 900 + i % 100];
+            ring.tap(
+                Direction::Outbound,
+                frame.len(),
+                vec![&frame[..]].into_iter(),
+            );
+            let frames = drain_all(&mut reader);
+            assert_eq!(frames, vec![(Direction::Outbound, frame.len(), frame)]);
+        }
+        assert_eq!(reader.dropped(), 5);
+
+        fs::remove_file(config.ring_path(0)).unwrap();
+    }
+
+    #[test]
+    fn filter_applies_to_both_paths() {
+        // Keeps frames whose first byte is 1, up to 16 bytes of them.
+        let filter = BpfProgram::parse("4\n48 0 0 0\n21 0 1 1\n6 0 0 16\n6 0 0 0\n").unwrap();
+        let config = config("filter", 64, Some(filter));
+        let mut ring = config.create_ring(0).unwrap();
+        let mut reader = CaptureReader::open(&config.ring_path(0)).unwrap();
+
+        let keep = vec![1u8; 50];
+        let skip = vec![2u8; 50];
+        ring.tap(Direction::Inbound, 50, vec![&keep[..]].into_iter());
+        ring.tap(Direction::Inbound, 50, vec![&skip[..]].into_iter());
+        ring.tap(
+            Direction::Inbound,
+            50,
+            vec![&keep[..25], &keep[25..]].into_iter(),
+        );
+        ring.tap(
+            Direction::Inbound,
+            50,
+            vec![&skip[..25], &skip[25..]].into_iter(),
+        );
+        let frames = drain_all(&mut reader);
+        assert_eq!(frames.len(), 2);
+        assert!(frames.iter().all(|f| f.2 == vec![1u8; 16]));
+
+        fs::remove_file(config.ring_path(0)).unwrap();
+    }
+}
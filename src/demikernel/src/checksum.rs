@@ -0,0 +1,532 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Internet checksums (RFC 1071) of TCP and UDP segments, for when the NIC doesn't compute them.
+//!
+//! The one's-complement sum doesn't depend on byte order, so the kernels add up native-endian
+//! 32-bit words into 64-bit lanes and only fold and swap the result at the end. There are AVX2 and
+//! SSE4.1 kernels, picked at runtime by what the CPU supports, and a scalar one for everything
+//! else. Each kernel can also copy what it sums, so that a libOS copying a body anyway reads it
+//! just once.
+//!
+//! The libOSes tell the network stack that checksums are offloaded, and fill them in (or check
+//! them) themselves with `SoftwareChecksums` where the NIC doesn't.
+
+use std::{
+    ops::Range,
+    ptr,
+    sync::Once,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+const ETHERNET2_HEADER_SIZE: usize = 14;
+const ETHER_TYPE_IPV4: [u8; 2] = [0x08, 0x00];
+const IPV4_HEADER_MIN_SIZE: usize = 20;
+const IPPROTO_TCP: u8 = 6;
+const IPPROTO_UDP: u8 = 17;
+const TCP_CHECKSUM_OFFSET: usize = 16;
+const UDP_CHECKSUM_OFFSET: usize = 6;
+
+static mut BEST_KERNEL: Kernel = Kernel::Scalar;
+static DETECT: Once = Once::new();
+
+/// Implementations of the sum, from slowest to fastest.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Kernel {
+    Scalar,
+    Sse41,
+    Avx2,
+}
+
+/// Running one's-complement sum over a sequence of byte slices.
+#[derive(Clone, Copy)]
+pub struct Checksum {
+    kernel: Kernel,
+    sum: u64,
+    /// Whether an odd number of bytes has been added, so the next byte is the second half of a
+    /// word.
+    odd: bool,
+}
+
+/// Which protocols the libOS checksums itself, rather than leaving it to the NIC.
+#[derive(Clone, Copy, Debug)]
+pub struct SoftwareChecksums {
+    pub tcp: bool,
+    pub udp: bool,
+}
+
+/// Where a frame's TCP or UDP segment is.
+struct Segment {
+    protocol: u8,
+    range: Range<usize>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl Kernel {
+    pub const ALL: &'static [Kernel] = &[Kernel::Scalar, Kernel::Sse41, Kernel::Avx2];
+
+    /// Fastest kernel this CPU supports.
+    pub fn best() -> Kernel {
+        DETECT.call_once(|| {
+            let best = Kernel::ALL
+                .iter()
+                .rev()
+                .find(|k| k.is_supported())
+                .cloned()
+                .unwrap_or(Kernel::Scalar);
+            unsafe { BEST_KERNEL = best };
+        });
+        unsafe { BEST_KERNEL }
+    }
+
+    pub fn is_supported(self) -> bool {
+        match self {
+            Kernel::Scalar => true,
+            #[cfg(target_arch = "x86_64")]
+            Kernel::Sse41 => is_x86_feature_detected!("sse4.1"),
+            #[cfg(target_arch = "x86_64")]
+            Kernel::Avx2 => is_x86_feature_detected!("avx2"),
+            #[cfg(not(target_arch = "x86_64"))]
+            _ => false,
+        }
+    }
+
+    pub fn name(self) -> &'static str {
+        match self {
+            Kernel::Scalar => "scalar",
+            Kernel::Sse41 => "sse4.1",
+            Kernel::Avx2 => "avx2",
+        }
+    }
+
+    /// Sums `src`, copying it to `dst` along the way if `COPY` is set.
+    fn sum<const COPY: bool>(self, dst: *mut u8, src: &[u8]) -> u64 {
+        let (src, len) = (src.as_ptr(), src.len());
+        unsafe {
+            match self {
+                #[cfg(target_arch = "x86_64")]
+                Kernel::Sse41 => x86::sum_sse41::<COPY>(dst, src, len),
+                #[cfg(target_arch = "x86_64")]
+                Kernel::Avx2 => x86::sum_avx2::<COPY>(dst, src, len),
+                _ => sum_scalar::<COPY>(dst, src, len),
+            }
+        }
+    }
+}
+
+impl Checksum {
+    pub fn new() -> Self {
+        Self::with_kernel(Kernel::best())
+    }
+
+    /// Sums with `kernel`, which must be supported by this CPU.
+    pub fn with_kernel(kernel: Kernel) -> Self {
+        assert!(kernel.is_supported());
+        Self {
+            kernel,
+            sum: 0,
+            odd: false,
+        }
+    }
+
+    pub fn add(&mut self, data: &[u8]) {
+        let sum = self.kernel.sum::<false>(ptr::null_mut(), data);
+        self.add_sum(sum, data.len());
+    }
+
+    /// Copies `src` to `dst` and adds it, reading it only once.
+    pub fn copy_and_add(&mut self, dst: &mut [u8], src: &[u8]) {
+        assert_eq!(dst.len(), src.len());
+        let sum = self.kernel.sum::<true>(dst.as_mut_ptr(), src);
+        self.add_sum(sum, src.len());
+    }
+
+    /// Adds the bytes summed by `other`, which come after the ones added so far.
+    pub fn append(&mut self, other: &Checksum) {
+        self.add_sum(fold(other.sum) as u64, if other.odd { 1 } else { 0 });
+    }
+
+    /// The checksum to write into a header, with `to_be_bytes()`. Summing a segment that
+    /// includes its checksum gives 0 if the checksum is correct.
+    pub fn finish(&self) -> u16 {
+        !u16::from_be(fold(self.sum))
+    }
+
+    /// Adds the sum of `len` bytes. Bytes that start on an odd offset pair up the other way
+    /// round, which swaps the bytes of their sum.
+    fn add_sum(&mut self, sum: u64, len: usize) {
+        if self.odd {
+            self.sum += fold(sum).swap_bytes() as u64;
+        } else {
+            self.sum += sum;
+        }
+        self.odd ^= len % 2 == 1;
+    }
+}
+
+impl SoftwareChecksums {
+    pub fn none() -> Self {
+        Self {
+            tcp: false,
+            udp: false,
+        }
+    }
+
+    pub fn all() -> Self {
+        Self {
+            tcp: true,
+            udp: true,
+        }
+    }
+
+    /// Whether the segment in `header`, which starts with an Ethernet header, is one we checksum.
+    pub fn applies_to(&self, header: &[u8]) -> bool {
+        self.segment(header).is_some()
+    }
+
+    /// Fills in the checksum of the segment whose headers are in `header`, if it's one we
+    /// checksum. The body that follows the headers has already been summed into `body`.
+    pub fn fill(&self, header: &mut [u8], body: Option<&Checksum>) {
+        let segment = match self.segment(header) {
+            Some(segment) => segment,
+            None => return,
+        };
+        let offset = segment.range.start + checksum_offset(segment.protocol);
+        if header.len() < offset + 2 {
+            return;
+        }
+        header[offset..(offset + 2)].copy_from_slice(&[0, 0]);
+
+        let mut checksum = pseudo_header(header, &segment);
+        checksum.add(&header[segment.range.start..]);
+        if let Some(body) = body {
+            checksum.append(body);
+        }
+        let mut value = checksum.finish();
+        // A UDP checksum of zero means there isn't one.
+        if segment.protocol == IPPROTO_UDP && value == 0 {
+            value = 0xffff;
+        }
+        header[offset..(offset + 2)].copy_from_slice(&value.to_be_bytes());
+    }
+
+    /// Whether `frame` has a correct checksum, or is one we don't check.
+    pub fn verify(&self, frame: &[u8]) -> bool {
+        let segment = match self.segment(frame) {
+            Some(segment) => segment,
+            None => return true,
+        };
+        if segment.range.end > frame.len() {
+            return false;
+        }
+        if unchecked_udp(frame, &segment) {
+            return true;
+        }
+        let mut checksum = pseudo_header(frame, &segment);
+        checksum.add(&frame[segment.range]);
+        checksum.finish() == 0
+    }
+
+    /// Copies `src` to `dst` and checks it as `verify()` does, summing the segment as it's
+    /// copied.
+    pub fn copy_and_verify(&self, dst: &mut [u8], src: &[u8]) -> bool {
+        let segment = match self.segment(src) {
+            Some(segment) if segment.range.end <= src.len() => segment,
+            segment => {
+                dst.copy_from_slice(src);
+                return segment.is_none();
+            },
+        };
+        let Range { start, end } = segment.range;
+        dst[..start].copy_from_slice(&src[..start]);
+        let mut checksum = pseudo_header(src, &segment);
+        checksum.copy_and_add(&mut dst[start..end], &src[start..end]);
+        dst[end..].copy_from_slice(&src[end..]);
+        unchecked_udp(src, &segment) || checksum.finish() == 0
+    }
+
+    /// Finds the TCP or UDP segment of an unfragmented IPv4 frame, if it's one we checksum. The
+    /// range is as given by the IPv4 header, so it leaves out padding but may run past the end
+    /// of `frame` if that only holds the headers.
+    fn segment(&self, frame: &[u8]) -> Option<Segment> {
+        let l3 = ETHERNET2_HEADER_SIZE;
+        if frame.len() < l3 + IPV4_HEADER_MIN_SIZE || frame[12..14] != ETHER_TYPE_IPV4 {
+            return None;
+        }
+        let protocol = frame[l3 + 9];
+        let ours = match protocol {
+            IPPROTO_TCP => self.tcp,
+            IPPROTO_UDP => self.udp,
+            _ => false,
+        };
+        if !ours || frame[l3] >> 4 != 4 {
+            return None;
+        }
+        // Leave fragments to the stack.
+        if u16::from_be_bytes([frame[l3 + 6], frame[l3 + 7]]) & 0x3fff != 0 {
+            return None;
+        }
+        let ihl = (frame[l3] & 0xf) as usize * 4;
+        let total_len = u16::from_be_bytes([frame[l3 + 2], frame[l3 + 3]]) as usize;
+        if ihl < IPV4_HEADER_MIN_SIZE || total_len < ihl + checksum_offset(protocol) + 2 {
+            return None;
+        }
+        Some(Segment {
+            protocol,
+            range: (l3 + ihl)..(l3 + total_len),
+        })
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Default for Checksum {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Folds a sum of native-endian words into 16 bits.
+fn fold(mut sum: u64) -> u16 {
+    while sum >> 16 != 0 {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    sum as u16
+}
+
+fn checksum_offset(protocol: u8) -> usize {
+    if protocol == IPPROTO_TCP {
+        TCP_CHECKSUM_OFFSET
+    } else {
+        UDP_CHECKSUM_OFFSET
+    }
+}
+
+/// Sum of the IPv4 pseudo-header of `segment`.
+fn pseudo_header(frame: &[u8], segment: &Segment) -> Checksum {
+    let l3 = ETHERNET2_HEADER_SIZE;
+    let len = (segment.range.end - segment.range.start) as u16;
+    let mut checksum = Checksum::new();
+    checksum.add(&frame[(l3 + 12)..(l3 + 20)]);
+    checksum.add(&[0, segment.protocol]);
+    checksum.add(&len.to_be_bytes());
+    checksum
+}
+
+fn unchecked_udp(frame: &[u8], segment: &Segment) -> bool {
+    let offset = segment.range.start + UDP_CHECKSUM_OFFSET;
+    segment.protocol == IPPROTO_UDP && frame[offset..(offset + 2)] == [0, 0]
+}
+
+/// Sums `len` bytes at `src` eight at a time. `dst` is only touched if `COPY` is set.
+unsafe fn sum_scalar<const COPY: bool>(dst: *mut u8, src: *const u8, len: usize) -> u64 {
+    let mut sum = 0;
+    let mut i = 0;
+    while i + 8 <= len {
+        let word = ptr::read_unaligned(src.add(i) as *const u64);
+        if COPY {
+            ptr::write_unaligned(dst.add(i) as *mut u64, word);
+        }
+        sum += (word & 0xffff_ffff) + (word >> 32);
+        i += 8;
+    }
+    if i < len {
+        // Zero-pad the tail, which keeps its bytes in the same halves of their words.
+        let mut tail = [0u8; 8];
+        ptr::copy_nonoverlapping(src.add(i), tail.as_mut_ptr(), len - i);
+        if COPY {
+            ptr::copy_nonoverlapping(tail.as_ptr(), dst.add(i), len - i);
+        }
+        let word = u64::from_ne_bytes(tail);
+        sum += (word & 0xffff_ffff) + (word >> 32);
+    }
+    sum
+}
+
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use super::sum_scalar;
+    use std::{
+        arch::x86_64::*,
+        mem,
+    };
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn sum_sse41<const COPY: bool>(dst: *mut u8, src: *const u8, len: usize) -> u64 {
+        let zero = _mm_setzero_si128();
+        let (mut acc0, mut acc1) = (zero, zero);
+        let mut i = 0;
+        // Two vectors at a time, into separate accumulators, to keep the adds independent.
+        while i + 32 <= len {
+            let a = _mm_loadu_si128(src.add(i) as *const __m128i);
+            let b = _mm_loadu_si128(src.add(i + 16) as *const __m128i);
+            if COPY {
+                _mm_storeu_si128(dst.add(i) as *mut __m128i, a);
+                _mm_storeu_si128(dst.add(i + 16) as *mut __m128i, b);
+            }
+            acc0 = _mm_add_epi64(acc0, _mm_cvtepu32_epi64(a));
+            acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+            acc0 = _mm_add_epi64(acc0, _mm_cvtepu32_epi64(b));
+            acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+            i += 32;
+        }
+        let lanes: [u64; 2] = mem::transmute(_mm_add_epi64(acc0, acc1));
+        lanes[0] + lanes[1] + sum_scalar::<COPY>(dst.wrapping_add(i), src.add(i), len - i)
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn sum_avx2<const COPY: bool>(dst: *mut u8, src: *const u8, len: usize) -> u64 {
+        let zero = _mm256_setzero_si256();
+        let mut acc = [zero; 4];
+        let mut i = 0;
+        // Four vectors at a time, into separate accumulators, to keep the adds independent.
+        while i + 128 <= len {
+            for (j, acc) in acc.iter_mut().enumerate() {
+                let v = _mm256_loadu_si256(src.add(i + 32 * j) as *const __m256i);
+                if COPY {
+                    _mm256_storeu_si256(dst.add(i + 32 * j) as *mut __m256i, v);
+                }
+                let words = _mm256_add_epi64(
+                    _mm256_unpacklo_epi32(v, zero),
+                    _mm256_unpackhi_epi32(v, zero),
+                );
+                *acc = _mm256_add_epi64(*acc, words);
+            }
+            i += 128;
+        }
+        while i + 32 <= len {
+            let v = _mm256_loadu_si256(src.add(i) as *const __m256i);
+            if COPY {
+                _mm256_storeu_si256(dst.add(i) as *mut __m256i, v);
+            }
+            acc[0] = _mm256_add_epi64(acc[0], _mm256_unpacklo_epi32(v, zero));
+            acc[1] = _mm256_add_epi64(acc[1], _mm256_unpackhi_epi32(v, zero));
+            i += 32;
+        }
+        let acc = _mm256_add_epi64(
+            _mm256_add_epi64(acc[0], acc[1]),
+            _mm256_add_epi64(acc[2], acc[3]),
+        );
+        let lanes: [u64; 4] = mem::transmute(acc);
+        let sum = lanes.iter().sum::<u64>();
+        sum + sum_scalar::<COPY>(dst.wrapping_add(i), src.add(i), len - i)
+    }
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        Checksum,
+        Kernel,
+        SoftwareChecksums,
+    };
+
+    /// Reference sum, a 16-bit word at a time as in RFC 1071.
+    fn reference(data: &[u8]) -> u16 {
+        let mut sum: u32 = 0;
+        for word in data.chunks(2) {
+            let hi = word[0] as u32;
+            let lo = *word.get(1).unwrap_or(&0) as u32;
+            sum += hi << 8 | lo;
+        }
+        while sum >> 16 != 0 {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+        !(sum as u16)
+    }
+
+    fn data(len: usize) -> Vec<u8> {
+        (0..len).map(|i| (i * 7 + i / 251) as u8).collect()
+    }
+
+    #[test]
+    fn kernels_match_reference() {
+        for kernel in Kernel::ALL.iter().filter(|k| k.is_supported()) {
+            for len in (0..300).chain([1499, 1500, 9000].iter().cloned()) {
+                let src = data(len);
+                let mut checksum = Checksum::with_kernel(*kernel);
+                checksum.add(&src);
+                assert_eq!(checksum.finish(), reference(&src), "{:?} {}", kernel, len);
+
+                let mut dst = vec![0; len];
+                let mut checksum = Checksum::with_kernel(*kernel);
+                checksum.copy_and_add(&mut dst, &src);
+                assert_eq!(checksum.finish(), reference(&src), "{:?} {}", kernel, len);
+                assert_eq!(dst, src);
+            }
+        }
+    }
+
+    #[test]
+    fn split_anywhere() {
+        let src = data(1000);
+        for split in (0..1000).step_by(37).chain([1, 999].iter().cloned()) {
+            for second in [split, split + 1].iter().filter(|s| **s <= 1000) {
+                let mut checksum = Checksum::new();
+                checksum.add(&src[..split]);
+                checksum.add(&src[split..*second]);
+                let mut rest = Checksum::new();
+                rest.add(&src[*second..]);
+                checksum.append(&rest);
+                assert_eq!(checksum.finish(), reference(&src));
+            }
+        }
+    }
+
+    /// UDP/IPv4 frame from 10.0.0.1:1234 to 10.0.0.2:5678.
+    fn udp_frame(payload: &[u8]) -> Vec<u8> {
+        let mut frame = vec![0; 14];
+        frame[12..14].copy_from_slice(&[0x08, 0x00]);
+        let total_len = (20 + 8 + payload.len()) as u16;
+        frame.extend_from_slice(&[0x45, 0, 0, 0, 0, 0, 0x40, 0, 64, 17, 0, 0]);
+        frame[16..18].copy_from_slice(&total_len.to_be_bytes());
+        frame.extend_from_slice(&[10, 0, 0, 1, 10, 0, 0, 2]);
+        frame.extend_from_slice(&1234u16.to_be_bytes());
+        frame.extend_from_slice(&5678u16.to_be_bytes());
+        frame.extend_from_slice(&((8 + payload.len()) as u16).to_be_bytes());
+        frame.extend_from_slice(&[0, 0]);
+        frame.extend_from_slice(payload);
+        frame
+    }
+
+    #[test]
+    fn fill_then_verify() {
+        let checksums = SoftwareChecksums::all();
+        let payload = data(333);
+        let mut frame = udp_frame(&payload);
+        let header_size = frame.len() - payload.len();
+
+        let mut body = Checksum::new();
+        body.add(&payload);
+        checksums.fill(&mut frame[..header_size], Some(&body));
+        assert_ne!(frame[40..42], [0, 0]);
+        assert!(checksums.verify(&frame));
+
+        // Padding past the IPv4 length isn't covered.
+        frame.extend_from_slice(&[0xff; 7]);
+        let mut copy = vec![0; frame.len()];
+        assert!(checksums.copy_and_verify(&mut copy, &frame));
+        assert_eq!(copy, frame);
+
+        frame[50] ^= 1;
+        assert!(!checksums.verify(&frame));
+        assert!(!checksums.copy_and_verify(&mut copy, &frame));
+        assert!(SoftwareChecksums::none().verify(&frame));
+    }
+}
@@ -0,0 +1,154 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Monotonic clock read from the CPU's timestamp counter, for the per-operation timestamps on the
+//! fast path, where a vDSO `clock_gettime()` on every call adds up.
+//!
+//! The TSC's frequency is calibrated against `Instant` once per process. Each thread anchors the
+//! counter to an `Instant` and re-anchors whenever the runtime advances its clock with a fresh
+//! reading, so calibration error can't build up. Readings never go backwards on a thread. Where
+//! the TSC isn't invariant across power states and cores (or this isn't x86-64), `now()` falls
+//! back to `Instant::now()`.
+
+use std::{
+    cell::Cell,
+    fs,
+    sync::Once,
+    thread,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// How long to measure the TSC for when calibrating.
+const CALIBRATION_PERIOD: Duration = Duration::from_millis(20);
+
+/// Nanoseconds per cycle in 32.32 fixed point, or 0 if the TSC isn't usable.
+static mut NS_PER_CYCLE: u64 = 0;
+static CALIBRATE: Once = Once::new();
+
+#[derive(Copy, Clone)]
+struct Anchor {
+    instant: Instant,
+    tsc: u64,
+    /// Latest reading handed out on this thread.
+    last: Instant,
+}
+
+thread_local! {
+    static ANCHOR: Cell<Option<Anchor>> = Cell::new(None);
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+#[cfg(target_arch = "x86_64")]
+fn rdtsc() -> u64 {
+    unsafe { core::arch::x86_64::_rdtsc() }
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+fn rdtsc() -> u64 {
+    0
+}
+
+fn tsc_is_invariant() -> bool {
+    if cfg!(not(target_arch = "x86_64")) {
+        return false;
+    }
+    match fs::read_to_string("/proc/cpuinfo") {
+        Ok(cpuinfo) => cpuinfo
+            .lines()
+            .find(|l| l.starts_with("flags"))
+            .map(|flags| {
+                let flags = flags.split_whitespace();
+                let has = |f| flags.clone().any(|g| g == f);
+                has("constant_tsc") && has("nonstop_tsc")
+            })
+            .unwrap_or(false),
+        Err(..) => false,
+    }
+}
+
+/// Reads the TSC and `Instant` together, taking the tightest of a few tries.
+fn paired_reading() -> (Instant, u64) {
+    (0..5)
+        .map(|_| {
+            let t0 = rdtsc();
+            let instant = Instant::now();
+            let t1 = rdtsc();
+            (t1 - t0, instant, t0 + (t1 - t0) / 2)
+        })
+        .min_by_key(|(width, ..)| *width)
+        .map(|(_, instant, tsc)| (instant, tsc))
+        .unwrap()
+}
+
+fn ns_per_cycle() -> u64 {
+    CALIBRATE.call_once(|| {
+        if !tsc_is_invariant() {
+            return;
+        }
+        let (i0, t0) = paired_reading();
+        thread::sleep(CALIBRATION_PERIOD);
+        let (i1, t1) = paired_reading();
+        let ns = (i1 - i0).as_nanos() as u64;
+        let cycles = t1 - t0;
+        if cycles > 0 {
+            unsafe { NS_PER_CYCLE = (((ns as u128) << 32) / cycles as u128) as u64 };
+        }
+    });
+    unsafe { NS_PER_CYCLE }
+}
+
+/// Current time on this thread. Costs a `rdtsc` and some arithmetic once calibrated.
+pub fn now() -> Instant {
+    let ns_per_cycle = ns_per_cycle();
+    if ns_per_cycle == 0 {
+        return Instant::now();
+    }
+    ANCHOR.with(|a| {
+        let mut anchor = match a.get() {
+            Some(anchor) => anchor,
+            None => {
+                let (instant, tsc) = paired_reading();
+                Anchor {
+                    instant,
+                    tsc,
+                    last: instant,
+                }
+            },
+        };
+        let cycles = rdtsc().saturating_sub(anchor.tsc);
+        let ns = ((cycles as u128 * ns_per_cycle as u128) >> 32) as u64;
+        let now = anchor.instant + Duration::from_nanos(ns);
+        if now > anchor.last {
+            anchor.last = now;
+        }
+        a.set(Some(anchor));
+        anchor.last
+    })
+}
+
+/// Re-anchors this thread's clock to `now`, a reading of `Instant::now()` that the caller took
+/// anyway. The first call calibrates the TSC, which takes `CALIBRATION_PERIOD`, so runtimes make
+/// it as they start up rather than on the fast path.
+pub fn resync(now: Instant) {
+    if ns_per_cycle() == 0 {
+        return;
+    }
+    ANCHOR.with(|a| {
+        let last = a.get().map_or(now, |anchor| anchor.last.max(now));
+        a.set(Some(Anchor {
+            instant: now,
+            tsc: rdtsc(),
+            last,
+        }));
+    })
+}
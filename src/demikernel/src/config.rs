@@ -1,6 +1,11 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 
+use crate::{
+    bpf::BpfProgram,
+    capture::CaptureConfig,
+    framing,
+};
 use anyhow::{
     format_err,
     Error,
@@ -48,6 +53,9 @@ pub struct Config {
     pub use_jumbo_frames: bool,
     pub udp_checksum_offload: bool,
     pub tcp_checksum_offload: bool,
+    pub tcp_tso: bool,
+    pub tcp_lro: bool,
+    pub rx_intr_idle_polls: Option<usize>,
     pub local_ipv4_addr: Ipv4Addr,
     pub local_link_addr: MacAddress,
     pub local_interface_name: String,
@@ -91,6 +99,125 @@ impl Config {
         }
     }
 
+    // Parse number of RX/TX queue pairs. Each queue pair is driven by its own libOS instance.
+    pub fn num_queues(&self) -> u16 {
+        match self.config_obj["dpdk"]["num_queues"].as_i64() {
+            Some(n) if n > 0 && n <= u16::MAX as i64 => n as u16,
+            Some(n) => panic!("Invalid number of queues {}", n),
+            None => 1,
+        }
+    }
+
+    // Parse RSS hash key, given as a list of bytes.
+    pub fn rss_key(&self) -> Option<Vec<u8>> {
+        match self.config_obj["dpdk"]["rss_key"] {
+            Yaml::Array(ref arr) => Some(
+                arr.iter()
+                    .map(|b| {
+                        b.as_i64()
+                            .filter(|&b| b >= 0 && b <= u8::MAX as i64)
+                            .map(|b| b as u8)
+                            .ok_or_else(|| format_err!("Invalid RSS key byte"))
+                    })
+                    .collect::<Result<Vec<_>, Error>>()
+                    .unwrap(),
+            ),
+            Yaml::BadValue => None,
+            _ => panic!("Malformed YAML config"),
+        }
+    }
+
+    // Parse RSS redirection table, given as a list of queue ids. The list is repeated to fill the
+    // device's redirection table.
+    pub fn rss_reta(&self) -> Option<Vec<u16>> {
+        match self.config_obj["dpdk"]["rss_reta"] {
+            Yaml::Array(ref arr) => Some(
+                arr.iter()
+                    .map(|q| {
+                        q.as_i64()
+                            .filter(|&q| q >= 0 && q < self.num_queues() as i64)
+                            .map(|q| q as u16)
+                            .ok_or_else(|| format_err!("Invalid RSS redirection table entry"))
+                    })
+                    .collect::<Result<Vec<_>, Error>>()
+                    .unwrap(),
+            ),
+            Yaml::BadValue => None,
+            _ => panic!("Malformed YAML config"),
+        }
+    }
+
+    // Parse whether to put the port in promiscuous mode. On by default.
+    pub fn promiscuous(&self) -> bool {
+        match self.config_obj["dpdk"]["promiscuous"] {
+            Yaml::Boolean(b) => b,
+            Yaml::BadValue => true,
+            _ => panic!("Malformed YAML config"),
+        }
+    }
+
+    // Parse whether to filter incoming traffic in hardware, so that only frames for our sockets
+    // reach the libOS. Off by default.
+    pub fn flow_filter(&self) -> bool {
+        match self.config_obj["dpdk"]["flow_filter"] {
+            Yaml::Boolean(b) => b,
+            Yaml::BadValue => false,
+            _ => panic!("Malformed YAML config"),
+        }
+    }
+
+    // Parse a per-queue mempool parameter (e.g. `body_pool_size`). Parameters that are left out
+    // keep the libOS's defaults.
+    pub fn mempool_param(&self, name: &str) -> Option<usize> {
+        match self.config_obj["dpdk"]["mempool"][name] {
+            Yaml::Integer(n) if n > 0 => Some(n as usize),
+            Yaml::BadValue => None,
+            _ => panic!("Invalid mempool parameter {}", name),
+        }
+    }
+
+    // Parse where to capture frames for `dmtr-capture`, if anywhere. Off by default. The filter is
+    // a compiled BPF program, as printed by `tcpdump -ddd`.
+    pub fn capture(&self) -> Option<CaptureConfig> {
+        let capture_obj = &self.config_obj["capture"];
+        let path = match capture_obj["path"] {
+            Yaml::String(ref path) => path.clone(),
+            Yaml::BadValue => return None,
+            _ => panic!("Malformed YAML config"),
+        };
+        let snaplen = match capture_obj["snaplen"] {
+            Yaml::Integer(n) if n > 0 => n as usize,
+            Yaml::BadValue => 65535,
+            _ => panic!("Invalid capture snaplen"),
+        };
+        let ring_size = match capture_obj["ring_size"] {
+            Yaml::Integer(n) if n > 0 => n as usize,
+            Yaml::BadValue => 16 << 20,
+            _ => panic!("Invalid capture ring size"),
+        };
+        let filter = match capture_obj["filter"] {
+            Yaml::String(ref bytecode) => Some(BpfProgram::parse(bytecode).unwrap()),
+            Yaml::BadValue => None,
+            _ => panic!("Malformed YAML config"),
+        };
+        Some(CaptureConfig {
+            path,
+            snaplen,
+            ring_size,
+            filter,
+        })
+    }
+
+    // Parse the largest message a framed queue takes (see `dmtr_set_framed`). A peer that
+    // announces a larger one fails the stream.
+    pub fn max_message_size(&self) -> usize {
+        match self.config_obj["framing"]["max_message_size"] {
+            Yaml::Integer(n) if n > 0 => n as usize,
+            Yaml::BadValue => framing::DEFAULT_MAX_MESSAGE_SIZE,
+            _ => panic!("Invalid framing max_message_size"),
+        }
+    }
+
     pub fn new(config_path: String) -> Self {
         let mut config_s = String::new();
         File::open(config_path)
@@ -139,6 +266,12 @@ impl Config {
         let mss: usize = env::var("MSS").unwrap().parse().unwrap();
         let udp_checksum_offload = env::var("UDP_CHECKSUM_OFFLOAD").is_ok();
         let tcp_checksum_offload = env::var("TCP_CHECKSUM_OFFLOAD").is_ok();
+        let tcp_tso = env::var("TCP_TSO").is_ok();
+        let tcp_lro = env::var("TCP_LRO").is_ok();
+        // Number of empty polls after which an idle core sleeps until the NIC interrupts it.
+        let rx_intr_idle_polls: Option<usize> = env::var("RX_INTR_IDLE_POLLS")
+            .ok()
+            .map(|s| s.parse().unwrap());
 
         let buffer_size: usize = 64;
 
@@ -153,6 +286,9 @@ impl Config {
             mtu,
             udp_checksum_offload,
             tcp_checksum_offload,
+            tcp_tso,
+            tcp_lro,
+            rx_intr_idle_polls,
             config_obj: config_obj.clone(),
         }
     }
@@ -0,0 +1,291 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Batched datagram operations behind `dmtr_pushto_many()` and `dmtr_popfrom()`, for UDP queues
+//! that would otherwise pay an FFI call, a token and a trip through the stack per datagram.
+//!
+//! Pushes are handed to the stack back to back and their tokens are reaped on later calls, so the
+//! frames go out together when the runtime flushes its transmit batch. Pops are kept outstanding
+//! between calls, one for every datagram the last call asked for, so a single pass of the stack
+//! completes as many of them as have arrived. Those pops take every datagram on the queue, so
+//! `dmtr_pop()` shouldn't be mixed with `dmtr_popfrom()` on the same queue.
+
+use crate::{
+    interop::{
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+    },
+    stats,
+    wait,
+};
+use catnip::{
+    file_table::FileDescriptor,
+    interop::{
+        dmtr_opcode_t,
+        dmtr_qtoken_t,
+    },
+    libos::LibOS,
+    protocols::{
+        ip,
+        ipv4,
+    },
+    runtime::Runtime,
+};
+use libc::{
+    c_int,
+    sockaddr_in,
+};
+use std::{
+    cell::RefCell,
+    collections::{
+        HashMap,
+        VecDeque,
+    },
+    convert::TryFrom,
+    mem,
+    net::Ipv4Addr,
+    slice,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Tokens that batched operations left outstanding on a queue.
+#[derive(Default)]
+struct Outstanding {
+    pops: VecDeque<dmtr_qtoken_t>,
+    pushes: Vec<dmtr_qtoken_t>,
+}
+
+thread_local! {
+    static OUTSTANDING: RefCell<HashMap<FileDescriptor, Outstanding>> =
+        RefCell::new(HashMap::new());
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Hands each of `sgas` to the stack as a datagram to the matching entry of `saddrs`, stopping at
+/// the first one that can't be sent. Returns how many were. `clone_buf` copies a datagram into a
+/// buffer of the runtime's, or returns `None` if it's out of buffers for now. Failures after a
+/// datagram has been handed over aren't reported, as with `sendmmsg()` on a UDP socket. The caller
+/// flushes the runtime's transmit batch afterwards.
+pub fn pushto_many<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    qd: FileDescriptor,
+    sgas: &[dmtr_sgarray_t],
+    saddrs: &[sockaddr_in],
+    mut clone_buf: impl FnMut(&dmtr_sgarray_t) -> Option<RT::Buf>,
+) -> Result<usize, c_int> {
+    if sgas.is_empty() || sgas.len() != saddrs.len() {
+        return Err(libc::EINVAL);
+    }
+    reap_pushes(libos, qd);
+
+    let mut qts = Vec::with_capacity(sgas.len());
+    let mut result = Ok(sgas.len());
+    for (i, (sga, saddr)) in sgas.iter().zip(saddrs).enumerate() {
+        let endpoint = match endpoint(saddr) {
+            Some(endpoint) if sga.is_valid() => endpoint,
+            _ => {
+                result = if i == 0 { Err(libc::EINVAL) } else { Ok(i) };
+                break;
+            },
+        };
+        let buf = match clone_buf(sga) {
+            Some(buf) => buf,
+            None => {
+                result = if i == 0 { Err(libc::EAGAIN) } else { Ok(i) };
+                break;
+            },
+        };
+        match libos.pushto2(qd, buf, endpoint) {
+            Ok(qt) => {
+                stats::record_push_issued(qt);
+                qts.push(qt);
+            },
+            Err(e) => {
+                result = if i == 0 { Err(e.errno()) } else { Ok(i) };
+                break;
+            },
+        }
+    }
+
+    OUTSTANDING.with(|o| o.borrow_mut().entry(qd).or_default().pushes.extend(qts));
+    result
+}
+
+/// Takes up to `sgas_out.len()` datagrams that have arrived on `qd`, along with their senders.
+/// Returns how many there were, or `EAGAIN` if there were none.
+pub fn popfrom<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    qd: FileDescriptor,
+    sgas_out: &mut [dmtr_sgarray_t],
+    saddrs_out: &mut [sockaddr_in],
+) -> Result<usize, c_int> {
+    let max = sgas_out.len().min(saddrs_out.len());
+    if max == 0 {
+        return Err(libc::EINVAL);
+    }
+
+    let mut pops = OUTSTANDING.with(|o| {
+        o.borrow_mut()
+            .get_mut(&qd)
+            .map(|outstanding| mem::take(&mut outstanding.pops))
+            .unwrap_or_default()
+    });
+    while pops.len() < max {
+        match libos.pop(qd) {
+            Ok(qt) => {
+                stats::record_pop_issued(qt);
+                pops.push_back(qt);
+            },
+            Err(e) => {
+                put_back_pops(qd, pops);
+                return Err(e.errno());
+            },
+        }
+    }
+
+    // Only the first pop runs the stack; the rest just check in. Pops don't necessarily complete
+    // in the order they were issued, so every one of them is checked.
+    let mut npopped = 0;
+    let mut result = Ok(());
+    let mut pending = VecDeque::with_capacity(pops.len());
+    for (i, qt) in pops.into_iter().enumerate() {
+        if npopped == max || result.is_err() {
+            pending.push_back(qt);
+            continue;
+        }
+        if i > 0 {
+            match wait::has_completed(libos, qt) {
+                Ok(true) => (),
+                Ok(false) => {
+                    pending.push_back(qt);
+                    continue;
+                },
+                Err(e) => {
+                    result = Err(e);
+                    continue;
+                },
+            }
+        }
+        let qr: dmtr_qresult_t = match libos.poll(qt) {
+            Some(qr) => qr.into(),
+            None => {
+                pending.push_back(qt);
+                continue;
+            },
+        };
+        stats::record_completed(qt);
+        if qr.qr_opcode != dmtr_opcode_t::DMTR_OPC_POP {
+            result = Err(libc::EIO);
+            continue;
+        }
+        let sga = unsafe { qr.qr_value.sga };
+        saddrs_out[npopped] = sga.sga_addr;
+        sgas_out[npopped] = sga;
+        npopped += 1;
+    }
+    put_back_pops(qd, pending);
+
+    match result {
+        Err(e) if npopped == 0 => Err(e),
+        _ if npopped == 0 => Err(libc::EAGAIN),
+        _ => Ok(npopped),
+    }
+}
+
+/// Drops the tokens that batched operations left outstanding on `qd`, which is being closed.
+pub fn forget<RT: Runtime>(libos: &mut LibOS<RT>, qd: FileDescriptor) {
+    if let Some(outstanding) = OUTSTANDING.with(|o| o.borrow_mut().remove(&qd)) {
+        for qt in outstanding.pops.into_iter().chain(outstanding.pushes) {
+            stats::record_dropped(qt);
+            libos.drop_qtoken(qt);
+        }
+    }
+}
+
+/// Checks and converts the arguments of `dmtr_pushto_many()` for [pushto_many].
+pub fn pushto_many_raw<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    num_pushed_out: *mut c_int,
+    qd: c_int,
+    sgas: *const dmtr_sgarray_t,
+    saddrs: *const sockaddr_in,
+    num: c_int,
+    clone_buf: impl FnMut(&dmtr_sgarray_t) -> Option<RT::Buf>,
+) -> c_int {
+    if num_pushed_out.is_null() || sgas.is_null() || saddrs.is_null() || num <= 0 {
+        return libc::EINVAL;
+    }
+    let sgas = unsafe { slice::from_raw_parts(sgas, num as usize) };
+    let saddrs = unsafe { slice::from_raw_parts(saddrs, num as usize) };
+    match pushto_many(libos, qd as FileDescriptor, sgas, saddrs, clone_buf) {
+        Ok(npushed) => {
+            unsafe { *num_pushed_out = npushed as c_int };
+            0
+        },
+        Err(e) => e,
+    }
+}
+
+/// Checks and converts the arguments of `dmtr_popfrom()` for [popfrom].
+pub fn popfrom_raw<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    num_out: *mut c_int,
+    qd: c_int,
+    sgas_out: *mut dmtr_sgarray_t,
+    saddrs_out: *mut sockaddr_in,
+    max: c_int,
+) -> c_int {
+    if num_out.is_null() || sgas_out.is_null() || saddrs_out.is_null() || max <= 0 {
+        return libc::EINVAL;
+    }
+    let sgas_out = unsafe { slice::from_raw_parts_mut(sgas_out, max as usize) };
+    let saddrs_out = unsafe { slice::from_raw_parts_mut(saddrs_out, max as usize) };
+    match popfrom(libos, qd as FileDescriptor, sgas_out, saddrs_out) {
+        Ok(npopped) => {
+            unsafe { *num_out = npopped as c_int };
+            0
+        },
+        Err(e) => {
+            unsafe { *num_out = 0 };
+            e
+        },
+    }
+}
+
+/// Drops the tokens of pushes that have completed, so they don't pile up.
+fn reap_pushes<RT: Runtime>(libos: &mut LibOS<RT>, qd: FileDescriptor) {
+    OUTSTANDING.with(|o| {
+        if let Some(outstanding) = o.borrow_mut().get_mut(&qd) {
+            outstanding
+                .pushes
+                .retain(|&qt| match wait::has_completed(libos, qt) {
+                    Ok(false) => true,
+                    Ok(true) => {
+                        stats::record_completed(qt);
+                        libos.drop_qtoken(qt);
+                        false
+                    },
+                    Err(..) => {
+                        stats::record_dropped(qt);
+                        false
+                    },
+                });
+        }
+    })
+}
+
+fn put_back_pops(qd: FileDescriptor, pops: VecDeque<dmtr_qtoken_t>) {
+    OUTSTANDING.with(|o| o.borrow_mut().entry(qd).or_default().pops = pops);
+}
+
+fn endpoint(saddr: &sockaddr_in) -> Option<ipv4::Endpoint> {
+    let addr = Ipv4Addr::from(u32::from_be_bytes(saddr.sin_addr.s_addr.to_le_bytes()));
+    let port = ip::Port::try_from(u16::from_be(saddr.sin_port)).ok()?;
+    Some(ipv4::Endpoint::new(addr, port))
+}
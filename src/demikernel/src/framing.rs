@@ -0,0 +1,771 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Framed TCP queues, behind `dmtr_set_framed()`, for applications that exchange whole messages
+//! rather than a byte stream.
+//!
+//! On a framed queue, each push goes out behind a `dmtr_header_t`, and a pop only completes once
+//! a whole message has arrived. The message comes back as an array whose segments point into the
+//! buffers it arrived in, without being copied out of them. A buffer that holds the end of one
+//! message and the start of the next is shared by both, and goes back to the runtime once both
+//! have been freed. Only a message spread over more buffers than an array has segments for is
+//! copied, and then only the buffers that don't fit.
+//!
+//! The stack knows nothing of messages, so a framed pop isn't one of its operations: its token is
+//! one of ours, which the libOS hands to [poll] and [wait] instead of the stack. Behind them, the
+//! queue keeps a pop of its own outstanding on the stack, and reassembles what it returns.
+
+use crate::{
+    interop::{
+        dmtr_header_t,
+        dmtr_qr_value_t,
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+        DMTR_HEADER_MAGIC,
+        DMTR_SGARRAY_MAXSIZE,
+    },
+    wait,
+};
+use catnip::{
+    file_table::FileDescriptor,
+    interop::{
+        dmtr_opcode_t,
+        dmtr_qtoken_t,
+        dmtr_sgaseg_t,
+    },
+    libos::LibOS,
+    runtime::Runtime,
+};
+use libc::{
+    c_int,
+    c_void,
+};
+use std::{
+    cell::{
+        Cell,
+        RefCell,
+    },
+    collections::{
+        HashMap,
+        HashSet,
+        VecDeque,
+    },
+    mem,
+    rc::Rc,
+    slice,
+    sync::atomic::{
+        AtomicUsize,
+        Ordering,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Set in the token of every framed pop, and in none of the stack's, which are slab indices.
+const FRAMED_TOKEN: dmtr_qtoken_t = 1 << 63;
+
+const HEADER_SIZE: usize = mem::size_of::<dmtr_header_t>();
+
+/// Largest message a framed queue takes unless configured otherwise.
+pub const DEFAULT_MAX_MESSAGE_SIZE: usize = 16 << 20;
+
+/// Largest message that framed queues made from here on take. A peer that announces a larger one
+/// fails the stream, rather than having us hold on to everything it sends until it's all there.
+static MAX_MESSAGE_SIZE: AtomicUsize = AtomicUsize::new(DEFAULT_MAX_MESSAGE_SIZE);
+
+/// A buffer popped from the stack, which goes back to the runtime once no message or queue
+/// references it anymore.
+struct Received(dmtr_sgarray_t);
+
+/// Bytes of a buffer that `owner` keeps alive.
+struct Chunk<O> {
+    owner: O,
+    ptr: *const u8,
+    len: usize,
+}
+
+/// The bytes that have arrived on a queue and aren't part of a popped message yet, in order.
+struct Reassembly<O> {
+    chunks: VecDeque<Chunk<O>>,
+    len: usize,
+    max_message_size: usize,
+}
+
+/// A whole message, taken off the front of a [Reassembly].
+struct Next<O> {
+    /// References to the buffers the header was in, which the payload doesn't need.
+    spent: Vec<O>,
+    payload: Vec<Chunk<O>>,
+}
+
+/// A framed queue.
+#[derive(Default)]
+struct Framer {
+    reassembly: Reassembly<Rc<Received>>,
+    /// Pop of our own on the stack, which the queue's data arrives through.
+    inner: Option<dmtr_qtoken_t>,
+    /// Result that every pop completes with once the messages that arrived before it are gone:
+    /// the connection failed or was closed, or the peer sent something that isn't a message.
+    last: Option<dmtr_qresult_t>,
+}
+
+/// What a popped message references, from its `sga_buf` until the application frees it.
+struct Message {
+    owners: Vec<Rc<Received>>,
+    copy: Option<Box<[u8]>>,
+}
+
+thread_local! {
+    static FRAMERS: RefCell<HashMap<FileDescriptor, Framer>> = RefCell::new(HashMap::new());
+
+    /// Framed pops that haven't completed, and their queues.
+    static POPS: RefCell<HashMap<dmtr_qtoken_t, FileDescriptor>> = RefCell::new(HashMap::new());
+
+    static NEXT_TOKEN: Cell<dmtr_qtoken_t> = Cell::new(FRAMED_TOKEN);
+
+    /// `sga_buf` of every popped message that hasn't been freed yet.
+    static MESSAGES: RefCell<HashSet<usize>> = RefCell::new(HashSet::new());
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl<O: Clone> Reassembly<O> {
+    /// Appends the segments of a buffer that `owner` keeps alive.
+    fn push(&mut self, owner: O, segments: &[dmtr_sgaseg_t]) {
+        for seg in segments.iter().filter(|seg| seg.sgaseg_len > 0) {
+            self.chunks.push_back(Chunk {
+                owner: owner.clone(),
+                ptr: seg.sgaseg_buf as *const u8,
+                len: seg.sgaseg_len as usize,
+            });
+            self.len += seg.sgaseg_len as usize;
+        }
+    }
+
+    /// Takes the next message off the front, which is `None` until all of it has arrived, and an
+    /// error if what's there doesn't start with a valid header or announces a message larger than
+    /// we take.
+    fn next_message(&mut self) -> Option<Result<Next<O>, ()>> {
+        let header = self.peek_header()?;
+        if header.h_magic != DMTR_HEADER_MAGIC
+            || header.h_bytes == 0
+            || header.h_sgasegs == 0
+            || header.h_sgasegs as usize > DMTR_SGARRAY_MAXSIZE
+            || header.h_bytes as usize > self.max_message_size
+        {
+            return Some(Err(()));
+        }
+        if self.len < HEADER_SIZE + header.h_bytes as usize {
+            return None;
+        }
+        let spent = self
+            .take(HEADER_SIZE)
+            .into_iter()
+            .map(|chunk| chunk.owner)
+            .collect();
+        let payload = self.take(header.h_bytes as usize);
+        Some(Ok(Next { spent, payload }))
+    }
+
+    /// Empties the reassembly, returning the owners of what it held.
+    fn clear(&mut self) -> Vec<O> {
+        self.len = 0;
+        self.chunks.drain(..).map(|chunk| chunk.owner).collect()
+    }
+
+    fn peek_header(&self) -> Option<dmtr_header_t> {
+        if self.len < HEADER_SIZE {
+            return None;
+        }
+        let mut bytes = [0u8; HEADER_SIZE];
+        let mut pos = 0;
+        for chunk in &self.chunks {
+            let n = chunk.len.min(HEADER_SIZE - pos);
+            let chunk_bytes = unsafe { slice::from_raw_parts(chunk.ptr, n) };
+            bytes[pos..(pos + n)].copy_from_slice(chunk_bytes);
+            pos += n;
+            if pos == HEADER_SIZE {
+                break;
+            }
+        }
+        let field = |i: usize| {
+            let mut field = [0u8; 4];
+            field.copy_from_slice(&bytes[(4 * i)..(4 * i + 4)]);
+            u32::from_ne_bytes(field)
+        };
+        Some(dmtr_header_t {
+            h_magic: field(0),
+            h_bytes: field(1),
+            h_sgasegs: field(2),
+        })
+    }
+
+    /// Takes `len` bytes off the front. A chunk that's only partly taken is split, with both
+    /// halves keeping its buffer alive.
+    fn take(&mut self, mut len: usize) -> Vec<Chunk<O>> {
+        assert!(len <= self.len);
+        self.len -= len;
+        let mut taken = Vec::new();
+        while len > 0 {
+            let front = self.chunks.front_mut().unwrap();
+            if front.len <= len {
+                len -= front.len;
+                taken.push(self.chunks.pop_front().unwrap());
+            } else {
+                taken.push(Chunk {
+                    owner: front.owner.clone(),
+                    ptr: front.ptr,
+                    len,
+                });
+                front.ptr = unsafe { front.ptr.add(len) };
+                front.len -= len;
+                len = 0;
+            }
+        }
+        taken
+    }
+}
+
+impl Framer {
+    fn poll<RT: Runtime>(
+        &mut self,
+        libos: &mut LibOS<RT>,
+        qd: FileDescriptor,
+        qt: dmtr_qtoken_t,
+        mut run_stack: bool,
+    ) -> Result<Option<dmtr_qresult_t>, c_int> {
+        loop {
+            if let Some(qr) = self.next_result(libos, qd, qt) {
+                return Ok(Some(qr));
+            }
+            let inner = match self.inner.take() {
+                Some(inner) => inner,
+                None => libos.pop(qd).map_err(|e| e.errno())?,
+            };
+            let qr = if run_stack {
+                libos.poll(inner).map(|qr| qr.into())
+            } else {
+                match wait::take_completed(libos, inner) {
+                    Ok(qr) => qr,
+                    Err(e) => {
+                        self.inner = Some(inner);
+                        return Err(e);
+                    },
+                }
+            };
+            let qr: dmtr_qresult_t = match qr {
+                Some(qr) => qr,
+                None => {
+                    self.inner = Some(inner);
+                    return Ok(None);
+                },
+            };
+            self.receive(libos, qd, qr);
+            // Whatever else has arrived is there for the next pop to take without another pass.
+            run_stack = false;
+        }
+    }
+
+    /// Feeds the result of one of our pops to the reassembly.
+    fn receive<RT: Runtime>(&mut self, libos: &LibOS<RT>, qd: FileDescriptor, qr: dmtr_qresult_t) {
+        if qr.qr_opcode != dmtr_opcode_t::DMTR_OPC_POP {
+            self.last = Some(qr);
+            return;
+        }
+        let sga = unsafe { qr.qr_value.sga };
+        if sga.len() == 0 {
+            // The peer closed the connection, which every later pop reports as plain pops do.
+            libos.rt().free_sgarray(sga.into());
+            self.last = Some(pop_result(qd, 0, dmtr_sgarray_t::empty()));
+            return;
+        }
+        self.reassembly.push(Rc::new(Received(sga)), sga.segments());
+    }
+
+    fn next_result<RT: Runtime>(
+        &mut self,
+        libos: &LibOS<RT>,
+        qd: FileDescriptor,
+        qt: dmtr_qtoken_t,
+    ) -> Option<dmtr_qresult_t> {
+        match self.reassembly.next_message() {
+            Some(Ok(next)) => {
+                release(libos, next.spent);
+                let (sga, copied) = into_sgarray(next.payload);
+                release(libos, copied);
+                return Some(pop_result(qd, qt, sga));
+            },
+            Some(Err(())) => {
+                // There's no telling where the next message starts, so the stream is done for.
+                release(libos, self.reassembly.clear());
+                self.last = Some(failed_result(qd));
+            },
+            None => (),
+        }
+        self.last.map(|mut qr| {
+            qr.qr_qd = qd as c_int;
+            qr.qr_qt = qt;
+            qr
+        })
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl<O> Default for Reassembly<O> {
+    fn default() -> Self {
+        Self {
+            chunks: VecDeque::new(),
+            len: 0,
+            max_message_size: MAX_MESSAGE_SIZE.load(Ordering::Relaxed),
+        }
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Makes `qd` framed or not. A queue only stops being framed while no data or framed pops are
+/// pending on it, since they'd be lost.
+pub fn set_framed(qd: FileDescriptor, framed: bool) -> Result<(), c_int> {
+    FRAMERS.with(|f| {
+        let mut framers = f.borrow_mut();
+        if framed {
+            framers.entry(qd).or_default();
+            return Ok(());
+        }
+        let busy = match framers.get(&qd) {
+            None => return Ok(()),
+            Some(framer) => {
+                framer.reassembly.len > 0
+                    || framer.inner.is_some()
+                    || POPS.with(|p| p.borrow().values().any(|&pop_qd| pop_qd == qd))
+            },
+        };
+        if busy {
+            return Err(libc::EBUSY);
+        }
+        framers.remove(&qd);
+        Ok(())
+    })
+}
+
+/// Sets the largest message that queues made framed from here on take (`framing.max_message_size`
+/// in the config).
+pub fn set_max_message_size(size: usize) {
+    MAX_MESSAGE_SIZE.store(size, Ordering::Relaxed);
+}
+
+pub fn is_framed(qd: FileDescriptor) -> bool {
+    FRAMERS.with(|f| {
+        let framers = f.borrow();
+        !framers.is_empty() && framers.contains_key(&qd)
+    })
+}
+
+/// Whether `qt` is a framed pop's, which only [poll], [wait] and [drop_token] take.
+#[inline]
+pub fn is_framed_token(qt: dmtr_qtoken_t) -> bool {
+    qt & FRAMED_TOKEN != 0
+}
+
+/// Returns `sga` behind a segment for its header, which is written to `header`. The header has to
+/// outlive the push, as the array's segments do. Leaves room in the array for the header, and
+/// rejects empty messages, which would read as the end of the stream.
+pub fn frame(sga: &dmtr_sgarray_t, header: &mut dmtr_header_t) -> Result<dmtr_sgarray_t, c_int> {
+    let len = sga.len();
+    if !sga.is_valid() || sga.sga_numsegs as usize == DMTR_SGARRAY_MAXSIZE {
+        return Err(libc::EINVAL);
+    }
+    if len == 0 || len > u32::MAX as usize {
+        return Err(libc::EINVAL);
+    }
+    *header = dmtr_header_t {
+        h_magic: DMTR_HEADER_MAGIC,
+        h_bytes: len as u32,
+        h_sgasegs: sga.sga_numsegs,
+    };
+    let mut framed = dmtr_sgarray_t::empty();
+    let header_seg = dmtr_sgaseg_t {
+        sgaseg_buf: header as *mut dmtr_header_t as *mut c_void,
+        sgaseg_len: HEADER_SIZE as u32,
+    };
+    framed.push_segment(header_seg).unwrap();
+    for seg in sga.segments() {
+        framed.push_segment(*seg).unwrap();
+    }
+    framed.sga_addr = sga.sga_addr;
+    Ok(framed)
+}
+
+/// Starts a framed pop on `qd`, if it's framed. Nothing happens on the stack until the token is
+/// polled.
+pub fn pop(qd: FileDescriptor) -> Option<dmtr_qtoken_t> {
+    if !is_framed(qd) {
+        return None;
+    }
+    let qt = NEXT_TOKEN.with(|n| {
+        let qt = n.get();
+        n.set(FRAMED_TOKEN | qt.wrapping_add(1));
+        qt
+    });
+    POPS.with(|p| p.borrow_mut().insert(qt, qd));
+    Some(qt)
+}
+
+/// Completes the framed pop behind `qt` if a whole message has arrived, consuming the token.
+/// With `run_stack`, the queue's own pop runs the stack's background work, as the first token
+/// of a wait does; otherwise, it only checks in.
+pub fn poll<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    qt: dmtr_qtoken_t,
+    run_stack: bool,
+) -> Result<Option<dmtr_qresult_t>, c_int> {
+    let qd = match POPS.with(|p| p.borrow().get(&qt).copied()) {
+        Some(qd) => qd,
+        None => return Err(libc::EINVAL),
+    };
+    let result = FRAMERS.with(|f| match f.borrow_mut().get_mut(&qd) {
+        Some(framer) => framer.poll(libos, qd, qt, run_stack),
+        None => Err(libc::EINVAL),
+    });
+    if let Ok(Some(..)) = result {
+        POPS.with(|p| p.borrow_mut().remove(&qt));
+    }
+    result
+}
+
+/// Runs the stack until the framed pop behind `qt` completes.
+pub fn wait<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    qt: dmtr_qtoken_t,
+) -> Result<dmtr_qresult_t, c_int> {
+    loop {
+        if let Some(qr) = poll(libos, qt, true)? {
+            return Ok(qr);
+        }
+    }
+}
+
+/// Forgets the framed pop behind `qt`. Data its queue has received stays for the next pop.
+pub fn drop_token(qt: dmtr_qtoken_t) -> Result<(), c_int> {
+    match POPS.with(|p| p.borrow_mut().remove(&qt)) {
+        Some(..) => Ok(()),
+        None => Err(libc::EINVAL),
+    }
+}
+
+/// Frees `sga` if it's a message that a framed pop returned, releasing the buffers it
+/// references. Returns whether it was.
+pub fn free<RT: Runtime>(libos: &LibOS<RT>, sga: &dmtr_sgarray_t) -> bool {
+    if sga.sga_buf.is_null() {
+        return false;
+    }
+    let is_message = MESSAGES.with(|m| {
+        let mut messages = m.borrow_mut();
+        !messages.is_empty() && messages.remove(&(sga.sga_buf as usize))
+    });
+    if !is_message {
+        return false;
+    }
+    let message = unsafe { Box::from_raw(sga.sga_buf as *mut Message) };
+    release(libos, message.owners);
+    true
+}
+
+/// Drops the state of `qd`, which is being closed. Messages already popped from it stay valid
+/// until they're freed.
+pub fn forget<RT: Runtime>(libos: &mut LibOS<RT>, qd: FileDescriptor) {
+    let mut framer = match FRAMERS.with(|f| f.borrow_mut().remove(&qd)) {
+        Some(framer) => framer,
+        None => return,
+    };
+    if let Some(inner) = framer.inner {
+        libos.drop_qtoken(inner);
+    }
+    release(libos, framer.reassembly.clear());
+    POPS.with(|p| p.borrow_mut().retain(|_, &mut pop_qd| pop_qd != qd));
+}
+
+/// Checks the arguments of `dmtr_set_framed()` for [set_framed].
+pub fn set_framed_raw(qd: c_int, framed: c_int) -> c_int {
+    match set_framed(qd as FileDescriptor, framed != 0) {
+        Ok(()) => 0,
+        Err(e) => e,
+    }
+}
+
+/// [poll] for `dmtr_poll()`, which returns `EAGAIN` until the pop completes.
+pub fn poll_raw<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    qr_out: *mut dmtr_qresult_t,
+    qt: dmtr_qtoken_t,
+) -> c_int {
+    match poll(libos, qt, true) {
+        Ok(Some(qr)) => {
+            if !qr_out.is_null() {
+                unsafe { *qr_out = qr };
+            }
+            0
+        },
+        Ok(None) => libc::EAGAIN,
+        Err(e) => e,
+    }
+}
+
+/// [wait] for `dmtr_wait()`.
+pub fn wait_raw<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    qr_out: *mut dmtr_qresult_t,
+    qt: dmtr_qtoken_t,
+) -> c_int {
+    match wait(libos, qt) {
+        Ok(qr) => {
+            if !qr_out.is_null() {
+                unsafe { *qr_out = qr };
+            }
+            0
+        },
+        Err(e) => e,
+    }
+}
+
+/// Turns the payload of a message into an array that owns its buffers through `sga_buf`. Chunks
+/// past what the array has segments for are copied into its last one, and the owners of those
+/// chunks are returned for release.
+fn into_sgarray(payload: Vec<Chunk<Rc<Received>>>) -> (dmtr_sgarray_t, Vec<Rc<Received>>) {
+    let num_direct = if payload.len() <= DMTR_SGARRAY_MAXSIZE {
+        payload.len()
+    } else {
+        DMTR_SGARRAY_MAXSIZE - 1
+    };
+    let mut sga = dmtr_sgarray_t::empty();
+    let mut message = Message {
+        owners: Vec::with_capacity(num_direct),
+        copy: None,
+    };
+    let mut chunks = payload.into_iter();
+    for chunk in chunks.by_ref().take(num_direct) {
+        let seg = dmtr_sgaseg_t {
+            sgaseg_buf: chunk.ptr as *mut c_void,
+            sgaseg_len: chunk.len as u32,
+        };
+        sga.push_segment(seg).unwrap();
+        // Consecutive chunks of a buffer are the same reference.
+        match message.owners.last() {
+            Some(last) if Rc::ptr_eq(last, &chunk.owner) => (),
+            _ => message.owners.push(chunk.owner),
+        }
+    }
+
+    let mut copied = Vec::new();
+    let rest: Vec<_> = chunks.collect();
+    if !rest.is_empty() {
+        let mut copy = Vec::with_capacity(rest.iter().map(|chunk| chunk.len).sum());
+        for chunk in rest {
+            copy.extend_from_slice(unsafe { slice::from_raw_parts(chunk.ptr, chunk.len) });
+            copied.push(chunk.owner);
+        }
+        let copy = copy.into_boxed_slice();
+        let seg = dmtr_sgaseg_t {
+            sgaseg_buf: copy.as_ptr() as *mut c_void,
+            sgaseg_len: copy.len() as u32,
+        };
+        sga.push_segment(seg).unwrap();
+        message.copy = Some(copy);
+    }
+
+    let buf = Box::into_raw(Box::new(message));
+    MESSAGES.with(|m| m.borrow_mut().insert(buf as usize));
+    sga.sga_buf = buf as *mut c_void;
+    (sga, copied)
+}
+
+/// Gives each buffer back to the runtime once nothing else references it.
+fn release<RT: Runtime>(libos: &LibOS<RT>, owners: Vec<Rc<Received>>) {
+    for owner in owners {
+        if let Ok(Received(sga)) = Rc::try_unwrap(owner) {
+            libos.rt().free_sgarray(sga.into());
+        }
+    }
+}
+
+fn pop_result(qd: FileDescriptor, qt: dmtr_qtoken_t, sga: dmtr_sgarray_t) -> dmtr_qresult_t {
+    dmtr_qresult_t {
+        qr_opcode: dmtr_opcode_t::DMTR_OPC_POP,
+        qr_qd: qd as c_int,
+        qr_qt: qt,
+        qr_value: dmtr_qr_value_t { sga },
+    }
+}
+
+fn failed_result(qd: FileDescriptor) -> dmtr_qresult_t {
+    dmtr_qresult_t {
+        qr_opcode: dmtr_opcode_t::DMTR_OPC_FAILED,
+        qr_qd: qd as c_int,
+        qr_qt: 0,
+        qr_value: unsafe { mem::zeroed() },
+    }
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn message(payload: &[u8]) -> Vec<u8> {
+        let header = dmtr_header_t {
+            h_magic: DMTR_HEADER_MAGIC,
+            h_bytes: payload.len() as u32,
+            h_sgasegs: 1,
+        };
+        let mut bytes = Vec::new();
+        for field in &[header.h_magic, header.h_bytes, header.h_sgasegs] {
+            bytes.extend_from_slice(&field.to_ne_bytes());
+        }
+        bytes.extend_from_slice(payload);
+        bytes
+    }
+
+    fn segment(bytes: &[u8]) -> dmtr_sgaseg_t {
+        dmtr_sgaseg_t {
+            sgaseg_buf: bytes.as_ptr() as *mut c_void,
+            sgaseg_len: bytes.len() as u32,
+        }
+    }
+
+    fn contents<O>(chunks: &[Chunk<O>]) -> Vec<u8> {
+        let mut bytes = Vec::new();
+        for chunk in chunks {
+            bytes.extend_from_slice(unsafe { slice::from_raw_parts(chunk.ptr, chunk.len) });
+        }
+        bytes
+    }
+
+    #[test]
+    fn reassembles_across_buffers() {
+        // Two messages, split so that the first header straddles two buffers and the third buffer
+        // holds the end of the first message and the start of the second.
+        let mut stream = message(b"hello, world");
+        stream.extend(message(b"bye"));
+        let buffers = [&stream[..5], &stream[5..14], &stream[14..30], &stream[30..]];
+
+        let mut reassembly = Reassembly::default();
+        reassembly.push(0, &[segment(buffers[0])]);
+        assert!(reassembly.next_message().is_none());
+        reassembly.push(1, &[segment(buffers[1])]);
+        assert!(reassembly.next_message().is_none());
+        reassembly.push(2, &[segment(buffers[2])]);
+
+        // The header ends partway into the second buffer, which the payload keeps alive.
+        let next = reassembly.next_message().unwrap().unwrap();
+        assert_eq!(next.spent, vec![0, 1]);
+        assert_eq!(contents(&next.payload), b"hello, world");
+        let owners: Vec<_> = next.payload.iter().map(|chunk| chunk.owner).collect();
+        assert_eq!(owners, vec![1, 2]);
+        // Nothing was copied.
+        assert_eq!(next.payload[0].ptr, stream[HEADER_SIZE..].as_ptr());
+
+        assert!(reassembly.next_message().is_none());
+        reassembly.push(3, &[segment(buffers[3])]);
+        let next = reassembly.next_message().unwrap().unwrap();
+        assert_eq!(next.spent, vec![2, 3]);
+        assert_eq!(contents(&next.payload), b"bye");
+        assert_eq!(reassembly.len, 0);
+    }
+
+    #[test]
+    fn rejects_invalid_headers() {
+        let mut stream = message(b"payload");
+        stream[0] ^= 0xff;
+        let mut reassembly = Reassembly::default();
+        reassembly.push(0, &[segment(&stream)]);
+        assert!(matches!(reassembly.next_message(), Some(Err(()))));
+        assert_eq!(reassembly.clear(), vec![0]);
+
+        let mut reassembly = Reassembly::default();
+        let empty = message(b"");
+        reassembly.push(0, &[segment(&empty)]);
+        assert!(matches!(reassembly.next_message(), Some(Err(()))));
+
+        // A message that's too large fails as soon as its header is in.
+        let mut reassembly = Reassembly {
+            max_message_size: 6,
+            ..Default::default()
+        };
+        let large = message(b"payload");
+        reassembly.push(0, &[segment(&large[..HEADER_SIZE])]);
+        assert!(matches!(reassembly.next_message(), Some(Err(()))));
+    }
+
+    #[test]
+    fn copies_only_what_the_array_has_no_room_for() {
+        let bytes: Vec<u8> = (0..20).collect();
+        let owners: Vec<_> = (0..20)
+            .map(|_| Rc::new(Received(dmtr_sgarray_t::empty())))
+            .collect();
+        let payload = (0..20)
+            .map(|i| Chunk {
+                owner: owners[i].clone(),
+                ptr: &bytes[i] as *const u8,
+                len: 1,
+            })
+            .collect();
+
+        let (sga, copied) = into_sgarray(payload);
+        assert_eq!(sga.sga_numsegs as usize, DMTR_SGARRAY_MAXSIZE);
+        assert_eq!(sga.sga_segs[0].sgaseg_buf as *const u8, bytes.as_ptr());
+        let last = sga.sga_segs[DMTR_SGARRAY_MAXSIZE - 1];
+        let last = unsafe { slice::from_raw_parts(last.sgaseg_buf as *const u8, 5) };
+        assert_eq!(last, &bytes[15..]);
+        assert_eq!(copied.len(), 5);
+        drop(copied);
+
+        // The message holds the buffers it points into, and only those.
+        assert!(MESSAGES.with(|m| m.borrow_mut().remove(&(sga.sga_buf as usize))));
+        let message = unsafe { Box::from_raw(sga.sga_buf as *mut Message) };
+        assert_eq!(message.owners.len(), 15);
+        assert_eq!(Rc::strong_count(&owners[0]), 2);
+        assert_eq!(Rc::strong_count(&owners[19]), 1);
+    }
+
+    #[test]
+    fn frames_pushes() {
+        let bytes = [7u8; 10];
+        let mut sga = dmtr_sgarray_t::empty();
+        sga.push_segment(segment(&bytes[..4])).unwrap();
+        sga.push_segment(segment(&bytes[4..])).unwrap();
+
+        let mut header = unsafe { mem::zeroed() };
+        let framed = frame(&sga, &mut header).unwrap();
+        assert_eq!(framed.sga_numsegs, 3);
+        assert_eq!(framed.len(), HEADER_SIZE + 10);
+        assert_eq!(
+            framed.sga_segs[0].sgaseg_buf as *const dmtr_header_t,
+            &header as *const _
+        );
+        assert_eq!(
+            header,
+            dmtr_header_t {
+                h_magic: DMTR_HEADER_MAGIC,
+                h_bytes: 10,
+                h_sgasegs: 2,
+            }
+        );
+
+        while (sga.sga_numsegs as usize) < DMTR_SGARRAY_MAXSIZE {
+            sga.push_segment(segment(&bytes)).unwrap();
+        }
+        assert_eq!(frame(&sga, &mut header).err(), Some(libc::EINVAL));
+    }
+}
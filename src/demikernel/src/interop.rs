@@ -0,0 +1,163 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#![allow(non_camel_case_types)]
+
+use catnip::interop::{
+    self as catnip_interop,
+    dmtr_accept_result_t,
+    dmtr_opcode_t,
+    dmtr_qtoken_t,
+    dmtr_sgaseg_t,
+};
+use libc::{
+    c_int,
+    c_void,
+    sockaddr_in,
+};
+use std::{
+    mem,
+    ptr,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Maximum number of segments in a scatter-gather array. This must match `DMTR_SGARRAY_MAXSIZE`
+/// in `include/dmtr/types.h`, since these are the types that cross the C ABI.
+pub const DMTR_SGARRAY_MAXSIZE: usize = 16;
+
+/// Magic number at the start of every `dmtr_header_t`. This must match `DMTR_HEADER_MAGIC` in
+/// `include/dmtr/types.h`.
+pub const DMTR_HEADER_MAGIC: u32 = 0x10102010;
+
+/// Called once the libOS no longer references a segment pushed from a registered memory region.
+pub type dmtr_free_cb_t = Option<unsafe extern "C" fn(buf: *mut c_void, arg: *mut c_void)>;
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub struct dmtr_sgarray_t {
+    pub sga_buf: *mut c_void,
+    pub sga_numsegs: u32,
+    pub sga_segs: [dmtr_sgaseg_t; DMTR_SGARRAY_MAXSIZE],
+    pub sga_addr: sockaddr_in,
+}
+
+/// Header that precedes each message on a framed queue, in host byte order.
+#[repr(C)]
+#[derive(Copy, Clone, Debug, Default, PartialEq, Eq)]
+pub struct dmtr_header_t {
+    pub h_magic: u32,
+    /// Number of bytes of the message that follow the header.
+    pub h_bytes: u32,
+    /// Number of segments the message was pushed as.
+    pub h_sgasegs: u32,
+}
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub union dmtr_qr_value_t {
+    pub sga: dmtr_sgarray_t,
+    pub ares: dmtr_accept_result_t,
+}
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub struct dmtr_qresult_t {
+    pub qr_opcode: dmtr_opcode_t,
+    pub qr_qd: c_int,
+    pub qr_qt: dmtr_qtoken_t,
+    pub qr_value: dmtr_qr_value_t,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl dmtr_sgarray_t {
+    pub fn empty() -> Self {
+        unsafe { mem::zeroed() }
+    }
+
+    /// Segments that are in use.
+    pub fn segments(&self) -> &[dmtr_sgaseg_t] {
+        &self.sga_segs[..self.sga_numsegs as usize]
+    }
+
+    /// Appends a segment, failing if the array is already full.
+    pub fn push_segment(&mut self, seg: dmtr_sgaseg_t) -> Result<(), dmtr_sgaseg_t> {
+        if self.sga_numsegs as usize == DMTR_SGARRAY_MAXSIZE {
+            return Err(seg);
+        }
+        self.sga_segs[self.sga_numsegs as usize] = seg;
+        self.sga_numsegs += 1;
+        Ok(())
+    }
+
+    /// Total number of bytes across all segments.
+    pub fn len(&self) -> usize {
+        self.segments()
+            .iter()
+            .map(|seg| seg.sgaseg_len as usize)
+            .sum()
+    }
+
+    pub fn is_valid(&self) -> bool {
+        self.sga_numsegs > 0 && self.sga_numsegs as usize <= DMTR_SGARRAY_MAXSIZE
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl From<catnip_interop::dmtr_sgarray_t> for dmtr_sgarray_t {
+    fn from(sga: catnip_interop::dmtr_sgarray_t) -> Self {
+        let numsegs = sga.sga_numsegs as usize;
+        let mut out = Self::empty();
+        out.sga_buf = sga.sga_buf;
+        out.sga_numsegs = sga.sga_numsegs;
+        out.sga_segs[..numsegs].copy_from_slice(&sga.sga_segs[..numsegs]);
+        out.sga_addr = sga.sga_addr;
+        out
+    }
+}
+
+/// Narrows a scatter-gather array to catnip's layout, which holds fewer segments. Panics if the
+/// array doesn't fit.
+impl From<dmtr_sgarray_t> for catnip_interop::dmtr_sgarray_t {
+    fn from(sga: dmtr_sgarray_t) -> Self {
+        let mut out: Self = unsafe { mem::zeroed() };
+        let numsegs = sga.sga_numsegs as usize;
+        assert!(numsegs <= out.sga_segs.len());
+        out.sga_buf = sga.sga_buf;
+        out.sga_numsegs = sga.sga_numsegs;
+        out.sga_segs[..numsegs].copy_from_slice(sga.segments());
+        out.sga_addr = sga.sga_addr;
+        out
+    }
+}
+
+impl From<catnip_interop::dmtr_qresult_t> for dmtr_qresult_t {
+    fn from(qr: catnip_interop::dmtr_qresult_t) -> Self {
+        let mut qr_value: dmtr_qr_value_t = unsafe { mem::zeroed() };
+        match qr.qr_opcode {
+            dmtr_opcode_t::DMTR_OPC_POP => qr_value.sga = unsafe { qr.qr_value.sga }.into(),
+            // Everything else has the same layout in both unions.
+            _ => unsafe {
+                ptr::copy_nonoverlapping(
+                    &qr.qr_value as *const _ as *const u8,
+                    &mut qr_value as *mut _ as *mut u8,
+                    mem::size_of_val(&qr.qr_value),
+                )
+            },
+        }
+        Self {
+            qr_opcode: qr.qr_opcode,
+            qr_qd: qr.qr_qd,
+            qr_qt: qr.qr_qt,
+            qr_value,
+        }
+    }
+}
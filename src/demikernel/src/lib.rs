@@ -3,6 +3,18 @@
 
 #![cfg_attr(feature = "strict", deny(warnings))]
 #![deny(clippy::all)]
+#![feature(once_cell)]
 
+pub mod arp;
+pub mod bpf;
+pub mod capture;
+pub mod checksum;
+pub mod clock;
 pub mod config;
+pub mod datagram;
+pub mod framing;
+pub mod interop;
 pub mod network;
+pub mod stats;
+pub mod timer;
+pub mod wait;
@@ -1,21 +1,42 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 
+//! The `dmtr_*` network calls of the C ABI.
+//!
+//! A libOS implements [NetworkOps] and binds the calls to itself with [export_network_libos], so
+//! that each call goes straight from the C ABI into the libOS, where it can be inlined. With the
+//! `dynamic-dispatch` feature, this crate exports the calls instead, and they go through a
+//! [NetworkLibOS] table of function pointers that the libOS installs at runtime.
+
 #![allow(non_camel_case_types, unused)]
 
-use catnip::interop::{
-    dmtr_qresult_t,
-    dmtr_qtoken_t,
-    dmtr_sgarray_t,
+use crate::{
+    clock,
+    interop::{
+        dmtr_free_cb_t,
+        dmtr_qresult_t,
+        dmtr_sgarray_t,
+    },
+    stats::{
+        self,
+        dmtr_stats_t,
+    },
 };
+use catnip::interop::dmtr_qtoken_t;
 use libc::{
     c_int,
+    c_void,
     sockaddr,
+    sockaddr_in,
     socklen_t,
+    timespec,
 };
-use std::cell::{
-    RefCell,
-    RefMut,
+use std::{
+    cell::{
+        RefCell,
+        RefMut,
+    },
+    slice,
 };
 
 type socket_fn = fn(*mut c_int, c_int, c_int, c_int) -> c_int;
@@ -25,8 +46,10 @@ type accept_fn = fn(*mut dmtr_qtoken_t, c_int) -> c_int;
 type connect_fn = fn(*mut dmtr_qtoken_t, c_int, *const sockaddr, socklen_t) -> c_int;
 type pushto_fn =
     fn(*mut dmtr_qtoken_t, c_int, *const dmtr_sgarray_t, *const sockaddr, socklen_t) -> c_int;
-type popfrom_fn =
-    fn(*mut dmtr_qtoken_t, c_int, *mut dmtr_sgarray_t, *const sockaddr, socklen_t) -> c_int;
+type pushto_many_fn =
+    fn(*mut c_int, c_int, *const dmtr_sgarray_t, *const sockaddr_in, c_int) -> c_int;
+type popfrom_fn = fn(*mut c_int, c_int, *mut dmtr_sgarray_t, *mut sockaddr_in, c_int) -> c_int;
+type set_framed_fn = fn(c_int, c_int) -> c_int;
 type drop_fn = fn(dmtr_qtoken_t) -> c_int;
 type close_fn = fn(c_int) -> c_int;
 
@@ -36,12 +59,93 @@ type push_fn = fn(*mut dmtr_qtoken_t, c_int, *const dmtr_sgarray_t) -> c_int;
 type pop_fn = fn(*mut dmtr_qtoken_t, c_int) -> c_int;
 
 type wait_any_fn = fn(*mut dmtr_qresult_t, *mut c_int, *mut dmtr_qtoken_t, c_int) -> c_int;
+type wait_many_fn = fn(
+    *mut dmtr_qresult_t,
+    *mut c_int,
+    *mut c_int,
+    *mut dmtr_qtoken_t,
+    c_int,
+    c_int,
+    *const timespec,
+) -> c_int;
+type get_stats_fn = fn(*mut dmtr_stats_t) -> c_int;
 
 type poll_fn = fn(*mut dmtr_qresult_t, dmtr_qtoken_t) -> c_int;
 
 type sgaalloc_fn = fn(libc::size_t) -> dmtr_sgarray_t;
 type sgafree_fn = fn(*mut dmtr_sgarray_t) -> c_int;
 type getsockname_fn = fn(c_int, *mut sockaddr, *mut socklen_t) -> c_int;
+type register_mem_fn = fn(*mut c_void, libc::size_t, dmtr_free_cb_t, *mut c_void) -> c_int;
+
+//==============================================================================
+
+/// Operations behind the `dmtr_*` network calls, which a libOS implements on a type of its own.
+/// They take the arguments of the C ABI as they are, and the libOS keeps its state thread-local.
+pub trait NetworkOps {
+    fn socket(qd_out: *mut c_int, domain: c_int, socket_type: c_int, protocol: c_int) -> c_int;
+    fn bind(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int;
+    fn listen(fd: c_int, backlog: c_int) -> c_int;
+    fn accept(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int;
+    fn connect(
+        qtok_out: *mut dmtr_qtoken_t,
+        qd: c_int,
+        saddr: *const sockaddr,
+        size: socklen_t,
+    ) -> c_int;
+    fn pushto(
+        qtok_out: *mut dmtr_qtoken_t,
+        qd: c_int,
+        sga: *const dmtr_sgarray_t,
+        saddr: *const sockaddr,
+        size: socklen_t,
+    ) -> c_int;
+    fn drop(qt: dmtr_qtoken_t) -> c_int;
+    fn close(qd: c_int) -> c_int;
+    fn push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray_t) -> c_int;
+    fn wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int;
+    fn wait_any(
+        qr_out: *mut dmtr_qresult_t,
+        ready_offset: *mut c_int,
+        qts: *mut dmtr_qtoken_t,
+        num_qts: c_int,
+    ) -> c_int;
+    fn poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int;
+    fn pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int;
+    fn sgaalloc(size: libc::size_t) -> dmtr_sgarray_t;
+    fn sgafree(sga: *mut dmtr_sgarray_t) -> c_int;
+    fn getsockname(qd: c_int, saddr: *mut sockaddr, size: *mut socklen_t) -> c_int;
+    fn register_mem(
+        ptr: *mut c_void,
+        len: libc::size_t,
+        free_cb: dmtr_free_cb_t,
+        free_arg: *mut c_void,
+    ) -> c_int;
+    fn wait_many(
+        qrs_out: *mut dmtr_qresult_t,
+        ready_offsets: *mut c_int,
+        num_ready_out: *mut c_int,
+        qts: *mut dmtr_qtoken_t,
+        num_qts: c_int,
+        max_ready: c_int,
+        timeout: *const timespec,
+    ) -> c_int;
+    fn get_stats(stats_out: *mut dmtr_stats_t) -> c_int;
+    fn pushto_many(
+        num_pushed_out: *mut c_int,
+        qd: c_int,
+        sgas: *const dmtr_sgarray_t,
+        saddrs: *const sockaddr_in,
+        num: c_int,
+    ) -> c_int;
+    fn popfrom(
+        num_out: *mut c_int,
+        qd: c_int,
+        sgas_out: *mut dmtr_sgarray_t,
+        saddrs_out: *mut sockaddr_in,
+        max: c_int,
+    ) -> c_int;
+    fn set_framed(qd: c_int, framed: c_int) -> c_int;
+}
 
 //==============================================================================
 
@@ -62,6 +166,12 @@ pub struct NetworkLibOS {
     sgaalloc: sgaalloc_fn,
     sgafree: sgafree_fn,
     getsockname: getsockname_fn,
+    register_mem: register_mem_fn,
+    wait_many: wait_many_fn,
+    get_stats: get_stats_fn,
+    pushto_many: pushto_many_fn,
+    popfrom: popfrom_fn,
+    set_framed: set_framed_fn,
 }
 
 impl NetworkLibOS {
@@ -82,6 +192,12 @@ impl NetworkLibOS {
         sgaalloc: sgaalloc_fn,
         sgafree: sgafree_fn,
         getsockname: getsockname_fn,
+        register_mem: register_mem_fn,
+        wait_many: wait_many_fn,
+        get_stats: get_stats_fn,
+        pushto_many: pushto_many_fn,
+        popfrom: popfrom_fn,
+        set_framed: set_framed_fn,
     ) -> Self {
         Self {
             socket,
@@ -100,8 +216,42 @@ impl NetworkLibOS {
             sgaalloc,
             sgafree,
             getsockname,
+            register_mem,
+            wait_many,
+            get_stats,
+            pushto_many,
+            popfrom,
+            set_framed,
         }
     }
+
+    /// Builds the table from the operations of `T`.
+    pub fn of<T: NetworkOps>() -> Self {
+        Self::new(
+            T::socket,
+            T::bind,
+            T::listen,
+            T::accept,
+            T::connect,
+            T::pushto,
+            T::drop,
+            T::close,
+            T::push,
+            T::wait,
+            T::wait_any,
+            T::poll,
+            T::pop,
+            T::sgaalloc,
+            T::sgafree,
+            T::getsockname,
+            T::register_mem,
+            T::wait_many,
+            T::get_stats,
+            T::pushto_many,
+            T::popfrom,
+            T::set_framed,
+        )
+    }
 }
 
 //==============================================================================
@@ -127,171 +277,710 @@ pub fn libos_network_init(libos: NetworkLibOS) {
     })
 }
 
+/// Binds the `dmtr_*` network calls on this thread to `T`, which only takes installing its table
+/// with the `dynamic-dispatch` feature. Otherwise, [export_network_libos] bound them at build time.
+pub fn libos_network_bind<T: NetworkOps>() {
+    if cfg!(feature = "dynamic-dispatch") {
+        libos_network_init(NetworkLibOS::of::<T>());
+    }
+}
+
+/// Operations that go through the [NetworkLibOS] table installed on this thread with
+/// [libos_network_init].
+pub struct DynamicLibOS;
+
+impl NetworkOps for DynamicLibOS {
+    fn socket(qd_out: *mut c_int, domain: c_int, socket_type: c_int, protocol: c_int) -> c_int {
+        with_libos(|libos| (libos.socket)(qd_out, domain, socket_type, protocol))
+    }
+
+    fn bind(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int {
+        with_libos(|libos| (libos.bind)(qd, saddr, size))
+    }
+
+    fn listen(fd: c_int, backlog: c_int) -> c_int {
+        with_libos(|libos| (libos.listen)(fd, backlog))
+    }
+
+    fn accept(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
+        with_libos(|libos| (libos.accept)(qtok_out, sockqd))
+    }
+
+    fn connect(
+        qtok_out: *mut dmtr_qtoken_t,
+        qd: c_int,
+        saddr: *const sockaddr,
+        size: socklen_t,
+    ) -> c_int {
+        with_libos(|libos| (libos.connect)(qtok_out, qd, saddr, size))
+    }
+
+    fn pushto(
+        qtok_out: *mut dmtr_qtoken_t,
+        qd: c_int,
+        sga: *const dmtr_sgarray_t,
+        saddr: *const sockaddr,
+        size: socklen_t,
+    ) -> c_int {
+        with_libos(|libos| (libos.pushto)(qtok_out, qd, sga, saddr, size))
+    }
+
+    fn drop(qt: dmtr_qtoken_t) -> c_int {
+        with_libos(|libos| (libos.drop)(qt))
+    }
+
+    fn close(qd: c_int) -> c_int {
+        with_libos(|libos| (libos.close)(qd))
+    }
+
+    fn push(qtok_out: *mut dmtr_qtoken_t, qd: c_int, sga: *const dmtr_sgarray_t) -> c_int {
+        with_libos(|libos| (libos.push)(qtok_out, qd, sga))
+    }
+
+    fn wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+        with_libos(|libos| (libos.wait)(qr_out, qt))
+    }
+
+    fn wait_any(
+        qr_out: *mut dmtr_qresult_t,
+        ready_offset: *mut c_int,
+        qts: *mut dmtr_qtoken_t,
+        num_qts: c_int,
+    ) -> c_int {
+        with_libos(|libos| (libos.wait_any)(qr_out, ready_offset, qts, num_qts))
+    }
+
+    fn poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+        with_libos(|libos| (libos.poll)(qr_out, qt))
+    }
+
+    fn pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+        with_libos(|libos| (libos.pop)(qtok_out, qd))
+    }
+
+    fn sgaalloc(size: libc::size_t) -> dmtr_sgarray_t {
+        with_libos(|libos| (libos.sgaalloc)(size))
+    }
+
+    fn sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
+        with_libos(|libos| (libos.sgafree)(sga))
+    }
+
+    fn getsockname(qd: c_int, saddr: *mut sockaddr, size: *mut socklen_t) -> c_int {
+        with_libos(|libos| (libos.getsockname)(qd, saddr, size))
+    }
+
+    fn register_mem(
+        ptr: *mut c_void,
+        len: libc::size_t,
+        free_cb: dmtr_free_cb_t,
+        free_arg: *mut c_void,
+    ) -> c_int {
+        with_libos(|libos| (libos.register_mem)(ptr, len, free_cb, free_arg))
+    }
+
+    fn wait_many(
+        qrs_out: *mut dmtr_qresult_t,
+        ready_offsets: *mut c_int,
+        num_ready_out: *mut c_int,
+        qts: *mut dmtr_qtoken_t,
+        num_qts: c_int,
+        max_ready: c_int,
+        timeout: *const timespec,
+    ) -> c_int {
+        with_libos(|libos| {
+            (libos.wait_many)(
+                qrs_out,
+                ready_offsets,
+                num_ready_out,
+                qts,
+                num_qts,
+                max_ready,
+                timeout,
+            )
+        })
+    }
+
+    fn get_stats(stats_out: *mut dmtr_stats_t) -> c_int {
+        with_libos(|libos| (libos.get_stats)(stats_out))
+    }
+
+    fn pushto_many(
+        num_pushed_out: *mut c_int,
+        qd: c_int,
+        sgas: *const dmtr_sgarray_t,
+        saddrs: *const sockaddr_in,
+        num: c_int,
+    ) -> c_int {
+        with_libos(|libos| (libos.pushto_many)(num_pushed_out, qd, sgas, saddrs, num))
+    }
+
+    fn popfrom(
+        num_out: *mut c_int,
+        qd: c_int,
+        sgas_out: *mut dmtr_sgarray_t,
+        saddrs_out: *mut sockaddr_in,
+        max: c_int,
+    ) -> c_int {
+        with_libos(|libos| (libos.popfrom)(num_out, qd, sgas_out, saddrs_out, max))
+    }
+
+    fn set_framed(qd: c_int, framed: c_int) -> c_int {
+        with_libos(|libos| (libos.set_framed)(qd, framed))
+    }
+}
+
+//==============================================================================
+// exports
+//==============================================================================
+
+/// Exports the `dmtr_*` network calls, bound to the [NetworkOps] of `$libos`. A program can only
+/// have one set of them, so this expands to nothing with the `dynamic-dispatch` feature, under
+/// which this crate exports calls that go through [DynamicLibOS].
+#[cfg(not(feature = "dynamic-dispatch"))]
+#[macro_export]
+macro_rules! export_network_libos {
+    ($libos:ty) => {
+        $crate::__export_network_libos!($libos);
+    };
+}
+
+#[cfg(feature = "dynamic-dispatch")]
+#[macro_export]
+macro_rules! export_network_libos {
+    ($libos:ty) => {};
+}
+
+#[doc(hidden)]
+#[macro_export]
+macro_rules! __export_network_libos {
+    ($libos:ty) => {
+        const _: () = {
+            use $crate::{
+                interop::{
+                    dmtr_free_cb_t,
+                    dmtr_qresult_t,
+                    dmtr_sgarray_t,
+                },
+                network::{
+                    self,
+                    __dmtr_qtoken_t as dmtr_qtoken_t,
+                    libc::{
+                        c_int,
+                        c_void,
+                        size_t,
+                        sockaddr,
+                        sockaddr_in,
+                        socklen_t,
+                        timespec,
+                    },
+                },
+                stats::dmtr_stats_t,
+            };
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_socket(
+                qd_out: *mut c_int,
+                domain: c_int,
+                socket_type: c_int,
+                protocol: c_int,
+            ) -> c_int {
+                network::dmtr_socket::<$libos>(qd_out, domain, socket_type, protocol)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_bind(
+                qd: c_int,
+                saddr: *const sockaddr,
+                size: socklen_t,
+            ) -> c_int {
+                network::dmtr_bind::<$libos>(qd, saddr, size)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_listen(fd: c_int, backlog: c_int) -> c_int {
+                network::dmtr_listen::<$libos>(fd, backlog)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_accept(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
+                network::dmtr_accept::<$libos>(qtok_out, sockqd)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_connect(
+                qtok_out: *mut dmtr_qtoken_t,
+                qd: c_int,
+                saddr: *const sockaddr,
+                size: socklen_t,
+            ) -> c_int {
+                network::dmtr_connect::<$libos>(qtok_out, qd, saddr, size)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_close(qd: c_int) -> c_int {
+                network::dmtr_close::<$libos>(qd)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_pushto(
+                qtok_out: *mut dmtr_qtoken_t,
+                qd: c_int,
+                sga: *const dmtr_sgarray_t,
+                saddr: *const sockaddr,
+                size: socklen_t,
+            ) -> c_int {
+                network::dmtr_pushto::<$libos>(qtok_out, qd, sga, saddr, size)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_pushto_many(
+                num_pushed_out: *mut c_int,
+                qd: c_int,
+                sgas: *const dmtr_sgarray_t,
+                saddrs: *const sockaddr_in,
+                num: c_int,
+            ) -> c_int {
+                network::dmtr_pushto_many::<$libos>(num_pushed_out, qd, sgas, saddrs, num)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_push(
+                qtok_out: *mut dmtr_qtoken_t,
+                qd: c_int,
+                sga: *const dmtr_sgarray_t,
+            ) -> c_int {
+                network::dmtr_push::<$libos>(qtok_out, qd, sga)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+                network::dmtr_pop::<$libos>(qtok_out, qd)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_popfrom(
+                num_out: *mut c_int,
+                qd: c_int,
+                sgas_out: *mut dmtr_sgarray_t,
+                saddrs_out: *mut sockaddr_in,
+                max: c_int,
+            ) -> c_int {
+                network::dmtr_popfrom::<$libos>(num_out, qd, sgas_out, saddrs_out, max)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_set_framed(qd: c_int, framed: c_int) -> c_int {
+                network::dmtr_set_framed::<$libos>(qd, framed)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+                network::dmtr_poll::<$libos>(qr_out, qt)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_drop(qt: dmtr_qtoken_t) -> c_int {
+                network::dmtr_drop::<$libos>(qt)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+                network::dmtr_wait::<$libos>(qr_out, qt)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_wait_any(
+                qr_out: *mut dmtr_qresult_t,
+                ready_offset: *mut c_int,
+                qts: *mut dmtr_qtoken_t,
+                num_qts: c_int,
+            ) -> c_int {
+                network::dmtr_wait_any::<$libos>(qr_out, ready_offset, qts, num_qts)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_wait_many(
+                qrs_out: *mut dmtr_qresult_t,
+                ready_offsets: *mut c_int,
+                num_ready_out: *mut c_int,
+                qts: *mut dmtr_qtoken_t,
+                num_qts: c_int,
+                max_ready: c_int,
+                timeout: *const timespec,
+            ) -> c_int {
+                network::dmtr_wait_many::<$libos>(
+                    qrs_out,
+                    ready_offsets,
+                    num_ready_out,
+                    qts,
+                    num_qts,
+                    max_ready,
+                    timeout,
+                )
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_sgaalloc(size: size_t) -> dmtr_sgarray_t {
+                network::dmtr_sgaalloc::<$libos>(size)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
+                network::dmtr_sgafree::<$libos>(sga)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_getsockname(
+                qd: c_int,
+                saddr: *mut sockaddr,
+                size: *mut socklen_t,
+            ) -> c_int {
+                network::dmtr_getsockname::<$libos>(qd, saddr, size)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_register_mem(
+                ptr: *mut c_void,
+                len: size_t,
+                free_cb: dmtr_free_cb_t,
+                free_arg: *mut c_void,
+            ) -> c_int {
+                network::dmtr_register_mem::<$libos>(ptr, len, free_cb, free_arg)
+            }
+
+            #[no_mangle]
+            pub extern "C" fn dmtr_get_stats(stats_out: *mut dmtr_stats_t, reset: c_int) -> c_int {
+                network::dmtr_get_stats::<$libos>(stats_out, reset)
+            }
+        };
+    };
+}
+
+#[cfg(feature = "dynamic-dispatch")]
+__export_network_libos!(DynamicLibOS);
+
+// Used by the exported calls, which expand in the libOS.
+#[doc(hidden)]
+pub use ::libc;
+#[doc(hidden)]
+pub use catnip::interop::dmtr_qtoken_t as __dmtr_qtoken_t;
+
 //==============================================================================
 // socket
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_socket(
+#[inline]
+pub fn dmtr_socket<T: NetworkOps>(
     qd_out: *mut c_int,
     domain: c_int,
     socket_type: c_int,
     protocol: c_int,
 ) -> c_int {
-    with_libos(|libos| (libos.socket)(qd_out, domain, socket_type, protocol))
+    T::socket(qd_out, domain, socket_type, protocol)
 }
 
 //==============================================================================
 // bind
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_bind(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int {
-    with_libos(|libos| (libos.bind)(qd, saddr, size))
+#[inline]
+pub fn dmtr_bind<T: NetworkOps>(qd: c_int, saddr: *const sockaddr, size: socklen_t) -> c_int {
+    T::bind(qd, saddr, size)
 }
 
 //==============================================================================
 // lsiten
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_listen(fd: c_int, backlog: c_int) -> c_int {
-    with_libos(|libos| (libos.listen)(fd, backlog))
+#[inline]
+pub fn dmtr_listen<T: NetworkOps>(fd: c_int, backlog: c_int) -> c_int {
+    T::listen(fd, backlog)
 }
 
 //==============================================================================
 // accept
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_accept(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
-    with_libos(|libos| (libos.accept)(qtok_out, sockqd))
+#[inline]
+pub fn dmtr_accept<T: NetworkOps>(qtok_out: *mut dmtr_qtoken_t, sockqd: c_int) -> c_int {
+    T::accept(qtok_out, sockqd)
 }
 
 //==============================================================================
 // connect
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_connect(
+#[inline]
+pub fn dmtr_connect<T: NetworkOps>(
     qtok_out: *mut dmtr_qtoken_t,
     qd: c_int,
     saddr: *const sockaddr,
     size: socklen_t,
 ) -> c_int {
-    with_libos(|libos| (libos.connect)(qtok_out, qd, saddr, size))
+    T::connect(qtok_out, qd, saddr, size)
 }
 
 //==============================================================================
 // close
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_close(qd: c_int) -> c_int {
-    with_libos(|libos| (libos.close)(qd))
+#[inline]
+pub fn dmtr_close<T: NetworkOps>(qd: c_int) -> c_int {
+    T::close(qd)
 }
 
 //==============================================================================
 // pushto
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_pushto(
+#[inline]
+pub fn dmtr_pushto<T: NetworkOps>(
     qtok_out: *mut dmtr_qtoken_t,
     qd: c_int,
     sga: *const dmtr_sgarray_t,
     saddr: *const sockaddr,
     size: socklen_t,
 ) -> c_int {
-    with_libos(|libos| (libos.pushto)(qtok_out, qd, sga, saddr, size))
+    let ret = T::pushto(qtok_out, qd, sga, saddr, size);
+    if ret == 0 {
+        stats::record_push_issued(unsafe { *qtok_out });
+    }
+    ret
+}
+
+//==============================================================================
+// pushto_many
+//==============================================================================
+
+#[inline]
+pub fn dmtr_pushto_many<T: NetworkOps>(
+    num_pushed_out: *mut c_int,
+    qd: c_int,
+    sgas: *const dmtr_sgarray_t,
+    saddrs: *const sockaddr_in,
+    num: c_int,
+) -> c_int {
+    T::pushto_many(num_pushed_out, qd, sgas, saddrs, num)
 }
 
 //==============================================================================
 // push
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_push(
+#[inline]
+pub fn dmtr_push<T: NetworkOps>(
     qtok_out: *mut dmtr_qtoken_t,
     qd: c_int,
     sga: *const dmtr_sgarray_t,
 ) -> c_int {
-    with_libos(|libos| (libos.push)(qtok_out, qd, sga))
+    let ret = T::push(qtok_out, qd, sga);
+    if ret == 0 {
+        stats::record_push_issued(unsafe { *qtok_out });
+    }
+    ret
 }
 
 //==============================================================================
 // pop
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_pop(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
-    with_libos(|libos| (libos.pop)(qtok_out, qd))
+#[inline]
+pub fn dmtr_pop<T: NetworkOps>(qtok_out: *mut dmtr_qtoken_t, qd: c_int) -> c_int {
+    let ret = T::pop(qtok_out, qd);
+    if ret == 0 {
+        stats::record_pop_issued(unsafe { *qtok_out });
+    }
+    ret
+}
+
+//==============================================================================
+// popfrom
+//==============================================================================
+
+#[inline]
+pub fn dmtr_popfrom<T: NetworkOps>(
+    num_out: *mut c_int,
+    qd: c_int,
+    sgas_out: *mut dmtr_sgarray_t,
+    saddrs_out: *mut sockaddr_in,
+    max: c_int,
+) -> c_int {
+    T::popfrom(num_out, qd, sgas_out, saddrs_out, max)
+}
+
+//==============================================================================
+// set_framed
+//==============================================================================
+
+#[inline]
+pub fn dmtr_set_framed<T: NetworkOps>(qd: c_int, framed: c_int) -> c_int {
+    T::set_framed(qd, framed)
 }
 
 //==============================================================================
 // poll
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_poll(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| (libos.poll)(qr_out, qt))
+#[inline]
+pub fn dmtr_poll<T: NetworkOps>(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    let ret = T::poll(qr_out, qt);
+    if ret == 0 {
+        stats::record_completed(qt);
+    }
+    ret
 }
 
 //==============================================================================
 // drop
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_drop(qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| (libos.drop)(qt))
+#[inline]
+pub fn dmtr_drop<T: NetworkOps>(qt: dmtr_qtoken_t) -> c_int {
+    stats::record_dropped(qt);
+    T::drop(qt)
 }
 
 //==============================================================================
 // wait
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_wait(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
-    with_libos(|libos| (libos.wait)(qr_out, qt))
+#[inline]
+pub fn dmtr_wait<T: NetworkOps>(qr_out: *mut dmtr_qresult_t, qt: dmtr_qtoken_t) -> c_int {
+    let start = clock::now();
+    let ret = T::wait(qr_out, qt);
+    stats::record_wait(clock::now().saturating_duration_since(start));
+    if ret == 0 {
+        stats::record_completed(qt);
+    }
+    ret
 }
 
 //==============================================================================
 // wait_any
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_wait_any(
+#[inline]
+pub fn dmtr_wait_any<T: NetworkOps>(
     qr_out: *mut dmtr_qresult_t,
     ready_offset: *mut c_int,
     qts: *mut dmtr_qtoken_t,
     num_qts: c_int,
 ) -> c_int {
-    with_libos(|libos| (libos.wait_any)(qr_out, ready_offset, qts, num_qts))
+    let start = clock::now();
+    let ret = T::wait_any(qr_out, ready_offset, qts, num_qts);
+    stats::record_wait(clock::now().saturating_duration_since(start));
+    if ret == 0 {
+        stats::record_completed(unsafe { (*qr_out).qr_qt });
+    }
+    ret
+}
+
+//==============================================================================
+// wait_many
+//==============================================================================
+
+#[inline]
+pub fn dmtr_wait_many<T: NetworkOps>(
+    qrs_out: *mut dmtr_qresult_t,
+    ready_offsets: *mut c_int,
+    num_ready_out: *mut c_int,
+    qts: *mut dmtr_qtoken_t,
+    num_qts: c_int,
+    max_ready: c_int,
+    timeout: *const timespec,
+) -> c_int {
+    let start = clock::now();
+    let ret = T::wait_many(
+        qrs_out,
+        ready_offsets,
+        num_ready_out,
+        qts,
+        num_qts,
+        max_ready,
+        timeout,
+    );
+    stats::record_wait(clock::now().saturating_duration_since(start));
+    if ret == 0 {
+        let qrs = unsafe { slice::from_raw_parts(qrs_out, *num_ready_out as usize) };
+        for qr in qrs {
+            stats::record_completed(qr.qr_qt);
+        }
+    }
+    ret
 }
 
 //==============================================================================
 // sgaalloc
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_sgaalloc(size: libc::size_t) -> dmtr_sgarray_t {
-    with_libos(|libos| (libos.sgaalloc)(size))
+#[inline]
+pub fn dmtr_sgaalloc<T: NetworkOps>(size: libc::size_t) -> dmtr_sgarray_t {
+    T::sgaalloc(size)
 }
 
 //==============================================================================
 // sgafree
 //==============================================================================
 
-#[no_mangle]
-pub extern "C" fn dmtr_sgafree(sga: *mut dmtr_sgarray_t) -> c_int {
-    with_libos(|libos| (libos.sgafree)(sga))
+#[inline]
+pub fn dmtr_sgafree<T: NetworkOps>(sga: *mut dmtr_sgarray_t) -> c_int {
+    T::sgafree(sga)
 }
 
 //==============================================================================
 // getsockname
 //==============================================================================
 
+#[inline]
+pub fn dmtr_getsockname<T: NetworkOps>(
+    qd: c_int,
+    saddr: *mut sockaddr,
+    size: *mut socklen_t,
+) -> c_int {
+    T::getsockname(qd, saddr, size)
+}
+
+//==============================================================================
+// register_mem
+//==============================================================================
+
+#[inline]
+pub fn dmtr_register_mem<T: NetworkOps>(
+    ptr: *mut c_void,
+    len: libc::size_t,
+    free_cb: dmtr_free_cb_t,
+    free_arg: *mut c_void,
+) -> c_int {
+    T::register_mem(ptr, len, free_cb, free_arg)
+}
+
+//==============================================================================
+// sgalen
+//==============================================================================
+
 #[no_mangle]
-pub extern "C" fn dmtr_getsockname(qd: c_int, saddr: *mut sockaddr, size: *mut socklen_t) -> c_int {
-    with_libos(|libos| (libos.getsockname)(qd, saddr, size))
+pub extern "C" fn dmtr_sgalen(len_out: *mut libc::size_t, sga: *const dmtr_sgarray_t) -> c_int {
+    if len_out.is_null() || sga.is_null() {
+        return libc::EINVAL;
+    }
+    let sga = unsafe { &*sga };
+    if !sga.is_valid() {
+        return libc::EINVAL;
+    }
+    unsafe { *len_out = sga.len() };
+    0
+}
+
+//==============================================================================
+// get_stats
+//==============================================================================
+
+#[inline]
+pub fn dmtr_get_stats<T: NetworkOps>(stats_out: *mut dmtr_stats_t, reset: c_int) -> c_int {
+    if stats_out.is_null() {
+        return libc::EINVAL;
+    }
+    unsafe { *stats_out = stats::snapshot(reset != 0) };
+    T::get_stats(stats_out)
 }
@@ -0,0 +1,350 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+#![allow(non_camel_case_types)]
+
+use crate::clock;
+use catnip::interop::dmtr_qtoken_t;
+use histogram::Histogram;
+use std::{
+    cell::RefCell,
+    mem,
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+/// Summary of a histogram. These are the types that cross the C ABI, so they must match
+/// `include/dmtr/stats.h`.
+#[repr(C)]
+#[derive(Copy, Clone, Debug, Default)]
+pub struct dmtr_histogram_t {
+    pub count: u64,
+    pub mean: u64,
+    pub p50: u64,
+    pub p90: u64,
+    pub p99: u64,
+    pub p999: u64,
+    pub max: u64,
+}
+
+#[repr(C)]
+#[derive(Copy, Clone, Debug, Default)]
+pub struct dmtr_stats_t {
+    // Time from issuing an operation until its completion is observed, in nanoseconds.
+    pub push_latency_ns: dmtr_histogram_t,
+    pub pop_latency_ns: dmtr_histogram_t,
+    // Time spent blocked in `dmtr_wait*()`, in nanoseconds.
+    pub wait_latency_ns: dmtr_histogram_t,
+
+    // Packets per non-empty RX burst and per TX burst.
+    pub rx_burst_size: dmtr_histogram_t,
+    pub tx_burst_size: dmtr_histogram_t,
+    pub rx_packets: u64,
+    pub tx_packets: u64,
+    pub empty_polls: u64,
+    // Outgoing TCP segments that resent sequence space already sent on their connection.
+    pub tcp_retransmits: u64,
+
+    // Filled in by the libOS, where it has them.
+    pub rx_sleeps: u64,
+    pub tx_dropped: u64,
+    pub header_pool_in_use: u64,
+    pub header_pool_size: u64,
+    pub body_pool_in_use: u64,
+    pub body_pool_size: u64,
+    pub alloc_failures: u64,
+    pub rx_filtered: u64,
+}
+
+/// How many outstanding operations can be timed at once. Tokens are spread over the slots by a
+/// multiplicative hash; a token that lands on an occupied slot takes it over, and the operation it
+/// displaced just goes unmeasured.
+const ISSUED_SLOTS_LOG2: u32 = 12;
+const ISSUED_SLOTS: usize = 1 << ISSUED_SLOTS_LOG2;
+
+/// How many TCP connections are tracked for retransmissions at once, with the same collision
+/// policy. A connection that loses its slot starts over, so its next retransmission may be missed.
+const FLOW_SLOTS_LOG2: u32 = 8;
+const FLOW_SLOTS: usize = 1 << FLOW_SLOTS_LOG2;
+
+const ETHERNET2_HEADER_SIZE: usize = 14;
+const TCP_FIN: u8 = 0x01;
+const TCP_SYN: u8 = 0x02;
+
+#[derive(Copy, Clone)]
+enum Operation {
+    Push,
+    Pop,
+}
+
+#[derive(Copy, Clone)]
+struct Issued {
+    qt: dmtr_qtoken_t,
+    op: Operation,
+    at: Instant,
+}
+
+/// The highest sequence number sent so far on a TCP connection, identified by its addresses and
+/// ports as they appear in the IPv4 and TCP headers.
+#[derive(Copy, Clone)]
+struct Flow {
+    key: [u8; 12],
+    snd_max: u32,
+}
+
+/// Statistics of the calling thread's libOS. Everything is thread-local, so recording is just a
+/// counter bump or a histogram increment.
+pub struct Stats {
+    push_latency: Histogram,
+    pop_latency: Histogram,
+    wait_latency: Histogram,
+    rx_burst_size: Histogram,
+    tx_burst_size: Histogram,
+    rx_packets: u64,
+    tx_packets: u64,
+    empty_polls: u64,
+    tcp_retransmits: u64,
+
+    // When outstanding pushes and pops were issued, and how far each TCP connection has sent.
+    // Neither is statistics, so they survive a reset.
+    issued: Box<[Option<Issued>]>,
+    flows: Box<[Option<Flow>]>,
+}
+
+thread_local! {
+    static STATS: RefCell<Stats> = RefCell::new(Stats::new());
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl Stats {
+    fn new() -> Self {
+        Self::with_tables(
+            vec![None; ISSUED_SLOTS].into_boxed_slice(),
+            vec![None; FLOW_SLOTS].into_boxed_slice(),
+        )
+    }
+
+    fn with_tables(issued: Box<[Option<Issued>]>, flows: Box<[Option<Flow>]>) -> Self {
+        Self {
+            push_latency: Histogram::new(),
+            pop_latency: Histogram::new(),
+            wait_latency: Histogram::new(),
+            rx_burst_size: Histogram::new(),
+            tx_burst_size: Histogram::new(),
+            rx_packets: 0,
+            tx_packets: 0,
+            empty_polls: 0,
+            tcp_retransmits: 0,
+            issued,
+            flows,
+        }
+    }
+
+    fn snapshot(&self) -> dmtr_stats_t {
+        dmtr_stats_t {
+            push_latency_ns: summarize(&self.push_latency),
+            pop_latency_ns: summarize(&self.pop_latency),
+            wait_latency_ns: summarize(&self.wait_latency),
+            rx_burst_size: summarize(&self.rx_burst_size),
+            tx_burst_size: summarize(&self.tx_burst_size),
+            rx_packets: self.rx_packets,
+            tx_packets: self.tx_packets,
+            empty_polls: self.empty_polls,
+            tcp_retransmits: self.tcp_retransmits,
+            ..Default::default()
+        }
+    }
+
+    fn reset(&mut self) {
+        let issued = mem::take(&mut self.issued);
+        let flows = mem::take(&mut self.flows);
+        *self = Self::with_tables(issued, flows);
+    }
+
+    fn issued_slot(&mut self, qt: dmtr_qtoken_t) -> &mut Option<Issued> {
+        let i = (qt.wrapping_mul(0x9e37_79b9_7f4a_7c15) >> (64 - ISSUED_SLOTS_LOG2)) as usize;
+        &mut self.issued[i]
+    }
+
+    fn record_issued(&mut self, qt: dmtr_qtoken_t, op: Operation) {
+        *self.issued_slot(qt) = Some(Issued {
+            qt,
+            op,
+            at: clock::now(),
+        });
+    }
+
+    /// Takes the issue time of `qt` out of its slot, if the slot still holds it.
+    fn take_issued(&mut self, qt: dmtr_qtoken_t) -> Option<Issued> {
+        let slot = self.issued_slot(qt);
+        match *slot {
+            Some(issued) if issued.qt == qt => slot.take(),
+            _ => None,
+        }
+    }
+
+    /// Counts a segment covering `seq_len` sequence numbers from `seq` as a retransmission if any
+    /// of them were sent before. A SYN only counts if it's the same SYN as the last one sent,
+    /// since any other is a new connection between the same endpoints.
+    fn record_tcp_segment(&mut self, key: [u8; 12], seq: u32, seq_len: u32, syn: bool) {
+        let word = |i: usize| u32::from_ne_bytes([key[i], key[i + 1], key[i + 2], key[i + 3]]);
+        let hash = (word(0) ^ word(4) ^ word(8)).wrapping_mul(0x9e37_79b9);
+        let slot = &mut self.flows[(hash >> (32 - FLOW_SLOTS_LOG2)) as usize];
+        let end = seq.wrapping_add(seq_len);
+        match slot {
+            Some(flow) if flow.key == key => {
+                if syn {
+                    if flow.snd_max == end {
+                        self.tcp_retransmits += 1;
+                    }
+                    flow.snd_max = end;
+                    return;
+                }
+                if seq_before(seq, flow.snd_max) {
+                    self.tcp_retransmits += 1;
+                }
+                if seq_before(flow.snd_max, end) {
+                    flow.snd_max = end;
+                }
+            },
+            _ => *slot = Some(Flow { key, snd_max: end }),
+        }
+    }
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+fn with_stats<T>(f: impl FnOnce(&mut Stats) -> T) -> T {
+    STATS.with(|s| f(&mut s.borrow_mut()))
+}
+
+fn summarize(h: &Histogram) -> dmtr_histogram_t {
+    if h.entries() == 0 {
+        return dmtr_histogram_t::default();
+    }
+    let percentile = |p| h.percentile(p).unwrap_or(0);
+    dmtr_histogram_t {
+        count: h.entries(),
+        mean: h.mean().unwrap_or(0),
+        p50: percentile(50.0),
+        p90: percentile(90.0),
+        p99: percentile(99.0),
+        p999: percentile(99.9),
+        max: h.maximum().unwrap_or(0),
+    }
+}
+
+fn as_nanos(d: Duration) -> u64 {
+    d.as_nanos() as u64
+}
+
+/// Is sequence number `a` before `b`, modulo wraparound?
+fn seq_before(a: u32, b: u32) -> bool {
+    (a.wrapping_sub(b) as i32) < 0
+}
+
+pub fn record_push_issued(qt: dmtr_qtoken_t) {
+    with_stats(|s| s.record_issued(qt, Operation::Push));
+}
+
+pub fn record_pop_issued(qt: dmtr_qtoken_t) {
+    with_stats(|s| s.record_issued(qt, Operation::Pop));
+}
+
+/// Records the latency of the push or pop behind `qt`, if that's what it was.
+pub fn record_completed(qt: dmtr_qtoken_t) {
+    with_stats(|s| {
+        if let Some(issued) = s.take_issued(qt) {
+            let latency = as_nanos(clock::now().saturating_duration_since(issued.at));
+            let _ = match issued.op {
+                Operation::Push => s.push_latency.increment(latency),
+                Operation::Pop => s.pop_latency.increment(latency),
+            };
+        }
+    })
+}
+
+pub fn record_dropped(qt: dmtr_qtoken_t) {
+    with_stats(|s| s.take_issued(qt));
+}
+
+pub fn record_wait(duration: Duration) {
+    with_stats(|s| {
+        let _ = s.wait_latency.increment(as_nanos(duration));
+    })
+}
+
+/// Records an RX burst that came back with `nb_rx` packets.
+pub fn record_rx_burst(nb_rx: usize) {
+    with_stats(|s| {
+        if nb_rx == 0 {
+            s.empty_polls += 1;
+        } else {
+            s.rx_packets += nb_rx as u64;
+            let _ = s.rx_burst_size.increment(nb_rx as u64);
+        }
+    })
+}
+
+/// Records a TX burst that handed `nb_tx` packets to the NIC.
+pub fn record_tx_burst(nb_tx: usize) {
+    with_stats(|s| {
+        s.tx_packets += nb_tx as u64;
+        let _ = s.tx_burst_size.increment(nb_tx as u64);
+    })
+}
+
+/// Records an outgoing frame by its headers, which for a TCP segment are enough to tell whether
+/// it's a retransmission. Anything else is ignored.
+pub fn record_tx_headers(headers: &[u8]) {
+    if headers.len() < ETHERNET2_HEADER_SIZE + 20 || headers[12..14] != [0x08, 0x00] {
+        return;
+    }
+    let ip = &headers[ETHERNET2_HEADER_SIZE..];
+    let l3_len = (ip[0] & 0xf) as usize * 4;
+    if ip[9] != libc::IPPROTO_TCP as u8 || ip.len() < l3_len + 20 {
+        return;
+    }
+    let tcp = &ip[l3_len..];
+    let l4_len = (tcp[12] >> 4) as usize * 4;
+    let total_len = u16::from_be_bytes([ip[2], ip[3]]) as usize;
+    if total_len < l3_len + l4_len {
+        return;
+    }
+    // SYN and FIN each take up a sequence number of their own.
+    let flags = tcp[13];
+    let seq_len = (total_len - l3_len - l4_len) as u32
+        + (flags & TCP_SYN != 0) as u32
+        + (flags & TCP_FIN != 0) as u32;
+    if seq_len == 0 {
+        return;
+    }
+    let mut key = [0; 12];
+    key[..8].copy_from_slice(&ip[12..20]);
+    key[8..].copy_from_slice(&tcp[..4]);
+    let seq = u32::from_be_bytes([tcp[4], tcp[5], tcp[6], tcp[7]]);
+    with_stats(|s| s.record_tcp_segment(key, seq, seq_len, flags & TCP_SYN != 0));
+}
+
+/// Statistics recorded on this thread so far, optionally starting over afterwards. The libOS
+/// fills in the rest.
+pub fn snapshot(reset: bool) -> dmtr_stats_t {
+    with_stats(|s| {
+        let stats = s.snapshot();
+        if reset {
+            s.reset();
+        }
+        stats
+    })
+}
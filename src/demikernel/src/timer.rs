@@ -0,0 +1,459 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+//! Hierarchical timing wheel behind the runtimes' `wait()` and `wait_until()`.
+//!
+//! Time is counted in ticks of `TICK_NS` from when the wheel was created. Each level has `SLOTS`
+//! slots, and each slot of a level spans a whole rotation of the level below, so a timer goes in
+//! the level of the highest digit (in base `SLOTS`) in which its tick differs from the current
+//! one. Inserting and cancelling a timer are O(1): every slot is an intrusive list threaded
+//! through a slab of entries. Advancing the clock only visits slots that have timers in them, and
+//! each timer is moved down a level at most `LEVELS` times before it fires.
+//!
+//! Timers fire on the first tick at or after their deadline, so never early and at most one tick
+//! late.
+
+use std::{
+    cell::RefCell,
+    future::Future,
+    mem,
+    pin::Pin,
+    rc::Rc,
+    task::{
+        Context,
+        Poll,
+        Waker,
+    },
+    time::{
+        Duration,
+        Instant,
+    },
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+const TICK_NS: u64 = 1 << 16;
+const SLOT_BITS: u32 = 6;
+const SLOTS: usize = 1 << SLOT_BITS;
+const LEVELS: usize = 6;
+
+/// Timers further out than the wheel spans (about 52 days) wait here until they fit.
+const OVERFLOW: usize = LEVELS * SLOTS;
+
+const NIL: usize = usize::MAX;
+
+struct Entry {
+    tick: u64,
+    waker: Option<Waker>,
+    fired: bool,
+    /// Slot the entry is linked into, or `NIL` once it has fired.
+    slot: usize,
+    prev: usize,
+    /// Next entry in the slot, or in the free list once the entry has been released.
+    next: usize,
+}
+
+struct TimerWheel {
+    origin: Instant,
+    now: Instant,
+    current_tick: u64,
+    entries: Vec<Entry>,
+    free: usize,
+    heads: Vec<usize>,
+    /// Bit `i` of `occupied[level]` is set if slot `i` of that level has timers in it.
+    occupied: [u64; LEVELS],
+    /// Wakers of timers that fired in the current `advance_clock()`, kept around so that
+    /// advancing the clock doesn't allocate.
+    expired: Vec<Waker>,
+}
+
+#[derive(Clone)]
+pub struct TimerRc(Rc<RefCell<TimerWheel>>);
+
+/// Resolves once its deadline has passed. Dropping it cancels the timer.
+pub struct WaitFuture {
+    timer: TimerRc,
+    /// Entry of the timer, or `None` if the deadline had already passed when it was created.
+    key: Option<usize>,
+}
+
+//==============================================================================
+// Associate Functions
+//==============================================================================
+
+impl TimerWheel {
+    fn new(now: Instant) -> Self {
+        Self {
+            origin: now,
+            now,
+            current_tick: 0,
+            entries: Vec::new(),
+            free: NIL,
+            heads: vec![NIL; OVERFLOW + 1],
+            occupied: [0; LEVELS],
+            expired: Vec::new(),
+        }
+    }
+
+    /// First tick at or after `when`.
+    fn tick_at_or_after(&self, when: Instant) -> u64 {
+        let ns = when.saturating_duration_since(self.origin).as_nanos() as u64;
+        (ns + TICK_NS - 1) / TICK_NS
+    }
+
+    fn slot_for(&self, tick: u64) -> usize {
+        let masked = (tick ^ self.current_tick) | (SLOTS as u64 - 1);
+        let level = ((63 - masked.leading_zeros()) / SLOT_BITS) as usize;
+        if level >= LEVELS {
+            return OVERFLOW;
+        }
+        level * SLOTS + ((tick >> (level as u32 * SLOT_BITS)) as usize & (SLOTS - 1))
+    }
+
+    fn allocate(&mut self, tick: u64) -> usize {
+        let entry = Entry {
+            tick,
+            waker: None,
+            fired: false,
+            slot: NIL,
+            prev: NIL,
+            next: NIL,
+        };
+        if self.free == NIL {
+            self.entries.push(entry);
+            return self.entries.len() - 1;
+        }
+        let key = self.free;
+        self.free = self.entries[key].next;
+        self.entries[key] = entry;
+        key
+    }
+
+    fn release(&mut self, key: usize) {
+        if !self.entries[key].fired {
+            self.unlink(key);
+        }
+        let entry = &mut self.entries[key];
+        entry.waker = None;
+        entry.next = self.free;
+        self.free = key;
+    }
+
+    /// Files `key` under its slot, or fires it if its tick has come.
+    fn schedule(&mut self, key: usize) {
+        let tick = self.entries[key].tick;
+        if tick <= self.current_tick {
+            self.fire(key);
+            return;
+        }
+        let slot = self.slot_for(tick);
+        let head = self.heads[slot];
+        {
+            let entry = &mut self.entries[key];
+            entry.slot = slot;
+            entry.prev = NIL;
+            entry.next = head;
+        }
+        if head != NIL {
+            self.entries[head].prev = key;
+        }
+        self.heads[slot] = key;
+        if slot != OVERFLOW {
+            self.occupied[slot / SLOTS] |= 1 << (slot % SLOTS);
+        }
+    }
+
+    fn unlink(&mut self, key: usize) {
+        let (slot, prev, next) = {
+            let entry = &self.entries[key];
+            (entry.slot, entry.prev, entry.next)
+        };
+        if prev == NIL {
+            self.heads[slot] = next;
+        } else {
+            self.entries[prev].next = next;
+        }
+        if next != NIL {
+            self.entries[next].prev = prev;
+        }
+        if self.heads[slot] == NIL && slot != OVERFLOW {
+            self.occupied[slot / SLOTS] &= !(1 << (slot % SLOTS));
+        }
+    }
+
+    fn fire(&mut self, key: usize) {
+        let entry = &mut self.entries[key];
+        entry.fired = true;
+        entry.slot = NIL;
+        if let Some(waker) = entry.waker.take() {
+            self.expired.push(waker);
+        }
+    }
+
+    /// Earliest occupied slot and the tick it starts on. Every occupied slot of a level comes
+    /// after the current one, and all of a level's slots come before the next level's first, so
+    /// this is the first occupied slot of the lowest occupied level.
+    fn next_expiration(&self) -> Option<(usize, u64)> {
+        for level in 0..LEVELS {
+            let occupied = self.occupied[level];
+            if occupied == 0 {
+                continue;
+            }
+            let shift = level as u32 * SLOT_BITS;
+            let slot = occupied.trailing_zeros() as usize;
+            debug_assert!(slot > (self.current_tick >> shift) as usize & (SLOTS - 1));
+            let rotation = self.current_tick & !((1 << (shift + SLOT_BITS)) - 1);
+            return Some((level * SLOTS + slot, rotation + ((slot as u64) << shift)));
+        }
+        None
+    }
+
+    fn take_slot(&mut self, slot: usize) -> usize {
+        let head = mem::replace(&mut self.heads[slot], NIL);
+        if slot != OVERFLOW {
+            self.occupied[slot / SLOTS] &= !(1 << (slot % SLOTS));
+        }
+        head
+    }
+
+    /// Reschedules every timer in the list starting at `key`, relative to the current tick.
+    fn cascade(&mut self, mut key: usize) {
+        while key != NIL {
+            let next = self.entries[key].next;
+            self.schedule(key);
+            key = next;
+        }
+    }
+
+    fn advance_clock(&mut self, now: Instant) {
+        if now <= self.now {
+            return;
+        }
+        self.now = now;
+        let target = now.duration_since(self.origin).as_nanos() as u64 / TICK_NS;
+
+        while let Some((slot, tick)) = self.next_expiration() {
+            if tick > target {
+                break;
+            }
+            self.current_tick = tick;
+            let head = self.take_slot(slot);
+            self.cascade(head);
+        }
+        self.current_tick = target;
+
+        if self.heads[OVERFLOW] != NIL {
+            let head = self.take_slot(OVERFLOW);
+            self.cascade(head);
+        }
+    }
+}
+
+impl TimerRc {
+    pub fn new(now: Instant) -> Self {
+        TimerRc(Rc::new(RefCell::new(TimerWheel::new(now))))
+    }
+
+    pub fn now(&self) -> Instant {
+        self.0.borrow().now
+    }
+
+    /// Moves the clock forward to `now`, waking every timer that is due by then.
+    pub fn advance_clock(&self, now: Instant) {
+        let mut expired = {
+            let mut wheel = self.0.borrow_mut();
+            wheel.advance_clock(now);
+            mem::take(&mut wheel.expired)
+        };
+        // Wake outside of the borrow, in case waking polls the timer.
+        for waker in expired.drain(..) {
+            waker.wake();
+        }
+        let mut wheel = self.0.borrow_mut();
+        if wheel.expired.is_empty() {
+            wheel.expired = expired;
+        }
+    }
+
+    /// No later than the earliest pending timer is due, for bounding how long a runtime may sleep.
+    /// Timers in the wheel's upper levels are only placed by slot, so this may come early, but
+    /// never late. `None` if nothing is pending within the span of the wheel.
+    pub fn next_deadline(&self) -> Option<Instant> {
+        let wheel = self.0.borrow();
+        wheel
+            .next_expiration()
+            .map(|(_, tick)| wheel.origin + Duration::from_nanos(tick * TICK_NS))
+    }
+
+    pub fn wait(&self, duration: Duration) -> WaitFuture {
+        let now = self.now();
+        self.wait_until(now + duration)
+    }
+
+    pub fn wait_until(&self, when: Instant) -> WaitFuture {
+        let mut wheel = self.0.borrow_mut();
+        let key = if when <= wheel.now {
+            None
+        } else {
+            let tick = wheel.tick_at_or_after(when);
+            let key = wheel.allocate(tick);
+            wheel.schedule(key);
+            Some(key)
+        };
+        WaitFuture {
+            timer: self.clone(),
+            key,
+        }
+    }
+}
+
+//==============================================================================
+// Trait Implementations
+//==============================================================================
+
+impl Future for WaitFuture {
+    type Output = ();
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context) -> Poll<()> {
+        let key = match self.key {
+            Some(key) => key,
+            None => return Poll::Ready(()),
+        };
+        let mut wheel = self.timer.0.borrow_mut();
+        let entry = &mut wheel.entries[key];
+        if entry.fired {
+            return Poll::Ready(());
+        }
+        match entry.waker {
+            Some(ref waker) if waker.will_wake(cx.waker()) => (),
+            _ => entry.waker = Some(cx.waker().clone()),
+        }
+        Poll::Pending
+    }
+}
+
+impl Drop for WaitFuture {
+    fn drop(&mut self) {
+        if let Some(key) = self.key.take() {
+            self.timer.0.borrow_mut().release(key);
+        }
+    }
+}
+
+//==============================================================================
+// Unit Tests
+//==============================================================================
+
+#[cfg(test)]
+mod tests {
+    use super::TimerRc;
+    use futures::{
+        task::noop_waker_ref,
+        FutureExt,
+    };
+    use std::{
+        task::Context,
+        time::{
+            Duration,
+            Instant,
+        },
+    };
+
+    fn is_ready(f: &mut super::WaitFuture) -> bool {
+        f.poll_unpin(&mut Context::from_waker(noop_waker_ref()))
+            .is_ready()
+    }
+
+    #[test]
+    fn fires_at_or_after_deadline() {
+        let start = Instant::now();
+        let timer = TimerRc::new(start);
+        // Deadlines on every level of the wheel, and past it.
+        let delays = [
+            Duration::from_micros(1),
+            Duration::from_micros(100),
+            Duration::from_millis(5),
+            Duration::from_millis(300),
+            Duration::from_secs(20),
+            Duration::from_secs(3600),
+            Duration::from_secs(100 * 24 * 3600),
+        ];
+        let mut futures = delays
+            .iter()
+            .map(|d| (*d, timer.wait(*d)))
+            .collect::<Vec<_>>();
+
+        let mut now = start;
+        let mut step = Duration::from_micros(7);
+        while !futures.is_empty() {
+            now += step;
+            step = step * 2;
+            timer.advance_clock(now);
+            let mut i = 0;
+            while i < futures.len() {
+                if is_ready(&mut futures[i].1) {
+                    assert!(start + futures[i].0 <= now);
+                    futures.swap_remove(i);
+                } else {
+                    i += 1;
+                }
+            }
+            assert!(now < start + Duration::from_secs(200 * 24 * 3600));
+        }
+    }
+
+    #[test]
+    fn fires_within_a_tick() {
+        let start = Instant::now();
+        let timer = TimerRc::new(start);
+        let mut f = timer.wait(Duration::from_millis(10));
+        let tick = Duration::from_nanos(super::TICK_NS);
+        let mut now = start;
+        while !is_ready(&mut f) {
+            now += Duration::from_micros(3);
+            timer.advance_clock(now);
+        }
+        assert!(now >= start + Duration::from_millis(10));
+        assert!(now <= start + Duration::from_millis(10) + tick);
+    }
+
+    #[test]
+    fn next_deadline_is_never_late() {
+        let start = Instant::now();
+        let timer = TimerRc::new(start);
+        let tick = Duration::from_nanos(super::TICK_NS);
+        assert!(timer.next_deadline().is_none());
+
+        let mut far = timer.wait(Duration::from_secs(20));
+        let near = timer.wait(Duration::from_millis(3));
+        assert!(timer.next_deadline().unwrap() <= start + Duration::from_millis(3) + tick);
+
+        // Once the near timer is gone, sleeping until each deadline in turn gets to the far one.
+        drop(near);
+        let mut now = start;
+        while let Some(deadline) = timer.next_deadline() {
+            assert!(deadline > now);
+            assert!(deadline <= start + Duration::from_secs(20) + tick);
+            assert!(!is_ready(&mut far));
+            now = deadline;
+            timer.advance_clock(now);
+        }
+        assert!(is_ready(&mut far));
+    }
+
+    #[test]
+    fn dropping_cancels() {
+        let start = Instant::now();
+        let timer = TimerRc::new(start);
+        let futures = (1..1000)
+            .map(|i| timer.wait(Duration::from_micros(i * 37)))
+            .collect::<Vec<_>>();
+        drop(futures);
+        timer.advance_clock(start + Duration::from_secs(1));
+        let wheel = timer.0.borrow();
+        assert!(wheel.heads.iter().all(|h| *h == super::NIL));
+        assert!(wheel.occupied.iter().all(|o| *o == 0));
+    }
+}
@@ -0,0 +1,181 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+use crate::{
+    clock,
+    framing,
+    interop::dmtr_qresult_t,
+};
+use catnip::{
+    interop::{
+        self as catnip_interop,
+        dmtr_qtoken_t,
+    },
+    libos::LibOS,
+    operations::Operation,
+    runtime::Runtime,
+};
+use libc::{
+    c_int,
+    timespec,
+};
+use std::{
+    cell::Cell,
+    slice,
+    time::Duration,
+};
+
+//==============================================================================
+// Constants & Structures
+//==============================================================================
+
+thread_local! {
+    /// Where the next call to [wait_many] starts its pass over the tokens.
+    static RESUME_OFFSET: Cell<usize> = Cell::new(0);
+}
+
+//==============================================================================
+// Standalone Functions
+//==============================================================================
+
+/// Waits for any of `qts` to complete, filling `qrs_out` and `offsets_out` with up to
+/// `qrs_out.len()` results and the offsets of their tokens in `qts`. Completed tokens are
+/// consumed. Gives up after `timeout`, if there is one, returning `ETIMEDOUT`; otherwise returns
+/// the number of results. An invalid token fails the call only if nothing has completed before it
+/// in the same pass.
+///
+/// Every pass over `qts` runs the stack's background work once, with the first token it visits,
+/// and then only checks whether each token's operation is done, consuming the ones that are
+/// without running the stack again. A pass stays cheap with many tokens outstanding, and one pass
+/// can hand back many completions. A pass starts right after the last token the previous call
+/// handed back, so when `qrs_out` fills up, tokens late in `qts` still get their turn.
+pub fn wait_many<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    qts: &[dmtr_qtoken_t],
+    qrs_out: &mut [dmtr_qresult_t],
+    offsets_out: &mut [c_int],
+    timeout: Option<Duration>,
+) -> Result<usize, c_int> {
+    let max_results = qrs_out.len().min(offsets_out.len());
+    if qts.is_empty() || max_results == 0 {
+        return Err(libc::EINVAL);
+    }
+
+    let deadline = timeout.map(|t| clock::now() + t);
+    let start = RESUME_OFFSET.with(|o| o.get()) % qts.len();
+    loop {
+        let mut nready = 0;
+        for k in 0..qts.len() {
+            let i = (start + k) % qts.len();
+            let qt = qts[i];
+            // The first token runs the stack's background work; the rest only take what's done.
+            let qr = if framing::is_framed_token(qt) {
+                framing::poll(libos, qt, k == 0)
+            } else if k == 0 {
+                has_completed(libos, qt).map(|_| libos.poll(qt).map(|qr| qr.into()))
+            } else {
+                take_completed(libos, qt)
+            };
+            // The tokens already in `qrs_out` have been consumed, so hand them back and leave the
+            // error for the next call to report.
+            let qr = match qr {
+                Ok(qr) => qr,
+                Err(_) if nready > 0 => return Ok(nready),
+                Err(e) => return Err(e),
+            };
+            if let Some(qr) = qr {
+                qrs_out[nready] = qr;
+                offsets_out[nready] = i as c_int;
+                nready += 1;
+                RESUME_OFFSET.with(|o| o.set(i + 1));
+                if nready == max_results {
+                    break;
+                }
+            }
+        }
+        if nready > 0 {
+            return Ok(nready);
+        }
+        if let Some(deadline) = deadline {
+            if clock::now() >= deadline {
+                return Err(libc::ETIMEDOUT);
+            }
+        }
+    }
+}
+
+/// Checks and converts the arguments of `dmtr_wait_many()` for [wait_many]. A null `timeout`
+/// waits forever.
+pub fn wait_many_raw<RT: Runtime>(
+    libos: &mut LibOS<RT>,
+    qrs_out: *mut dmtr_qresult_t,
+    ready_offsets: *mut c_int,
+    num_ready_out: *mut c_int,
+    qts: *mut dmtr_qtoken_t,
+    num_qts: c_int,
+    max_ready: c_int,
+    timeout: *const timespec,
+) -> c_int {
+    if qrs_out.is_null() || ready_offsets.is_null() || num_ready_out.is_null() || qts.is_null() {
+        return libc::EINVAL;
+    }
+    if num_qts <= 0 || max_ready <= 0 {
+        return libc::EINVAL;
+    }
+    let timeout = match unsafe { timeout.as_ref() } {
+        None => None,
+        Some(ts) if ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1_000_000_000 => {
+            return libc::EINVAL;
+        },
+        Some(ts) => Some(Duration::new(ts.tv_sec as u64, ts.tv_nsec as u32)),
+    };
+
+    let qts = unsafe { slice::from_raw_parts(qts, num_qts as usize) };
+    let qrs_out = unsafe { slice::from_raw_parts_mut(qrs_out, max_ready as usize) };
+    let offsets_out = unsafe { slice::from_raw_parts_mut(ready_offsets, max_ready as usize) };
+    match wait_many(libos, qts, qrs_out, offsets_out, timeout) {
+        Ok(nready) => {
+            unsafe { *num_ready_out = nready as c_int };
+            0
+        },
+        Err(e) => e,
+    }
+}
+
+/// Checks whether the operation behind `qt` is done, without consuming the token.
+pub(crate) fn has_completed<RT: Runtime>(
+    libos: &LibOS<RT>,
+    qt: dmtr_qtoken_t,
+) -> Result<bool, c_int> {
+    let handle = match libos.rt().scheduler().from_raw_handle(qt) {
+        Some(handle) => handle,
+        None => return Err(libc::EINVAL),
+    };
+    let completed = handle.has_completed();
+    handle.into_raw();
+    Ok(completed)
+}
+
+/// Consumes the operation behind `qt` if it's done. Unlike `LibOS::poll()`, this doesn't run the
+/// stack's background work first.
+pub(crate) fn take_completed<RT: Runtime>(
+    libos: &LibOS<RT>,
+    qt: dmtr_qtoken_t,
+) -> Result<Option<dmtr_qresult_t>, c_int> {
+    let handle = match libos.rt().scheduler().from_raw_handle(qt) {
+        Some(handle) => handle,
+        None => return Err(libc::EINVAL),
+    };
+    if !handle.has_completed() {
+        handle.into_raw();
+        return Ok(None);
+    }
+    let (qd, result) = match libos.rt().scheduler().take(handle) {
+        Operation::Tcp(f) => f.expect_result(),
+        Operation::Udp(f) => f.expect_result(),
+        Operation::Background(..) => return Err(libc::EINVAL),
+    };
+    Ok(Some(
+        catnip_interop::dmtr_qresult_t::pack(libos.rt(), result, qd, qt).into(),
+    ))
+}